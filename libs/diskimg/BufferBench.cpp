@@ -0,0 +1,100 @@
+/*
+ * CiderPress
+ * Copyright (C) 2026 by CiderPress authors.  All Rights Reserved.
+ * See the file LICENSE for distribution terms.
+ */
+/*
+ * Timing for GFDBuffer growth.  We write a 32MB stream into an expandable
+ * buffer 512 bytes at a time, once starting from a single block and once
+ * with the final size reserved up front, then read it back to make sure
+ * nothing got lost when the buffer moved.
+ *
+ * Build with "make bufferbench".  Not part of the library.
+ */
+#include "StdAfx.h"
+#include "DiskImgPriv.h"
+
+using namespace DiskImgLib;
+
+enum {
+    kStreamLen = 32 * 1024 * 1024,
+    kPieceLen = 512,
+};
+
+/* the library is chatty; set BENCH_VERBOSE to see what it says */
+static void DebugMsgHandler(const char* file, int line, const char* msg)
+{
+    if (getenv("BENCH_VERBOSE") != NULL)
+        fprintf(stderr, "%s:%d %s\n", file, line, msg);
+}
+
+static double Now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/*
+ * Write the stream, optionally reserving space first, and check it.
+ * Returns false if anything went wrong.
+ */
+static bool WriteStream(const char* label, bool reserve)
+{
+    GFDBuffer gfd;
+    uint8_t piece[kPieceLen];
+    double start, elapsed;
+    long offset;
+    DIError dierr;
+
+    dierr = gfd.Open(NULL, kPieceLen, true, true, false);
+    if (dierr == kDIErrNone && reserve)
+        dierr = gfd.Reserve(kStreamLen);
+    if (dierr != kDIErrNone) {
+        printf("%s: open failed: %s\n", label, DIStrError(dierr));
+        return false;
+    }
+
+    start = Now();
+    for (offset = 0; offset < kStreamLen; offset += kPieceLen) {
+        memset(piece, (uint8_t) (offset / kPieceLen), kPieceLen);
+        dierr = gfd.Write(piece, kPieceLen);
+        if (dierr != kDIErrNone) {
+            printf("%s: write at %ld failed: %s\n", label, offset,
+                DIStrError(dierr));
+            return false;
+        }
+    }
+    elapsed = Now() - start;
+
+    gfd.Rewind();
+    for (offset = 0; offset < kStreamLen; offset += kPieceLen) {
+        if (gfd.Read(piece, kPieceLen) != kDIErrNone ||
+            piece[0] != (uint8_t) (offset / kPieceLen) ||
+            piece[kPieceLen-1] != (uint8_t) (offset / kPieceLen))
+        {
+            printf("%s: data at %ld is wrong\n", label, offset);
+            return false;
+        }
+    }
+
+    printf("%s: %d MB in %d-byte writes, %.3f sec (%.0f MB/sec)\n", label,
+        kStreamLen / (1024 * 1024), kPieceLen, elapsed,
+        kStreamLen / (1024.0 * 1024.0) / (elapsed > 0 ? elapsed : 1e-6));
+    return true;
+}
+
+int main(void)
+{
+    bool ok;
+
+    Global::SetDebugMsgHandler(DebugMsgHandler);
+    Global::AppInit();
+
+    ok = WriteStream("grow", false);
+    ok = WriteStream("reserved", true) && ok;
+
+    Global::AppCleanup();
+    return ok ? 0 : 1;
+}
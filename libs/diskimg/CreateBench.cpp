@@ -0,0 +1,182 @@
+/*
+ * CiderPress
+ * Copyright (C) 2026 by CiderPress authors.  All Rights Reserved.
+ * See the file LICENSE for distribution terms.
+ */
+/*
+ * Timing for ProDOS file creation.  We format a 65535-block volume and
+ * fill it with small files, reporting how long each batch of files took
+ * to create.  Block allocation shouldn't get slower as the volume fills,
+ * so the last batches should take about as long as the first.
+ *
+ * With an argument, the volume is left in that file instead of being
+ * thrown away.
+ *
+ * Build with "make createbench".  Not part of the library.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include "DiskImg.h"
+
+using namespace DiskImgLib;
+
+static const char* kTempName = "CreateBench.tmp";
+
+enum {
+    kNumBlocks = 65535,
+    kFilesPerDir = 500,
+    kFilesPerBatch = 2500,
+    kMaxFileLen = 3 * 512,
+};
+
+/* the library is chatty; set BENCH_VERBOSE to see what it says */
+static void DebugMsgHandler(const char* file, int line, const char* msg)
+{
+    if (getenv("BENCH_VERBOSE") != NULL)
+        fprintf(stderr, "%s:%d %s\n", file, line, msg);
+}
+
+static double Now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/*
+ * Simple LCG, so the file sizes are the same every time.
+ */
+static uint32_t gRandState = 1;
+static long NextRand(long range)
+{
+    gRandState = gRandState * 1103515245 + 12345;
+    return (gRandState >> 16) % range;
+}
+
+/*
+ * Create one file and write "length" bytes of "buf" into it.
+ */
+static DIError AddFile(DiskFS* pDiskFS, const char* pathName,
+    const uint8_t* buf, long length)
+{
+    DiskFS::CreateParms parms;
+    A2File* pFile;
+    A2FileDescr* pOpenFile;
+    DIError dierr;
+
+    memset(&parms, 0, sizeof(parms));
+    parms.pathName = pathName;
+    parms.fssep = ':';
+    parms.storageType = 1;      // seedling; grows as needed
+    parms.fileType = 0x06;      // BIN
+    parms.access = 0xe3;
+    parms.createWhen = parms.modWhen = time(NULL);
+
+    dierr = pDiskFS->CreateFile(&parms, &pFile);
+    if (dierr != kDIErrNone)
+        return dierr;
+    dierr = pFile->Open(&pOpenFile, false, false);
+    if (dierr != kDIErrNone)
+        return dierr;
+    dierr = pOpenFile->Write(buf, length);
+    pOpenFile->Close();
+    return dierr;
+}
+
+/*
+ * Create the volume in "imageName" and fill it.  Returns false if
+ * something other than running out of space stopped us.
+ */
+static bool FillVolume(const char* imageName)
+{
+    uint8_t buf[kMaxFileLen];
+    DiskImg img;
+    DiskFS* pDiskFS = NULL;
+    char pathName[64];
+    double start, batchStart, now;
+    long numFiles, totalBlocks, freeBlocks;
+    int unitSize;
+    DIError dierr;
+    int i;
+
+    for (i = 0; i < kMaxFileLen; i++)
+        buf[i] = (uint8_t) NextRand(256);
+
+    remove(imageName);
+    dierr = img.CreateImage(imageName, NULL, DiskImg::kOuterFormatNone,
+                DiskImg::kFileFormatUnadorned, DiskImg::kPhysicalFormatSectors,
+                NULL, DiskImg::kSectorOrderProDOS, DiskImg::kFormatGenericProDOSOrd,
+                kNumBlocks, false);
+    if (dierr == kDIErrNone)
+        dierr = img.FormatImage(DiskImg::kFormatProDOS, "BENCH");
+    if (dierr == kDIErrNone) {
+        pDiskFS = img.OpenAppropriateDiskFS();
+        if (pDiskFS == NULL)
+            dierr = kDIErrUnsupportedFSFmt;
+    }
+    if (dierr == kDIErrNone)
+        dierr = pDiskFS->Initialize(&img, DiskFS::kInitFull);
+    if (dierr != kDIErrNone) {
+        printf("unable to create volume: %s\n", DIStrError(dierr));
+        delete pDiskFS;
+        return false;
+    }
+
+    /*
+     * Keep going until the disk fills up.  Directories are created as
+     * needed by CreateFile.
+     */
+    numFiles = 0;
+    start = batchStart = Now();
+    while (true) {
+        snprintf(pathName, sizeof(pathName), "DIR%ld:F%ld",
+            numFiles / kFilesPerDir, numFiles);
+        dierr = AddFile(pDiskFS, pathName, buf, 1 + NextRand(kMaxFileLen));
+        if (dierr != kDIErrNone)
+            break;
+        numFiles++;
+
+        if (numFiles % kFilesPerBatch == 0) {
+            now = Now();
+            pDiskFS->GetFreeSpaceCount(&totalBlocks, &freeBlocks, &unitSize);
+            printf("files %6ld-%6ld: %.3f sec (%ld blocks free)\n",
+                numFiles - kFilesPerBatch + 1, numFiles, now - batchStart,
+                freeBlocks);
+            batchStart = now;
+        }
+    }
+    now = Now();
+    if (dierr != kDIErrDiskFull) {
+        printf("stopped after %ld files: %s\n", numFiles, DIStrError(dierr));
+        delete pDiskFS;
+        return false;
+    }
+
+    pDiskFS->GetFreeSpaceCount(&totalBlocks, &freeBlocks, &unitSize);
+    printf("%ld files in %.3f sec (%.0f files/sec), %ld blocks free\n",
+        numFiles, now - start, numFiles / (now - start), freeBlocks);
+
+    delete pDiskFS;
+    img.CloseImage();
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    const char* imageName = (argc > 1) ? argv[1] : kTempName;
+    bool ok;
+
+    Global::SetDebugMsgHandler(DebugMsgHandler);
+    Global::AppInit();
+
+    ok = FillVolume(imageName);
+    if (argc <= 1)
+        remove(imageName);
+
+    Global::AppCleanup();
+    return ok ? 0 : 1;
+}
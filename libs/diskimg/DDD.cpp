@@ -95,119 +95,165 @@ const unsigned long kDDDProSignature = 0xd0bfc903;
  */
 
 /*
- * Class for getting and putting bits to and from a file.
+ * Class for getting and putting bits to and from a memory buffer.
+ *
+ * Bits are held in a 64-bit accumulator in the order in which they appear
+ * in the file, so the first bit is the most significant one.  DDD writes
+ * values low bit first, so a value has to be bit-reversed on the way in
+ * and out.  The "Code" functions take and return bits in file order
+ * (callers generally do the reversing with a table); PutBits reverses
+ * for you.
  */
 class WrapperDDD::BitBuffer {
 public:
-    BitBuffer(void) : fpGFD(NULL), fBits(0), fBitCount(0), fIOFailure(false) {}
+    BitBuffer(void) : fInBuf(NULL), fOutBuf(NULL), fBufLen(0), fPosn(0),
+        fAccum(0), fAccumBits(0), fBitsUsed(0), fOverflow(false)
+        {}
     ~BitBuffer(void) {}
 
-    void SetFile(GenericFD* pGFD) { fpGFD = pGFD; }
-    void PutBits(uint8_t bits, int numBits);
-    uint8_t GetBits(int numBits);
+    /* prepare to read from or write to a buffer */
+    void SetInput(const uint8_t* buf, long len) {
+        fInBuf = buf;
+        fBufLen = len;
+    }
+    void SetOutput(uint8_t* buf, long len) {
+        fOutBuf = buf;
+        fBufLen = len;
+    }
 
-    bool IOFailure(void) const { return fIOFailure; }
+    /* add "numBits" bits (1-32), which are in file order */
+    void PutCode(uint32_t code, int numBits) {
+        assert(numBits > 0 && numBits <= 32);
+        fAccum = (fAccum << numBits) | code;
+        fAccumBits += numBits;
+        if (fAccumBits >= 32)
+            FlushBytes();
+    }
+    /* add the low "numBits" bits of "bits", lowest first */
+    void PutBits(uint8_t bits, int numBits) {
+        assert(numBits > 0 && numBits <= 8);
+        PutCode(kReverse[bits] >> (8 - numBits), numBits);
+    }
+    void AppendBits(const uint8_t* buf, long numBits);
+    /* write out all complete bytes; returns total #of bytes written */
+    long Flush(void) {
+        FlushBytes();
+        return fPosn;
+    }
+    /* zero-fill to the end of the current byte and write it */
+    void PadToByte(void) {
+        if (fAccumBits & 0x07)
+            PutCode(0, 8 - (fAccumBits & 0x07));
+        FlushBytes();
+    }
+    long GetBitCount(void) const { return fPosn * 8 + fAccumBits; }
+    bool Overflow(void) const { return fOverflow; }
+
+    /* get the next "numBits" bits (1-24) in file order */
+    uint32_t PeekCode(int numBits) {
+        assert(numBits > 0 && numBits <= 24);
+        if (fAccumBits < numBits)
+            Refill();
+        return (uint32_t) (fAccum >> (fAccumBits - numBits)) &
+            ((1 << numBits) - 1);
+    }
+    void SkipBits(int numBits) {
+        assert(numBits <= fAccumBits);
+        fAccumBits -= numBits;
+        fBitsUsed += numBits;
+    }
+    uint32_t GetCode(int numBits) {
+        uint32_t val = PeekCode(numBits);
+        SkipBits(numBits);
+        return val;
+    }
+    /* get a value that was written with PutBits(val, 8) */
+    uint8_t GetByte(void) { return kReverse[GetCode(8)]; }
+
+    /* true if we've consumed more bits than the input holds */
+    bool IOFailure(void) const { return fBitsUsed > (di_off_t) fBufLen * 8; }
+    /* #of input bytes we've touched */
+    long GetBytesUsed(void) const { return (long) ((fBitsUsed + 7) / 8); }
 
-    static uint8_t Reverse(uint8_t val);
+    static uint8_t Reverse(uint8_t val) { return kReverse[val]; }
 
 private:
-    GenericFD*  fpGFD;
-    uint8_t     fBits;
-    int         fBitCount;
-    bool        fIOFailure;
+    static const uint8_t kReverse[256];
+
+    void FlushBytes(void);
+    void Refill(void);
+
+    const uint8_t*  fInBuf;
+    uint8_t*    fOutBuf;
+    long        fBufLen;
+    long        fPosn;
+    uint64_t    fAccum;
+    int         fAccumBits;
+    di_off_t    fBitsUsed;      // input only
+    bool        fOverflow;      // output only
+};
+
+/* bit-reversed bytes */
+/*static*/ const uint8_t WrapperDDD::BitBuffer::kReverse[256] = {
+#define R2(n) (n), (n) + 2*64, (n) + 1*64, (n) + 3*64
+#define R4(n) R2(n), R2((n) + 2*16), R2((n) + 1*16), R2((n) + 3*16)
+#define R6(n) R4(n), R4((n) + 2*4), R4((n) + 1*4), R4((n) + 3*4)
+    R6(0), R6(2), R6(1), R6(3)
+#undef R2
+#undef R4
+#undef R6
 };
 
 /*
- * Add bits to the buffer.
- *
- * We roll the low bits out of "bits" and shift them to the left (in the
- * reverse order in which they were passed in).  As soon as we get 8 bits
- * we flush.
+ * Write complete bytes from the accumulator to the output buffer.
  */
-void WrapperDDD::BitBuffer::PutBits(uint8_t bits, int numBits)
+void WrapperDDD::BitBuffer::FlushBytes(void)
 {
-    assert(fBitCount >= 0 && fBitCount < 8);
-    assert(numBits > 0 && numBits <= 8);
-    assert(fpGFD != NULL);
-
-    DIError dierr;
-
-    while (numBits--) {
-        fBits = (fBits << 1) | (bits & 0x01);
-        fBitCount++;
-
-        if (fBitCount == 8) {
-            dierr = fpGFD->Write(&fBits, 1);
-            fIOFailure = (dierr != kDIErrNone);
-            fBitCount = 0;
-        }
-
-        bits >>= 1;
+    assert(fOutBuf != NULL);
+
+    while (fAccumBits >= 8) {
+        fAccumBits -= 8;
+        if (fPosn < fBufLen)
+            fOutBuf[fPosn++] = (uint8_t) (fAccum >> fAccumBits);
+        else
+            fOverflow = true;
     }
 }
 
 /*
- * Get bits from the buffer.
- *
- * These come out in the order in which they appear in the file, which
- * means that in some cases they will have to be reversed.
+ * Load the accumulator with as many input bytes as it'll hold.  Reading
+ * past the end yields zeroes; IOFailure() tells you if you used any.
  */
-uint8_t WrapperDDD::BitBuffer::GetBits(int numBits)
+void WrapperDDD::BitBuffer::Refill(void)
 {
-    assert(fBitCount >= 0 && fBitCount < 8);
-    assert(numBits > 0 && numBits <= 8);
-    assert(fpGFD != NULL);
-
-    DIError dierr;
-    uint8_t retVal;
-
-    if (fBitCount == 0) {
-        /* have no bits */
-        dierr = fpGFD->Read(&fBits, 1);
-        fIOFailure = (dierr != kDIErrNone);
-        fBitCount = 8;
-    }
-
-    if (numBits <= fBitCount) {
-        /* just serve up what we've already got */
-        retVal = fBits >> (8 - numBits);
-        fBits <<= numBits;
-        fBitCount -= numBits;
-    } else {
-        /* some old, some new; load what we have right-aligned */
-        retVal = fBits >> (8 - fBitCount);
-        numBits -= fBitCount;
-
-        dierr = fpGFD->Read(&fBits, 1);
-        fIOFailure = (dierr != kDIErrNone);
-        fBitCount = 8;
-
-        /* make room for the rest (also zeroes out the low bits) */
-        retVal <<= numBits;
-
-        /* add the high bits from the new byte */
-        retVal |= fBits >> (8 - numBits);
-        fBits <<= numBits;
-        fBitCount -= numBits;
+    assert(fInBuf != NULL);
+
+    while (fAccumBits <= 56) {
+        fAccum <<= 8;
+        if (fPosn < fBufLen)
+            fAccum |= fInBuf[fPosn];
+        fPosn++;
+        fAccumBits += 8;
     }
-
-    return retVal;
 }
 
 /*
- * Utility function to reverse the order of bits in a byte.
+ * Add "numBits" bits from "buf", which holds them in file order (as
+ * written by another BitBuffer).
  */
-/*static*/ uint8_t WrapperDDD::BitBuffer::Reverse(uint8_t val)
+void WrapperDDD::BitBuffer::AppendBits(const uint8_t* buf, long numBits)
 {
-    int i;
-    uint8_t result = 0;       // init is to make valgrind happy
-
-    for (i = 0; i < 8; i++) {
-        result = (result << 1) + (val & 0x01);
-        val >>= 1;
+    while (numBits >= 24) {
+        PutCode((buf[0] << 16) | (buf[1] << 8) | buf[2], 24);
+        buf += 3;
+        numBits -= 24;
     }
-
-    return result;
+    while (numBits >= 8) {
+        PutCode(*buf++, 8);
+        numBits -= 8;
+    }
+    if (numBits != 0)
+        PutCode(*buf >> (8 - numBits), (int) numBits);
 }
 
 
@@ -230,47 +276,163 @@ static const int kFavoriteBitEncLen[kNumFavorites] = {
     6, 6, 6, 6, 6, 6, 6, 7, 7, 7
 };
 
+/*
+ * This is the reverse of the kFavoriteBitEnc table.  The bits are
+ * reversed and lack the high bit.
+ */
+static const uint8_t kFavoriteBitDec[kNumFavorites] = {
+    0x04, 0x01, 0x0f, 0x0e, 0x0c, 0x0b, 0x0a, 0x06, 0x05, 0x1b,
+    0x0f, 0x09, 0x08, 0x03, 0x02, 0x01, 0x00, 0x35, 0x1d, 0x1c
+};
+
+/*
+ * Codes in file order, built from the tables above.
+ *
+ * "favDecode" is indexed by the six bits that follow a 1 bit, and says
+ * which favorite they start with.  It's built by running the original
+ * bit-at-a-time search (3 to 6 bits, first match wins) on every possible
+ * pattern, so it decodes exactly the way that did.  Patterns that don't
+ * match anything are taken to be the start of an RLE delimiter.
+ */
+static const uint8_t kNoFavorite = 0xff;
+static struct DDDCodes {
+    uint32_t    favCode[kNumFavorites];     // includes the leading 1 bit
+    uint32_t    rleDelimCode;
+    uint8_t     favDecode[64];
+    uint8_t     favDecodeLen[64];           // includes the leading 1 bit
+
+    DDDCodes(void) {
+        static const int kRange[5] = { 0, 2, 9, 17, 20 };
+        int i, fav, extraBits;
+
+        for (fav = 0; fav < kNumFavorites; fav++) {
+            favCode[fav] = ReverseBits(kFavoriteBitEnc[fav],
+                                kFavoriteBitEncLen[fav]);
+        }
+        rleDelimCode = ReverseBits(kRLEDelim, 8);
+
+        for (i = 0; i < 64; i++) {
+            uint32_t val = i >> 4;
+            favDecode[i] = kNoFavorite;
+            favDecodeLen[i] = 0;
+            for (extraBits = 0; extraBits < 4; extraBits++) {
+                val = (val << 1) | ((i >> (3 - extraBits)) & 0x01);
+                for (fav = kRange[extraBits]; fav < kRange[extraBits+1]; fav++) {
+                    if (val == kFavoriteBitDec[fav])
+                        break;
+                }
+                if (fav < kRange[extraBits+1]) {
+                    favDecode[i] = (uint8_t) fav;
+                    favDecodeLen[i] = (uint8_t) (4 + extraBits);
+                    break;
+                }
+            }
+        }
+    }
+    static uint32_t ReverseBits(uint32_t val, int numBits) {
+        uint32_t result = 0;
+        while (numBits--) {
+            result = (result << 1) | (val & 0x01);
+            val >>= 1;
+        }
+        return result;
+    }
+} sCodes;
+
+/*
+ * Arguments for PackTrackWorker.
+ */
+typedef struct PackDiskWork {
+    const uint8_t*  trackData;      // all tracks, back to back
+    uint8_t*        packBufs;       // one output buffer per track
+    long            packBufLen;     // size of each output buffer
+    long*           packBits;       // #of bits of output for each track
+} PackDiskWork;
+
+/*
+ * Pack one track into its own buffer (RunParallel worker).
+ */
+/*static*/ void WrapperDDD::PackTrackWorker(int track, void* arg)
+{
+    PackDiskWork* pWork = (PackDiskWork*) arg;
+    BitBuffer bitBuffer;
+
+    bitBuffer.SetOutput(pWork->packBufs + track * pWork->packBufLen,
+        pWork->packBufLen);
+    PackTrack(pWork->trackData + track * kTrackLen, &bitBuffer);
+    pWork->packBits[track] = bitBuffer.GetBitCount();
+    bitBuffer.PadToByte();
+    assert(!bitBuffer.Overflow());
+}
 
 /*
  * Pack a disk image with DDD.
  *
  * Assumes pSrcGFD points to DOS-ordered sectors.  (This is enforced when the
  * disk image is first being created.)
+ *
+ * The tracks are packed in parallel, each into its own buffer, and the
+ * resulting bit streams are stitched together afterward.  The tracks
+ * don't end on byte boundaries, so the stitching has to shift them.
  */
 /*static*/ DIError WrapperDDD::PackDisk(GenericFD* pSrcGFD, GenericFD* pWrapperGFD,
     short diskVolNum)
 {
     DIError dierr = kDIErrNone;
     BitBuffer bitBuffer;
+    PackDiskWork work;
+    uint8_t* trackData = NULL;
+    uint8_t* outBuf = NULL;
+    long outBufLen, outLen;
+    int track;
 
     assert(diskVolNum >= 0 && diskVolNum < 256);
 
+    /* worst case is 9 bits per byte, plus the favorites */
+    work.packBufLen = (kNumFavorites * 8 + kTrackLen * 9 + 7) / 8;
+    work.packBufs = new uint8_t[kNumTracks * work.packBufLen];
+    work.packBits = new long[kNumTracks];
+    trackData = new uint8_t[kNumTracks * kTrackLen];
+    outBufLen = kNumTracks * work.packBufLen + 4;
+    outBuf = new uint8_t[outBufLen];
+    if (work.packBufs == NULL || work.packBits == NULL || trackData == NULL ||
+        outBuf == NULL)
+    {
+        dierr = kDIErrMalloc;
+        goto bail;
+    }
+    work.trackData = trackData;
+
+    dierr = pSrcGFD->Read(trackData, kNumTracks * kTrackLen);
+    if (dierr != kDIErrNone) {
+        LOGI(" DDD error during read (err=%d)", dierr);
+        goto bail;
+    }
+
+    RunParallel(kNumTracks, PackTrackWorker, &work);
+
     /* write four zeroes to replace the DOS addr/len bytes */
     /* (actually, let's write the apparent DDD Pro v1.1 signature instead) */
     WriteLongLE(pWrapperGFD, kDDDProSignature);
 
-    bitBuffer.SetFile(pWrapperGFD);
+    bitBuffer.SetOutput(outBuf, outBufLen);
 
     bitBuffer.PutBits(0x00, 3);
     bitBuffer.PutBits((uint8_t)diskVolNum, 8);
 
-    /*
-     * Process all tracks.
-     */
-    for (int track = 0; track < kNumTracks; track++) {
-        uint8_t trackBuf[kTrackLen];
-
-        dierr = pSrcGFD->Read(trackBuf, kTrackLen);
-        if (dierr != kDIErrNone) {
-            LOGI(" DDD error during read (err=%d)", dierr);
-            goto bail;
-        }
-
-        PackTrack(trackBuf, &bitBuffer);
+    for (track = 0; track < kNumTracks; track++) {
+        bitBuffer.AppendBits(work.packBufs + track * work.packBufLen,
+            work.packBits[track]);
     }
 
     /* write 8 bits of zeroes to flush remaining data out of buffer */
     bitBuffer.PutBits(0x00, 8);
+    outLen = bitBuffer.Flush();
+    assert(!bitBuffer.Overflow());
+
+    dierr = pWrapperGFD->Write(outBuf, outLen);
+    if (dierr != kDIErrNone)
+        goto bail;
 
     /* write another zero byte because that's what DDD Pro v1.1 does */
     long zero;
@@ -281,6 +443,10 @@ static const int kFavoriteBitEncLen[kNumFavorites] = {
 
     assert(dierr == kDIErrNone);
 bail:
+    delete[] work.packBufs;
+    delete[] work.packBits;
+    delete[] trackData;
+    delete[] outBuf;
     return dierr;
 }
 
@@ -291,6 +457,7 @@ bail:
 {
     uint16_t freqCounts[kNumSymbols];
     uint8_t favorites[kNumFavorites];
+    uint8_t favIndex[kNumSymbols];
     int i, fav;
 
     ComputeFreqCounts(trackBuf, freqCounts);
@@ -300,6 +467,15 @@ bail:
     for (fav = 0; fav < kNumFavorites; fav++)
         pBitBuf->PutBits(favorites[fav], 8);
 
+    /*
+     * Map byte values to favorites.  A symbol can appear more than once
+     * (when there are fewer than 20 distinct ones), in which case the
+     * first one wins.
+     */
+    memset(favIndex, kNoFavorite, sizeof(favIndex));
+    for (fav = kNumFavorites-1; fav >= 0; fav--)
+        favIndex[favorites[fav]] = (uint8_t) fav;
+
     /*
      * Compress track data.  Store runs as { 0x97 char count }, where
      * a count of zero means 256.
@@ -326,25 +502,22 @@ bail:
                 }
             }
 
-            pBitBuf->PutBits(kRLEDelim, 8);     // note kRLEDelim has hi bit set
-            pBitBuf->PutBits(*ucp, 8);
-            pBitBuf->PutBits(runLen, 8);
+            // note kRLEDelim has hi bit set
+            pBitBuf->PutCode((sCodes.rleDelimCode << 16) |
+                (BitBuffer::Reverse(*ucp) << 8) |
+                BitBuffer::Reverse((uint8_t) runLen), 24);
 
         } else {
             /*
              * Not a run, see if it's one of our favorites.
              */
-            for (fav = 0; fav < kNumFavorites; fav++) {
-                if (*ucp == favorites[fav])
-                    break;
-            }
-            if (fav == kNumFavorites) {
-                /* just a plain byte */
-                pBitBuf->PutBits(0x00, 1);
-                pBitBuf->PutBits(*ucp, 8);
+            fav = favIndex[*ucp];
+            if (fav == kNoFavorite) {
+                /* just a plain byte: a zero bit, then the byte */
+                pBitBuf->PutCode(BitBuffer::Reverse(*ucp), 9);
             } else {
                 /* found a favorite; leading hi bit is implied */
-                pBitBuf->PutBits(kFavoriteBitEnc[fav], kFavoriteBitEncLen[fav]);
+                pBitBuf->PutCode(sCodes.favCode[fav], kFavoriteBitEncLen[fav]);
             }
         }
     }
@@ -434,26 +607,23 @@ bail:
  * ===========================================================================
  */
 
-/*
- * This is the reverse of the kFavoriteBitEnc table.  The bits are
- * reversed and lack the high bit.
- */
-static const uint8_t kFavoriteBitDec[kNumFavorites] = {
-    0x04, 0x01, 0x0f, 0x0e, 0x0c, 0x0b, 0x0a, 0x06, 0x05, 0x1b,
-    0x0f, 0x09, 0x08, 0x03, 0x02, 0x01, 0x00, 0x35, 0x1d, 0x1c
-};
-
 /*
  * Entry point for unpacking a disk image compressed with DDD.
  *
  * The result is an unadorned DOS-ordered image.
+ *
+ * The compressed data is small enough (< 160K) that we just pull the whole
+ * thing into memory.
  */
 /*static*/ DIError WrapperDDD::UnpackDisk(GenericFD* pGFD, GenericFD* pNewGFD,
     short* pDiskVolNum)
 {
     DIError dierr = kDIErrNone;
     BitBuffer bitBuffer;
-    uint8_t val;
+    uint8_t* inBuf = NULL;
+    di_off_t startPosn, inLen;
+    long maxInLen, excess;
+    uint32_t val;
     long lbuf;
 
     assert(pGFD != NULL);
@@ -465,16 +635,47 @@ static const uint8_t kFavoriteBitDec[kNumFavorites] = {
     if (dierr != kDIErrNone)
         goto bail;
 
-    bitBuffer.SetFile(pGFD);
+    startPosn = pGFD->Tell();
+    dierr = pGFD->Seek(0, kSeekEnd);
+    if (dierr != kDIErrNone)
+        goto bail;
+    inLen = pGFD->Tell() - startPosn;
+    dierr = pGFD->Seek(startPosn, kSeekSet);
+    if (dierr != kDIErrNone)
+        goto bail;
 
-    val = bitBuffer.GetBits(3);
+    /*
+     * Largest legal input is 9 bits for every byte, plus the header and
+     * favorites, plus the excess we allow for at the end.  Anything bigger
+     * would fail the excess test below anyway.
+     */
+    maxInLen = (11 + kNumTracks * (kNumFavorites * 8 + kTrackLen * 9) + 7) / 8
+                + 256;
+    if (inLen > maxInLen) {
+        LOGW(" DDD looks like too much data in input file (%ld bytes)",
+            (long) inLen);
+        dierr = kDIErrBadCompressedData;
+        goto bail;
+    }
+
+    inBuf = new uint8_t[(long) inLen + 1];
+    if (inBuf == NULL) {
+        dierr = kDIErrMalloc;
+        goto bail;
+    }
+    dierr = pGFD->Read(inBuf, (size_t) inLen);
+    if (dierr != kDIErrNone)
+        goto bail;
+
+    bitBuffer.SetInput(inBuf, (long) inLen);
+
+    val = bitBuffer.GetCode(3);
     if (val != 0) {
         LOGI(" DDD bits not zero, this isn't a DDD II file (0x%02x)", val);
         dierr = kDIErrGeneric;
         goto bail;
     }
-    val = bitBuffer.GetBits(8);
-    *pDiskVolNum = bitBuffer.Reverse(val);
+    *pDiskVolNum = bitBuffer.GetByte();
     LOGI(" DDD found disk volume num = %d", *pDiskVolNum);
 
     int track;
@@ -497,8 +698,7 @@ static const uint8_t kFavoriteBitDec[kNumFavorites] = {
     }
 
     /*
-     * We should be within a byte or two of the end of the file.  Try
-     * to read more and expect it to fail.
+     * We should be within a byte or two of the end of the file.
      *
      * Unfortunately, if this was a DOS DDD file, we could be up to 256
      * bytes off (the 1 additional byte it adds plus the remaining 255
@@ -509,25 +709,21 @@ static const uint8_t kFavoriteBitDec[kNumFavorites] = {
      * for long runs of bytes provides some opportunity for correct
      * detection.
      */
-    size_t actual;
-    char sctBuf[256 + 16];
-    dierr = pGFD->Read(&sctBuf, sizeof(sctBuf), &actual);
-    if (dierr == kDIErrNone) {
-        if (actual > /*kMaxExcessByteCount*/ 256) {
-            LOGW(" DDD looks like too much data in input file (%lu extra)",
-                (unsigned long) actual);
-            dierr = kDIErrBadCompressedData;
-            goto bail;
-        } else {
-            LOGI(" DDD excess bytes (%lu) within normal parameters",
-                (unsigned long) actual);
-        }
+    excess = (long) inLen - bitBuffer.GetBytesUsed();
+    if (excess > /*kMaxExcessByteCount*/ 256) {
+        LOGW(" DDD looks like too much data in input file (%ld extra)",
+            excess);
+        dierr = kDIErrBadCompressedData;
+        goto bail;
+    } else {
+        LOGI(" DDD excess bytes (%ld) within normal parameters", excess);
     }
 
     LOGI(" DDD looks like a DDD archive!");
     dierr = kDIErrNone;
 
 bail:
+    delete[] inBuf;
     return dierr;
 }
 
@@ -539,89 +735,60 @@ bail:
 /*static*/ bool WrapperDDD::UnpackTrack(BitBuffer* pBitBuffer, uint8_t* trackBuf)
 {
     uint8_t favorites[kNumFavorites];
-    uint8_t val;
     uint8_t* trackPtr;
+    uint32_t code;
     int fav;
 
     /*
      * Start by pulling our favorites out, in reverse order.
      */
-    for (fav = 0; fav < kNumFavorites; fav++) {
-        val = pBitBuffer->GetBits(8);
-        val = pBitBuffer->Reverse(val);
-        favorites[fav] = val;
-    }
+    for (fav = 0; fav < kNumFavorites; fav++)
+        favorites[fav] = pBitBuffer->GetByte();
 
     trackPtr = trackBuf;
 
     /*
-     * Keep pulling data out until the track is full.
+     * Keep pulling data out until the track is full.  Every symbol starts
+     * within the next 9 bits, so we peek at those and figure out what
+     * we've got from there.
      */
     while (trackPtr < trackBuf + kTrackLen) {
-        val = pBitBuffer->GetBits(1);
-        if (!val) {
+        code = pBitBuffer->PeekCode(9);
+        if ((code & 0x100) == 0) {
             /* simple byte */
-            val = pBitBuffer->GetBits(8);
-            val = pBitBuffer->Reverse(val);
-            *trackPtr++ = val;
-        } else {
-            /* try for a prefix match */
-            int extraBits;
-
-            val = pBitBuffer->GetBits(2);
-
-            for (extraBits = 0; extraBits < 4; extraBits++) {
-                val = (val << 1) | pBitBuffer->GetBits(1);
-                int start, end;
-
-                if (extraBits == 0) {
-                    start = 0;
-                    end = 2;
-                } else if (extraBits == 1) {
-                    start = 2;
-                    end = 9;
-                } else if (extraBits == 2) {
-                    start = 9;
-                    end = 17;
-                } else {
-                    start = 17;
-                    end = 20;
-                }
+            *trackPtr++ = BitBuffer::Reverse((uint8_t) code);
+            pBitBuffer->SkipBits(9);
+            continue;
+        }
 
-                while (start < end) {
-                    if (val == kFavoriteBitDec[start]) {
-                        /* winner! */
-                        *trackPtr++ = favorites[start];
-                        break;
-                    }
-                    start++;
-                }
-                if (start != end)
-                    break;      // we got it, break out of for loop
-            }
-            if (extraBits == 4) {
-                /* we didn't get it, this must be RLE */
-                uint8_t rleChar;
-                int rleCount;
-
-                (void) pBitBuffer->GetBits(1);  // get last bit of 0x97
-                val = pBitBuffer->GetBits(8);
-                rleChar = pBitBuffer->Reverse(val);
-                val = pBitBuffer->GetBits(8);
-                rleCount = pBitBuffer->Reverse(val);
-                //LOGI(" DDD found run of %d of 0x%02x", rleCount, rleChar);
-
-                if (rleCount == 0)
-                    rleCount = 256;
-
-                /* make sure we won't overrun */
-                if (trackPtr + rleCount > trackBuf + kTrackLen) {
-                    LOGI(" DDD overrun in RLE");
-                    return false;
-                }
-                while (rleCount--)
-                    *trackPtr++ = rleChar;
+        /* try for a prefix match on the 6 bits after the 1 */
+        int idx = (code >> 2) & 0x3f;
+        fav = sCodes.favDecode[idx];
+        if (fav != kNoFavorite) {
+            /* winner! */
+            *trackPtr++ = favorites[fav];
+            pBitBuffer->SkipBits(sCodes.favDecodeLen[idx]);
+        } else {
+            /* we didn't get it, this must be RLE */
+            uint8_t rleChar;
+            int rleCount;
+
+            pBitBuffer->SkipBits(8);        // rest of 0x97
+            code = pBitBuffer->GetCode(16);
+            rleChar = BitBuffer::Reverse((uint8_t) (code >> 8));
+            rleCount = BitBuffer::Reverse((uint8_t) code);
+            //LOGI(" DDD found run of %d of 0x%02x", rleCount, rleChar);
+
+            if (rleCount == 0)
+                rleCount = 256;
+
+            /* make sure we won't overrun */
+            if (trackPtr + rleCount > trackBuf + kTrackLen) {
+                LOGI(" DDD overrun in RLE");
+                return false;
             }
+            memset(trackPtr, rleChar, rleCount);
+            trackPtr += rleCount;
         }
     }
 
@@ -0,0 +1,315 @@
+/*
+ * CiderPress
+ * Copyright (C) 2026 by CiderPress authors.  All Rights Reserved.
+ * See the file LICENSE for distribution terms.
+ */
+/*
+ * Round-trip check for the DDD packer.  Each sample disk is written to a
+ * new DDD image, which is closed (packing it) and reopened (unpacking
+ * it), and every sector is compared against the original.
+ *
+ * With no arguments we use a set of generated disks.  Any arguments are
+ * taken as 140K DOS-order images to check in addition to those.
+ *
+ * For the generated disks we also check the CRC of the packed file
+ * against a known-good value, so any change to the bits the packer
+ * writes shows up here, even if the unpacker happens to agree with it.
+ * If the format change is intentional, DDDTEST_VERBOSE shows the new
+ * values.
+ *
+ * Build with "make dddtest" and run with "make check".  Not part of the
+ * library.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "DiskImg.h"
+#include "../nufxlib/NufxLib.h"
+#include "../zlib/zlib.h"
+
+using namespace DiskImgLib;
+
+static const char* kTempName = "DDDTest.tmp";
+
+enum {
+    kNumTracks = 35,
+    kNumSectors = 16,
+    kTrackLen = kNumSectors * kSectorSize,
+    kDiskLen = kNumTracks * kTrackLen,
+};
+
+/* the library is chatty; set DDDTEST_VERBOSE to see what it says */
+static void DebugMsgHandler(const char* file, int line, const char* msg)
+{
+    if (getenv("DDDTEST_VERBOSE") != NULL)
+        fprintf(stderr, "%s:%d %s\n", file, line, msg);
+}
+
+/* NufxLib complains when the image format probe offers it a DDD file */
+static NuResult NufxErrorMsgHandler(NuArchive* /*pArchive*/, void* vErrorMessage)
+{
+    const NuErrorMessage* pErrorMessage = (const NuErrorMessage*) vErrorMessage;
+
+    if (getenv("DDDTEST_VERBOSE") != NULL)
+        fprintf(stderr, "nufxlib: %s\n", pErrorMessage->message);
+    return kNuOK;
+}
+
+/*
+ * Simple LCG, so the "random" disks are the same every time.
+ */
+static uint32_t gRandState = 1;
+static uint8_t NextRand(void)
+{
+    gRandState = gRandState * 1103515245 + 12345;
+    return (uint8_t) (gRandState >> 16);
+}
+
+/*
+ * Fill one track with pattern "kind".  The patterns cover the things the
+ * packer treats differently: runs of various lengths (including ones
+ * too short to be worth encoding), the favorite-byte table, and bytes
+ * that don't compress at all.
+ */
+static void FillTrack(uint8_t* trackBuf, int kind)
+{
+    static const char kText[] =
+        "THE QUICK BROWN FOX JUMPS OVER THE LAZY DOG.  0123456789\r";
+    int i, len;
+
+    switch (kind) {
+    case 0:     // empty
+        memset(trackBuf, 0x00, kTrackLen);
+        break;
+    case 1:     // erased
+        memset(trackBuf, 0xff, kTrackLen);
+        break;
+    case 2:     // the byte DDD uses for RLE
+        memset(trackBuf, 0x97, kTrackLen);
+        break;
+    case 3:     // incompressible
+        for (i = 0; i < kTrackLen; i++)
+            trackBuf[i] = NextRand();
+        break;
+    case 4:     // text, which is all favorites
+        for (i = 0; i < kTrackLen; i++)
+            trackBuf[i] = kText[i % (sizeof(kText) - 1)] | 0x80;
+        break;
+    case 5:     // every byte value, in order
+        for (i = 0; i < kTrackLen; i++)
+            trackBuf[i] = (uint8_t) i;
+        break;
+    case 6:     // runs from 1 to 300 bytes, around the RLE threshold
+        i = 0;
+        len = 1;
+        while (i < kTrackLen) {
+            uint8_t val = NextRand();
+            int j;
+
+            for (j = 0; j < len && i < kTrackLen; j++)
+                trackBuf[i++] = val;
+            len = (len % 300) + 1;
+        }
+        break;
+    default:    // a mix of random bytes and short runs of 0x97
+        for (i = 0; i < kTrackLen; i++) {
+            uint8_t val = NextRand();
+            trackBuf[i] = (val < 0x40) ? 0x97 : val;
+        }
+        break;
+    }
+}
+
+/*
+ * Compute the CRC32 of the packed image.
+ */
+static bool GetFileCRC(const char* fileName, uint32_t* pCRC)
+{
+    uint8_t buf[4096];
+    FILE* fp;
+    size_t actual;
+    uLong crc;
+
+    fp = fopen(fileName, "rb");
+    if (fp == NULL)
+        return false;
+    crc = crc32(0L, Z_NULL, 0);
+    while ((actual = fread(buf, 1, sizeof(buf), fp)) != 0)
+        crc = crc32(crc, buf, (uInt) actual);
+    fclose(fp);
+    *pCRC = (uint32_t) crc;
+    return true;
+}
+
+/*
+ * Pack "diskBuf" into a DDD image, unpack it, and compare.  If
+ * "expectedCRC" is nonzero, the packed file must match it.
+ *
+ * Returns the number of sectors that didn't come back intact, or -1 if
+ * the image couldn't be created or reopened or the packed file was
+ * wrong.
+ */
+static int RoundTrip(const char* label, const uint8_t* diskBuf,
+    uint32_t expectedCRC)
+{
+    DiskImg outImg, inImg;
+    DIError dierr;
+    uint8_t sctBuf[kSectorSize];
+    uint32_t crc;
+    int track, sector, bad;
+
+    remove(kTempName);
+
+    dierr = outImg.CreateImage(kTempName, NULL, DiskImg::kOuterFormatNone,
+                DiskImg::kFileFormatDDD, DiskImg::kPhysicalFormatSectors,
+                NULL, DiskImg::kSectorOrderDOS, DiskImg::kFormatGenericDOSOrd,
+                kNumTracks, kNumSectors, true);
+    if (dierr != kDIErrNone) {
+        printf("%s: create failed: %s\n", label, DIStrError(dierr));
+        return -1;
+    }
+    for (track = 0; track < kNumTracks; track++) {
+        for (sector = 0; sector < kNumSectors; sector++) {
+            dierr = outImg.WriteTrackSector(track, sector,
+                        diskBuf + (track * kNumSectors + sector) * kSectorSize);
+            if (dierr != kDIErrNone) {
+                printf("%s: write T%d S%d failed: %s\n", label, track, sector,
+                    DIStrError(dierr));
+                outImg.CloseImage();
+                return -1;
+            }
+        }
+    }
+    dierr = outImg.CloseImage();        // this packs it
+    if (dierr != kDIErrNone) {
+        printf("%s: close failed: %s\n", label, DIStrError(dierr));
+        return -1;
+    }
+
+    if (!GetFileCRC(kTempName, &crc)) {
+        printf("%s: unable to read packed file\n", label);
+        return -1;
+    }
+    if (getenv("DDDTEST_VERBOSE") != NULL)
+        printf("%s: packed CRC is 0x%08x\n", label, crc);
+    if (expectedCRC != 0 && crc != expectedCRC) {
+        printf("%s: packed CRC is 0x%08x, expected 0x%08x\n", label, crc,
+            expectedCRC);
+        return -1;
+    }
+
+    dierr = inImg.OpenImage(kTempName, '/', true);
+    if (dierr == kDIErrNone)
+        dierr = inImg.AnalyzeImage();
+    if (dierr != kDIErrNone) {
+        printf("%s: reopen failed: %s\n", label, DIStrError(dierr));
+        return -1;
+    }
+    if (inImg.GetFileFormat() != DiskImg::kFileFormatDDD) {
+        printf("%s: reopened as file format %d, not DDD\n", label,
+            inImg.GetFileFormat());
+        inImg.CloseImage();
+        return -1;
+    }
+    if (inImg.GetFSFormat() == DiskImg::kFormatUnknown) {
+        inImg.OverrideFormat(DiskImg::kPhysicalFormatSectors,
+            DiskImg::kFormatGenericDOSOrd, DiskImg::kSectorOrderDOS);
+    }
+
+    bad = 0;
+    for (track = 0; track < kNumTracks; track++) {
+        for (sector = 0; sector < kNumSectors; sector++) {
+            const uint8_t* orig =
+                diskBuf + (track * kNumSectors + sector) * kSectorSize;
+            if (inImg.ReadTrackSector(track, sector, sctBuf) != kDIErrNone ||
+                memcmp(sctBuf, orig, kSectorSize) != 0)
+            {
+                if (bad == 0)
+                    printf("%s: T%d S%d differs\n", label, track, sector);
+                bad++;
+            }
+        }
+    }
+    inImg.CloseImage();
+
+    printf("%s: %s (%d bad sectors)\n", label, bad == 0 ? "OK" : "FAILED",
+        bad);
+    return bad;
+}
+
+/*
+ * Load a 140K image from a file.
+ */
+static bool LoadDisk(const char* fileName, uint8_t* diskBuf)
+{
+    FILE* fp;
+    size_t actual;
+
+    fp = fopen(fileName, "rb");
+    if (fp == NULL) {
+        printf("%s: unable to open\n", fileName);
+        return false;
+    }
+    actual = fread(diskBuf, 1, kDiskLen, fp);
+    fclose(fp);
+    if (actual != kDiskLen) {
+        printf("%s: not a 140K image\n", fileName);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    static const char* kNames[] = {
+        "zeroes", "0xff", "0x97", "random", "text", "ascending", "runs",
+    };
+    /*
+     * CRC32 of the packed files, one per entry in kNames plus the "mixed"
+     * disk.  These came from the original, single-threaded packer.
+     */
+    static const uint32_t kPackedCRC[] = {
+        0xc160d39f, 0x33e6c11e, 0x2de09a32, 0x97ac5a9e, 0x43f0a8b3,
+        0x88491657, 0x684aea4a, 0x415eefd0,
+    };
+    const int kNumSolid = sizeof(kNames) / sizeof(kNames[0]);
+    uint8_t* diskBuf;
+    char label[64];
+    int kind, track, i, failed;
+
+    Global::SetDebugMsgHandler(DebugMsgHandler);
+    NuSetGlobalErrorMessageHandler(NufxErrorMsgHandler);
+    Global::AppInit();
+
+    diskBuf = new uint8_t[kDiskLen];
+    failed = 0;
+
+    /* one disk of each pattern, then one with a different one per track */
+    for (kind = 0; kind <= kNumSolid; kind++) {
+        for (track = 0; track < kNumTracks; track++) {
+            int trackKind = (kind < kNumSolid) ? kind : track % (kNumSolid + 1);
+            FillTrack(diskBuf + track * kTrackLen, trackKind);
+        }
+        if (kind < kNumSolid)
+            snprintf(label, sizeof(label), "%s", kNames[kind]);
+        else
+            snprintf(label, sizeof(label), "mixed");
+        if (RoundTrip(label, diskBuf, kPackedCRC[kind]) != 0)
+            failed++;
+    }
+
+    for (i = 1; i < argc; i++) {
+        if (!LoadDisk(argv[i], diskBuf) || RoundTrip(argv[i], diskBuf, 0) != 0)
+            failed++;
+    }
+
+    remove(kTempName);
+    delete[] diskBuf;
+    Global::AppCleanup();
+
+    if (failed != 0) {
+        printf("%d disk(s) failed\n", failed);
+        return 1;
+    }
+    return 0;
+}
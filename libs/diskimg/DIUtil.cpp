@@ -8,6 +8,8 @@
  */
 #include "StdAfx.h"
 #include "DiskImgPriv.h"
+#include <atomic>
+#include <thread>
 
 #define kFilenameExtDelim   '.'     /* separates extension from filename */
 
@@ -196,6 +198,64 @@ DIError DiskImgLib::WriteLongBE(GenericFD* pGFD, uint32_t val)
 }
 
 
+/*
+ * Upper limit on worker threads.  The jobs we hand out (tracks, chunks)
+ * come in batches of a few dozen to a few hundred, so going wider than
+ * this mostly adds thread startup cost.
+ */
+const int kMaxWorkerThreads = 16;
+
+/*
+ * Pull indices off of a shared counter until they're gone.
+ */
+static void ParallelWorker(std::atomic<int>* pNext, int count,
+    ParallelWorkFunc func, void* arg)
+{
+    int idx;
+
+    while ((idx = pNext->fetch_add(1)) < count)
+        (*func)(idx, arg);
+}
+
+/*
+ * Run "func" on [0, count) using a handful of threads.  The calling thread
+ * does its share of the work, so if we can't start any threads (or there's
+ * only one CPU) everything still gets done, just serially.
+ */
+void DiskImgLib::RunParallel(int count, ParallelWorkFunc func, void* arg)
+{
+    std::thread workers[kMaxWorkerThreads];
+    std::atomic<int> next(0);
+    int numThreads, numStarted, i;
+
+    if (count <= 0)
+        return;
+
+    numThreads = (int) std::thread::hardware_concurrency();
+    if (numThreads > kMaxWorkerThreads)
+        numThreads = kMaxWorkerThreads;
+    if (numThreads > count)
+        numThreads = count;
+
+    /* we're one of the workers, so start one fewer */
+    numStarted = 0;
+    for (i = 0; i < numThreads - 1; i++) {
+        try {
+            workers[i] = std::thread(ParallelWorker, &next, count, func, arg);
+        } catch (...) {
+            LOGW("RunParallel: unable to start worker thread %d", i);
+            break;
+        }
+        numStarted++;
+    }
+
+    ParallelWorker(&next, count, func, arg);
+
+    for (i = 0; i < numStarted; i++)
+        workers[i].join();
+}
+
+
 /*
  * Find the filename component of a local pathname.  Uses the fssep passed
  * in.  If the fssep is '\0' (as is the case for DOS 3.3), then the entire
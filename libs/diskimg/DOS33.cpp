@@ -2150,6 +2150,7 @@ DIError DiskFSDOS33::RenameFile(A2File* pGenericFile, const char* newName)
     A2FileDOS::TrimTrailingSpaces(storedName);
 
     strcpy(pFile->fFileName, storedName);
+    FilePathChanged(pFile);
 
 bail:
     return dierr;
@@ -96,6 +96,10 @@ DIError DiskFS::Flush(DiskImg::FlushMode mode)
 
     assert(fpImg != NULL);
 
+    dierr = FlushFS();
+    if (dierr != kDIErrNone)
+        return dierr;
+
     return fpImg->FlushImage(mode);
 }
 
@@ -155,6 +159,10 @@ void DiskFS::SetAllReadOnly(bool val)
 
 /*
  * Add a file to the end of our list.
+ *
+ * Hierarchical filesystems add files as they walk the disk, so a new file
+ * at the end of the list is also the last thing in each directory that
+ * contains it.
  */
 void DiskFS::AddFileToList(A2File* pFile)
 {
@@ -168,6 +176,17 @@ void DiskFS::AddFileToList(A2File* pFile)
         fpA2Tail->SetNext(pFile);
         fpA2Tail = pFile;
     }
+    fFileCount++;
+
+    A2File* pAncestor;
+    for (pAncestor = pFile->GetParent(); pAncestor != NULL;
+                                        pAncestor = pAncestor->GetParent())
+    {
+        pAncestor->fpLastDescendant = pFile;
+    }
+
+    if (fpFileHash != NULL)
+        AddFileToHash(pFile);
 }
 
 /*
@@ -178,14 +197,11 @@ void DiskFS::AddFileToList(A2File* pFile)
  * An empty hierarchic filesystem will have an entry for the volume dir, so
  * we should never have an empty list or a NULL pPrev.
  *
- * The part where things go pear-shaped happens if "pPrev" is a subdirectory.
- * If so, we need to come after all of the subdir's entries, including any
- * entries for sub-subdirs.  There's no graceful way to go about this in a
- * linear list.
- *
- * (We'd love to be able to find the *next* entry and then back up one,
- * but odds are that there isn't a "next" entry if we're busily creating
- * files.)
+ * If "pPrev" is a subdirectory other than our parent, we need to come after
+ * all of the subdir's entries, including any entries for sub-subdirs.  Each
+ * directory remembers the last entry in its group, so we can go straight
+ * there.  If we land at the end of our parent's group (or its parent's...),
+ * we become the new last entry.
  */
 void DiskFS::InsertFileInList(A2File* pFile, A2File* pPrev)
 {
@@ -194,90 +210,184 @@ void DiskFS::InsertFileInList(A2File* pFile, A2File* pPrev)
     if (fpA2Head == NULL) {
         assert(pPrev == NULL);
         fpA2Head = fpA2Tail = pFile;
+        fFileCount++;
+        if (fpFileHash != NULL)
+            AddFileToHash(pFile);
         return;
     } else if (pPrev == NULL) {
         // create two entries on DOS disk, delete first, add new file
         pFile->SetNext(fpA2Head);
+        fpA2Head->SetPrev(pFile);
         fpA2Head = pFile;
+        fFileCount++;
+        if (fpFileHash != NULL)
+            AddFileToHash(pFile);
         return;
     }
 
-    /*
-     * If we're inserting after the parent (i.e. we're the very first thing
-     * in a subdir) or after a plain file, just drop it in.
-     *
-     * If we're inserting after a subdir, go fish.
-     */
-    if (pPrev->IsDirectory() && pFile->GetParent() != pPrev) {
-        pPrev = SkipSubdir(pPrev);
+    if (pPrev->IsDirectory() && pFile->GetParent() != pPrev &&
+        pPrev->fpLastDescendant != NULL)
+    {
+        pPrev = pPrev->fpLastDescendant;
     }
 
+    pFile->SetPrev(pPrev);
     pFile->SetNext(pPrev->GetNext());
+    if (pPrev->GetNext() != NULL)
+        pPrev->GetNext()->SetPrev(pFile);
+    else
+        fpA2Tail = pFile;
     pPrev->SetNext(pFile);
+    fFileCount++;
+
+    A2File* pAncestor;
+    for (pAncestor = pFile->GetParent(); pAncestor != NULL;
+                                        pAncestor = pAncestor->GetParent())
+    {
+        if (pAncestor->fpLastDescendant == pPrev ||
+            (pAncestor->fpLastDescendant == NULL && pAncestor == pPrev))
+        {
+            pAncestor->fpLastDescendant = pFile;
+        } else {
+            break;      // we're in the middle of this one's group
+        }
+    }
+
+    if (fpFileHash != NULL)
+        AddFileToHash(pFile);
 }
 
 /*
- * Skip over all entries in the subdir we're pointing to.
- *
- * The return value is the very last entry in the subdir.
+ * Delete a member from the list.
  */
-A2File* DiskFS::SkipSubdir(A2File* pSubdir)
+void DiskFS::DeleteFileFromList(A2File* pFile)
 {
-    if (pSubdir->GetNext() == NULL)
-        return pSubdir;     // end of list reached -- subdir is empty
+    A2File* pPrev = pFile->GetPrev();
+    A2File* pNext = pFile->GetNext();
 
-    A2File* pCur = pSubdir;
-    A2File* pNext = NULL;
+    assert(pFile->fpLastDescendant == NULL);    // dirs must be empty
 
-    assert(pCur != NULL);    // at least one time through the loop
+    /*
+     * If we were the last thing in any directories, the entry before us
+     * takes over -- unless that's the directory itself, which is now empty.
+     */
+    A2File* pAncestor;
+    for (pAncestor = pFile->GetParent(); pAncestor != NULL;
+                                        pAncestor = pAncestor->GetParent())
+    {
+        if (pAncestor->fpLastDescendant != pFile)
+            break;
+        pAncestor->fpLastDescendant = (pPrev == pAncestor) ? NULL : pPrev;
+    }
 
-    while (pCur != NULL) {
-        pNext = pCur->GetNext();
-        if (pNext == NULL)               // end of list reached
-            return pCur;
+    if (fpFileHash != NULL)
+        RemoveFileFromHash(pFile);
 
-        if (pNext->GetParent() != pSubdir)  // end of dir reached
-            return pCur;
-        if (pNext->IsDirectory())
-            pCur = SkipSubdir(pNext);   // get last entry in dir
-        else
-            pCur = pNext;               // advance forward one
+    if (pPrev != NULL) {
+        pPrev->SetNext(pNext);
+    } else {
+        assert(fpA2Head == pFile);
+        fpA2Head = pNext;
+    }
+    if (pNext != NULL) {
+        pNext->SetPrev(pPrev);
+    } else {
+        assert(fpA2Tail == pFile);
+        fpA2Tail = pPrev;
     }
+    fFileCount--;
 
-    /* should never get here */
-    assert(false);
-    return pNext;
+    delete pFile;
 }
 
 /*
- * Delete a member from the list.
- *
- * We're currently singly-linked, making this rather expensive.
+ * Update the pathname hash after a file has been renamed.
  */
-void DiskFS::DeleteFileFromList(A2File* pFile)
+void DiskFS::FilePathChanged(A2File* pFile)
 {
-    if (fpA2Head == pFile) {
-        /* delete the head of the list */
-        fpA2Head = fpA2Head->GetNext();
-        delete pFile;
-    } else {
-        A2File* pCur = fpA2Head;
-        while (pCur != NULL) {
-            if (pCur->GetNext() == pFile) {
-                /* found it */
-                A2File* pNextNext = pCur->GetNext()->GetNext();
-                delete pCur->GetNext();
-                pCur->SetNext(pNextNext);
-                break;
-            }
-            pCur = pCur->GetNext();
-        }
+    if (fpFileHash == NULL)
+        return;
+    if (HashPathName(pFile->GetPathName()) == pFile->fPathHash)
+        return;
 
-        if (pCur == NULL) {
-            LOGI("GLITCH: couldn't find element to delete!");
-            assert(false);
+    RemoveFileFromHash(pFile);
+    AddFileToHash(pFile);
+}
+
+/*
+ * Hash a pathname, ignoring case the same way strcasecmp() does.  (FNV-1a.)
+ */
+/*static*/ uint32_t DiskFS::HashPathName(const char* pathName)
+{
+    uint32_t hash = 2166136261U;
+
+    while (*pathName != '\0') {
+        hash ^= (uint8_t) tolower((uint8_t) *pathName++);
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+/*
+ * Build the pathname hash from scratch, with at least one bucket per file.
+ */
+void DiskFS::BuildFileHash(void)
+{
+    A2File* pFile;
+
+    delete[] fpFileHash;
+    fFileHashSize = 64;
+    while (fFileHashSize < fFileCount)
+        fFileHashSize *= 2;
+    fpFileHash = new A2File*[fFileHashSize];
+    memset(fpFileHash, 0, sizeof(A2File*) * fFileHashSize);
+
+    for (pFile = fpA2Head; pFile != NULL; pFile = pFile->GetNext()) {
+        pFile->fPathHash = HashPathName(pFile->GetPathName());
+        long bucket = pFile->fPathHash & (fFileHashSize-1);
+        pFile->fpHashNext = fpFileHash[bucket];
+        fpFileHash[bucket] = pFile;
+    }
+}
+
+/*
+ * Add a file to the pathname hash, growing it if it's getting crowded.
+ * The file must already be in the list.
+ */
+void DiskFS::AddFileToHash(A2File* pFile)
+{
+    assert(fpFileHash != NULL);
+
+    if (fFileCount > fFileHashSize * 2) {
+        BuildFileHash();        // picks up pFile too
+        return;
+    }
+
+    pFile->fPathHash = HashPathName(pFile->GetPathName());
+    long bucket = pFile->fPathHash & (fFileHashSize-1);
+    pFile->fpHashNext = fpFileHash[bucket];
+    fpFileHash[bucket] = pFile;
+}
+
+/*
+ * Remove a file from the pathname hash.
+ */
+void DiskFS::RemoveFileFromHash(A2File* pFile)
+{
+    assert(fpFileHash != NULL);
+
+    A2File** ppLink = &fpFileHash[pFile->fPathHash & (fFileHashSize-1)];
+    while (*ppLink != NULL) {
+        if (*ppLink == pFile) {
+            *ppLink = pFile->fpHashNext;
+            pFile->fpHashNext = NULL;
+            return;
         }
+        ppLink = &(*ppLink)->fpHashNext;
     }
+
+    LOGI("GLITCH: couldn't find '%s' in path hash", pFile->GetPathName());
+    assert(false);
 }
 
 
@@ -297,21 +407,10 @@ A2File* DiskFS::GetNextFile(A2File* pFile) const
 
 /*
  * Return the #of elements in the linear file list.
- *
- * Right now the only code that calls this is the disk info panel in
- * CiderPress, so we don't need it to be efficient.
  */
 long DiskFS::GetFileCount(void) const
 {
-    long count = 0;
-
-    A2File* pFile = fpA2Head;
-    while (pFile != NULL) {
-        count++;
-        pFile = pFile->GetNext();
-    }
-
-    return count;
+    return fFileCount;
 }
 
 /*
@@ -328,6 +427,12 @@ void DiskFS::DeleteFileList(void)
         delete pFile;
         pFile = pNext;
     }
+    fpA2Head = fpA2Tail = NULL;
+    fFileCount = 0;
+
+    delete[] fpFileHash;
+    fpFileHash = NULL;
+    fFileHashSize = 0;
 }
 
 /*
@@ -355,11 +460,57 @@ void DiskFS::DumpFileList(void)
  * be best to let the application dig for the sub-volume.
  */
 A2File* DiskFS::GetFileByName(const char* fileName, StringCompareFunc func)
+{
+    /*
+     * Filesystems that defer directory loading get a chance to pull in
+     * the directories along the path before we go looking.
+     */
+    DIError dierr = LoadFilesForPath(fileName);
+    if (dierr != kDIErrNone) {
+        LOGW(" DiskFS unable to load files for '%s' (err=%d)", fileName, dierr);
+        return NULL;
+    }
+
+    return FindFileByName(fileName, func);
+}
+
+/*
+ * Search the files currently in the list.  This is the guts of
+ * GetFileByName(), without the on-demand loading.
+ */
+A2File* DiskFS::FindFileByName(const char* fileName, StringCompareFunc func)
 {
     A2File* pFile;
 
-    if (func == NULL)
+    /*
+     * With the standard comparison we can use the pathname hash.  Names
+     * aren't guaranteed to be unique, and we must return the first match
+     * in the list, so if the bucket has more than one match we fall back
+     * to the scan.
+     */
+    if (func == NULL) {
+        if (fpFileHash == NULL)
+            BuildFileHash();
+
+        uint32_t hash = HashPathName(fileName);
+        A2File* pMatch = NULL;
+        int matches = 0;
+
+        pFile = fpFileHash[hash & (fFileHashSize-1)];
+        while (pFile != NULL) {
+            if (pFile->fPathHash == hash &&
+                ::strcasecmp(pFile->GetPathName(), fileName) == 0)
+            {
+                pMatch = pFile;
+                matches++;
+            }
+            pFile = pFile->fpHashNext;
+        }
+        if (matches <= 1)
+            return pMatch;
+
         func = ::strcasecmp;
+    }
 
     pFile = GetNextFile(NULL);
     while (pFile != NULL) {
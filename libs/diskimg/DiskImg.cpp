@@ -194,6 +194,7 @@ DiskImg::DiskImg(void)
     fpOuterWrapper = NULL;
     fpImageWrapper = NULL;
     fpParentImg = NULL;
+    fpProbeCache = NULL;
     fDOSVolumeNum = kVolumeNumNotSet;
     fOuterLength = -1;
     fWrappedLength = -1;
@@ -1316,6 +1317,108 @@ DIError DiskImg::AnalyzeImage(void)
     return kDIErrNone;
 }
 
+/*
+ * Filesystem probes, in the order AnalyzeImageFS checks them.
+ */
+enum {
+    kProbeMacPart = 0,
+    kProbeMicroDrive,
+    kProbeFocusDrive,
+    kProbeCFFA,
+    kProbeFAT,
+    kProbeDOS33,
+    kProbeWideDOS,
+    kProbeUNIDOS,
+    kProbeOzDOS,
+    kProbeProDOS,
+    kProbePascal,
+    kProbeCPM,
+    kProbeRDOS,
+    kProbeHFS,
+    kProbeGutenberg,
+    kNumProbes
+};
+typedef DIError (*ProbeFunc)(DiskImg* pImg, DiskImg::SectorOrder* pOrder,
+    DiskImg::FSFormat* pFormat, DiskFS::FSLeniency leniency);
+static const ProbeFunc kProbeFuncs[kNumProbes] = {
+    DiskFSMacPart::TestFS,
+    DiskFSMicroDrive::TestFS,
+    DiskFSFocusDrive::TestFS,
+    DiskFSCFFA::TestFS,
+    DiskFSFAT::TestFS,
+    DiskFSDOS33::TestFS,
+    DiskFSUNIDOS::TestWideFS,
+    DiskFSUNIDOS::TestFS,
+    DiskFSOzDOS::TestFS,
+    DiskFSProDOS::TestFS,
+    DiskFSPascal::TestFS,
+    DiskFSCPM::TestFS,
+    DiskFSRDOS::TestFS,
+    DiskFSHFS::TestFS,
+    DiskFSGutenberg::TestFS,
+};
+
+/*
+ * Results from the probes.  Each probe starts from the same order and
+ * format values (a probe that fails leaves them alone, so this is what it
+ * would have seen if they ran one after another).
+ */
+typedef struct ProbeWork {
+    DiskImg*                pImg;
+    DiskImg::SectorOrder    initialOrder;
+    DiskImg::FSFormat       initialFormat;
+    bool                    done[kNumProbes];
+    DIError                 result[kNumProbes];
+    DiskImg::SectorOrder    order[kNumProbes];
+    DiskImg::FSFormat       format[kNumProbes];
+} ProbeWork;
+
+/*
+ * Run one probe.
+ */
+static void RunProbe(ProbeWork* pWork, int idx)
+{
+    pWork->order[idx] = pWork->initialOrder;
+    pWork->format[idx] = pWork->initialFormat;
+    pWork->result[idx] = (*kProbeFuncs[idx])(pWork->pImg, &pWork->order[idx],
+                            &pWork->format[idx], DiskFS::kLeniencyNot);
+    pWork->done[idx] = true;
+}
+
+/*
+ * Run one probe (RunParallel worker).
+ *
+ * The CFFA probe opens sub-volumes, which read the image file without
+ * going through our ProbeCache, so we leave it for ProbeFound to run
+ * after everything else has finished.  (It's also the most expensive
+ * probe, so it's just as well to skip it when MacPart et al. win.)
+ */
+static void ProbeWorker(int idx, void* arg)
+{
+    ProbeWork* pWork = (ProbeWork*) arg;
+
+    if (idx != kProbeCFFA)
+        RunProbe(pWork, idx);
+}
+
+/*
+ * Return "true" if probe "idx" found its filesystem, in which case the
+ * order and format it found are copied out.  If the probe hasn't been
+ * run yet, run it now.
+ */
+static bool ProbeFound(ProbeWork* pWork, int idx, DiskImg::SectorOrder* pOrder,
+    DiskImg::FSFormat* pFormat)
+{
+    if (!pWork->done[idx])
+        RunProbe(pWork, idx);
+    if (pWork->result[idx] != kDIErrNone)
+        return false;
+
+    *pOrder = pWork->order[idx];
+    *pFormat = pWork->format[idx];
+    return true;
+}
+
 /*
  * Try to figure out what filesystem exists on this disk image.
  *
@@ -1326,24 +1429,51 @@ DIError DiskImg::AnalyzeImage(void)
  */
 void DiskImg::AnalyzeImageFS(void)
 {
+    /*
+     * The probes read the same few areas many times over, so serve them
+     * from memory.  The first 128K covers the boot blocks, partition maps,
+     * and the ProDOS, Pascal, CP/M, and 5.25" DOS catalogs in one read;
+     * anything else gets pulled in as the probes ask for it.
+     */
+    ProbeCache probeCache(fpDataGFD, fLength);
+    assert(fpProbeCache == NULL);
+    probeCache.Prefetch(0, 128 * 1024);
+    fpProbeCache = &probeCache;
+
+    /*
+     * The probes are independent of each other, so if parallel probing is
+     * enabled we run them all at once on sector images and then pick the
+     * winner below, in the usual order.  Otherwise (and always for nibble
+     * images, which share a track buffer) the probes run one at a time,
+     * as they're asked for.  Either way, probes we don't get to before
+     * finding a winner are irrelevant.
+     */
+    ProbeWork probes;
+    probes.pImg = this;
+    probes.initialOrder = fOrder;
+    probes.initialFormat = fFormat;
+    memset(probes.done, 0, sizeof(probes.done));
+    if (gParallelProbes && IsSectorFormat(fPhysical))
+        RunParallel(kNumProbes, ProbeWorker, &probes);
+
     /*
      * In some circumstances it would be useful to have a set describing
      * what filesystems we might expect to find, e.g. we're not likely to
      * encounter RDOS embedded in a CF card.
      */
-    if (DiskFSMacPart::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot) == kDIErrNone)
+    if (ProbeFound(&probes, kProbeMacPart, &fOrder, &fFormat))
     {
         assert(fFormat == kFormatMacPart);
         LOGI(" DI found MacPart, order=%d", fOrder);
-    } else if (DiskFSMicroDrive::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot) == kDIErrNone)
+    } else if (ProbeFound(&probes, kProbeMicroDrive, &fOrder, &fFormat))
     {
         assert(fFormat == kFormatMicroDrive);
         LOGI(" DI found MicroDrive, order=%d", fOrder);
-    } else if (DiskFSFocusDrive::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot) == kDIErrNone)
+    } else if (ProbeFound(&probes, kProbeFocusDrive, &fOrder, &fFormat))
     {
         assert(fFormat == kFormatFocusDrive);
         LOGI(" DI found FocusDrive, order=%d", fOrder);
-    } else if (DiskFSCFFA::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot) == kDIErrNone)
+    } else if (ProbeFound(&probes, kProbeCFFA, &fOrder, &fFormat))
     {
         // The CFFA format doesn't have a partition map, but we do insist
         // on finding multiple volumes.  It needs to come after MicroDrive,
@@ -1352,7 +1482,7 @@ void DiskImg::AnalyzeImageFS(void)
         // out the blocks.
         assert(fFormat == kFormatCFFA4 || fFormat == kFormatCFFA8);
         LOGI(" DI found CFFA, order=%d", fOrder);
-    } else if (DiskFSFAT::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot) == kDIErrNone)
+    } else if (ProbeFound(&probes, kProbeFAT, &fOrder, &fFormat))
     {
         // This is really just a trap to catch CFFA cards that were formatted
         // for ProDOS and then re-formatted for MSDOS.  As such it needs to
@@ -1360,54 +1490,54 @@ void DiskImg::AnalyzeImageFS(void)
         // and can be overridden, so it's pretty safe.
         assert(fFormat == kFormatMSDOS);
         LOGI(" DI found MSDOS, order=%d", fOrder);
-    } else if (DiskFSDOS33::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot) == kDIErrNone)
+    } else if (ProbeFound(&probes, kProbeDOS33, &fOrder, &fFormat))
     {
         assert(fFormat == kFormatDOS32 || fFormat == kFormatDOS33);
         LOGI(" DI found DOS3.x, order=%d", fOrder);
         if (fNumSectPerTrack == 13)
             fFormat = kFormatDOS32;
-    } else if (DiskFSUNIDOS::TestWideFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot) == kDIErrNone)
+    } else if (ProbeFound(&probes, kProbeWideDOS, &fOrder, &fFormat))
     {
         // Should only succeed on 400K embedded chunks.
         assert(fFormat == kFormatDOS33);
         fNumSectPerTrack = 32;
         fNumTracks /= 2;
         LOGI(" DI found 'wide' DOS3.3, order=%d", fOrder);
-    } else if (DiskFSUNIDOS::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot) == kDIErrNone)
+    } else if (ProbeFound(&probes, kProbeUNIDOS, &fOrder, &fFormat))
     {
         assert(fFormat == kFormatUNIDOS);
         fNumSectPerTrack = 32;
         fNumTracks /= 2;
         LOGI(" DI found UNIDOS, order=%d", fOrder);
-    } else if (DiskFSOzDOS::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot) == kDIErrNone)
+    } else if (ProbeFound(&probes, kProbeOzDOS, &fOrder, &fFormat))
     {
         assert(fFormat == kFormatOzDOS);
         fNumSectPerTrack = 32;
         fNumTracks /= 2;
         LOGI(" DI found OzDOS, order=%d", fOrder);
-    } else if (DiskFSProDOS::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot) == kDIErrNone)
+    } else if (ProbeFound(&probes, kProbeProDOS, &fOrder, &fFormat))
     {
         assert(fFormat == kFormatProDOS);
         LOGI(" DI found ProDOS, order=%d", fOrder);
-    } else if (DiskFSPascal::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot) == kDIErrNone)
+    } else if (ProbeFound(&probes, kProbePascal, &fOrder, &fFormat))
     {
         assert(fFormat == kFormatPascal);
         LOGI(" DI found Pascal, order=%d", fOrder);
-    } else if (DiskFSCPM::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot) == kDIErrNone)
+    } else if (ProbeFound(&probes, kProbeCPM, &fOrder, &fFormat))
     {
         assert(fFormat == kFormatCPM);
         LOGI(" DI found CP/M, order=%d", fOrder);
-    } else if (DiskFSRDOS::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot) == kDIErrNone)
+    } else if (ProbeFound(&probes, kProbeRDOS, &fOrder, &fFormat))
     {
         assert(fFormat == kFormatRDOS33 ||
                fFormat == kFormatRDOS32 ||
                fFormat == kFormatRDOS3);
         LOGI(" DI found RDOS 3.3, order=%d", fOrder);
-    } else if (DiskFSHFS::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot) == kDIErrNone)
+    } else if (ProbeFound(&probes, kProbeHFS, &fOrder, &fFormat))
     {
         assert(fFormat == kFormatMacHFS);
         LOGI(" DI found HFS, order=%d", fOrder);
-    } else if (DiskFSGutenberg::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot) == kDIErrNone)
+    } else if (ProbeFound(&probes, kProbeGutenberg, &fOrder, &fFormat))
     {
         assert(fFormat == kFormatGutenberg);
         LOGI(" DI found Gutenberg, order=%d", fOrder);
@@ -1417,6 +1547,7 @@ void DiskImg::AnalyzeImageFS(void)
             fOrder);
     }
 
+    fpProbeCache = NULL;
     fFileSysOrder = CalcFSSectorOrder();
 }
 
@@ -1710,9 +1841,9 @@ bail:
  *
  * BUG: this should also handle the track/sector case.
  *
- * HEY: this is awfully slow on large disks... should have some sort of
- * optimized path that just writes to the GFD or something.  Maybe even just
- * a "ZeroBlock" instead of "WriteBlock" so we can memset instead of memcpy?
+ * For sector images the order doesn't matter (zero is zero), so we hand
+ * the whole thing to the GFD, which can punch a hole instead of writing.
+ * Nibble images have to go through WriteBlock.
  */
 DIError DiskImg::ZeroImage(void)
 {
@@ -1721,6 +1852,29 @@ DIError DiskImg::ZeroImage(void)
     long block;
 
     LOGI(" DI ZeroImage (%ld blocks)", GetNumBlocks());
+
+    if (fPhysical == kPhysicalFormatSectors) {
+        if (fReadOnly)
+            return kDIErrAccessDenied;
+        assert(fpDataGFD != NULL);
+
+        dierr = fpDataGFD->Seek(0, kSeekSet);
+        if (dierr == kDIErrNone)
+            dierr = fpDataGFD->WriteZeroes((di_off_t) GetNumBlocks() * kBlockSize);
+        if (dierr != kDIErrNone) {
+            LOGI(" DI ZeroImage failed (err=%d)", dierr);
+            return dierr;
+        }
+
+        /* set the dirty flag here and everywhere above */
+        DiskImg* pImg = this;
+        while (pImg != NULL) {
+            pImg->fDirty = true;
+            pImg = pImg->fpParentImg;
+        }
+        return kDIErrNone;
+    }
+
     memset(blkBuf, 0, sizeof(blkBuf));
 
     for (block = 0; block < GetNumBlocks(); block++) {
@@ -2297,6 +2451,9 @@ DIError DiskImg::CopyBytesOut(void* buf, di_off_t offset, int size) const
 {
     DIError dierr;
 
+    if (fpProbeCache != NULL)
+        return fpProbeCache->Read(buf, offset, size);
+
     dierr = fpDataGFD->Seek(offset, kSeekSet);
     if (dierr != kDIErrNone) {
         LOGI(" DI seek off=%ld failed (err=%d)", (long) offset, dierr);
@@ -2313,6 +2470,114 @@ DIError DiskImg::CopyBytesOut(void* buf, di_off_t offset, int size) const
     return kDIErrNone;
 }
 
+/*
+ * ===========================================================================
+ *      ProbeCache
+ * ===========================================================================
+ */
+
+/*
+ * Read [offset, offset+len) into a new chunk.  Returns NULL if we're out
+ * of room or the read fails.
+ */
+ProbeCache::Chunk* ProbeCache::LoadChunk(di_off_t offset, long len)
+{
+    Chunk* pChunk;
+
+    if (fNumChunks == kMaxChunks)
+        return NULL;
+    if (offset + len > fLength)
+        len = (long) (fLength - offset);
+    if (len <= 0)
+        return NULL;
+
+    pChunk = &fChunks[fNumChunks];
+    pChunk->data = new uint8_t[len];
+    if (pChunk->data == NULL)
+        return NULL;
+    if (fpGFD->Seek(offset, kSeekSet) != kDIErrNone ||
+        fpGFD->Read(pChunk->data, len) != kDIErrNone)
+    {
+        delete[] pChunk->data;
+        return NULL;
+    }
+    pChunk->offset = offset;
+    pChunk->len = len;
+    fNumChunks++;
+    fNumReads++;
+    return pChunk;
+}
+
+/*
+ * Load a region with a single read.
+ */
+void ProbeCache::Prefetch(di_off_t offset, long len)
+{
+    (void) LoadChunk(offset, len);
+}
+
+/*
+ * Copy data out of the cache, loading it if necessary.
+ */
+DIError ProbeCache::Read(void* buf, di_off_t offset, long len)
+{
+    std::lock_guard<std::mutex> lock(fLock);
+    Chunk* pChunk = NULL;
+    DIError dierr;
+    int i;
+
+    for (i = 0; i < fNumChunks; i++) {
+        if (offset >= fChunks[i].offset &&
+            offset + len <= fChunks[i].offset + fChunks[i].len)
+        {
+            pChunk = &fChunks[i];
+            break;
+        }
+    }
+    if (pChunk == NULL) {
+        di_off_t chunkStart = offset - (offset % kChunkSize);
+        if (offset + len <= chunkStart + kChunkSize)
+            pChunk = LoadChunk(chunkStart, kChunkSize);
+    }
+
+    if (pChunk != NULL) {
+        memcpy(buf, pChunk->data + (offset - pChunk->offset), len);
+        return kDIErrNone;
+    }
+
+    /* not cacheable; do it the old-fashioned way */
+    dierr = fpGFD->Seek(offset, kSeekSet);
+    if (dierr != kDIErrNone) {
+        LOGI(" DI seek off=%ld failed (err=%d)", (long) offset, dierr);
+        return dierr;
+    }
+    dierr = fpGFD->Read(buf, len);
+    if (dierr != kDIErrNone) {
+        LOGI(" DI read off=%ld size=%ld failed (err=%d)",
+            (long) offset, len, dierr);
+        return dierr;
+    }
+    return kDIErrNone;
+}
+
+/*
+ * Throw out everything we've cached.
+ */
+void ProbeCache::Invalidate(void)
+{
+    std::lock_guard<std::mutex> lock(fLock);
+    int i;
+
+    if (fNumReads != 0) {
+        LOGD(" ProbeCache used %d reads, %d chunks", fNumReads, fNumChunks);
+        fNumReads = 0;
+    }
+    for (i = 0; i < fNumChunks; i++)
+        delete[] fChunks[i].data;
+    fNumChunks = 0;
+}
+
+
 /*
  * Copy a chunk of bytes into the disk image.
  *
@@ -2330,6 +2595,9 @@ DIError DiskImg::CopyBytesIn(const void* buf, di_off_t offset, int size)
     }
     assert(fpDataGFD != NULL);   // somebody closed the image?
 
+    if (fpProbeCache != NULL)
+        fpProbeCache->Invalidate();
+
     dierr = fpDataGFD->Seek(offset, kSeekSet);
     if (dierr != kDIErrNone) {
         LOGI(" DI seek off=%ld failed (err=%d)", (long) offset, dierr);
@@ -2648,6 +2916,14 @@ DIError DiskImg::CreateImageCommon(const char* pathName, const char* storageName
     }
     assert(fpDataGFD != NULL);
 
+    /*
+     * If the wrapper lives in our memory buffer and now knows how big it
+     * will be, make room for all of it, so formatting the data doesn't
+     * have to grow the buffer and copy the image.
+     */
+    if (fOuterFormat != kOuterFormatNone && fWrappedLength > fLength)
+        ((GFDBuffer*) fpWrapperGFD)->Reserve(fWrappedLength);
+
     /*
      * Step 6: "format" fpDataGFD.
      *
@@ -2893,7 +3169,6 @@ DIError DiskImg::FormatSectors(GenericFD* pGFD, bool quickFormat) const
 {
     DIError dierr = kDIErrNone;
     char sctBuf[kSectorSize];
-    di_off_t length;
 
     assert(fLength > 0 && (fLength & 0xff) == 0);
 
@@ -2916,14 +3191,12 @@ DIError DiskImg::FormatSectors(GenericFD* pGFD, bool quickFormat) const
             goto bail;
         }
     } else {
-        for (length = fLength ; length > 0; length -= sizeof(sctBuf)) {
-            dierr = pGFD->Write(sctBuf, sizeof(sctBuf), NULL);
-            if (dierr != kDIErrNone) {
-                LOGI(" FormatSectors: GFD write failed (err=%d)", dierr);
-                goto bail;
-            }
+        /* file-backed GFDs will leave this as a hole */
+        dierr = pGFD->WriteZeroes(fLength);
+        if (dierr != kDIErrNone) {
+            LOGI(" FormatSectors: GFD write failed (err=%d)", dierr);
+            goto bail;
         }
-        assert(length == 0);
     }
 
 
@@ -3496,3 +3769,17 @@ bool DiskImgLib::gAllowWritePhys0 = false;
 /*static*/ void DiskImg::SetAllowWritePhys0(bool val) {
     DiskImgLib::gAllowWritePhys0 = val;
 }
+
+/*static*/ void DiskImg::SetGzipRandomAccess(bool enable, bool useIndexFile) {
+    DiskImgLib::gGzipRandomAccess = enable;
+    DiskImgLib::gGzipIndexFile = useIndexFile;
+}
+
+/*static*/ void DiskImg::SetNuFXLazyAccess(bool enable) {
+    DiskImgLib::gNuFXLazyAccess = enable;
+}
+
+bool DiskImgLib::gParallelProbes = false;
+/*static*/ void DiskImg::SetParallelProbes(bool enable) {
+    DiskImgLib::gParallelProbes = enable;
+}
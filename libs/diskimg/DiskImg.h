@@ -183,6 +183,7 @@ class ImageWrapper;
 class CircularBufferAccess;
 class ASPI;
 class LinearBitmap;
+class ProbeCache;
 
 
 /*
@@ -635,6 +636,14 @@ public:
     static DIError UnpackNibbleTrack35(const uint8_t* nibbleBuf,
         long nibbleLen, uint8_t* outputBuf, int cyl, int head,
         LinearBitmap* pBadBlockMap);
+    // unpack every nibble track of a 3.5" disk into a block image
+    static DIError UnpackNibbleDisk35(const uint8_t* const* nibbleBufs,
+        const long* nibbleLens, int numCyls, int numHeads,
+        uint8_t* outputBuf, LinearBitmap* pBadBlockMap);
+    // decode one 3.5" track without touching shared state
+    static void DecodeNibbleTrack35(const uint8_t* nibbleBuf,
+        long nibbleLen, uint8_t* outputBuf, int cyl, int head,
+        bool* badSector);
     // compute the #of sectors per track for cylinder N (0-79)
     static int SectorsPerTrack35(int cylinder);
 
@@ -656,6 +665,24 @@ public:
     // you're booting from SATA.  This only has meaning under Win32.
     static void SetAllowWritePhys0(bool val);
 
+    // Large gzip images opened read-only are normally expanded on demand
+    // rather than all at once.  Set "useIndexFile" to keep the seek index
+    // in a ".gzidx" file next to the image, so it needn't be rebuilt.
+    static void SetGzipRandomAccess(bool enable, bool useIndexFile);
+
+    // LZW-compressed ShrinkIt disk images opened read-only are normally
+    // expanded a track at a time, as they're read.  LZW/1 images are
+    // handled that way when opened read-write too, and only the modified
+    // tracks are recompressed when they're written back (the NuFX
+    // compression type setting doesn't apply to them).
+    static void SetNuFXLazyAccess(bool enable);
+
+    // Run the filesystem probes in AnalyzeImage on several threads at
+    // once.  The result is the same either way.  This only pays off when
+    // the probes are slow, e.g. large images on slow media; otherwise the
+    // thread startup costs more than it saves.  Off by default.
+    static void SetParallelProbes(bool enable);
+
     /*
      * Get string constants for enumerated values.
      */
@@ -705,6 +732,7 @@ private:
     OuterWrapper*   fpOuterWrapper; // needed for outer .gz wrapper
     ImageWrapper*   fpImageWrapper; // disk image wrapper (2MG, SHK, etc)
     DiskImg*        fpParentImg;    // set for embedded volumes
+    ProbeCache*     fpProbeCache;   // set while AnalyzeImageFS runs
     short           fDOSVolumeNum;  // specified by some wrapper formats
     di_off_t        fOuterLength;   // total len of file
     di_off_t        fWrappedLength; // len of file after Outer wrapper removed
@@ -839,7 +867,17 @@ private:
         uint8_t* sctBuf, const NibbleDescr* pNibbleDescr);
     void EncodeNibble53(const CircularBufferAccess& buffer, int idx,
         const uint8_t* sctBuf, const NibbleDescr* pNibbleDescr) const;
-    int TestNibbleTrack(int track, const NibbleDescr* pNibbleDescr, int* pVol);
+    typedef struct {
+        int             track;
+        long            trackLen;
+        uint8_t*        buf;            // private copy of the track
+        int*            addrPosn;       // offsets of possible addr fields
+        int             numAddrPosn;
+    } NibbleTrackIndex;
+    DIError IndexNibbleTrack(int track, NibbleTrackIndex* pIndex);
+    void FreeNibbleTrackIndex(NibbleTrackIndex* pIndex);
+    int ScoreNibbleTrack(const NibbleTrackIndex* pIndex,
+        const NibbleDescr* pNibbleDescr, int* pVol);
     DIError AnalyzeNibbleData(void);
     inline uint8_t Conv44(uint16_t val, bool first) const {
         if (first)
@@ -1092,6 +1130,9 @@ public:
 
     DiskFS(void) {
         fpA2Head = fpA2Tail = NULL;
+        fFileCount = 0;
+        fpFileHash = NULL;
+        fFileHashSize = 0;
         fpSubVolumeHead = fpSubVolumeTail = NULL;
         fpImg = NULL;
         fScanForSubVolumes = kScanSubDisabled;
@@ -1099,6 +1140,8 @@ public:
         fParmTable[kParm_CreateUnique] = 0;
         fParmTable[kParmProDOS_AllowLowerCase] = 1;
         fParmTable[kParmProDOS_AllocSparse] = 1;
+        fParmTable[kParmProDOS_WriteThroughBitmap] = 0;
+        fParmTable[kParmProDOS_BatchScanReads] = 1;
     }
     virtual ~DiskFS(void) {
         DeleteSubVolumeList();
@@ -1139,10 +1182,21 @@ public:
      * always do the full scan; this is an optimization.)  Guaranteed to
      * set the volume name and volume block/sector count.
      *
+     * "kInitLazy" reads the volume directory and defers everything else
+     * until it's needed: subdirectories are loaded the first time a
+     * pathname reaches into them, and the usage map is built on the first
+     * call to GetVolumeUsageMap().  Until then GetNextFile() and
+     * GetFileCount() only see what has been loaded, sparse lengths are
+     * just the EOF, and damage is only noticed in the parts that have
+     * been touched.  Sub-volumes are not scanned.  Only ProDOS implements
+     * this; everything else treats it as kInitFull.
+     *
      * If a progress callback is set up, this can return with a "cancelled"
      * result, which should not be treated as a failure.
      */
-    typedef enum { kInitUnknown = 0, kInitHeaderOnly, kInitFull } InitMode;
+    typedef enum {
+        kInitUnknown = 0, kInitHeaderOnly, kInitFull, kInitLazy
+    } InitMode;
     virtual DIError Initialize(DiskImg* pImg, InitMode initMode) = 0;
 
     /*
@@ -1301,6 +1355,8 @@ public:
      * const to keep non-DiskFS classes from altering the map.
      */
     const VolumeUsage* GetVolumeUsageMap(void) {
+        if (!fVolumeUsage.GetInitialized())
+            (void) LoadVolumeUsage();
         if (fVolumeUsage.GetInitialized())
             return &fVolumeUsage;
         else
@@ -1337,6 +1393,8 @@ public:
 
         kParmProDOS_AllowLowerCase = 10,    // allow lower case and spaces
         kParmProDOS_AllocSparse = 11,       // don't store empty blocks
+        kParmProDOS_WriteThroughBitmap = 12, // save bitmap after every change
+        kParmProDOS_BatchScanReads = 13,    // read index blocks in batches
 
         kParmMax        // must be last entry
     } DiskFSParameter;
@@ -1346,10 +1404,12 @@ public:
     /*
      * Flush changed data.
      *
-     * The individual filesystems shouldn't generally do any caching; if
-     * they do, we would want a virtual "FlushFS()" that gets called by
-     * Flush.  The better answer is to cache in DiskImg, which works for
-     * everything, and knows if the underlying storage is already in RAM.
+     * The individual filesystems shouldn't generally do any caching; the
+     * better answer is to cache in DiskImg, which works for everything,
+     * and knows if the underlying storage is already in RAM.  Filesystems
+     * that do hold on to something (ProDOS keeps its volume bitmap) write
+     * it out in FlushFS(), which is called here before the DiskImg is
+     * flushed.
      *
      * For the most part this just needs to recursively flush the DiskImg
      * objects in all of the sub-volumes and then the current volume.  This
@@ -1390,10 +1450,23 @@ protected:
     void InsertFileInList(A2File* pFile, A2File* pPrev);
     // delete an entry
     void DeleteFileFromList(A2File* pFile);
+    // call after changing the pathname of a file that's in the list
+    void FilePathChanged(A2File* pFile);
 
     // scan for damaged or suspicious files
     void ScanForDamagedFiles(bool* pDamaged, bool* pSuspicious);
 
+    // write out anything the filesystem is holding; called by Flush
+    virtual DIError FlushFS(void) { return kDIErrNone; }
+
+    // for kInitLazy: load whatever is needed to resolve "pathName", or
+    //  build the usage map; no-ops for filesystems that load everything
+    virtual DIError LoadFilesForPath(const char* pathName) { return kDIErrNone; }
+    virtual DIError LoadVolumeUsage(void) { return kDIErrNone; }
+
+    // GetFileByName() without the LoadFilesForPath() call
+    A2File* FindFileByName(const char* pathName, StringCompareFunc func = NULL);
+
     // pointer to the DiskImg structure underlying this filesystem
     DiskImg*    fpImg;
 
@@ -1402,15 +1475,27 @@ protected:
 
 
 private:
-    A2File* SkipSubdir(A2File* pSubdir);
     void CopyInheritables(DiskFS* pNewFS);
     void DeleteFileList(void);
     void DeleteSubVolumeList(void);
+    static uint32_t HashPathName(const char* pathName);
+    void BuildFileHash(void);
+    void AddFileToHash(A2File* pFile);
+    void RemoveFileFromHash(A2File* pFile);
 
     long fParmTable[kParmMax];          // for DiskFSParameter
 
     A2File*     fpA2Head;
     A2File*     fpA2Tail;
+    long        fFileCount;             // #of entries in fpA2Head list
+
+    /*
+     * Hash of case-folded pathnames, chained through A2File::fpHashNext.
+     * It's built the first time somebody looks up a file by name, and
+     * kept up to date after that.  NULL until then.
+     */
+    A2File**    fpFileHash;
+    long        fFileHashSize;          // #of buckets, always a power of 2
     SubVolume*  fpSubVolumeHead;
     SubVolume*  fpSubVolumeTail;
 
@@ -1451,6 +1536,9 @@ public:
 
     A2File(DiskFS* pDiskFS) : fpDiskFS(pDiskFS) {
         fpPrev = fpNext = NULL;
+        fpHashNext = NULL;
+        fPathHash = 0;
+        fpLastDescendant = NULL;
         fFileQuality = kQualityGood;
     }
     virtual ~A2File(void) {}
@@ -1565,6 +1653,14 @@ private:
     A2File*     fpPrev;
     A2File*     fpNext;
 
+    // DiskFS pathname hash chain, and the hash we were filed under
+    A2File*     fpHashNext;
+    uint32_t    fPathHash;
+
+    // For a directory, the last entry in the list that lives somewhere
+    //  inside it (the end of its group of entries), or NULL if it's empty.
+    A2File*     fpLastDescendant;
+
 
 private:
     A2File& operator=(const A2File&);
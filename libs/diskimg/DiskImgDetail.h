@@ -63,6 +63,17 @@ public:
 
     virtual const char* GetExtension(void) const = 0;
 
+protected:
+    // compress to a raw deflate stream, using multiple threads
+    static DIError DeflateParallel(GenericFD* pDst, GenericFD* pSrc,
+        di_off_t srcLen, int level, di_off_t* pCompLength, uint32_t* pCRC);
+
+    enum {
+        kDeflateChunkSize = 128 * 1024,
+        kDeflateDictSize = 32768,
+        kDeflateBatchChunks = 16,
+    };
+
 private:
     OuterWrapper& operator=(const OuterWrapper&);
     OuterWrapper(const OuterWrapper&);
@@ -84,13 +95,27 @@ public:
     virtual const char* GetExtension(void) const override { return NULL; }
 
 private:
-    DIError ExtractGzipImage(gzFile gzfp, char** pBuf, di_off_t* pLength);
+    DIError ReadSizeHint(GenericFD* pOuterGFD, di_off_t outerLength,
+        uint32_t* pSize);
+    DIError ExtractPresized(GenericFD* pOuterGFD, di_off_t outerLength,
+        char** pBuf, di_off_t* pLength);
+    DIError ExtractGzipImage(gzFile gzfp, char** pBuf, di_off_t* pLength,
+        di_off_t* pAllocLength);
+    DIError LoadRandomAccess(GenericFD* pOuterGFD, di_off_t outerLength,
+        di_off_t* pWrapperLength, GenericFD** ppWrapperGFD);
     DIError CloseGzip(void);
 
     // Largest possible ProDOS volume; quite a bit to hold in RAM. Add a
     // little extra for .hdv format.
     enum { kMaxUncompressedSize = kGzipMax +256 };
 
+    enum {
+        kGzipMagic = 0x8b1f,            // 0x1f 0x8b, read little-endian
+        kMinGzipLen = 18,               // 10-byte header, 8-byte trailer
+        kMinRandomAccessSize = 4 * 1024 * 1024,
+    };
+    static const char* kIndexFileExt;
+
     bool    fWrapperDamaged;
 };
 
@@ -273,8 +298,6 @@ private:
         uint8_t** pBuf, di_off_t* pLength);
     DIError InflateGFDToBuffer(GenericFD* pGFD, unsigned long compSize,
         unsigned long uncompSize, uint8_t* buf);
-    DIError DeflateGFDToGFD(GenericFD* pDst, GenericFD* pSrc, di_off_t length,
-        di_off_t* pCompLength, uint32_t* pCRC);
 
 private:
     void SetExtension(const char* ext);
@@ -398,7 +421,7 @@ public:
 class WrapperNuFX : public ImageWrapper {
 public:
     WrapperNuFX(void) : fpArchive(NULL), fThreadIdx(0), fStorageName(NULL),
-        fCompressType(kNuThreadFormatLZW2)
+        fCompressType(kNuThreadFormatLZW2), fUpdateChunks(false)
         {}
     virtual ~WrapperNuFX(void) { CloseNuFX(); delete[] fStorageName; }
 
@@ -428,9 +451,12 @@ private:
     enum { kDefaultStorageFssep = ':' };
     static NuResult ErrMsgHandler(NuArchive* pArchive, void* vErrorMessage);
     static DIError OpenNuFX(const char* pathName, NuArchive** ppArchive,
-        NuThreadIdx* pThreadIdx, long* pLength, bool readOnly);
+        NuThreadIdx* pThreadIdx, long* pLength, bool readOnly,
+        NuThread* pThreadCopy, bool* pThreadHasCRC);
     DIError GetNuFXDiskImage(NuArchive* pArchive, NuThreadIdx threadIdx,
         long length, char** ppData);
+    DIError FindNewThread(NuRecordIdx recordIdx, NuThreadIdx threadIdx,
+        const NuThread** ppThread);
     static char* GenTempPath(const char* path);
     DIError CloseNuFX(void);
     void UNIXTimeToDateTime(const time_t* pWhen, NuDateTime *pDateTime);
@@ -439,13 +465,18 @@ private:
     NuThreadIdx     fThreadIdx;
     char*           fStorageName;
     NuThreadFormat  fCompressType;
+    bool            fUpdateChunks;  // data GFD is a writable GFDNuFX
 };
 
 class WrapperDiskCopy42 : public ImageWrapper {
 public:
-    WrapperDiskCopy42(void) : fStorageName(NULL), fBadChecksum(false)
+    WrapperDiskCopy42(void) : fStorageName(NULL), fBadChecksum(false),
+        fBlockChecksum(NULL)
         {}
-    virtual ~WrapperDiskCopy42(void) { delete[] fStorageName; }
+    virtual ~WrapperDiskCopy42(void) {
+        delete[] fStorageName;
+        delete[] fBlockChecksum;
+    }
 
     static DIError Test(GenericFD* pGFD, di_off_t wrappedLength);
     virtual DIError Prep(GenericFD* pGFD, di_off_t wrappedLength, bool readOnly,
@@ -475,11 +506,12 @@ private:
     void InitHeader(DC42Header* pHeader);
     static int ReadHeader(GenericFD* pGFD, DC42Header* pHeader);
     DIError WriteHeader(GenericFD* pGFD, const DC42Header* pHeader);
-    static DIError ComputeChecksum(GenericFD* pGFD,
-        uint32_t* pChecksum);
+    static DIError ComputeChecksum(GenericFD* pGFD, int startBlock,
+        int cleanBlock, uint32_t* blockChecksum, uint32_t* pChecksum);
 
     char*           fStorageName;
     bool            fBadChecksum;
+    uint32_t*       fBlockChecksum;     // running checksum at each block
 };
 
 class WrapperDDD : public ImageWrapper {
@@ -518,6 +550,7 @@ private:
     static bool UnpackTrack(BitBuffer* pBitBuffer, uint8_t* trackBuf);
     static DIError PackDisk(GenericFD* pSrcGFD, GenericFD* pWrapperGFD,
         short diskVolNum);
+    static void PackTrackWorker(int track, void* arg);
     static void PackTrack(const uint8_t* trackBuf, BitBuffer* pBitBuf);
     static void ComputeFreqCounts(const uint8_t* trackBuf,
         uint16_t* freqCounts);
@@ -720,6 +753,9 @@ private:
         kPulseStreamDataOffset = 16,    // start of header to avg stream
 
         kBitRate525 = 250000,           // 250Kbits/sec
+
+        kPulseBatchSize = 16,           // tracks decoded at once
+        kHuffTableBits = 10,            // bits per Huffman table lookup
     };
 
     /* meaning of the two-bit compression format value */
@@ -728,13 +764,60 @@ private:
         kCompHuffman        = 1,
     } CompressedFormat;
 
-    /* node in the Huffman tree */
+    /* node in the Huffman tree; children are indices, -1 for leaves */
     typedef struct HuffNode {
-        uint16_t            val;
-        struct HuffNode*    left;
-        struct HuffNode*    right;
+        uint32_t    contrib;        // leaf value, shifted into position
+        int         left;
+        int         right;
+        int         depth;
     } HuffNode;
 
+    /* decode table entry: where the next kHuffTableBits bits lead */
+    typedef struct HuffTableEntry {
+        int         node;
+        int         len;            // #of bits actually used
+    } HuffTableEntry;
+
+    /* scratch space for Huffman expansion, reused from stream to stream */
+    typedef struct HuffScratch {
+        HuffNode*   nodes;
+        int*        stack;          // tree-parsing stack, same size as nodes
+        int         nodesAlloc;
+        int         numNodes;
+        HuffTableEntry table[1 << kHuffTableBits];
+    } HuffScratch;
+
+    /*
+     * Per-track working storage for DecodePulseTracks().  A batch of these
+     * is reused for every group of tracks, so the buffers only grow.
+     */
+    typedef struct PulseTrackSlot {
+        int         trk;
+        int         type;
+        int         bitRate;
+        uint8_t*    inputBuf;
+        long        inputBufLen;    // allocated size of inputBuf
+        long        inputLen;       // amount of data in inputBuf
+        uint32_t*   streamBuf;      // holds all four streams
+        long        streamBufLen;
+        HuffScratch huff;
+        PulseIndexHeader hdr;       // stream pointers point into streamBuf
+        uint32_t    maxIndex;
+        int         indexOffset;
+        uint32_t    totalAvg;
+        uint8_t     bitBuffer[kBitBufferSize];
+        int         bitCount;
+        bool        good;
+        uint8_t*    nibbleBuf;
+        long        nibbleLen;
+    } PulseTrackSlot;
+
+    /* shared state for the DecodePulseTracks() workers */
+    typedef struct PulseTrackWork {
+        WrapperFDI*     pWrapper;
+        PulseTrackSlot* slots;
+    } PulseTrackWork;
+
     /* 
      * Keep a copy of the header around while we work.  None of the formats
      * we're interested in have more than kMaxHeaderBlockTracks tracks in
@@ -753,29 +836,33 @@ private:
 
     DIError UnpackDisk525(GenericFD* pGFD, GenericFD* pNewGFD, int numCyls,
         int numHeads);
-    DIError UnpackDisk35(GenericFD* pGFD, GenericFD* pNewGFD, int numCyls,
+    DIError UnpackDisk35(GenericFD* pGFD, uint8_t* outputBuf, int numCyls,
         int numHeads, LinearBitmap* pBadBlockMap);
     void GetTrackInfo(int trk, int* pType, int* pLength256);
 
     int BitRate35(int trk);
     void FixBadNibbles(uint8_t* nibbleBuf, long nibbleLen);
-    bool DecodePulseTrack(const uint8_t* inputBuf, long inputLen,
-        int bitRate, uint8_t* nibbleBuf, long* pNibbleLen);
+    DIError DecodePulseTracks(GenericFD* pGFD, int numTracks, int numHeads,
+        bool is35, long maxNibbleLen, uint8_t* nibbleStore, long* nibbleLens,
+        bool* goodTracks);
+    static void PreparePulseTrackWorker(int idx, void* arg);
+    static void NibblizePulseTrackWorker(int idx, void* arg);
+    bool PreparePulseTrack(PulseTrackSlot* pSlot);
     bool UncompressPulseStream(const uint8_t* inputBuf, long inputLen,
-        uint32_t* outputBuf, long numPulses, int format, int bytesPerPulse);
+        uint32_t* outputBuf, long numPulses, int format, int bytesPerPulse,
+        HuffScratch* pScratch);
     bool ExpandHuffman(const uint8_t* inputBuf, long inputLen,
-        uint32_t* outputBuf, long numPulses);
-    const uint8_t* HuffExtractTree(const uint8_t* inputBuf,
-        HuffNode* pNode, uint8_t* pBits, uint8_t* pBitMask);
-    const uint8_t* HuffExtractValues16(const uint8_t* inputBuf,
-        HuffNode* pNode);
-    const uint8_t* HuffExtractValues8(const uint8_t* inputBuf,
-        HuffNode* pNode);
-    void HuffFreeNodes(HuffNode* pNode);
+        uint32_t* outputBuf, long numPulses, HuffScratch* pScratch);
+    bool HuffReserveNodes(HuffScratch* pScratch, int count);
+    bool HuffExtractTree(const uint8_t* inputBuf, long inputLen,
+        long* pOffset, HuffScratch* pScratch, int* pMaxDepth);
+    bool HuffExtractValues(const uint8_t* inputBuf, long inputLen,
+        long* pOffset, HuffScratch* pScratch, bool sixteenBits,
+        bool signExtend, int subStreamShift);
+    void HuffFillTable(HuffScratch* pScratch, int node, int depth, int code,
+        int tableBits);
     uint32_t HuffSignExtend16(uint32_t val);
     uint32_t HuffSignExtend8(uint32_t val);
-    bool ConvertPulseStreamsToNibbles(PulseIndexHeader* pHdr, int bitRate,
-        uint8_t* nibbleBuf, long* pNibbleLen);
     bool ConvertPulsesToBits(const uint32_t* avgStream,
         const uint32_t* minStream, const uint32_t* maxStream,
         const uint32_t* idxStream, int numPulses, int maxIndex,
@@ -1538,13 +1625,16 @@ class A2FileProDOS;
  */
 class DISKIMG_API DiskFSProDOS : public DiskFS {
 public:
-    DiskFSProDOS(void) : fBitMapPointer(0), fTotalBlocks(0), fBlockUseMap(NULL)
+    DiskFSProDOS(void) : fBitMapPointer(0), fTotalBlocks(0), fBlockUseMap(NULL),
+        fSavedBlockUseMap(NULL), fBitmapPending(0), fBitmapDirty(0),
+        fAllocCursor(0), fpDirIndexList(NULL), fpScanBatch(NULL),
+        fpLoadPrev(NULL), fLazyInit(false)
         {}
     virtual ~DiskFSProDOS(void) {
-        if (fBlockUseMap != NULL) {
-            assert(false);  // unexpected
-            delete[] fBlockUseMap;
-        }
+        /* write back bitmap changes nobody flushed */
+        (void) FlushVolBitmap();
+        DropVolBitmap();
+        FreeDirIndexes();
     }
 
     static DIError TestFS(DiskImg* pImg, DiskImg::SectorOrder* pOrder,
@@ -1589,10 +1679,13 @@ public:
     static void GenerateLowerCaseName(const char* upperName,
         char* lowerNameNoTerm, uint16_t lcFlags, bool fromAppleWorks);
 
+    friend class A2FileProDOS;  // for ReadIndexBlock
     friend class A2FDProDOS;
 
 private:
     struct DirHeader;
+    class DirIndex;
+    class ScanBatch;
 
     enum { kMaxExtensionLen = 4 };  // used when normalizing; ".gif" is 4
 
@@ -1605,7 +1698,18 @@ private:
     DIError LoadVolBitmap(void);
     DIError SaveVolBitmap(void);
     void FreeVolBitmap(void);
+    DIError FlushVolBitmap(void);
+    void DropVolBitmap(void);
+    virtual DIError FlushFS(void) override { return FlushVolBitmap(); }
+    virtual DIError LoadFilesForPath(const char* pathName) override;
+    virtual DIError LoadVolumeUsage(void) override;
     long AllocBlock(void);
+    DIError AllocBlocks(long count, uint16_t* blockList);
+    DIError AllocBlocksAfter(long prevBlock, long count,
+        uint16_t* blockList);
+    DIError AllocExtents(long count, uint16_t* blockList);
+    long FindFreeBlock(long start, long end) const;
+    long FindUsedBlock(long start, long end) const;
     int GetNumBitmapBlocks(void) const {
         /* use fTotalBlocks rather than GetNumBlocks() */
         assert(fTotalBlocks > 0);
@@ -1626,7 +1730,11 @@ private:
         const uint8_t* blkBuf, bool skipFirst, int* pCount,
         const char* basePath, uint16_t thisBlock, int depth);
     DIError ReadExtendedInfo(A2FileProDOS* pFile);
+    DIError LoadDirectory(A2FileProDOS* pDir);
+    void MarkDirBlocks(A2FileProDOS* pDir);
     DIError ScanFileUsage(void);
+    A2FileProDOS* FillScanBatch(A2FileProDOS* pFile, ScanBatch* pBatch);
+    DIError ReadIndexBlock(uint16_t block, uint8_t* blkBuf);
     void ScanBlockList(long blockCount, uint16_t* blockList,
         long indexCount, uint16_t* indexList, long* pSparseCount);
     DIError ScanForSubVolumes(void);
@@ -1643,14 +1751,17 @@ private:
         char** pNormalizedPath);
     void UpperCaseName(char* upperName, const char* name);
     bool CheckDiskIsGood(void);
-    DIError AllocDirEntry(A2FileDescr* pOpenSubdir, uint8_t** ppDir,
-        long* pDirLen, uint8_t** ppDirEntry, uint16_t* pDirKeyBlock,
-        int* pDirEntrySlot, uint16_t* pDirBlock);
-    uint8_t* GetPrevDirEntry(uint8_t* buf, uint8_t* ptr);
-    DIError MakeFileNameUnique(const uint8_t* dirBuf, long dirLen,
-        char* fileName);
-    bool NameExistsInDir(const uint8_t* dirBuf, long dirLen,
-        const char* fileName);
+    bool CheckVolumeUsage(void);
+    bool CheckFileQuality(A2File* pFile, A2File* pEnd);
+    DIError GetDirIndex(A2FileProDOS* pDir, DirIndex** ppIndex);
+    DirIndex* FindDirIndex(const A2FileProDOS* pDir) const;
+    DIError LoadDirIndex(A2FileProDOS* pDir, DirIndex** ppIndex);
+    void DiscardDirIndex(A2FileProDOS* pDir);
+    void FreeDirIndexes(void);
+    DIError ExtendDirectory(A2FileProDOS* pDir, DirIndex* pIndex,
+        uint16_t newBlock);
+    DIError MakeFileNameUnique(const DirIndex* pIndex, char* fileName);
+    bool NameExistsInDir(const DirIndex* pIndex, const char* fileName);
 
     DIError FreeBlocks(long blockCount, uint16_t* blockList);
     DIError RegeneratePathName(A2FileProDOS* pFile);
@@ -1674,14 +1785,55 @@ private:
 //  A2FileProDOS*   fpVolDir;       // a "fake" file entry for the volume dir
 
     /*
-     * This is a working copy of the block use map from blocks 6+.  It should
-     * be loaded when we're about to modify files on the disk and freed
-     * immediately afterward.  The goal is to facilitate speedy updates to the
-     * bitmap without creating problems if the application decides to modify
-     * one of the bitmap blocks directly (e.g. with the disk sector editor).
-     * It should never be held across calls.
+     * This is a working copy of the block use map from blocks 6+.  It's
+     * read from disk the first time it's loaded, and stays resident after
+     * that, so a series of file operations doesn't re-read and re-write
+     * the whole map every time.
+     *
+     * Operations still bracket their changes with Load/Save/FreeVolBitmap.
+     * Changes are "pending" until SaveVolBitmap commits them into
+     * fSavedBlockUseMap; FreeVolBitmap throws away anything still pending.
+     * Committed changes are "dirty" until FlushVolBitmap writes those
+     * bitmap blocks to disk, which happens on DiskFS::Flush, when we're
+     * destroyed, or -- with kParmProDOS_WriteThroughBitmap -- on every
+     * SaveVolBitmap, as in the past.
+     *
+     * Because we hang on to the map, an application that modifies the
+     * bitmap blocks directly (e.g. with the disk sector editor) needs to
+     * do so with no DiskFS open on the volume.
      */
     uint8_t*        fBlockUseMap;
+    uint8_t*        fSavedBlockUseMap;  // map as of the last SaveVolBitmap
+    uint32_t        fBitmapPending;     // bitmap blocks changed, not saved
+    uint32_t        fBitmapDirty;       // bitmap blocks saved, not written
+
+    /*
+     * Where the next block allocation search starts.  Allocation is
+     * next-fit, so a series of allocations doesn't keep re-scanning the
+     * full part of the disk.  This is only a hint, so it's fine for it
+     * to outlive the bitmap.
+     */
+    long            fAllocCursor;
+
+    /*
+     * Name and free-slot indexes for the directories we've modified, built
+     * the first time each one is touched so that CreateFile doesn't have
+     * to read and scan the whole directory every time.
+     */
+    DirIndex*       fpDirIndexList;
+
+    /* index blocks read ahead by ScanFileUsage; only set while it runs */
+    ScanBatch*      fpScanBatch;
+
+    /* where LoadDirectory inserts the next entry; only set while it runs */
+    A2File*         fpLoadPrev;
+
+    /*
+     * Set by a kInitLazy Initialize.  Subdirectories aren't read until
+     * something asks for them by name, and the VolumeUsage map doesn't
+     * exist until LoadVolumeUsage builds it (which clears this).
+     */
+    bool            fLazyInit;
 
     /*
      * Set this if the disk is "perfect".  If it's not, we disallow write
@@ -1701,11 +1853,13 @@ private:
 class DISKIMG_API A2FDProDOS : public A2FileDescr {
 public:
     A2FDProDOS(A2File* pFile) : A2FileDescr(pFile), fModified(false),
-        fBlockList(NULL), fOffset(0)
+        fBlockList(NULL), fBlockListAlloc(0), fIndexList(NULL), fOffset(0)
     {}
     virtual ~A2FDProDOS(void) {
         delete[] fBlockList;
         fBlockList = NULL;
+        delete[] fIndexList;
+        fIndexList = NULL;
     }
 
     friend class A2FileProDOS;
@@ -1728,11 +1882,16 @@ public:
 private:
     bool IsEmptyBlock(const uint8_t* blk);
     DIError WriteDirectory(const void* buf, size_t len, size_t* pActual);
+    uint16_t GetForkKeyBlock(void) const;
+    DIError GrowBlockList(long count);
+    DIError WriteIndexBlocks(void);
 
     /* state for open files */
     bool            fModified;
     long            fBlockCount;
     uint16_t*       fBlockList;
+    long            fBlockListAlloc;    // #of entries in fBlockList, if grown
+    uint16_t*       fIndexList;         // tree index blocks, set by Write
     di_off_t        fOpenEOF;           // current EOF
     uint16_t        fOpenBlocksUsed;    // #of block used by open piece
     int             fOpenStorageType;
@@ -1751,6 +1910,7 @@ public:
         fpOpenFile = NULL;
         fParentDirBlock = 0;
         fParentDirIdx = -1;
+        fDirPending = false;
         fpParent = NULL;
     }
     virtual ~A2FileProDOS(void) {
@@ -1887,6 +2047,9 @@ public:
     uint16_t        fParentDirBlock;    // directory block
     int             fParentDirIdx;      // index in dir block
 
+    /* subdirectory whose entries haven't been loaded yet (kInitLazy) */
+    bool            fDirPending;
+
     /* these are only valid if storageType == kStorageExtended */
     ExtendedInfo    fExtData;
     ExtendedInfo    fExtRsrc;
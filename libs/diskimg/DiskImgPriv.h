@@ -14,6 +14,7 @@
 #include "DiskImgDetail.h"
 #include <errno.h>
 #include <assert.h>
+#include <mutex>
 // "GenericFD.h" included at end
 
 using namespace DiskImgLib;     // make life easy for all internal code
@@ -80,6 +81,27 @@ DIError WriteLongLE(GenericFD* pGFD, uint32_t val);
 DIError WriteShortBE(GenericFD* pGFD, uint16_t val);
 DIError WriteLongBE(GenericFD* pGFD, uint32_t val);
 
+/*
+ * Call "func(idx, arg)" once for every idx in [0, count), spreading the
+ * calls across a few worker threads.  The calls happen in no particular
+ * order, so "func" must only touch state that belongs to its index (and
+ * shouldn't poke at DiskImg or GenericFD objects, except for reads that go
+ * through a ProbeCache).  Logging is fine; PrintDebugMsg serializes the
+ * calls to the handler.  Returns when all of them have finished.
+ */
+typedef void (*ParallelWorkFunc)(int idx, void* arg);
+void RunParallel(int count, ParallelWorkFunc func, void* arg);
+
+/* gzip random-access settings; see DiskImg::SetGzipRandomAccess() */
+extern bool gGzipRandomAccess;
+extern bool gGzipIndexFile;
+
+/* see DiskImg::SetNuFXLazyAccess() */
+extern bool gNuFXLazyAccess;
+
+/* see DiskImg::SetParallelProbes() */
+extern bool gParallelProbes;
+
 #ifdef _WIN32
 /* Windows helpers */
 DIError LastErrorToDIError(void);
@@ -123,6 +145,17 @@ public:
     //    return &fBuf[idx];
     //}
 
+    /*
+     * Return a pointer to "len" bytes starting at "idx", or NULL if the
+     * span wraps around the end of the buffer.
+     */
+    const uint8_t* GetLinearSpan(int idx, int len) const {
+        idx = Normalize(idx);
+        if (idx + len > fLen)
+            return NULL;
+        return fBuf + idx;
+    }
+
     int Normalize(int idx) const {
         while (idx >= fLen)
             idx -= fLen;
@@ -268,14 +301,20 @@ public:
         uint8_t val;
         int i;
 
-        if (true || fCurrentBit > fBitCount-8) {
+        if (fCurrentBit > fBitCount-8) {
             /* near end, use single-bit function iteratively */
             val = 0;
             for (i = 0; i < 8; i++)
                 val = (val << 1) | GetBit(pWrap);
         } else {
             /* room to spare, grab it in one or two chunks */
-            assert(false);
+            uint16_t pair = fBuf[0] << 8;
+            if (fBitPosn != 7)
+                pair |= fBuf[1];
+            val = (uint8_t) (pair >> (fBitPosn + 1));
+            fBuf++;
+            fCurrentBit += 8;
+            fBitsConsumed += 8;
         }
         return val;
     }
@@ -305,6 +344,49 @@ private:
     int             fBitsConsumed;      // sanity check - all bits used?
 };
 
+/*
+ * Read cache used while the filesystem probes run.  The probes look at the
+ * same few places over and over (the first few blocks, the DOS catalog
+ * track, partition maps), often once for every sector order, so we keep
+ * what we read in kChunkSize pieces.  Call Prefetch to load a region with
+ * a single read before the probes start.
+ *
+ * Reads that we can't cache (too many chunks, or a read that straddles
+ * two) go straight to the GFD.  Anything that writes to the GFD while
+ * this is active must call Invalidate.
+ *
+ * Read may be called from several threads at once; all access to the GFD
+ * is serialized by fLock.
+ */
+class ProbeCache {
+public:
+    ProbeCache(GenericFD* pGFD, di_off_t length) :
+        fpGFD(pGFD), fLength(length), fNumChunks(0), fNumReads(0)
+        {}
+    ~ProbeCache(void) { Invalidate(); }
+
+    void Prefetch(di_off_t offset, long len);
+    DIError Read(void* buf, di_off_t offset, long len);
+    void Invalidate(void);
+
+private:
+    enum { kChunkSize = 16384, kMaxChunks = 64 };
+    typedef struct Chunk {
+        di_off_t    offset;
+        long        len;
+        uint8_t*    data;
+    } Chunk;
+
+    Chunk* LoadChunk(di_off_t offset, long len);
+
+    GenericFD*  fpGFD;
+    di_off_t    fLength;
+    Chunk       fChunks[kMaxChunks];
+    int         fNumChunks;
+    int         fNumReads;      // for the log message
+    std::mutex  fLock;
+};
+
 /*
  * Linear bitmap.  Suitable for use as a bad block map.
  */
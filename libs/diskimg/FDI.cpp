@@ -60,99 +60,47 @@ DIError WrapperFDI::UnpackDisk525(GenericFD* pGFD, GenericFD* pNewGFD,
     int numCyls, int numHeads)
 {
     DIError dierr = kDIErrNone;
+    const int numTracks = numCyls * numHeads;
     uint8_t nibbleBuf[kNibbleBufLen];
-    uint8_t* inputBuf = NULL;
+    uint8_t* nibbleStore = NULL;
+    long nibbleLens[kMaxNibbleTracks525];
     bool goodTracks[kMaxNibbleTracks525];
-    int inputBufLen = -1;
     int badTracks = 0;
-    int trk, type, length256;
+    int trk;
     long nibbleLen;
-    bool result;
 
     assert(numHeads == 1);
+    assert(numTracks <= kMaxNibbleTracks525);
     memset(goodTracks, false, sizeof(goodTracks));
 
-    dierr = pGFD->Seek(kMinHeaderLen, kSeekSet);
-    if (dierr != kDIErrNone) {
-        LOGI("FDI: track seek failed (offset=%d)", kMinHeaderLen);
+    nibbleStore = new uint8_t[numTracks * kNibbleBufLen];
+    if (nibbleStore == NULL) {
+        dierr = kDIErrMalloc;
         goto bail;
     }
 
-    for (trk = 0; trk < numCyls * numHeads; trk++) {
-        GetTrackInfo(trk, &type, &length256);
-        LOGI("%2d.%d: t=0x%02x l=%d (%d)", trk / numHeads, trk % numHeads,
-            type, length256, length256 * 256);
-
-        /* if we have data to read, read it */
-        if (length256 > 0) {
-            if (length256  * 256 > inputBufLen) {
-                /* allocate or increase the size of the input buffer */
-                delete[] inputBuf;
-                inputBufLen = length256 * 256;
-                inputBuf = new uint8_t[inputBufLen];
-                if (inputBuf == NULL) {
-                    dierr = kDIErrMalloc;
-                    goto bail;
-                }
-            }
+    dierr = DecodePulseTracks(pGFD, numTracks, numHeads, false,
+                kTrackAllocSize, nibbleStore, nibbleLens, goodTracks);
+    if (dierr != kDIErrNone)
+        goto bail;
 
-            dierr = pGFD->Read(inputBuf, length256 * 256);
-            if (dierr != kDIErrNone)
-                goto bail;
-        } else {
-            assert(type == 0x00);
-        }
+    for (trk = 0; trk < numTracks; trk++) {
+        uint8_t* trackBuf = nibbleStore + trk * kNibbleBufLen;
 
-        /* figure out what we want to do with this track */
-        switch (type) {
-        case 0x00:
-            /* blank track */
+        nibbleLen = nibbleLens[trk];
+        if (!goodTracks[trk])
             badTracks++;
-            memset(nibbleBuf, 0xff, sizeof(nibbleBuf));
-            nibbleLen = kTrackLenNb2525;
-            break;
-        case 0x80:
-        case 0x90:
-        case 0xa0:
-        case 0xb0:
-            /* low-level pulse-index */
-            nibbleLen = kNibbleBufLen;
-            result = DecodePulseTrack(inputBuf, length256*256, kBitRate525,
-                        nibbleBuf, &nibbleLen);
-            if (!result) {
-                /* something failed in the decoder; fake it */
-                badTracks++;
-                memset(nibbleBuf, 0xff, sizeof(nibbleBuf));
-                nibbleLen = kTrackLenNb2525;
-            } else {
-                goodTracks[trk] = true;
-            }
-            if (nibbleLen > kTrackAllocSize) {
-                LOGI(" FDI: decoded %ld nibbles, buffer is only %d",
-                    nibbleLen, kTrackAllocSize);
-                dierr = kDIErrBadRawData;
-                goto bail;
-            }
-            break;
-        default:
-            LOGI("FDI: unexpected track type 0x%04x", type);
-            dierr = kDIErrUnsupportedImageFeature;
-            goto bail;
-        }
 
         fNibbleTrackInfo.offset[trk] = trk * kTrackAllocSize;
         fNibbleTrackInfo.length[trk] = nibbleLen;
-        FixBadNibbles(nibbleBuf, nibbleLen);
+        FixBadNibbles(trackBuf, nibbleLen);
         dierr = pNewGFD->Seek(fNibbleTrackInfo.offset[trk], kSeekSet);
         if (dierr != kDIErrNone)
             goto bail;
-        dierr = pNewGFD->Write(nibbleBuf, nibbleLen);
+        dierr = pNewGFD->Write(trackBuf, nibbleLen);
         if (dierr != kDIErrNone)
             goto bail;
         LOGI("  FDI: track %d: wrote %ld nibbles", trk, nibbleLen);
-
-        //offset += 256 * length256;
-        //break;        // DEBUG DEBUG
     }
 
     LOGI(" FDI: %d of %d tracks bad or blank",
@@ -207,134 +155,62 @@ DIError WrapperFDI::UnpackDisk525(GenericFD* pGFD, GenericFD* pNewGFD,
     fNibbleTrackInfo.numTracks = trk;
 
 bail:
-    delete[] inputBuf;
+    delete[] nibbleStore;
     return dierr;
 }
 
 /*
  * Unpack an FDI-encoded disk image from "pGFD" to 800K of ProDOS-ordered
- * 512-byte blocks in "pNewGFD".
+ * 512-byte blocks in "outputBuf".
  *
  * We could keep the 12-byte "tags" on each block, but they were never
  * really used in the Apple II world.
  *
  * We also need to set up a "bad block" map to identify parts that we had
  * trouble unpacking.
+ *
+ * All of the tracks are converted to nibbles first, and then handed to
+ * the 3.5" nibble decoder as a batch so it can work on them in parallel.
  */
-DIError WrapperFDI::UnpackDisk35(GenericFD* pGFD, GenericFD* pNewGFD, int numCyls,
-    int numHeads, LinearBitmap* pBadBlockMap)
+DIError WrapperFDI::UnpackDisk35(GenericFD* pGFD, uint8_t* outputBuf,
+    int numCyls, int numHeads, LinearBitmap* pBadBlockMap)
 {
     DIError dierr = kDIErrNone;
-    uint8_t nibbleBuf[kNibbleBufLen];
-    uint8_t* inputBuf = NULL;
-    uint8_t outputBuf[kMaxSectors35 * kBlockSize];    // 6KB
-    int inputBufLen = -1;
-    int badTracks = 0;
-    int trk, type, length256;
-    long nibbleLen;
-    bool result;
+    const int numTracks = numCyls * numHeads;
+    uint8_t* nibbleStore = NULL;
+    const uint8_t* nibbleBufs[kMaxNibbleTracks35 * kMaxHeads];
+    long nibbleLens[kMaxNibbleTracks35 * kMaxHeads];
+    bool goodTracks[kMaxNibbleTracks35 * kMaxHeads];
+    int trk;
 
     assert(numHeads == 2);
+    assert(numTracks <= (int) NELEM(nibbleBufs));
 
-    dierr = pGFD->Seek(kMinHeaderLen, kSeekSet);
-    if (dierr != kDIErrNone) {
-        LOGI("FDI: track seek failed (offset=%d)", kMinHeaderLen);
+    nibbleStore = new uint8_t[numTracks * kNibbleBufLen];
+    if (nibbleStore == NULL) {
+        dierr = kDIErrMalloc;
         goto bail;
     }
 
-    pNewGFD->Rewind();
-
-    for (trk = 0; trk < numCyls * numHeads; trk++) {
-        GetTrackInfo(trk, &type, &length256);
-        LOGI("%2d.%d: t=0x%02x l=%d (%d)", trk / numHeads, trk % numHeads,
-            type, length256, length256 * 256);
-
-        /* if we have data to read, read it */
-        if (length256 > 0) {
-            if (length256  * 256 > inputBufLen) {
-                /* allocate or increase the size of the input buffer */
-                delete[] inputBuf;
-                inputBufLen = length256 * 256;
-                inputBuf = new uint8_t[inputBufLen];
-                if (inputBuf == NULL) {
-                    dierr = kDIErrMalloc;
-                    goto bail;
-                }
-            }
-
-            dierr = pGFD->Read(inputBuf, length256 * 256);
-            if (dierr != kDIErrNone)
-                goto bail;
-        } else {
-            assert(type == 0x00);
-        }
-
-        /* figure out what we want to do with this track */
-        switch (type) {
-        case 0x00:
-            /* blank track */
-            badTracks++;
-            memset(nibbleBuf, 0xff, sizeof(nibbleBuf));
-            nibbleLen = kTrackLenNb2525;
-            break;
-        case 0x80:
-        case 0x90:
-        case 0xa0:
-        case 0xb0:
-            /* low-level pulse-index */
-            nibbleLen = kNibbleBufLen;
-            result = DecodePulseTrack(inputBuf, length256*256,
-                        BitRate35(trk/numHeads), nibbleBuf, &nibbleLen);
-            if (!result) {
-                /* something failed in the decoder; fake it */
-                badTracks++;
-                memset(nibbleBuf, 0xff, sizeof(nibbleBuf));
-                nibbleLen = kTrackLenNb2525;
-            } 
-            if (nibbleLen > kNibbleBufLen) {
-                LOGI(" FDI: decoded %ld nibbles, buffer is only %d",
-                    nibbleLen, kTrackAllocSize);
-                dierr = kDIErrBadRawData;
-                goto bail;
-            }
-            break;
-        default:
-            LOGI("FDI: unexpected track type 0x%04x", type);
-            dierr = kDIErrUnsupportedImageFeature;
-            goto bail;
-        }
-
-        LOGI(" FDI: track %d got %ld nibbles", trk, nibbleLen);
-
-        /*
-        fNibbleTrackInfo.offset[trk] = trk * kTrackAllocSize;
-        fNibbleTrackInfo.length[trk] = nibbleLen;
-        dierr = pNewGFD->Seek(fNibbleTrackInfo.offset[trk], kSeekSet);
-        if (dierr != kDIErrNone)
-            goto bail;
-        dierr = pNewGFD->Write(nibbleBuf, nibbleLen);
-        if (dierr != kDIErrNone)
-            goto bail;
-        */
-
-        dierr = DiskImg::UnpackNibbleTrack35(nibbleBuf, nibbleLen, outputBuf,
-                    trk / numHeads, trk % numHeads, pBadBlockMap);
-        if (dierr != kDIErrNone)
-            goto bail;
+    dierr = DecodePulseTracks(pGFD, numTracks, numHeads, true,
+                kNibbleBufLen, nibbleStore, nibbleLens, goodTracks);
+    if (dierr != kDIErrNone)
+        goto bail;
 
-        dierr = pNewGFD->Write(outputBuf,
-                    kBlockSize * DiskImg::SectorsPerTrack35(trk / numHeads));
-        if (dierr != kDIErrNone) {
-            LOGI("FDI: failed writing disk blocks (%d * %d)",
-                kBlockSize, DiskImg::SectorsPerTrack35(trk / numHeads));
-            goto bail;
-        }
+    for (trk = 0; trk < numTracks; trk++) {
+        LOGI(" FDI: track %d got %ld nibbles", trk, nibbleLens[trk]);
+        nibbleBufs[trk] = nibbleStore + trk * kNibbleBufLen;
     }
 
+    dierr = DiskImg::UnpackNibbleDisk35(nibbleBufs, nibbleLens, numCyls,
+                numHeads, outputBuf, pBadBlockMap);
+    if (dierr != kDIErrNone)
+        goto bail;
+
     //fNibbleTrackInfo.numTracks = numCyls * numHeads;
 
 bail:
-    delete[] inputBuf;
+    delete[] nibbleStore;
     return dierr;
 }
 
@@ -440,118 +316,432 @@ void WrapperFDI::GetTrackInfo(int trk, int* pType, int* pLength256)
 }
 
 
+/* use these to extract values from the index stream */
+#define ZeroStateCount(_val)    (((_val) >> 8) & 0xff)
+#define OneStateCount(_val)     ((_val) & 0xff)
+
+
 /*
- * Convert a track encoded as one or more pulse streams to nibbles.
+ * Convert "numTracks" tracks of pulse data, starting at the first track
+ * descriptor, to nibbles.
  *
- * This decompresses the pulse streams in "inputBuf", then converts them
- * to nibble form in "nibbleBuf".
+ * Each track gets kNibbleBufLen bytes in "nibbleStore"; the length used
+ * goes into "nibbleLens", and "goodTracks" is set for tracks that decoded
+ * successfully.  Blank tracks and tracks we couldn't decode are filled
+ * with 0xff and given a length of kTrackLenNb2525.  A track that decodes
+ * to more than "maxNibbleLen" nibbles is an error.
  *
- * "*pNibbleLen" should hold the maximum size of the buffer.  On success,
- * it will hold the actual number of bytes used.
+ * The tracks are read from the file serially, a batch at a time.  The
+ * stream expansion and the bits-to-nibbles conversion are handed to
+ * worker threads, but the pulse-to-bit conversion runs in track order
+ * on this thread, because the pseudo-random dither in MyRand() carries
+ * its state from one track to the next.  Errors are reported for the
+ * first track that has one, same as if we'd done them one at a time.
+ */
+DIError WrapperFDI::DecodePulseTracks(GenericFD* pGFD, int numTracks,
+    int numHeads, bool is35, long maxNibbleLen, uint8_t* nibbleStore,
+    long* nibbleLens, bool* goodTracks)
+{
+    DIError dierr = kDIErrNone;
+    DIError readErr = kDIErrNone;
+    PulseTrackSlot* slots = NULL;
+    PulseTrackWork work;
+    int first, numSlots, i;
+
+    slots = new PulseTrackSlot[kPulseBatchSize];
+    if (slots == NULL) {
+        dierr = kDIErrMalloc;
+        goto bail;
+    }
+    memset(slots, 0, sizeof(PulseTrackSlot) * kPulseBatchSize);
+
+    dierr = pGFD->Seek(kMinHeaderLen, kSeekSet);
+    if (dierr != kDIErrNone) {
+        LOGI("FDI: track seek failed (offset=%d)", kMinHeaderLen);
+        goto bail;
+    }
+
+    work.pWrapper = this;
+    work.slots = slots;
+
+    for (first = 0; first < numTracks && readErr == kDIErrNone;
+        first += kPulseBatchSize)
+    {
+        /*
+         * Read the next batch of tracks.  If something goes wrong, decode
+         * what we have so far, so that problems in earlier tracks are
+         * the ones that get reported.
+         */
+        numSlots = 0;
+        while (numSlots < kPulseBatchSize && first + numSlots < numTracks) {
+            PulseTrackSlot* pSlot = &slots[numSlots];
+            int trk = first + numSlots;
+            int type, length256;
+
+            GetTrackInfo(trk, &type, &length256);
+            LOGI("%2d.%d: t=0x%02x l=%d (%d)", trk / numHeads, trk % numHeads,
+                type, length256, length256 * 256);
+
+            /* if we have data to read, read it */
+            if (length256 > 0) {
+                if (length256 * 256 > pSlot->inputBufLen) {
+                    /* allocate or increase the size of the input buffer */
+                    delete[] pSlot->inputBuf;
+                    pSlot->inputBufLen = length256 * 256;
+                    pSlot->inputBuf = new uint8_t[pSlot->inputBufLen];
+                    if (pSlot->inputBuf == NULL) {
+                        pSlot->inputBufLen = 0;
+                        readErr = kDIErrMalloc;
+                        break;
+                    }
+                }
+
+                readErr = pGFD->Read(pSlot->inputBuf, length256 * 256);
+                if (readErr != kDIErrNone)
+                    break;
+            } else {
+                assert(type == 0x00);
+            }
+
+            if (type != 0x00 && type != 0x80 && type != 0x90 &&
+                type != 0xa0 && type != 0xb0)
+            {
+                LOGI("FDI: unexpected track type 0x%04x", type);
+                readErr = kDIErrUnsupportedImageFeature;
+                break;
+            }
+
+            pSlot->trk = trk;
+            pSlot->type = type;
+            pSlot->inputLen = length256 * 256;
+            if (is35)
+                pSlot->bitRate = BitRate35(trk / numHeads);
+            else
+                pSlot->bitRate = kBitRate525;
+            pSlot->nibbleBuf = nibbleStore + trk * kNibbleBufLen;
+            numSlots++;
+        }
+
+        /* expand the pulse streams */
+        RunParallel(numSlots, PreparePulseTrackWorker, &work);
+
+        /* convert pulses to bits, in order */
+        for (i = 0; i < numSlots; i++) {
+            PulseTrackSlot* pSlot = &slots[i];
+
+            if (!pSlot->good)
+                continue;
+
+            pSlot->bitCount = kBitBufferSize;
+            if (!ConvertPulsesToBits(pSlot->hdr.avgStream,
+                    pSlot->hdr.minStream, pSlot->hdr.maxStream,
+                    pSlot->hdr.idxStream, pSlot->hdr.numPulses,
+                    pSlot->maxIndex, pSlot->indexOffset, pSlot->totalAvg,
+                    pSlot->bitRate, pSlot->bitBuffer, &pSlot->bitCount))
+            {
+                LOGI(" FDI: ConvertPulsesToBits() failed");
+                pSlot->good = false;
+            } else if (pSlot->bitCount < 0) {
+                LOGI(" FDI: overran output bit buffer");
+                pSlot->good = false;
+            }
+        }
+
+        /* turn the bits into nibbles, or fake it for bad tracks */
+        RunParallel(numSlots, NibblizePulseTrackWorker, &work);
+
+        for (i = 0; i < numSlots; i++) {
+            PulseTrackSlot* pSlot = &slots[i];
+
+            nibbleLens[pSlot->trk] = pSlot->nibbleLen;
+            goodTracks[pSlot->trk] = pSlot->good;
+            if (pSlot->nibbleLen > maxNibbleLen) {
+                LOGI(" FDI: decoded %ld nibbles, buffer is only %ld",
+                    pSlot->nibbleLen, maxNibbleLen);
+                dierr = kDIErrBadRawData;
+                goto bail;
+            }
+        }
+    }
+
+    dierr = readErr;
+
+bail:
+    if (slots != NULL) {
+        for (i = 0; i < kPulseBatchSize; i++) {
+            delete[] slots[i].inputBuf;
+            delete[] slots[i].streamBuf;
+            delete[] slots[i].huff.nodes;
+            delete[] slots[i].huff.stack;
+        }
+        delete[] slots;
+    }
+    return dierr;
+}
+
+/*
+ * Worker for DecodePulseTracks(): expand the pulse streams for one track.
+ */
+/*static*/ void WrapperFDI::PreparePulseTrackWorker(int idx, void* arg)
+{
+    PulseTrackWork* pWork = (PulseTrackWork*) arg;
+    PulseTrackSlot* pSlot = &pWork->slots[idx];
+
+    if (pSlot->type == 0x00) {
+        /* blank track */
+        pSlot->good = false;
+    } else {
+        /* low-level pulse-index */
+        pSlot->good = pWork->pWrapper->PreparePulseTrack(pSlot);
+    }
+}
+
+/*
+ * Worker for DecodePulseTracks(): convert one track's bits to nibbles.
+ */
+/*static*/ void WrapperFDI::NibblizePulseTrackWorker(int idx, void* arg)
+{
+    PulseTrackWork* pWork = (PulseTrackWork*) arg;
+    PulseTrackSlot* pSlot = &pWork->slots[idx];
+
+    if (pSlot->good) {
+        pSlot->nibbleLen = kNibbleBufLen;
+        if (!pWork->pWrapper->ConvertBitsToNibbles(pSlot->bitBuffer,
+                pSlot->bitCount, pSlot->nibbleBuf, &pSlot->nibbleLen))
+        {
+            LOGI(" FDI: ConvertBitsToNibbles() failed");
+            pSlot->good = false;
+        }
+    }
+
+    if (!pSlot->good) {
+        /* blank, or something failed in the decoder; fake it */
+        memset(pSlot->nibbleBuf, 0xff, kNibbleBufLen);
+        pSlot->nibbleLen = kTrackLenNb2525;
+    }
+}
+
+/*
+ * Expand the pulse streams in a track, and compute the values that
+ * ConvertPulsesToBits() needs.
+ *
+ * The streams are decompressed into "pSlot->streamBuf", which is grown
+ * as needed.  The min and max streams are converted to absolute values,
+ * and the index stream is rewritten to hold the sum of its two counts.
  *
  * Returns "true" on success, "false" on failure.
  */
-bool WrapperFDI::DecodePulseTrack(const uint8_t* inputBuf, long inputLen,
-    int bitRate, uint8_t* nibbleBuf, long* pNibbleLen)
+bool WrapperFDI::PreparePulseTrack(PulseTrackSlot* pSlot)
 {
     const int kSizeValueMask = 0x003fffff;
     const int kSizeCompressMask = 0x00c00000;
     const int kSizeCompressShift = 22;
-    PulseIndexHeader hdr;
+    PulseIndexHeader* pHdr = &pSlot->hdr;
+    const uint8_t* inputBuf = pSlot->inputBuf;
+    long inputLen = pSlot->inputLen;
+    uint32_t* avgStream;
+    uint32_t* minStream;
+    uint32_t* maxStream;
+    uint32_t* idxStream;
     uint32_t val;
-    bool result = false;
+    int i;
+
+    memset(pHdr, 0, sizeof(*pHdr));
 
-    memset(&hdr, 0, sizeof(hdr));
+    if (inputLen < kPulseStreamDataOffset) {
+        LOGI(" FDI: no data in pulse track");
+        return false;
+    }
 
-    hdr.numPulses = GetLongBE(&inputBuf[0x00]);
+    pHdr->numPulses = GetLongBE(&inputBuf[0x00]);
     val = Get24BE(&inputBuf[0x04]);
-    hdr.avgStreamLen = val & kSizeValueMask;
-    hdr.avgStreamCompression = (val & kSizeCompressMask) >> kSizeCompressShift;
+    pHdr->avgStreamLen = val & kSizeValueMask;
+    pHdr->avgStreamCompression = (val & kSizeCompressMask) >> kSizeCompressShift;
     val = Get24BE(&inputBuf[0x07]);
-    hdr.minStreamLen = val & kSizeValueMask;
-    hdr.minStreamCompression = (val & kSizeCompressMask) >> kSizeCompressShift;
+    pHdr->minStreamLen = val & kSizeValueMask;
+    pHdr->minStreamCompression = (val & kSizeCompressMask) >> kSizeCompressShift;
     val = Get24BE(&inputBuf[0x0a]);
-    hdr.maxStreamLen = val & kSizeValueMask;
-    hdr.maxStreamCompression = (val & kSizeCompressMask) >> kSizeCompressShift;
+    pHdr->maxStreamLen = val & kSizeValueMask;
+    pHdr->maxStreamCompression = (val & kSizeCompressMask) >> kSizeCompressShift;
     val = Get24BE(&inputBuf[0x0d]);
-    hdr.idxStreamLen = val & kSizeValueMask;
-    hdr.idxStreamCompression = (val & kSizeCompressMask) >> kSizeCompressShift;
+    pHdr->idxStreamLen = val & kSizeValueMask;
+    pHdr->idxStreamCompression = (val & kSizeCompressMask) >> kSizeCompressShift;
 
-    if (hdr.numPulses < 64 || hdr.numPulses > 131072) {
+    if (pHdr->numPulses < 64 || pHdr->numPulses > 131072) {
         /* should be about 40,000 */
-        LOGI(" FDI: bad pulse count %ld in track", hdr.numPulses);
+        LOGI(" FDI: bad pulse count %ld in track", pHdr->numPulses);
+        return false;
+    }
+    if (kPulseStreamDataOffset + pHdr->avgStreamLen + pHdr->minStreamLen +
+        pHdr->maxStreamLen + pHdr->idxStreamLen > inputLen)
+    {
+        LOGI(" FDI: pulse streams run off end of track");
         return false;
     }
 
     /* advance past the 16 hdr bytes; now pointing at "average" stream */
     inputBuf += kPulseStreamDataOffset;
 
-    LOGI("  pulses: %ld", hdr.numPulses);
-    //LOGI("  avg: len=%d comp=%d", hdr.avgStreamLen, hdr.avgStreamCompression);
-    //LOGI("  min: len=%d comp=%d", hdr.minStreamLen, hdr.minStreamCompression);
-    //LOGI("  max: len=%d comp=%d", hdr.maxStreamLen, hdr.maxStreamCompression);
-    //LOGI("  idx: len=%d comp=%d", hdr.idxStreamLen, hdr.idxStreamCompression);
+    LOGI("  pulses: %ld", pHdr->numPulses);
+
+    /*
+     * One buffer holds all four streams.  Streams we don't have are
+     * left NULL in the header.
+     */
+    if (pSlot->streamBufLen < pHdr->numPulses * 4) {
+        delete[] pSlot->streamBuf;
+        pSlot->streamBufLen = pHdr->numPulses * 4;
+        pSlot->streamBuf = new uint32_t[pSlot->streamBufLen];
+        if (pSlot->streamBuf == NULL) {
+            pSlot->streamBufLen = 0;
+            return false;
+        }
+    }
+    avgStream = pSlot->streamBuf;
+    minStream = avgStream + pHdr->numPulses;
+    maxStream = minStream + pHdr->numPulses;
+    idxStream = maxStream + pHdr->numPulses;
 
     /*
      * Uncompress or endian-swap the pulse streams.
      */
-    hdr.avgStream = new uint32_t[hdr.numPulses];
-    if (hdr.avgStream == NULL)
-        goto bail;
-    if (!UncompressPulseStream(inputBuf, hdr.avgStreamLen, hdr.avgStream,
-        hdr.numPulses, hdr.avgStreamCompression, 4))
+    if (!UncompressPulseStream(inputBuf, pHdr->avgStreamLen, avgStream,
+        pHdr->numPulses, pHdr->avgStreamCompression, 4, &pSlot->huff))
     {
-        goto bail;
+        return false;
     }
-    inputBuf += hdr.avgStreamLen;
+    pHdr->avgStream = avgStream;
+    inputBuf += pHdr->avgStreamLen;
 
-    if (hdr.minStreamLen > 0) {
-        hdr.minStream = new uint32_t[hdr.numPulses];
-        if (hdr.minStream == NULL)
-            goto bail;
-        if (!UncompressPulseStream(inputBuf, hdr.minStreamLen, hdr.minStream,
-            hdr.numPulses, hdr.minStreamCompression, 4))
+    if (pHdr->minStreamLen > 0) {
+        if (!UncompressPulseStream(inputBuf, pHdr->minStreamLen, minStream,
+            pHdr->numPulses, pHdr->minStreamCompression, 4, &pSlot->huff))
         {
-            goto bail;
+            return false;
         }
-        inputBuf += hdr.minStreamLen;
+        pHdr->minStream = minStream;
+        inputBuf += pHdr->minStreamLen;
     }
-    if (hdr.maxStreamLen > 0) {
-        hdr.maxStream = new uint32_t[hdr.numPulses];
-        if (!UncompressPulseStream(inputBuf, hdr.maxStreamLen, hdr.maxStream,
-            hdr.numPulses, hdr.maxStreamCompression, 4))
+    if (pHdr->maxStreamLen > 0) {
+        if (!UncompressPulseStream(inputBuf, pHdr->maxStreamLen, maxStream,
+            pHdr->numPulses, pHdr->maxStreamCompression, 4, &pSlot->huff))
         {
-            goto bail;
+            return false;
         }
-        inputBuf += hdr.maxStreamLen;
+        pHdr->maxStream = maxStream;
+        inputBuf += pHdr->maxStreamLen;
     }
-    if (hdr.idxStreamLen > 0) {
-        hdr.idxStream = new uint32_t[hdr.numPulses];
-        if (!UncompressPulseStream(inputBuf, hdr.idxStreamLen, hdr.idxStream,
-            hdr.numPulses, hdr.idxStreamCompression, 2))
+    if (pHdr->idxStreamLen > 0) {
+        if (!UncompressPulseStream(inputBuf, pHdr->idxStreamLen, idxStream,
+            pHdr->numPulses, pHdr->idxStreamCompression, 2, &pSlot->huff))
         {
-            goto bail;
+            return false;
+        }
+        pHdr->idxStream = idxStream;
+        inputBuf += pHdr->idxStreamLen;
+    }
+
+    /*
+     * If we don't have min/max streams, use the average for both.
+     */
+    if (pHdr->minStream != NULL && pHdr->maxStream != NULL) {
+        /* adjust the values in the min/max streams */
+        for (i = 0; i < pHdr->numPulses; i++) {
+            maxStream[i] = avgStream[i] + minStream[i] - maxStream[i];
+            minStream[i] = avgStream[i] - minStream[i];
         }
-        inputBuf += hdr.idxStreamLen;
+    } else {
+        pHdr->minStream = avgStream;
+        pHdr->maxStream = avgStream;
+    }
+
+    if (pHdr->idxStream == NULL) {
+        /*
+         * The UAE sample code has some stuff to fake it.  The code there
+         * is broken, so I'm guessing it has never been used, but I'm going
+         * to replicate it here (and probably never test it either).  This
+         * assumes that the original was written for a big-endian machine.
+         */
+        LOGI(" FDI: HEY: using fake index stream");
+        DebugBreak();
+        for (i = 1; i < pHdr->numPulses; i++)
+            idxStream[i] = 0x0200;      // '1' for two, '0' for zero
+        idxStream[0] = 0x0101;          // '1' for one, '0' for one
+
+        pHdr->idxStream = idxStream;
     }
 
     /*
-     * Convert the pulse streams to a nibble stream.
+     * Compute a value for maxIndex.
      */
-    result = ConvertPulseStreamsToNibbles(&hdr, bitRate, nibbleBuf, pNibbleLen);
-    // fall through with result
+    uint32_t maxIndex;
 
-bail:
-    /* clean up */
-    if (hdr.avgStream != NULL)
-        delete[] hdr.avgStream;
-    if (hdr.minStream != NULL)
-        delete[] hdr.minStream;
-    if (hdr.maxStream != NULL)
-        delete[] hdr.maxStream;
-    if (hdr.idxStream != NULL)
-        delete[] hdr.idxStream;
-    return result;
+    maxIndex = 0;
+    for (i = 0; i < pHdr->numPulses; i++) {
+        uint32_t sum;
+
+        /* add up the two single-byte values in the index stream */
+        sum = ZeroStateCount(idxStream[i]) + OneStateCount(idxStream[i]);
+        if (sum > maxIndex)
+            maxIndex = sum;
+    }
+
+    /*
+     * Compute a value for indexOffset.
+     */
+    int indexOffset;
+
+    indexOffset = 0;
+    for (i = 0; i < pHdr->numPulses && OneStateCount(idxStream[i]) != 0; i++) {
+        /* "falling edge, replace with ZeroStateCount for rising edge" */
+    }
+    if (i < pHdr->numPulses) {
+        int start = i;
+        do {
+            i++;
+            if (i >= pHdr->numPulses)
+                i = 0;      // wrapped around
+        } while (i != start && ZeroStateCount(idxStream[i]) == 0);
+        if (i != start) {
+            /* index pulse detected */
+            while (i != start &&
+                ZeroStateCount(idxStream[i]) > OneStateCount(idxStream[i]))
+            {
+                i++;
+                if (i >= pHdr->numPulses)
+                    i = 0;
+            }
+            if (i != start)
+                indexOffset = i;    /* index position detected */
+        }
+    }
+
+    /*
+     * Compute totalAvg and weakBits, and rewrite idxStream.
+     * (We don't actually use weakBits.)
+     */
+    uint32_t totalAvg;
+    int weakBits;
+
+    totalAvg = weakBits = 0;
+    for (i = 0; i < pHdr->numPulses; i++) {
+        unsigned int sum;
+        sum = ZeroStateCount(idxStream[i]) + OneStateCount(idxStream[i]);
+        if (sum >= maxIndex)
+            totalAvg += avgStream[i];   // could this overflow...?
+        else
+            weakBits++;
+
+        idxStream[i] = sum;
+    }
+
+    LOGI("     FDI: maxIndex=%u indexOffset=%d totalAvg=%d weakBits=%d",
+        maxIndex, indexOffset, totalAvg, weakBits);
+
+    pSlot->maxIndex = maxIndex;
+    pSlot->indexOffset = indexOffset;
+    pSlot->totalAvg = totalAvg;
+    return true;
 }
 
 /*
@@ -569,7 +759,8 @@ bail:
  * couldn't handle.
  */
 bool WrapperFDI::UncompressPulseStream(const uint8_t* inputBuf, long inputLen,
-    uint32_t* outputBuf, long numPulses, int format, int bytesPerPulse)
+    uint32_t* outputBuf, long numPulses, int format, int bytesPerPulse,
+    HuffScratch* pScratch)
 {
     assert(bytesPerPulse == 2 || bytesPerPulse == 4);
 
@@ -601,7 +792,7 @@ bool WrapperFDI::UncompressPulseStream(const uint8_t* inputBuf, long inputLen,
             }
         }
     } else if (format == kCompHuffman) {
-        if (!ExpandHuffman(inputBuf, inputLen, outputBuf, numPulses))
+        if (!ExpandHuffman(inputBuf, inputLen, outputBuf, numPulses, pScratch))
             return false;
         //LOGI("  FDI: Huffman expansion succeeded");
     } else {
@@ -620,179 +811,289 @@ bool WrapperFDI::UncompressPulseStream(const uint8_t* inputBuf, long inputLen,
  *
  * "outputBuf" is expected to hold "numPulses" entries.
  *
- * This implementation is based on the fdi2raw code.
+ * This is based on the fdi2raw code, but rather than walking the tree one
+ * bit at a time we look up the first kHuffTableBits bits of each code in
+ * a table, and only walk the tree for the (rare) codes that are longer.
  */
 bool WrapperFDI::ExpandHuffman(const uint8_t* inputBuf, long inputLen,
-    uint32_t* outputBuf, long numPulses)
+    uint32_t* outputBuf, long numPulses, HuffScratch* pScratch)
 {
-    HuffNode root;
-    const uint8_t* origInputBuf = inputBuf;
+    long offset = 0;
     bool signExtend, sixteenBits;
-    int i, subStreamShift;
+    int i, subStreamShift, maxDepth, tableBits;
     uint8_t bits;
-    uint8_t bitMask;
 
     memset(outputBuf, 0, numPulses * sizeof(uint32_t));
     subStreamShift = 1;
 
     while (subStreamShift != 0) {
-        if (inputBuf - origInputBuf >= inputLen) {
+        if (offset >= inputLen) {
             LOGI("  FDI: overran input(1)");
             return false;
         }
 
         /* decode the sub-stream header */
-        bits = *inputBuf++;
+        bits = inputBuf[offset++];
         subStreamShift = bits & 0x7f;           // low-order bit number
         signExtend = (bits & 0x80) != 0;
-        bits = *inputBuf++;
+        if (offset >= inputLen) {
+            LOGI("  FDI: overran input(2)");
+            return false;
+        }
+        bits = inputBuf[offset++];
         sixteenBits = (bits & 0x80) != 0;       // ignore redundant high-order
 
         //LOGI("   FDI: shift=%d ext=%d sixt=%d",
         //  subStreamShift, signExtend, sixteenBits);
 
-        /* decode the Huffman tree structure */
-        root.left = NULL;
-        root.right = NULL;
-        bitMask = 0;
-        inputBuf = HuffExtractTree(inputBuf, &root, &bits, &bitMask);
-
-        //LOGI("    after tree: off=%d", inputBuf - origInputBuf);
-
-        /* extract the Huffman node values */
-        if (sixteenBits)
-            inputBuf = HuffExtractValues16(inputBuf, &root);
-        else
-            inputBuf = HuffExtractValues8(inputBuf, &root);
-
-        if (inputBuf - origInputBuf >= inputLen) {
+        /* decode the Huffman tree structure, and the node values */
+        if (!HuffExtractTree(inputBuf, inputLen, &offset, pScratch,
+                &maxDepth) ||
+            !HuffExtractValues(inputBuf, inputLen, &offset, pScratch,
+                sixteenBits, signExtend, subStreamShift) ||
+            offset >= inputLen)
+        {
             LOGI("  FDI: overran input(2)");
             return false;
         }
-        //LOGI("    after values: off=%d", inputBuf - origInputBuf);
+        //LOGI("    after values: off=%d", offset);
+
+        const HuffNode* nodes = pScratch->nodes;
+        if (nodes[0].left < 0) {
+            /* tree is a single leaf; every pulse gets it, no bits used */
+            for (i = 0; i < numPulses; i++)
+                outputBuf[i] |= nodes[0].contrib;
+            continue;
+        }
+
+        tableBits = maxDepth;
+        if (tableBits > kHuffTableBits)
+            tableBits = kHuffTableBits;
+        HuffFillTable(pScratch, 0, 0, 0, tableBits);
+
+        /*
+         * Decode the data over all pulses.  Bits come out of a 64-bit
+         * accumulator, MSB first; reads past the end of the input return
+         * zeroes, and we catch the overrun when we check the length.
+         */
+        const HuffTableEntry* table = pScratch->table;
+        uint64_t acc = 0;
+        int accBits = 0;
+        long inPosn = offset;
+        long bitsUsed = 0;
 
-        /* decode the data over all pulses */
-        bitMask = 0;
         for (i = 0; i < numPulses; i++) {
-            uint32_t outVal;
-            const HuffNode* pCurrent = &root;
+            while (accBits <= 56) {
+                if (inPosn < inputLen)
+                    acc |= (uint64_t) inputBuf[inPosn] << (56 - accBits);
+                inPosn++;
+                accBits += 8;
+            }
+
+            const HuffTableEntry* pEntry = &table[acc >> (64 - tableBits)];
+            int node = pEntry->node;
+            acc <<= pEntry->len;
+            accBits -= pEntry->len;
+            bitsUsed += pEntry->len;
 
-            /* chase down the tree until we hit a leaf */
             /* (note: nodes have two kids or none) */
-            while (true) {
-                if (pCurrent->left == NULL) {
-                    break;
-                } else {
-                    bitMask >>= 1;
-                    if (bitMask == 0) {
-                        bitMask = 0x80;
-                        bits = *inputBuf++;
-                    }
-                    if (bits & bitMask)
-                        pCurrent = pCurrent->right;
+            while (nodes[node].left >= 0) {
+                if (accBits == 0) {
+                    if (inPosn < inputLen)
+                        acc = (uint64_t) inputBuf[inPosn] << 56;
                     else
-                        pCurrent = pCurrent->left;
+                        acc = 0;
+                    inPosn++;
+                    accBits = 8;
                 }
-            }
-
-            outVal = outputBuf[i];
-            if (signExtend) {
-                if (sixteenBits)
-                    outVal |= HuffSignExtend16(pCurrent->val) << subStreamShift;
+                if (acc & 0x8000000000000000ULL)
+                    node = nodes[node].right;
                 else
-                    outVal |= HuffSignExtend8(pCurrent->val) << subStreamShift;
-            } else {
-                outVal |= pCurrent->val << subStreamShift;
+                    node = nodes[node].left;
+                acc <<= 1;
+                accBits--;
+                bitsUsed++;
             }
-            outputBuf[i] = outVal;
+
+            outputBuf[i] |= nodes[node].contrib;
         }
-        HuffFreeNodes(root.left);
-        HuffFreeNodes(root.right);
+
+        /* each sub-stream's data starts on a byte boundary */
+        offset += (bitsUsed + 7) / 8;
     }
 
-    if (inputBuf - origInputBuf != inputLen) {
-        LOGI("  FDI: warning: Huffman input %ld vs. %ld",
-            inputBuf - origInputBuf, inputLen);
+    if (offset != inputLen) {
+        LOGI("  FDI: warning: Huffman input %ld vs. %ld", offset, inputLen);
         return false;
     }
 
     return true;
 }
 
-
 /*
- * Recursively extract the Huffman tree structure for this sub-stream.
+ * Make sure the Huffman scratch area has room for at least "count" nodes.
  */
-const uint8_t* WrapperFDI::HuffExtractTree(const uint8_t* inputBuf,
-    HuffNode* pNode, uint8_t* pBits, uint8_t* pBitMask)
+bool WrapperFDI::HuffReserveNodes(HuffScratch* pScratch, int count)
 {
-    uint8_t val;
-
-    if (*pBitMask == 0) {
-        *pBits = *inputBuf++;
-        *pBitMask = 0x80;
+    if (count <= pScratch->nodesAlloc)
+        return true;
+
+    int newAlloc = pScratch->nodesAlloc * 2;
+    if (newAlloc < count)
+        newAlloc = count + 512;
+
+    HuffNode* newNodes = new HuffNode[newAlloc];
+    int* newStack = new int[newAlloc];
+    if (newNodes == NULL || newStack == NULL) {
+        delete[] newNodes;
+        delete[] newStack;
+        return false;
     }
-    val = *pBits & *pBitMask;
-    (*pBitMask) >>= 1;
-
-    //LOGI("     val=%d", val);
-
-    if (val != 0) {
-        assert(pNode->left == NULL);
-        assert(pNode->right == NULL);
-        return inputBuf;
-    } else {
-        pNode->left = new HuffNode;
-        memset(pNode->left, 0, sizeof(HuffNode));
-        inputBuf = HuffExtractTree(inputBuf, pNode->left, pBits, pBitMask);
-        pNode->right = new HuffNode;
-        memset(pNode->right, 0, sizeof(HuffNode));
-        return HuffExtractTree(inputBuf, pNode->right, pBits, pBitMask);
+    if (pScratch->nodes != NULL) {
+        memcpy(newNodes, pScratch->nodes,
+            pScratch->nodesAlloc * sizeof(HuffNode));
+        memcpy(newStack, pScratch->stack, pScratch->nodesAlloc * sizeof(int));
     }
+    delete[] pScratch->nodes;
+    delete[] pScratch->stack;
+    pScratch->nodes = newNodes;
+    pScratch->stack = newStack;
+    pScratch->nodesAlloc = newAlloc;
+    return true;
 }
 
 /*
- * Recursively get the 16-bit values for our Huffman tree from the stream.
+ * Extract the Huffman tree structure for this sub-stream.
+ *
+ * The tree is stored as a preorder walk, with a 0 bit for each interior
+ * node and a 1 bit for each leaf, padded out to a byte boundary.  The
+ * nodes are stored in the scratch area in the order we find them, so the
+ * root is node 0 and the leaves appear in the same order as their values.
+ *
+ * Sets "*pMaxDepth" to the depth of the deepest leaf.  Returns "false" if
+ * we run off the end of the input.
  */
-const uint8_t* WrapperFDI::HuffExtractValues16(const uint8_t* inputBuf,
-    HuffNode* pNode)
+bool WrapperFDI::HuffExtractTree(const uint8_t* inputBuf, long inputLen,
+    long* pOffset, HuffScratch* pScratch, int* pMaxDepth)
 {
-    if (pNode->left == NULL) {
-        pNode->val = (*inputBuf++) << 8;
-        pNode->val |= *inputBuf++;
-        return inputBuf;
-    } else {
-        inputBuf = HuffExtractValues16(inputBuf, pNode->left);
-        return HuffExtractValues16(inputBuf, pNode->right);
+    long offset = *pOffset;
+    int numNodes, cur, stackDepth, maxDepth;
+    uint8_t bits = 0;
+    uint8_t bitMask = 0;
+
+    if (!HuffReserveNodes(pScratch, 1))
+        return false;
+    pScratch->nodes[0].left = pScratch->nodes[0].right = -1;
+    pScratch->nodes[0].depth = 0;
+    numNodes = 1;
+    cur = 0;
+    stackDepth = maxDepth = 0;
+
+    while (true) {
+        if (bitMask == 0) {
+            if (offset >= inputLen)
+                return false;
+            bits = inputBuf[offset++];
+            bitMask = 0x80;
+        }
+        bool isLeaf = (bits & bitMask) != 0;
+        bitMask >>= 1;
+
+        int parent;
+        if (!isLeaf) {
+            /* interior node; left child comes next, right one later */
+            parent = cur;
+            pScratch->stack[stackDepth++] = parent;
+        } else {
+            if (pScratch->nodes[cur].depth > maxDepth)
+                maxDepth = pScratch->nodes[cur].depth;
+            if (stackDepth == 0)
+                break;          // that was the last leaf
+            parent = pScratch->stack[--stackDepth];
+        }
+
+        if (!HuffReserveNodes(pScratch, numNodes + 1))
+            return false;
+        HuffNode* nodes = pScratch->nodes;
+        cur = numNodes++;
+        nodes[cur].left = nodes[cur].right = -1;
+        nodes[cur].depth = nodes[parent].depth + 1;
+        if (!isLeaf)
+            nodes[parent].left = cur;
+        else
+            nodes[parent].right = cur;
     }
+
+    pScratch->numNodes = numNodes;
+    *pMaxDepth = maxDepth;
+    *pOffset = offset;
+    return true;
 }
 
 /*
- * Recursively get the 8-bit values for our Huffman tree from the stream.
+ * Get the 8-bit or 16-bit values for the leaves of our Huffman tree from
+ * the stream.  We store them sign-extended (if requested) and shifted
+ * into position, ready to be OR'ed into the output.
  */
-const uint8_t* WrapperFDI::HuffExtractValues8(const uint8_t* inputBuf,
-    HuffNode* pNode)
+bool WrapperFDI::HuffExtractValues(const uint8_t* inputBuf, long inputLen,
+    long* pOffset, HuffScratch* pScratch, bool sixteenBits, bool signExtend,
+    int subStreamShift)
 {
-    if (pNode->left == NULL) {
-        pNode->val = *inputBuf++;
-        return inputBuf;
-    } else {
-        inputBuf = HuffExtractValues8(inputBuf, pNode->left);
-        return HuffExtractValues8(inputBuf, pNode->right);
+    long offset = *pOffset;
+    int i;
+
+    for (i = 0; i < pScratch->numNodes; i++) {
+        HuffNode* pNode = &pScratch->nodes[i];
+        uint32_t val;
+
+        if (pNode->left >= 0)
+            continue;
+
+        if (sixteenBits) {
+            if (offset + 2 > inputLen)
+                return false;
+            val = inputBuf[offset] << 8 | inputBuf[offset+1];
+            offset += 2;
+            if (signExtend)
+                val = HuffSignExtend16(val);
+        } else {
+            if (offset + 1 > inputLen)
+                return false;
+            val = inputBuf[offset++];
+            if (signExtend)
+                val = HuffSignExtend8(val);
+        }
+        pNode->contrib = val << subStreamShift;
     }
+
+    *pOffset = offset;
+    return true;
 }
 
 /*
- * Recursively free up the current node and all nodes beneath it.
+ * Fill in the decode table for the subtree at "node", which is reached by
+ * the "depth"-bit code "code".  Each entry is indexed by the next
+ * "tableBits" bits of input, and holds the node those bits lead to along
+ * with the number of bits used to get there.
  */
-void WrapperFDI::HuffFreeNodes(HuffNode* pNode)
+void WrapperFDI::HuffFillTable(HuffScratch* pScratch, int node, int depth,
+    int code, int tableBits)
 {
-    if (pNode != NULL) {
-        HuffFreeNodes(pNode->left);
-        HuffFreeNodes(pNode->right);
-        delete pNode;
+    const HuffNode* pNode = &pScratch->nodes[node];
+
+    if (pNode->left < 0 || depth == tableBits) {
+        int span = 1 << (tableBits - depth);
+        HuffTableEntry* pEntry = &pScratch->table[code << (tableBits - depth)];
+        while (span--) {
+            pEntry->node = node;
+            pEntry->len = depth;
+            pEntry++;
+        }
+    } else {
+        HuffFillTable(pScratch, pNode->left, depth+1, code << 1, tableBits);
+        HuffFillTable(pScratch, pNode->right, depth+1, (code << 1) | 1,
+            tableBits);
     }
-
 }
 
 /*
@@ -816,183 +1117,6 @@ uint32_t WrapperFDI::HuffSignExtend8(uint32_t val)
 }
 
 
-/* use these to extract values from the index stream */
-#define ZeroStateCount(_val)    (((_val) >> 8) & 0xff)
-#define OneStateCount(_val)     ((_val) & 0xff)
-
-/*
- * Convert our collection of pulse streams into (what we hope will be)
- * Apple II nibble form.
- *
- * This modifies the contents of the minStream, maxStream, and idxStream
- * arrays.
- *
- * "*pNibbleLen" should hold the maximum size of the buffer.  On success,
- * it will hold the actual number of bytes used.
- */
-bool WrapperFDI::ConvertPulseStreamsToNibbles(PulseIndexHeader* pHdr, int bitRate,
-    uint8_t* nibbleBuf, long* pNibbleLen)
-{
-    uint32_t* fakeIdxStream = NULL;
-    bool result = false;
-    int i;
-
-    /*
-     * Stream pointers.  If we don't have a stream, fake it.
-     */
-    uint32_t* avgStream;
-    uint32_t* minStream;
-    uint32_t* maxStream;
-    uint32_t* idxStream;
-    
-    avgStream = pHdr->avgStream;
-    if (pHdr->minStream != NULL && pHdr->maxStream != NULL) {
-        minStream = pHdr->minStream;
-        maxStream = pHdr->maxStream;
-
-        /* adjust the values in the min/max streams */
-        for (i = 0; i < pHdr->numPulses; i++) {
-            maxStream[i] = avgStream[i] + minStream[i] - maxStream[i];
-            minStream[i] = avgStream[i] - minStream[i];
-        }
-    } else {
-        minStream = pHdr->avgStream;
-        maxStream = pHdr->avgStream;
-    }
-
-    if (pHdr->idxStream != NULL)
-        idxStream = pHdr->idxStream;
-    else {
-        /*
-         * The UAE sample code has some stuff to fake it.  The code there
-         * is broken, so I'm guessing it has never been used, but I'm going
-         * to replicate it here (and probably never test it either).  This
-         * assumes that the original was written for a big-endian machine.
-         */
-        LOGI(" FDI: HEY: using fake index stream");
-        DebugBreak();
-        fakeIdxStream = new uint32_t[pHdr->numPulses];
-        if (fakeIdxStream == NULL) {
-            LOGI(" FDI: unable to alloc fake idx stream");
-            goto bail;
-        }
-        for (i = 1; i < pHdr->numPulses; i++)
-            fakeIdxStream[i] = 0x0200;      // '1' for two, '0' for zero
-        fakeIdxStream[0] = 0x0101;          // '1' for one, '0' for one
-
-        idxStream = fakeIdxStream;
-    }
-
-    /*
-     * Compute a value for maxIndex.
-     */
-    uint32_t maxIndex;
-
-    maxIndex = 0;
-    for (i = 0; i < pHdr->numPulses; i++) {
-        uint32_t sum;
-
-        /* add up the two single-byte values in the index stream */
-        sum = ZeroStateCount(idxStream[i]) + OneStateCount(idxStream[i]);
-        if (sum > maxIndex)
-            maxIndex = sum;
-    }
-
-    /*
-     * Compute a value for indexOffset.
-     */
-    int indexOffset;
-
-    indexOffset = 0;
-    for (i = 0; i < pHdr->numPulses && OneStateCount(idxStream[i]) != 0; i++) {
-        /* "falling edge, replace with ZeroStateCount for rising edge" */
-    }
-    if (i < pHdr->numPulses) {
-        int start = i;
-        do {
-            i++;
-            if (i >= pHdr->numPulses)
-                i = 0;      // wrapped around
-        } while (i != start && ZeroStateCount(idxStream[i]) == 0);
-        if (i != start) {
-            /* index pulse detected */
-            while (i != start &&
-                ZeroStateCount(idxStream[i]) > OneStateCount(idxStream[i]))
-            {
-                i++;
-                if (i >= pHdr->numPulses)
-                    i = 0;
-            }
-            if (i != start)
-                indexOffset = i;    /* index position detected */
-        }
-    }
-
-    /*
-     * Compute totalAvg and weakBits, and rewrite idxStream.
-     * (We don't actually use weakBits.)
-     */
-    uint32_t totalAvg;
-    int weakBits;
-
-    totalAvg = weakBits = 0;
-    for (i = 0; i < pHdr->numPulses; i++) {
-        unsigned int sum;
-        sum = ZeroStateCount(idxStream[i]) + OneStateCount(idxStream[i]);
-        if (sum >= maxIndex)
-            totalAvg += avgStream[i];   // could this overflow...?
-        else
-            weakBits++;
-
-        idxStream[i] = sum;
-    }
-
-    LOGI("     FDI: maxIndex=%u indexOffset=%d totalAvg=%d weakBits=%d",
-        maxIndex, indexOffset, totalAvg, weakBits);
-
-    /*
-     * Take our altered stream values and the stuff we've calculated,
-     * and convert the pulse values into bits.
-     */
-    uint8_t bitBuffer[kBitBufferSize];
-    int bitCount;
-    
-    bitCount = kBitBufferSize;
-
-    if (!ConvertPulsesToBits(avgStream, minStream, maxStream, idxStream,
-        pHdr->numPulses, maxIndex, indexOffset, totalAvg, bitRate,
-        bitBuffer, &bitCount))
-    {
-        LOGI(" FDI: ConvertPulsesToBits() failed");
-        goto bail;
-    }
-
-    //LOGI("  Got %d bits", bitCount);
-    if (bitCount < 0) {
-        LOGI(" FDI: overran output bit buffer");
-        goto bail;
-    }
-
-    /*
-     * We have a bit stream with the GCR bits as they appear coming out of
-     * the IWM.  Convert it to 8-bit nibble form.
-     *
-     * We currently discard self-sync byte information.
-     */
-    if (!ConvertBitsToNibbles(bitBuffer, bitCount, nibbleBuf, pNibbleLen))
-    {
-        LOGI(" FDI: ConvertBitsToNibbles() failed");
-        goto bail;
-    }
-
-    result = true;
-
-bail:
-    delete[] fakeIdxStream;
-    return result;
-}
-
-
 /*
  * Local data structures.  Not worth putting in the header file.
  */
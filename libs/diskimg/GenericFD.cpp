@@ -21,6 +21,10 @@
  *
  * If "pCRC" is non-NULL, this computes a CRC32 as it goes, using the zlib
  * library function.
+ *
+ * If the source knows where its holes are, we skip reading them and
+ * let the destination write the zeroes however it likes (which, for a
+ * file, means keeping it sparse).
  */
 /*static*/ DIError GenericFD::CopyFile(GenericFD* pDst, GenericFD* pSrc,
     di_off_t length, uint32_t* pCRC)
@@ -28,6 +32,7 @@
     DIError dierr = kDIErrNone;
     const int kCopyBufSize = 32768;
     uint8_t* copyBuf = NULL;
+    di_off_t posn, dataStart, dataEnd;
     int copySize;
 
     LOGD("+++ CopyFile: %ld bytes", (long) length);
@@ -44,10 +49,53 @@
     if (pCRC != NULL)
         *pCRC = crc32(0L, Z_NULL, 0);
 
+    posn = pSrc->Tell();
+    dataStart = dataEnd = posn;
     while (length != 0) {
+        if (posn >= dataEnd) {
+            if (posn < 0 ||
+                pSrc->FindData(posn, posn + length, &dataStart, &dataEnd) !=
+                    kDIErrNone)
+            {
+                dataStart = posn;
+                dataEnd = posn + length;
+            }
+            assert(dataStart >= posn && dataEnd >= dataStart);
+        }
+
+        if (posn < dataStart) {
+            /* skip over a hole */
+            di_off_t holeLen = dataStart - posn;
+
+            if (pCRC != NULL) {
+                di_off_t crcLen = holeLen;
+                memset(copyBuf, 0, kCopyBufSize);
+                while (crcLen != 0) {
+                    copySize = kCopyBufSize;
+                    if (copySize > crcLen)
+                        copySize = (int) crcLen;
+                    *pCRC = crc32(*pCRC, copyBuf, copySize);
+                    crcLen -= copySize;
+                }
+            }
+
+            dierr = pDst->WriteZeroes(holeLen);
+            if (dierr != kDIErrNone)
+                goto bail;
+
+            posn += holeLen;
+            length -= holeLen;
+            if (length != 0) {
+                dierr = pSrc->Seek(posn, kSeekSet);
+                if (dierr != kDIErrNone)
+                    goto bail;
+            }
+            continue;
+        }
+
         copySize = kCopyBufSize;
-        if (copySize > length)
-            copySize = (int) length;
+        if (copySize > dataEnd - posn)
+            copySize = (int) (dataEnd - posn);
 
         dierr = pSrc->Read(copyBuf, copySize);
         if (dierr != kDIErrNone)
@@ -60,6 +108,7 @@
         if (dierr != kDIErrNone)
             goto bail;
 
+        posn += copySize;
         length -= copySize;
     }
 
@@ -68,6 +117,38 @@ bail:
     return dierr;
 }
 
+/*
+ * Write "length" zero bytes, the hard way.
+ */
+DIError GenericFD::WriteZeroes(di_off_t length)
+{
+    DIError dierr = kDIErrNone;
+    const int kZeroBufSize = 32768;
+    uint8_t* zeroBuf;
+    int writeSize;
+
+    if (length == 0)
+        return kDIErrNone;
+
+    zeroBuf = new uint8_t[kZeroBufSize];
+    if (zeroBuf == NULL)
+        return kDIErrMalloc;
+    memset(zeroBuf, 0, kZeroBufSize);
+
+    while (length != 0) {
+        writeSize = kZeroBufSize;
+        if (writeSize > length)
+            writeSize = (int) length;
+        dierr = Write(zeroBuf, writeSize);
+        if (dierr != kDIErrNone)
+            break;
+        length -= writeSize;
+    }
+
+    delete[] zeroBuf;
+    return dierr;
+}
+
 
 /*
  * ===========================================================================
@@ -235,6 +316,115 @@ DIError GFDFile::Close(void)
     return kDIErrNone;
 }
 
+/*
+ * Write zeroes without writing them.  The part that lies within the file
+ * has a hole punched in it, and the part past the end is handled by
+ * extending the file, which leaves a hole on filesystems that support
+ * them.  If the filesystem can't punch holes we write the zeroes out.
+ */
+DIError GFDFile::WriteZeroes(di_off_t length)
+{
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
+    DIError dierr;
+    struct stat sb;
+    di_off_t start, end, fileLen;
+    int fd;
+
+    if (fFp == NULL)
+        return kDIErrNotReady;
+    if (fReadOnly)
+        return kDIErrAccessDenied;
+    if (length == 0)
+        return kDIErrNone;
+
+    start = Tell();
+    if (start < 0 || ::fflush(fFp) != 0)
+        return GenericFD::WriteZeroes(length);
+    end = start + length;
+
+    fd = fileno(fFp);
+    if (::fstat(fd, &sb) != 0)
+        return GenericFD::WriteZeroes(length);
+    fileLen = sb.st_size;
+
+    if (start < fileLen) {
+        di_off_t punchEnd = (end < fileLen) ? end : fileLen;
+
+        if (::fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                start, punchEnd - start) != 0)
+        {
+            LOGD("  GFDFile can't punch hole (errno=%d), writing zeroes",
+                errno);
+            dierr = GenericFD::WriteZeroes(punchEnd - start);
+            if (dierr != kDIErrNone)
+                return dierr;
+        }
+    }
+    if (end > fileLen) {
+        if (::ftruncate(fd, end) != 0) {
+            dierr = ErrnoOrGeneric();
+            LOGW("  GFDFile extend to %ld failed (err=%d)", (long) end, dierr);
+            return dierr;
+        }
+    }
+
+    return Seek(end, kSeekSet);
+#else
+    return GenericFD::WriteZeroes(length);
+#endif
+}
+
+/*
+ * Use SEEK_DATA / SEEK_HOLE to find out where the data is.
+ */
+DIError GFDFile::FindData(di_off_t offset, di_off_t limit,
+    di_off_t* pStart, di_off_t* pEnd)
+{
+    *pStart = offset;
+    *pEnd = limit;
+
+#if defined(HAVE_SEEK_DATA) && defined(SEEK_DATA)
+    di_off_t posn, dataStart, holeStart;
+    int fd;
+
+    if (fFp == NULL)
+        return kDIErrNotReady;
+
+    /* make sure pending writes are visible, and remember where we are */
+    posn = Tell();
+    if (posn < 0 || ::fflush(fFp) != 0)
+        return kDIErrNone;
+    fd = fileno(fFp);
+
+    dataStart = ::lseek(fd, offset, SEEK_DATA);
+    if (dataStart < 0) {
+        struct stat sb;
+
+        /*
+         * ENXIO means there's no data at or past "offset".  If we're
+         * inside the file that's a hole running to EOF; if we're at or
+         * past the end, it's not a hole at all, and we let the read
+         * report it.  Anything else means SEEK_DATA isn't supported
+         * here, so we treat it all as data.
+         */
+        if (errno == ENXIO && ::fstat(fd, &sb) == 0 && offset < sb.st_size) {
+            *pStart = (sb.st_size < limit) ? (di_off_t) sb.st_size : limit;
+        }
+    } else {
+        holeStart = ::lseek(fd, dataStart, SEEK_HOLE);
+        if (holeStart < dataStart)
+            holeStart = limit;
+        *pStart = (dataStart < limit) ? dataStart : limit;
+        *pEnd = (holeStart < limit) ? holeStart : limit;
+    }
+
+    /* put the FILE* back where it was (this also resyncs its fd) */
+    if (::fseeko(fFp, posn, SEEK_SET) != 0)
+        return ErrnoOrGeneric();
+#endif
+    return kDIErrNone;
+}
+
 #else /*HAVE_FSEEKO*/
 
 DIError GFDFile::Open(const char* filename, bool readOnly)
@@ -437,6 +627,64 @@ DIError GFDBuffer::Open(void* buffer, di_off_t length, bool doDelete,
     return kDIErrNone;
 }
 
+DIError GFDBuffer::Adopt(void* buffer, di_off_t length, di_off_t allocLength,
+    bool doExpand, bool readOnly)
+{
+    DIError dierr;
+
+    if (buffer == NULL || allocLength < length || allocLength > kMaxReasonableSize)
+        return kDIErrInvalidArg;
+
+    dierr = Open(buffer, length, true, doExpand, readOnly);
+    if (dierr != kDIErrNone)
+        return dierr;
+    fAllocLength = (long) allocLength;
+    return kDIErrNone;
+}
+
+DIError GFDBuffer::Reserve(di_off_t length)
+{
+    if (fBuffer == NULL)
+        return kDIErrNotReady;
+    if (length <= fAllocLength)
+        return kDIErrNone;
+    if (!fDoExpand)
+        return kDIErrDataOverrun;
+    if (length > kMaxReasonableSize)
+        return kDIErrInvalidArg;
+
+    return Resize((long) length);
+}
+
+/*
+ * Reallocate the buffer to hold "newAllocLength" bytes.
+ *
+ * We delete the old buffer unless "doDelete" is not set, in which case
+ * we just drop the pointer.  Anything we allocate here can and will be
+ * deleted; "doDelete" only applies to the pointer initially passed in.
+ */
+DIError GFDBuffer::Resize(long newAllocLength)
+{
+    assert(newAllocLength >= fLength);
+    assert(newAllocLength <= kMaxReasonableSize);
+
+    LOGI("Reallocating buffer (new size = %ld)", newAllocLength);
+    char* newBuf = new char[newAllocLength];
+    if (newBuf == NULL)
+        return kDIErrMalloc;
+
+    memcpy(newBuf, fBuffer, fLength);
+
+    if (fDoDelete)
+        delete[] (char*)fBuffer;
+    else
+        fDoDelete = true;       // future deletions are okay
+
+    fBuffer = newBuf;
+    fAllocLength = newAllocLength;
+    return kDIErrNone;
+}
+
 DIError GFDBuffer::Read(void* buf, size_t length, size_t* pActual)
 {
     if (fBuffer == NULL)
@@ -481,35 +729,28 @@ DIError GFDBuffer::Write(const void* buf, size_t length, size_t* pActual)
         }
 
         /*
-         * Expand the buffer as needed.
-         *
-         * We delete the old buffer unless "doDelete" is not set, in
-         * which case we just drop the pointer.  Anything we allocate
-         * here can and will be deleted; "doDelete" only applies to the
-         * pointer initially passed in.
+         * Expand the buffer as needed.  If it doesn't fit in the space
+         * we have, double the allocation, so that a long series of small
+         * writes doesn't copy the whole buffer every time.
          */
-        if (fCurrentOffset + (long)length <= fAllocLength) {
-            /* fits inside allocated space, so just extend length */
-            fLength = (long) fCurrentOffset + (long)length;
-        } else {
-            /* does not fit, realloc buffer */
-            fAllocLength = (long) fCurrentOffset + (long)length + 8*1024;
-            LOGI("Reallocating buffer (new size = %ld)", fAllocLength);
-            assert(fAllocLength < kMaxReasonableSize);
-            char* newBuf = new char[(int) fAllocLength];
-            if (newBuf == NULL)
-                return kDIErrMalloc;
-
-            memcpy(newBuf, fBuffer, fLength);
-
-            if (fDoDelete)
-                delete[] (char*)fBuffer;
-            else
-                fDoDelete = true;       // future deletions are okay
-
-            fBuffer = newBuf;
-            fLength = (long) fCurrentOffset + (long)length;
+        long needed = (long) fCurrentOffset + (long) length;
+        if (needed > fAllocLength) {
+            if (needed > kMaxReasonableSize) {
+                LOGI("  GFDBuffer refusing to expand to %ld bytes", needed);
+                return kDIErrDataOverrun;
+            }
+
+            long newAllocLength = fAllocLength * 2;
+            if (newAllocLength < needed + kMinGrowth)
+                newAllocLength = needed + kMinGrowth;
+            if (newAllocLength > kMaxReasonableSize)
+                newAllocLength = kMaxReasonableSize;
+
+            DIError dierr = Resize(newAllocLength);
+            if (dierr != kDIErrNone)
+                return dierr;
         }
+        fLength = needed;
     }
 
     memcpy((char*)fBuffer + fCurrentOffset, buf, length);
@@ -575,6 +816,704 @@ DIError GFDBuffer::Close(void)
 }
 
 
+/*
+ * ===========================================================================
+ *      GFDGzip
+ * ===========================================================================
+ */
+
+/* first 8 bytes of an index file */
+/*static*/ const char GFDGzip::kIndexFileMagic[8] =
+    { 'D', 'I', 'G', 'Z', 'I', 'D', 'X', 0x1a };
+
+/*
+ * Prepare to read the gzip file in "pGFD".
+ *
+ * If "indexPath" is non-NULL, we try to load the checkpoint index from
+ * there, and write one there if we had to build it.  The index is tied
+ * to the gzip file by its length and trailer, so a stale one gets
+ * rebuilt.
+ *
+ * Fails with kDIErrTooBig if the data expands to more than "maxLength"
+ * bytes, and kDIErrNotSupported if the file holds more than one gzip
+ * member.
+ */
+DIError GFDGzip::Open(GenericFD* pGFD, di_off_t outerLength, long maxLength,
+    const char* indexPath)
+{
+    DIError dierr = kDIErrNone;
+    uint8_t trailer[8];
+    uint32_t trailerCRC, trailerSize;
+    int i;
+
+    if (fpGFD != NULL)
+        return kDIErrAlreadyOpen;
+    if (pGFD == NULL || outerLength < 18)  // 10-byte hdr, 8-byte trailer
+        return kDIErrInvalidArg;
+
+    fpGFD = pGFD;
+    fReadOnly = true;
+    for (i = 0; i < kNumCacheChunks; i++)
+        fCache[i].chunkNum = -1;
+
+    /* the trailer identifies the contents well enough for the index file */
+    dierr = fpGFD->Seek(outerLength - 8, kSeekSet);
+    if (dierr != kDIErrNone)
+        goto bail;
+    dierr = fpGFD->Read(trailer, sizeof(trailer));
+    if (dierr != kDIErrNone)
+        goto bail;
+    trailerCRC = GetLongLE(&trailer[0]);
+    trailerSize = GetLongLE(&trailer[4]);
+
+    if (indexPath != NULL &&
+        LoadIndex(indexPath, outerLength, trailerCRC, trailerSize) == kDIErrNone)
+    {
+        LOGI("  GFDGzip loaded index from '%s' (%d points)",
+            indexPath, fNumPoints);
+    } else {
+        dierr = BuildIndex(outerLength, maxLength);
+        if (dierr != kDIErrNone)
+            goto bail;
+        LOGI("  GFDGzip built index: %ld bytes, %d points",
+            (long) fLength, fNumPoints);
+        if (indexPath != NULL)
+            SaveIndex(indexPath, outerLength, trailerCRC, trailerSize);
+    }
+
+    if (fLength == 0 || fNumPoints == 0 || fPoints[0].out != 0) {
+        LOGI("  GFDGzip: nothing to index");
+        dierr = kDIErrNotSupported;
+        goto bail;
+    }
+
+    fCurrentOffset = 0;
+
+bail:
+    if (dierr != kDIErrNone)
+        Close();
+    return dierr;
+}
+
+/*
+ * Make one pass through the compressed data, recording checkpoints at
+ * deflate block boundaries.
+ */
+DIError GFDGzip::BuildIndex(di_off_t outerLength, long maxLength)
+{
+    const int kInputBufSize = 16384;
+    DIError dierr = kDIErrNone;
+    z_stream zstream;
+    uint8_t* inBuf = NULL;
+    uint8_t* window = NULL;
+    bool zInit = false;
+    di_off_t totalIn, totalOut, last;
+    int zerr = Z_OK;
+
+    inBuf = new uint8_t[kInputBufSize];
+    window = new uint8_t[kWindowSize];
+    if (inBuf == NULL || window == NULL) {
+        dierr = kDIErrMalloc;
+        goto bail;
+    }
+
+    /*
+     * Checkpoints in the first 32K copy the whole window, including the
+     * part inflate hasn't written yet, and the index file saves all of
+     * it.  Start with zeroes so we don't write out stale heap contents.
+     */
+    memset(window, 0, kWindowSize);
+
+    memset(&zstream, 0, sizeof(zstream));
+    zstream.zalloc = (alloc_func) Z_NULL;
+    zstream.zfree = (free_func) Z_NULL;
+    zstream.opaque = (voidpf) Z_NULL;
+    zerr = inflateInit2(&zstream, 15 + 32);     // expect a gzip header
+    if (zerr != Z_OK) {
+        LOGI("  GFDGzip: inflateInit2 failed (zerr=%d)", zerr);
+        dierr = kDIErrInternal;
+        goto bail;
+    }
+    zInit = true;
+
+    dierr = fpGFD->Seek(0, kSeekSet);
+    if (dierr != kDIErrNone)
+        goto bail;
+
+    totalIn = totalOut = last = 0;
+    do {
+        size_t actual;
+
+        dierr = fpGFD->Read(inBuf, kInputBufSize, &actual);
+        if (dierr == kDIErrEOF) {
+            LOGI("  GFDGzip: compressed data ends early");
+            dierr = kDIErrBadCompressedData;
+            goto bail;
+        } else if (dierr != kDIErrNone) {
+            goto bail;
+        }
+        zstream.next_in = inBuf;
+        zstream.avail_in = (uInt) actual;
+
+        do {
+            if (zstream.avail_out == 0) {
+                zstream.next_out = window;
+                zstream.avail_out = kWindowSize;
+            }
+
+            /* stop at the end of each deflate block */
+            totalIn += zstream.avail_in;
+            totalOut += zstream.avail_out;
+            zerr = inflate(&zstream, Z_BLOCK);
+            totalIn -= zstream.avail_in;
+            totalOut -= zstream.avail_out;
+
+            if (zerr == Z_NEED_DICT || zerr == Z_DATA_ERROR ||
+                zerr == Z_MEM_ERROR)
+            {
+                LOGI("  GFDGzip: inflate failed (zerr=%d)", zerr);
+                dierr = kDIErrBadCompressedData;
+                goto bail;
+            }
+            if (totalOut > maxLength) {
+                LOGI("  GFDGzip: excessive size, probably not a disk image");
+                dierr = kDIErrTooBig;
+                goto bail;
+            }
+            if (zerr == Z_STREAM_END)
+                break;
+
+            /*
+             * At the end of a block, but not the last one, add a
+             * checkpoint if we've gone far enough since the previous.
+             */
+            if ((zstream.data_type & 128) != 0 &&
+                (zstream.data_type & 64) == 0 &&
+                (totalOut == 0 || totalOut - last > kIndexSpan))
+            {
+                dierr = AddPoint(zstream.data_type & 7, totalIn, totalOut,
+                            zstream.avail_out, window);
+                if (dierr != kDIErrNone)
+                    goto bail;
+                last = totalOut;
+            }
+        } while (zstream.avail_in != 0);
+    } while (zerr != Z_STREAM_END);
+
+    fLength = totalOut;
+
+    /*
+     * gzread() would keep going if another gzip member follows.  We
+     * don't handle that here, so let the caller fall back on that.
+     */
+    {
+        uint8_t magic[2];
+        size_t actual = 0;
+
+        if (zstream.avail_in >= 2) {
+            magic[0] = zstream.next_in[0];
+            magic[1] = zstream.next_in[1];
+            actual = 2;
+        } else {
+            if (zstream.avail_in == 1)
+                magic[0] = zstream.next_in[0];
+            if (fpGFD->Read(&magic[zstream.avail_in], 2 - zstream.avail_in,
+                    &actual) == kDIErrNone)
+            {
+                actual += zstream.avail_in;
+            }
+        }
+        if (actual == 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+            LOGI("  GFDGzip: found multiple gzip members");
+            dierr = kDIErrNotSupported;
+            goto bail;
+        }
+    }
+
+bail:
+    if (zInit)
+        inflateEnd(&zstream);
+    delete[] inBuf;
+    delete[] window;
+    return dierr;
+}
+
+/*
+ * Add a checkpoint.  "window" holds the last 32K of output, wrapped
+ * around at the point where "left" bytes of space remain.
+ */
+DIError GFDGzip::AddPoint(int bits, di_off_t in, di_off_t out,
+    unsigned int left, const uint8_t* window)
+{
+    IndexPoint* pPoint;
+
+    if (fNumPoints == fAllocPoints) {
+        int newAlloc = fAllocPoints == 0 ? 8 : fAllocPoints * 2;
+        IndexPoint* newPoints = new IndexPoint[newAlloc];
+        if (newPoints == NULL)
+            return kDIErrMalloc;
+        if (fNumPoints != 0)
+            memcpy(newPoints, fPoints, fNumPoints * sizeof(IndexPoint));
+        delete[] fPoints;
+        fPoints = newPoints;
+        fAllocPoints = newAlloc;
+    }
+
+    pPoint = &fPoints[fNumPoints++];
+    pPoint->bits = bits;
+    pPoint->in = in;
+    pPoint->out = out;
+    if (left != 0)
+        memcpy(pPoint->window, window + kWindowSize - left, left);
+    if (left < kWindowSize)
+        memcpy(pPoint->window + left, window, kWindowSize - left);
+    return kDIErrNone;
+}
+
+/*
+ * Load the checkpoint index from a file.  Fails if the file doesn't exist
+ * or doesn't match the gzip file.
+ */
+DIError GFDGzip::LoadIndex(const char* indexPath, di_off_t outerLength,
+    uint32_t trailerCRC, uint32_t trailerSize)
+{
+    DIError dierr = kDIErrNone;
+    GFDFile indexFile;
+    char magic[8];
+    uint32_t version, fileOuterLen, fileCRC, fileSize, length, numPoints;
+    uint32_t out, in, bits;
+    uint32_t i;
+
+    dierr = indexFile.Open(indexPath, true);
+    if (dierr != kDIErrNone)
+        return dierr;
+
+    dierr = indexFile.Read(magic, sizeof(magic));
+    if (dierr != kDIErrNone)
+        goto bail;
+    if (memcmp(magic, kIndexFileMagic, sizeof(magic)) != 0) {
+        dierr = kDIErrBadFileFormat;
+        goto bail;
+    }
+
+    dierr = ReadLongLE(&indexFile, &version);
+    if (dierr == kDIErrNone)
+        dierr = ReadLongLE(&indexFile, &fileOuterLen);
+    if (dierr == kDIErrNone)
+        dierr = ReadLongLE(&indexFile, &fileCRC);
+    if (dierr == kDIErrNone)
+        dierr = ReadLongLE(&indexFile, &fileSize);
+    if (dierr == kDIErrNone)
+        dierr = ReadLongLE(&indexFile, &length);
+    if (dierr == kDIErrNone)
+        dierr = ReadLongLE(&indexFile, &numPoints);
+    if (dierr != kDIErrNone)
+        goto bail;
+
+    if (version != kIndexFileVersion || fileOuterLen != outerLength ||
+        fileCRC != trailerCRC || fileSize != trailerSize ||
+        numPoints == 0 || numPoints > (length / kIndexSpan) + 1)
+    {
+        LOGI("  GFDGzip: index file '%s' doesn't match, ignoring", indexPath);
+        dierr = kDIErrBadFileFormat;
+        goto bail;
+    }
+
+    fPoints = new IndexPoint[numPoints];
+    if (fPoints == NULL) {
+        dierr = kDIErrMalloc;
+        goto bail;
+    }
+    fAllocPoints = numPoints;
+
+    for (i = 0; i < numPoints; i++) {
+        IndexPoint* pPoint = &fPoints[i];
+
+        dierr = ReadLongLE(&indexFile, &out);
+        if (dierr == kDIErrNone)
+            dierr = ReadLongLE(&indexFile, &in);
+        if (dierr == kDIErrNone)
+            dierr = ReadLongLE(&indexFile, &bits);
+        if (dierr == kDIErrNone)
+            dierr = indexFile.Read(pPoint->window, kWindowSize);
+        if (dierr != kDIErrNone)
+            goto bail;
+        if (out >= length || in >= outerLength || bits > 7 ||
+            (i > 0 && out <= fPoints[i-1].out))
+        {
+            dierr = kDIErrBadFileFormat;
+            goto bail;
+        }
+        pPoint->out = out;
+        pPoint->in = in;
+        pPoint->bits = bits;
+        fNumPoints++;
+    }
+
+    fLength = length;
+
+bail:
+    if (dierr != kDIErrNone) {
+        delete[] fPoints;
+        fPoints = NULL;
+        fNumPoints = fAllocPoints = 0;
+    }
+    return dierr;
+}
+
+/*
+ * Save the checkpoint index to a file.  Failure isn't fatal; we just
+ * won't have it next time.
+ */
+void GFDGzip::SaveIndex(const char* indexPath, di_off_t outerLength,
+    uint32_t trailerCRC, uint32_t trailerSize)
+{
+    FILE* fp;
+    int i;
+
+    fp = fopen(indexPath, "wb");
+    if (fp == NULL) {
+        LOGI("  GFDGzip: unable to create index file '%s' (errno=%d)",
+            indexPath, errno);
+        return;
+    }
+
+    fwrite(kIndexFileMagic, 8, 1, fp);
+    WriteLongLE(fp, kIndexFileVersion);
+    WriteLongLE(fp, (uint32_t) outerLength);
+    WriteLongLE(fp, trailerCRC);
+    WriteLongLE(fp, trailerSize);
+    WriteLongLE(fp, (uint32_t) fLength);
+    WriteLongLE(fp, fNumPoints);
+    for (i = 0; i < fNumPoints; i++) {
+        WriteLongLE(fp, (uint32_t) fPoints[i].out);
+        WriteLongLE(fp, (uint32_t) fPoints[i].in);
+        WriteLongLE(fp, fPoints[i].bits);
+        fwrite(fPoints[i].window, kWindowSize, 1, fp);
+    }
+
+    if (ferror(fp)) {
+        LOGI("  GFDGzip: failed writing index file '%s'", indexPath);
+        fclose(fp);
+        remove(indexPath);
+        return;
+    }
+    fclose(fp);
+}
+
+/*
+ * Find a chunk in the cache.  Returns NULL if it's not there.
+ */
+GFDGzip::CacheChunk* GFDGzip::FindChunk(long chunkNum)
+{
+    int i;
+
+    for (i = 0; i < kNumCacheChunks; i++) {
+        if (fCache[i].chunkNum == chunkNum)
+            return &fCache[i];
+    }
+    return NULL;
+}
+
+/*
+ * Get a cache entry to fill, discarding the least-recently-used one if
+ * they're all busy.
+ */
+GFDGzip::CacheChunk* GFDGzip::GetFreeChunk(void)
+{
+    CacheChunk* pChunk = &fCache[0];
+    int i;
+
+    for (i = 0; i < kNumCacheChunks; i++) {
+        if (fCache[i].chunkNum < 0) {
+            pChunk = &fCache[i];
+            break;
+        }
+        if (fCache[i].lastUse < pChunk->lastUse)
+            pChunk = &fCache[i];
+    }
+
+    if (pChunk->data == NULL) {
+        pChunk->data = new uint8_t[kChunkSize];
+        if (pChunk->data == NULL)
+            return NULL;
+    }
+    pChunk->chunkNum = -1;
+    pChunk->lastUse = ++fUseCounter;
+    return pChunk;
+}
+
+/*
+ * Expand chunk "chunkNum" into the cache, and return its entry in
+ * "*ppChunk".
+ *
+ * We start from the nearest checkpoint at or before the start of the
+ * chunk.  Since sequential reads are common, we also cache the chunks
+ * that follow it, up to the next checkpoint or kReadAheadChunks,
+ * whichever comes first.  Output before the chunk is thrown away.
+ * Deflate blocks over blank areas can cover megabytes, so caching
+ * everything from the checkpoint on would push the chunk we were asked
+ * for out of the cache.
+ */
+DIError GFDGzip::ExpandChunk(long chunkNum, CacheChunk** ppChunk)
+{
+    const int kInputBufSize = 16384;
+    DIError dierr = kDIErrNone;
+    const di_off_t chunkStart = (di_off_t) chunkNum * kChunkSize;
+    const IndexPoint* pPoint;
+    z_stream zstream;
+    uint8_t* inBuf = NULL;
+    uint8_t* skipBuf = NULL;
+    bool zInit = false;
+    di_off_t outPosn, endPosn;
+    int lo, hi, zerr;
+
+    assert(chunkStart < fLength);
+    *ppChunk = NULL;
+
+    /* binary search for the last checkpoint at or before chunkStart */
+    lo = 0;
+    hi = fNumPoints - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (fPoints[mid].out <= chunkStart)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    pPoint = &fPoints[lo];
+    if (lo + 1 < fNumPoints)
+        endPosn = fPoints[lo+1].out;
+    else
+        endPosn = fLength;
+    if (endPosn > chunkStart + kReadAheadChunks * kChunkSize)
+        endPosn = chunkStart + kReadAheadChunks * kChunkSize;
+    if (endPosn < chunkStart + kChunkSize)
+        endPosn = chunkStart + kChunkSize;
+
+    inBuf = new uint8_t[kInputBufSize];
+    skipBuf = new uint8_t[kChunkSize];
+    if (inBuf == NULL || skipBuf == NULL) {
+        dierr = kDIErrMalloc;
+        goto bail;
+    }
+
+    memset(&zstream, 0, sizeof(zstream));
+    zstream.zalloc = (alloc_func) Z_NULL;
+    zstream.zfree = (free_func) Z_NULL;
+    zstream.opaque = (voidpf) Z_NULL;
+    zerr = inflateInit2(&zstream, -15);         // raw deflate
+    if (zerr != Z_OK) {
+        LOGI("  GFDGzip: inflateInit2 failed (zerr=%d)", zerr);
+        dierr = kDIErrInternal;
+        goto bail;
+    }
+    zInit = true;
+
+    /* position the input, feeding in any partial byte */
+    dierr = fpGFD->Seek(pPoint->in - (pPoint->bits ? 1 : 0), kSeekSet);
+    if (dierr != kDIErrNone)
+        goto bail;
+    if (pPoint->bits != 0) {
+        uint8_t partial;
+        dierr = fpGFD->Read(&partial, 1);
+        if (dierr != kDIErrNone)
+            goto bail;
+        inflatePrime(&zstream, pPoint->bits, partial >> (8 - pPoint->bits));
+    }
+    inflateSetDictionary(&zstream, pPoint->window, kWindowSize);
+
+    outPosn = pPoint->out;
+    while (outPosn < endPosn && outPosn < fLength) {
+        long curChunkNum = (long) (outPosn / kChunkSize);
+        CacheChunk* pChunk = NULL;
+        uint8_t* dst;
+        long want;
+
+        /*
+         * Output before the chunk we want, or for chunks that are already
+         * cached, gets thrown away.
+         */
+        if (curChunkNum < chunkNum || outPosn % kChunkSize != 0 ||
+            FindChunk(curChunkNum) != NULL)
+        {
+            dst = skipBuf;
+            want = kChunkSize - (long) (outPosn % kChunkSize);
+        } else {
+            pChunk = GetFreeChunk();
+            if (pChunk == NULL) {
+                dierr = kDIErrMalloc;
+                goto bail;
+            }
+            dst = pChunk->data;
+            want = kChunkSize;
+        }
+        if (want > fLength - outPosn)
+            want = (long) (fLength - outPosn);
+
+        zstream.next_out = dst;
+        zstream.avail_out = want;
+        while (zstream.avail_out != 0) {
+            if (zstream.avail_in == 0) {
+                size_t actual;
+                dierr = fpGFD->Read(inBuf, kInputBufSize, &actual);
+                if (dierr == kDIErrEOF)
+                    dierr = kDIErrBadCompressedData;
+                if (dierr != kDIErrNone)
+                    goto bail;
+                zstream.next_in = inBuf;
+                zstream.avail_in = (uInt) actual;
+            }
+            zerr = inflate(&zstream, Z_NO_FLUSH);
+            if (zerr == Z_STREAM_END && zstream.avail_out != 0) {
+                LOGI("  GFDGzip: stream ended early");
+                dierr = kDIErrBadCompressedData;
+                goto bail;
+            }
+            if (zerr != Z_OK && zerr != Z_STREAM_END) {
+                LOGI("  GFDGzip: inflate failed (zerr=%d)", zerr);
+                dierr = kDIErrBadCompressedData;
+                goto bail;
+            }
+        }
+
+        if (pChunk != NULL) {
+            pChunk->chunkNum = curChunkNum;
+            pChunk->length = want;
+            if (curChunkNum == chunkNum)
+                *ppChunk = pChunk;
+        }
+        outPosn += want;
+    }
+
+    if (*ppChunk == NULL) {
+        LOGW("  GFDGzip: chunk %ld wasn't expanded", chunkNum);
+        dierr = kDIErrInternal;
+    }
+
+bail:
+    if (zInit)
+        inflateEnd(&zstream);
+    delete[] inBuf;
+    delete[] skipBuf;
+    return dierr;
+}
+
+DIError GFDGzip::Read(void* buf, size_t length, size_t* pActual)
+{
+    DIError dierr;
+
+    if (fpGFD == NULL)
+        return kDIErrNotReady;
+    if (length == 0)
+        return kDIErrInvalidArg;
+
+    if (fCurrentOffset + (long)length > fLength) {
+        if (pActual == NULL) {
+            LOGW("  GFDGzip underrrun off=%ld len=%lu flen=%ld",
+                (long) fCurrentOffset, (unsigned long) length, (long) fLength);
+            return kDIErrDataUnderrun;
+        } else {
+            /* set *pActual and adjust "length" */
+            assert(fLength >= fCurrentOffset);
+            length = (size_t) (fLength - fCurrentOffset);
+            *pActual = length;
+
+            if (length == 0)
+                return kDIErrEOF;
+        }
+    }
+    if (pActual != NULL)
+        *pActual = length;
+
+    while (length != 0) {
+        long chunkNum = (long) (fCurrentOffset / kChunkSize);
+        long chunkOffset = (long) (fCurrentOffset % kChunkSize);
+        CacheChunk* pChunk;
+        size_t copyLen;
+
+        pChunk = FindChunk(chunkNum);
+        if (pChunk == NULL) {
+            dierr = ExpandChunk(chunkNum, &pChunk);
+            if (dierr != kDIErrNone)
+                return dierr;
+        }
+        pChunk->lastUse = ++fUseCounter;
+
+        copyLen = pChunk->length - chunkOffset;
+        if (copyLen > length)
+            copyLen = length;
+        memcpy(buf, pChunk->data + chunkOffset, copyLen);
+        buf = (uint8_t*) buf + copyLen;
+        length -= copyLen;
+        fCurrentOffset += copyLen;
+    }
+
+    return kDIErrNone;
+}
+
+DIError GFDGzip::Seek(di_off_t offset, DIWhence whence)
+{
+    if (fpGFD == NULL)
+        return kDIErrNotReady;
+
+    switch (whence) {
+    case kSeekSet:
+        if (offset < 0 || offset >= fLength)
+            return kDIErrInvalidArg;
+        fCurrentOffset = offset;
+        break;
+    case kSeekEnd:
+        if (offset > 0 || offset < -fLength)
+            return kDIErrInvalidArg;
+        fCurrentOffset = fLength + offset;
+        break;
+    case kSeekCur:
+        if (offset < -fCurrentOffset ||
+            offset >= (fLength - fCurrentOffset))
+        {
+            return kDIErrInvalidArg;
+        }
+        fCurrentOffset += offset;
+        break;
+    default:
+        assert(false);
+        return kDIErrInvalidArg;
+    }
+
+    assert(fCurrentOffset >= 0 && fCurrentOffset <= fLength);
+    return kDIErrNone;
+}
+
+di_off_t GFDGzip::Tell(void)
+{
+    if (fpGFD == NULL)
+        return (di_off_t) -1;
+    return fCurrentOffset;
+}
+
+DIError GFDGzip::Close(void)
+{
+    int i;
+
+    if (fpGFD == NULL)
+        return kDIErrNone;
+
+    LOGI("  GFDGzip closing");
+    delete[] fPoints;
+    fPoints = NULL;
+    fNumPoints = fAllocPoints = 0;
+    for (i = 0; i < kNumCacheChunks; i++) {
+        delete[] fCache[i].data;
+        fCache[i].data = NULL;
+        fCache[i].chunkNum = -1;
+    }
+    fpGFD = NULL;       // do NOT close underlying descriptor
+
+    return kDIErrNone;
+}
+
+
 #ifdef _WIN32
 /*
  * ===========================================================================
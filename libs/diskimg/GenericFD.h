@@ -93,6 +93,8 @@ private:
  * disallow seeking past the current EOF of a file.  When writing a file this
  * can be very useful, so someday we should implement it for all classes.
  */
+class GFDGFD;
+
 class GenericFD {
 public:
     GenericFD(void) : fReadOnly(true) {}
@@ -115,8 +117,28 @@ public:
     // Utility functions.
     virtual DIError Rewind(void) { return Seek(0, kSeekSet); }
 
+    // Write "length" zero bytes at the current position, leaving the
+    // position just past them.  The default implementation writes them
+    // out; file-backed GFDs can punch holes or extend a sparse file.
+    virtual DIError WriteZeroes(di_off_t length);
+
+    // Find the first span in [offset, limit) that might hold nonzero
+    // data.  Everything in [offset, *pStart) reads as zeroes, and
+    // *pStart == limit means the whole range does.  The default reports
+    // the whole range as data.  Doesn't change the file position.
+    virtual DIError FindData(di_off_t offset, di_off_t limit,
+        di_off_t* pStart, di_off_t* pEnd)
+    {
+        *pStart = offset;
+        *pEnd = limit;
+        return kDIErrNone;
+    }
+
     virtual bool GetReadOnly(void) const { return fReadOnly; }
 
+    // Returns "this" if the object is a GFDGFD, NULL otherwise.
+    virtual GFDGFD* AsGFDGFD(void) { return NULL; }
+
     /*
     typedef enum {
         kGFDTypeUnknown = 0,
@@ -161,6 +183,11 @@ public:
     virtual DIError Truncate(void);
     virtual DIError Close(void);
     virtual const char* GetPathName(void) const { return fPathName; }
+#ifdef HAVE_FSEEKO
+    virtual DIError WriteZeroes(di_off_t length);
+    virtual DIError FindData(di_off_t offset, di_off_t limit,
+        di_off_t* pStart, di_off_t* pEnd);
+#endif
 
 private:
     char*       fPathName;
@@ -213,10 +240,19 @@ public:
     //
     // "doExpand" will cause writing past the end of the buffer to
     // reallocate the buffer.  Again, for internally-allocated storage
-    // only.  We expect the initial size to be close to accurate, so we
-    // don't aggressively expand the buffer.
+    // only.  The allocation grows geometrically, so a long series of
+    // small appends is linear overall; use Reserve() if you have a
+    // better idea of the final size.
     virtual DIError Open(void* buffer, di_off_t length, bool doDelete,
         bool doExpand, bool readOnly);
+    // Take ownership of "buffer", which was allocated with new[] and
+    // holds "allocLength" bytes, of which the first "length" are valid.
+    // Anything past "length" is used for expansion before we realloc.
+    DIError Adopt(void* buffer, di_off_t length, di_off_t allocLength,
+        bool doExpand, bool readOnly);
+    // Make sure there's room for "length" bytes without reallocating.
+    // This is only a hint; it fails if the buffer can't expand.
+    DIError Reserve(di_off_t length);
     virtual DIError Read(void* buf, size_t length,
         size_t* pActual = NULL);
     virtual DIError Write(const void* buf, size_t length,
@@ -234,7 +270,12 @@ public:
     void* GetBuffer(void) const { return fBuffer; }
 
 private:
-    enum { kMaxReasonableSize = 256 * 1024 * 1024 };
+    enum {
+        kMaxReasonableSize = 256 * 1024 * 1024,
+        kMinGrowth = 8 * 1024,
+    };
+    DIError Resize(long newAllocLength);
+
     void*       fBuffer;
     long        fLength;        // these sit in memory, so there's no
     long        fAllocLength;   //  value in using di_off_t here
@@ -243,6 +284,245 @@ private:
     di_off_t    fCurrentOffset; // actually limited to (long)
 };
 
+/*
+ * Read-only access to the contents of a gzip file, without expanding the
+ * whole thing into memory.
+ *
+ * When opened we make one pass through the compressed data and record a
+ * checkpoint every kIndexSpan bytes or so (the approach used by "zran.c"
+ * in the zlib examples).  Each checkpoint holds the position in the input
+ * and the last 32K of output, which is everything inflate needs to start
+ * up again from there.  Reads are satisfied from a small cache of
+ * kChunkSize pieces, which are expanded on demand from the nearest
+ * checkpoint.
+ *
+ * The index can optionally be saved to, and later loaded from, a file.
+ *
+ * "pGFD" is used to read the compressed data, and must remain open until
+ * this is closed.
+ */
+class GFDGzip : public GenericFD {
+public:
+    GFDGzip(void) : fpGFD(NULL), fPoints(NULL), fNumPoints(0),
+        fAllocPoints(0), fLength(0), fCurrentOffset(0), fUseCounter(0)
+    {
+        memset(fCache, 0, sizeof(fCache));
+    }
+    virtual ~GFDGzip(void) { Close(); }
+
+    // "outerLength" is the length of the gzip file; "indexPath" may be NULL.
+    DIError Open(GenericFD* pGFD, di_off_t outerLength, long maxLength,
+        const char* indexPath);
+    virtual DIError Read(void* buf, size_t length,
+        size_t* pActual = NULL);
+    virtual DIError Write(const void* buf, size_t length,
+        size_t* pActual = NULL)
+    {
+        return kDIErrAccessDenied;
+    }
+    virtual DIError Seek(di_off_t offset, DIWhence whence);
+    virtual di_off_t Tell(void);
+    virtual DIError Truncate(void) { return kDIErrAccessDenied; }
+    virtual DIError Close(void);
+    virtual const char* GetPathName(void) const { return NULL; }
+
+    di_off_t GetLength(void) const { return fLength; }
+
+private:
+    enum {
+        kWindowSize = 32768,            // inflate history size
+        kIndexSpan = 256 * 1024,        // output bytes between checkpoints
+        kChunkSize = 64 * 1024,         // unit of caching
+        kNumCacheChunks = 32,
+        kReadAheadChunks = 8,           // must be well under kNumCacheChunks
+        kIndexFileVersion = 1,
+    };
+
+    static const char kIndexFileMagic[8];
+
+    /* inflate checkpoint */
+    typedef struct IndexPoint {
+        di_off_t    out;                // offset in the uncompressed data
+        di_off_t    in;                 // offset in the gzip file
+        int         bits;               // #of bits from the byte at in-1
+        uint8_t     window[kWindowSize];
+    } IndexPoint;
+
+    /* one cached piece of uncompressed data */
+    typedef struct CacheChunk {
+        long        chunkNum;           // -1 if unused
+        long        length;             // less than kChunkSize at EOF
+        uint32_t    lastUse;
+        uint8_t*    data;
+    } CacheChunk;
+
+    DIError BuildIndex(di_off_t outerLength, long maxLength);
+    DIError AddPoint(int bits, di_off_t in, di_off_t out, unsigned int left,
+        const uint8_t* window);
+    DIError LoadIndex(const char* indexPath, di_off_t outerLength,
+        uint32_t trailerCRC, uint32_t trailerSize);
+    void SaveIndex(const char* indexPath, di_off_t outerLength,
+        uint32_t trailerCRC, uint32_t trailerSize);
+    DIError ExpandChunk(long chunkNum, CacheChunk** ppChunk);
+    CacheChunk* FindChunk(long chunkNum);
+    CacheChunk* GetFreeChunk(void);
+
+    GenericFD*  fpGFD;
+    IndexPoint* fPoints;
+    int         fNumPoints;
+    int         fAllocPoints;
+    di_off_t    fLength;
+    di_off_t    fCurrentOffset;
+    uint32_t    fUseCounter;
+    CacheChunk  fCache[kNumCacheChunks];
+};
+
+/*
+ * Read-only access to the disk image thread in a NuFX archive, expanding
+ * ShrinkIt LZW/1 or LZW/2 data a 4K chunk at a time as it's needed.
+ *
+ * LZW/1 and LZW/2 compress each 4K "track" separately, but there's no
+ * directory of chunks, and LZW/2 carries its string table from one chunk
+ * to the next until the table fills up and is cleared.  So we walk the
+ * compressed thread front to back the first time each chunk is touched,
+ * recording where every chunk starts and the most recent point where
+ * the LZW table was empty.  After that any chunk can be expanded again
+ * by starting from its reset point.  Expanded chunks are kept in a small
+ * LRU cache.
+ *
+ * The archive file is opened separately (read-only) from NufxLib's handle.
+ *
+ * Implemented in ShrinkIt.cpp.
+ */
+class GFDNuFX : public GenericFD {
+public:
+    GFDNuFX(void) : fpGFD(NULL), fArchivePath(NULL), fChunks(NULL),
+        fNumChunks(0), fNumScanned(0), fNumDirty(0), fPendingChunks(NULL),
+        fpScanState(NULL), fBadCRC(false), fpRandState(NULL),
+        fCompBuf(NULL), fLength(0),
+        fCurrentOffset(0), fUseCounter(0)
+    {
+        memset(fCache, 0, sizeof(fCache));
+    }
+    virtual ~GFDNuFX(void) { Close(); }
+
+    // returns true if we know how to expand threads in this format
+    static bool IsFormatSupported(NuThreadFormat format) {
+        return format == kNuThreadFormatLZW1 || format == kNuThreadFormatLZW2;
+    }
+
+    // returns true if we can update threads in this format in place
+    static bool IsUpdateSupported(NuThreadFormat format) {
+        return format == kNuThreadFormatLZW1;
+    }
+
+    // "threadCRC" is checked if "checkThreadCRC" is set (v3+ records)
+    DIError Open(const char* archivePath, const NuThread* pThread,
+        bool checkThreadCRC, bool readOnly);
+    virtual DIError Read(void* buf, size_t length,
+        size_t* pActual = NULL);
+    virtual DIError Write(const void* buf, size_t length,
+        size_t* pActual = NULL);
+    virtual DIError Seek(di_off_t offset, DIWhence whence);
+    virtual di_off_t Tell(void);
+    virtual DIError Truncate(void) { return kDIErrAccessDenied; }
+    virtual DIError Close(void);
+    virtual const char* GetPathName(void) const { return NULL; }
+
+    di_off_t GetLength(void) const { return fLength; }
+
+    /*
+     * Rewriting the archive is a three-step dance.  BuildUpdate creates
+     * the new compressed thread (which the caller hands to NufxLib) and
+     * lets go of the archive file.  Once NufxLib has written the new
+     * archive, FinishUpdate points us at the new thread; if it fails,
+     * CancelUpdate goes back to the old one.
+     */
+    DIError BuildUpdate(uint8_t** pBuf, long* pLen, uint16_t* pThreadCRC);
+    DIError FinishUpdate(const NuThread* pThread);
+    DIError CancelUpdate(void);
+
+    struct LZWState;        // expansion state, defined in ShrinkIt.cpp
+    struct LZWCompState;    // LZW/1 compression state, ditto
+
+private:
+    enum {
+        kChunkSize = 4096,              // ShrinkIt "track" size
+        kNumCacheChunks = 64,
+        kMaxChunkCompLen = kChunkSize + 4,  // largest chunk incl. header
+        kCompBufPad = 64,               // LZW reads a little past the end
+    };
+
+    /* where expansion can begin with an empty LZW table */
+    typedef struct ResetPoint {
+        long        chunkNum;           // chunk that holds the reset
+        long        compOffset;         // first code after table clear, or
+                                        //  -1 for the start of the chunk
+        int         atBit;              // bit position within prev byte
+        long        outOffset;          // LZW output produced before it
+    } ResetPoint;
+
+    typedef struct ChunkInfo {
+        long        compOffset;         // chunk header, from thread start
+        long        compLen;            // header plus data
+        ResetPoint  reset;              // where to start expanding
+        int         cacheSlot;          // index into fCache, or -1
+        uint16_t    crc;                // CRC-16 (seed 0) of all 4K
+        uint8_t*    dirty;              // modified data, or NULL
+    } ChunkInfo;
+
+    typedef struct CacheChunk {
+        long        chunkNum;           // -1 if unused
+        uint32_t    lastUse;
+        uint8_t*    data;
+    } CacheChunk;
+
+    DIError ScanNextChunk(void);
+    DIError ExpandChunk(long chunkNum);
+    DIError DecodeChunk(LZWState* pState, long chunkNum,
+        const ResetPoint* pStart, uint8_t* outBuf, long* pCompLen,
+        ResetPoint* pLastClear);
+    uint8_t* GetCacheData(long chunkNum);
+    uint8_t* AddToCache(long chunkNum);
+    uint8_t* GetChunkData(long chunkNum, DIError* pErr);
+    long WriteLen(long chunkNum) const {
+        if ((di_off_t) (chunkNum + 1) * kChunkSize > fLength)
+            return (long) (fLength - (di_off_t) chunkNum * kChunkSize);
+        return kChunkSize;
+    }
+
+    GFDFile*    fpGFD;
+    char*       fArchivePath;
+    di_off_t    fThreadOffset;          // file offset of thread data
+    long        fThreadCompLen;         // thThreadCompEOF
+    NuThreadFormat fFormat;
+    uint16_t    fThreadCRC;
+    bool        fCheckThreadCRC;
+    uint16_t    fStreamCRC;             // LZW/1 CRC from stream header
+    uint8_t     fRLEEscape;
+    long        fDataStart;             // offset of first chunk header
+
+    ChunkInfo*  fChunks;
+    long        fNumChunks;
+    long        fNumScanned;            // chunks with known offsets
+    long        fNumDirty;              // chunks with non-NULL "dirty"
+    ChunkInfo*  fPendingChunks;         // layout of BuildUpdate's output
+    long        fPendingCompLen;
+    uint16_t    fPendingStreamCRC;
+    LZWState*   fpScanState;            // state at end of last scanned chunk
+    ResetPoint  fScanLastClear;         // most recent reset seen by scan
+    uint16_t    fScanStreamCRC;         // running LZW/1 stream CRC
+    uint16_t    fScanThreadCRC;         // running thread CRC
+    bool        fBadCRC;                // scan hit a CRC mismatch
+    LZWState*   fpRandState;            // for re-expanding chunks
+    uint8_t*    fCompBuf;
+
+    di_off_t    fLength;
+    di_off_t    fCurrentOffset;
+    uint32_t    fUseCounter;
+    CacheChunk  fCache[kNumCacheChunks];
+};
+
 #if 0
 class GFDEmbedded : public GenericFD {
 public:
@@ -267,16 +547,32 @@ private:
 /* pass all requests straight through to another GFD (with offset bias) */
 class GFDGFD : public GenericFD {
 public:
-    GFDGFD(void) : fpGFD(NULL), fOffset(0) {}
+    GFDGFD(void) : fpGFD(NULL), fOffset(0), fpParent(NULL), fParentOffset(0),
+        fDirtyStart(0), fDirtyEnd(0)
+        {}
     virtual ~GFDGFD(void) { Close(); }
 
+    /*
+     * If "pGFD" is itself a GFDGFD (e.g. a volume nested inside a
+     * partition), we go straight to the GFD at the bottom of the chain,
+     * so every I/O is one call no matter how deep the nesting goes.  The
+     * GFDGFDs we skip over still hear about writes, so their dirty
+     * ranges stay correct.  "pGFD" must stay open while we're open.
+     */
     virtual DIError Open(GenericFD* pGFD, di_off_t offset, bool readOnly) {
         if (pGFD == NULL)
             return kDIErrInvalidArg;
         if (!readOnly && pGFD->GetReadOnly())
             return kDIErrAccessDenied;          // can't convert to read-write
-        fpGFD = pGFD;
-        fOffset = offset;
+        fpParent = pGFD->AsGFDGFD();
+        fParentOffset = offset;
+        if (fpParent != NULL) {
+            fpGFD = fpParent->fpGFD;
+            fOffset = fpParent->fOffset + offset;
+        } else {
+            fpGFD = pGFD;
+            fOffset = offset;
+        }
         fReadOnly = readOnly;
         Seek(0, kSeekSet);
         return kDIErrNone;
@@ -289,7 +585,33 @@ public:
     virtual DIError Write(const void* buf, size_t length,
         size_t* pActual = NULL)
     {
-        return fpGFD->Write(buf, length, pActual);
+        DIError dierr = fpGFD->Write(buf, length, pActual);
+        size_t written;
+        if (pActual != NULL)
+            written = *pActual;
+        else
+            written = (dierr == kDIErrNone) ? length : 0;
+        if (written != 0) {
+            di_off_t end = Tell();
+            NoteWrite(end - written, end);
+        }
+        return dierr;
+    }
+    virtual DIError WriteZeroes(di_off_t length) {
+        di_off_t start = Tell();
+        DIError dierr = fpGFD->WriteZeroes(length);
+        if (dierr == kDIErrNone && length != 0)
+            NoteWrite(start, start + length);
+        return dierr;
+    }
+    virtual DIError FindData(di_off_t offset, di_off_t limit,
+        di_off_t* pStart, di_off_t* pEnd)
+    {
+        DIError dierr = fpGFD->FindData(offset + fOffset, limit + fOffset,
+                            pStart, pEnd);
+        *pStart -= fOffset;
+        *pEnd -= fOffset;
+        return dierr;
     }
     virtual DIError Seek(di_off_t offset, DIWhence whence) {
         return fpGFD->Seek(offset + fOffset, whence);
@@ -303,13 +625,57 @@ public:
     virtual DIError Close(void) {
         /* do NOT close underlying descriptor */
         fpGFD = NULL;
+        fpParent = NULL;
         return kDIErrNone;
     }
     virtual const char* GetPathName(void) const { return fpGFD->GetPathName(); }
+    virtual GFDGFD* AsGFDGFD(void) { return this; }
+
+    /*
+     * Get the span of offsets [start, end) touched by Write() since the
+     * last call to ClearDirtyRange().  Returns false if nothing has been
+     * written.  Wrappers use this to avoid rescanning the whole image.
+     */
+    bool GetDirtyRange(di_off_t* pStart, di_off_t* pEnd) const {
+        if (fDirtyStart == fDirtyEnd)
+            return false;
+        *pStart = fDirtyStart;
+        *pEnd = fDirtyEnd;
+        return true;
+    }
+    void ClearDirtyRange(void) { fDirtyStart = fDirtyEnd = 0; }
 
 private:
-    GenericFD*  fpGFD;
-    di_off_t    fOffset;
+    /* mark the range dirty here and in the GFDGFDs we sit on */
+    void NoteWrite(di_off_t start, di_off_t end) {
+        GFDGFD* pGFDGFD = this;
+        while (true) {
+            pGFDGFD->MarkDirty(start, end);
+            if (pGFDGFD->fpParent == NULL)
+                break;
+            start += pGFDGFD->fParentOffset;
+            end += pGFDGFD->fParentOffset;
+            pGFDGFD = pGFDGFD->fpParent;
+        }
+    }
+    void MarkDirty(di_off_t start, di_off_t end) {
+        if (fDirtyStart == fDirtyEnd) {
+            fDirtyStart = start;
+            fDirtyEnd = end;
+        } else {
+            if (start < fDirtyStart)
+                fDirtyStart = start;
+            if (end > fDirtyEnd)
+                fDirtyEnd = end;
+        }
+    }
+
+    GenericFD*  fpGFD;          // bottom of the chain, never a GFDGFD
+    di_off_t    fOffset;        // offset into fpGFD
+    GFDGFD*     fpParent;       // GFDGFD we were opened on, if any
+    di_off_t    fParentOffset;  // offset into fpParent
+    di_off_t    fDirtyStart;
+    di_off_t    fDirtyEnd;
 };
 
 };  // namespace DiskImgLib
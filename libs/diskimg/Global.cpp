@@ -140,6 +140,12 @@ const char* DiskImgLib::kASPIDev = "ASPI:";
  */
 /*static*/ Global::DebugMsgHandler Global::gDebugMsgHandler = NULL;
 
+/*
+ * Held while the handler runs, so messages logged from RunParallel workers
+ * reach it one at a time.
+ */
+static std::mutex gDebugMsgLock;
+
 /*
  * Change the debug message handler.  The previous handler is returned.
  */
@@ -157,6 +163,10 @@ Global::DebugMsgHandler Global::SetDebugMsgHandler(DebugMsgHandler handler)
  *
  * Even if _DEBUG_MSGS is disabled we can still get here from the NuFX error
  * handler.
+ *
+ * This may be called from several threads at once.  The message is
+ * formatted on our own stack, and the handler is only called by one
+ * thread at a time, so it doesn't need to do its own locking.
  */
 /*static*/ void Global::PrintDebugMsg(const char* file, int line, const char* fmt, ...)
 {
@@ -187,5 +197,6 @@ Global::DebugMsgHandler Global::SetDebugMsgHandler(DebugMsgHandler handler)
 
     buf[sizeof(buf)-1] = '\0';
 
+    std::lock_guard<std::mutex> lock(gDebugMsgLock);
     (*gDebugMsgHandler)(file, line, buf);
 }
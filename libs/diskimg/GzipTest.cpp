@@ -0,0 +1,228 @@
+/*
+ * CiderPress
+ * Copyright (C) 2026 by CiderPress authors.  All Rights Reserved.
+ * See the file LICENSE for distribution terms.
+ */
+/*
+ * Check for random access into gzip-compressed images.  Each sample image
+ * is compressed, opened read-only (which uses GFDGzip for anything big
+ * enough), read back a block at a time, and compared against the original.
+ *
+ * The samples are mostly zeroes, because deflate blocks over blank areas
+ * can cover megabytes, and that's where the chunk cache gets stressed.
+ *
+ * Build with "make gziptest" and run with "make check".  Not part of the
+ * library.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "DiskImg.h"
+#include "../nufxlib/NufxLib.h"
+#include "../zlib/zlib.h"
+
+using namespace DiskImgLib;
+
+static const char* kRawName = "GzipTest.tmp";
+static const char* kGzName = "GzipTest.tmp.gz";
+
+/* the library is chatty; set GZIPTEST_VERBOSE to see what it says */
+static void DebugMsgHandler(const char* file, int line, const char* msg)
+{
+    if (getenv("GZIPTEST_VERBOSE") != NULL)
+        fprintf(stderr, "%s:%d %s\n", file, line, msg);
+}
+
+/* NufxLib complains when the image format probe offers it something */
+static NuResult NufxErrorMsgHandler(NuArchive* /*pArchive*/, void* vErrorMessage)
+{
+    const NuErrorMessage* pErrorMessage = (const NuErrorMessage*) vErrorMessage;
+
+    if (getenv("GZIPTEST_VERBOSE") != NULL)
+        fprintf(stderr, "nufxlib: %s\n", pErrorMessage->message);
+    return kNuOK;
+}
+
+/*
+ * Simple LCG, so the "random" data is the same every time.
+ */
+static uint32_t gRandState = 1;
+static uint8_t NextRand(void)
+{
+    gRandState = gRandState * 1103515245 + 12345;
+    return (uint8_t) (gRandState >> 16);
+}
+
+/*
+ * Load "fileName" into a new buffer.  Returns NULL on failure.
+ */
+static uint8_t* LoadFile(const char* fileName, long* pLength)
+{
+    FILE* fp;
+    uint8_t* buf;
+    long length;
+
+    fp = fopen(fileName, "rb");
+    if (fp == NULL)
+        return NULL;
+    fseek(fp, 0, SEEK_END);
+    length = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    buf = new uint8_t[length];
+    if (fread(buf, 1, length, fp) != (size_t) length) {
+        delete[] buf;
+        buf = NULL;
+    }
+    fclose(fp);
+    *pLength = length;
+    return buf;
+}
+
+/*
+ * Compress "buf" into the test .gz file.
+ */
+static bool WriteGzip(const uint8_t* buf, long length)
+{
+    gzFile gzfp;
+    bool result;
+
+    gzfp = gzopen(kGzName, "wb");
+    if (gzfp == NULL)
+        return false;
+    result = (gzwrite(gzfp, buf, length) == length);
+    if (gzclose(gzfp) != Z_OK)
+        result = false;
+    return result;
+}
+
+/*
+ * Compress "diskBuf", open the result, and compare every block.  We read
+ * the first block before anything else, since that's what the format
+ * probe does and what used to push the wanted chunk out of the cache.
+ *
+ * Returns the number of blocks that didn't come back intact, or -1 if
+ * the image couldn't be written or opened.
+ */
+static int CheckImage(const char* label, const uint8_t* diskBuf, long length)
+{
+    DiskImg img;
+    DIError dierr;
+    uint8_t blkBuf[kBlockSize];
+    long numBlocks, block;
+    int bad;
+
+    remove(kGzName);
+    if (!WriteGzip(diskBuf, length)) {
+        printf("%s: unable to write %s\n", label, kGzName);
+        return -1;
+    }
+
+    dierr = img.OpenImage(kGzName, '/', true);
+    if (dierr == kDIErrNone)
+        dierr = img.AnalyzeImage();
+    if (dierr == kDIErrNone && img.GetFSFormat() == DiskImg::kFormatUnknown) {
+        dierr = img.OverrideFormat(DiskImg::kPhysicalFormatSectors,
+                    DiskImg::kFormatGenericProDOSOrd, DiskImg::kSectorOrderProDOS);
+    }
+    if (dierr != kDIErrNone) {
+        printf("%s: open failed: %s\n", label, DIStrError(dierr));
+        return -1;
+    }
+
+    numBlocks = img.GetNumBlocks();
+    if (numBlocks != length / kBlockSize) {
+        printf("%s: opened with %ld blocks, expected %ld\n", label,
+            numBlocks, length / kBlockSize);
+        img.CloseImage();
+        return -1;
+    }
+
+    bad = 0;
+    for (block = 0; block < numBlocks; block++) {
+        if (img.ReadBlock(block, blkBuf) != kDIErrNone ||
+            memcmp(blkBuf, diskBuf + block * kBlockSize, kBlockSize) != 0)
+        {
+            if (bad == 0)
+                printf("%s: block %ld differs\n", label, block);
+            bad++;
+        }
+    }
+
+    /* go back for a few scattered ones, now that the cache is full */
+    for (block = numBlocks - 1; block >= 0; block -= numBlocks / 7 + 1) {
+        if (img.ReadBlock(block, blkBuf) != kDIErrNone ||
+            memcmp(blkBuf, diskBuf + block * kBlockSize, kBlockSize) != 0)
+        {
+            if (bad == 0)
+                printf("%s: block %ld differs on re-read\n", label, block);
+            bad++;
+        }
+    }
+    img.CloseImage();
+
+    printf("%s: %s (%d bad blocks)\n", label, bad == 0 ? "OK" : "FAILED",
+        bad);
+    return bad;
+}
+
+/*
+ * Create a blank, formatted 65535-block ProDOS volume and load it.
+ */
+static uint8_t* MakeBlankProDOS(long* pLength)
+{
+    DiskImg img;
+    DIError dierr;
+
+    remove(kRawName);
+    dierr = img.CreateImage(kRawName, NULL, DiskImg::kOuterFormatNone,
+                DiskImg::kFileFormatUnadorned, DiskImg::kPhysicalFormatSectors,
+                NULL, DiskImg::kSectorOrderProDOS, DiskImg::kFormatGenericProDOSOrd,
+                65535, false);
+    if (dierr == kDIErrNone)
+        dierr = img.FormatImage(DiskImg::kFormatProDOS, "BLANK");
+    if (dierr != kDIErrNone) {
+        printf("unable to create ProDOS volume: %s\n", DIStrError(dierr));
+        img.CloseImage();
+        return NULL;
+    }
+    img.CloseImage();
+
+    return LoadFile(kRawName, pLength);
+}
+
+int main(void)
+{
+    uint8_t* diskBuf;
+    long length, i;
+    int failed = 0;
+
+    Global::SetDebugMsgHandler(DebugMsgHandler);
+    NuSetGlobalErrorMessageHandler(NufxErrorMsgHandler);
+    Global::AppInit();
+
+    /* 8MB, random for the first 64K and zero after that */
+    length = 8 * 1024 * 1024;
+    diskBuf = new uint8_t[length];
+    memset(diskBuf, 0, length);
+    for (i = 0; i < 65536; i++)
+        diskBuf[i] = NextRand();
+    if (CheckImage("random-then-zero", diskBuf, length) != 0)
+        failed++;
+    delete[] diskBuf;
+
+    /* a blank 32MB ProDOS volume */
+    diskBuf = MakeBlankProDOS(&length);
+    if (diskBuf == NULL || CheckImage("blank-prodos", diskBuf, length) != 0)
+        failed++;
+    delete[] diskBuf;
+
+    remove(kRawName);
+    remove(kGzName);
+    Global::AppCleanup();
+
+    if (failed != 0) {
+        printf("%d image(s) failed\n", failed);
+        return 1;
+    }
+    return 0;
+}
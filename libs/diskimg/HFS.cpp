@@ -1493,6 +1493,7 @@ DIError DiskFSHFS::RegeneratePathName(A2FileHFS* pFile)
 
     LOGI("Replacing '%s' with '%s'", pFile->GetPathName(), buf);
     pFile->SetPathName("", buf);
+    FilePathChanged(pFile);
     delete[] buf;
 
     return kDIErrNone;
@@ -1540,6 +1541,7 @@ DIError DiskFSHFS::RenameVolume(const char* newName)
     SetVolumeID();
     strcpy(pFile->fFileName, newName);
     pFile->SetPathName("", newName);
+    FilePathChanged(pFile);
 
 bail:
     delete[] oldNameColon;
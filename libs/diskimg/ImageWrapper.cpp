@@ -29,6 +29,9 @@
 #include "DiskImgPriv.h"
 #include "TwoImg.h"
 
+/* see DiskImg::SetNuFXLazyAccess() */
+bool DiskImgLib::gNuFXLazyAccess = true;
+
 
 /*
  * ===========================================================================
@@ -223,10 +226,13 @@ DIError Wrapper2MG::Flush(GenericFD* pWrapperGFD, GenericFD* pDataGFD,
  * Open a NuFX archive, and verify that it holds exactly one disk archive.
  *
  * On success, the NuArchive pointer and thread idx are set, and 0 is
- * returned.  Returns -1 on failure.
+ * returned.  Returns -1 on failure.  If "pThreadCopy" is non-NULL, it
+ * receives a copy of the disk image thread, and "*pThreadHasCRC" is set
+ * if the record format keeps a CRC of the uncompressed data in it.
  */
 /*static*/ DIError WrapperNuFX::OpenNuFX(const char* pathName, NuArchive** ppArchive,
-    NuThreadIdx* pThreadIdx, long* pLength, bool readOnly)
+    NuThreadIdx* pThreadIdx, long* pLength, bool readOnly,
+    NuThread* pThreadCopy, bool* pThreadHasCRC)
 {
     NuError nerr = kNuErrNone;
     NuArchive* pArchive = NULL;
@@ -308,6 +314,10 @@ DIError Wrapper2MG::Flush(GenericFD* pWrapperGFD, GenericFD* pDataGFD,
     }
     assert(pThread != NULL);
     *pThreadIdx = pThread->threadIdx;
+    if (pThreadCopy != NULL) {
+        *pThreadCopy = *pThread;
+        *pThreadHasCRC = (pRecord->recVersionNumber >= 3);
+    }
 
     /*
      * Don't allow zero-length disks.
@@ -425,7 +435,8 @@ bail:
         return kDIErrNotSupported;
     }
     LOGI("Testing for NuFX");
-    dierr = OpenNuFX(imagePath, &pArchive, &threadIdx, &length, true);
+    dierr = OpenNuFX(imagePath, &pArchive, &threadIdx, &length, true,
+                NULL, NULL);
     if (dierr != kDIErrNone)
         return dierr;
 
@@ -438,6 +449,10 @@ bail:
 
 /*
  * Open the archive, extract the disk image into a memory buffer.
+ *
+ * If the image is LZW-compressed, we expand pieces of it as they're
+ * needed instead (see GFDNuFX).  That only works for read-write opens
+ * if it's LZW/1, because then Flush can leave unmodified chunks alone.
  */
 DIError WrapperNuFX::Prep(GenericFD* pGFD, di_off_t wrappedLength, bool readOnly,
     di_off_t* pLength, DiskImg::PhysicalFormat* pPhysical,
@@ -446,7 +461,9 @@ DIError WrapperNuFX::Prep(GenericFD* pGFD, di_off_t wrappedLength, bool readOnly
 {
     DIError dierr = kDIErrNone;
     NuThreadIdx threadIdx;
-    GFDBuffer* pNewGFD = NULL;
+    NuThread thread;
+    bool threadHasCRC;
+    GenericFD* pNewGFD = NULL;
     char* buf = NULL;
     long length = -1;
     const char* imagePath;
@@ -457,20 +474,40 @@ DIError WrapperNuFX::Prep(GenericFD* pGFD, di_off_t wrappedLength, bool readOnly
         return kDIErrNotSupported;
     }
     pGFD->Close();      // don't hold the file open
-    dierr = OpenNuFX(imagePath, &fpArchive, &threadIdx, &length, readOnly);
+    dierr = OpenNuFX(imagePath, &fpArchive, &threadIdx, &length, readOnly,
+                &thread, &threadHasCRC);
     if (dierr != kDIErrNone)
         goto bail;
 
+    if (gNuFXLazyAccess &&
+        (readOnly ? GFDNuFX::IsFormatSupported(thread.thThreadFormat) :
+                    GFDNuFX::IsUpdateSupported(thread.thThreadFormat)))
+    {
+        GFDNuFX* pNuFXGFD = new GFDNuFX;
+        dierr = pNuFXGFD->Open(imagePath, &thread, threadHasCRC, readOnly);
+        if (dierr == kDIErrNone) {
+            pNewGFD = pNuFXGFD;
+            fUpdateChunks = !readOnly;
+            goto opened;
+        }
+        LOGI(" NuFX lazy open failed (err=%d), extracting instead", dierr);
+        delete pNuFXGFD;
+        dierr = kDIErrNone;
+    }
+
     dierr = GetNuFXDiskImage(fpArchive, threadIdx, length, &buf);
     if (dierr != kDIErrNone)
         goto bail;
 
-    pNewGFD = new GFDBuffer;
-    dierr = pNewGFD->Open(buf, length, true, false, readOnly);
+    GFDBuffer* pBufferGFD;
+    pBufferGFD = new GFDBuffer;
+    pNewGFD = pBufferGFD;
+    dierr = pBufferGFD->Open(buf, length, true, false, readOnly);
     if (dierr != kDIErrNone)
         goto bail;
     buf = NULL;      // now owned by pNewGFD;
 
+opened:
     /*
      * Success!
      */
@@ -630,9 +667,40 @@ DIError WrapperNuFX::CloseNuFX(void)
     return kDIErrNone;
 }
 
+/*
+ * Find thread "threadIdx" in record "recordIdx".
+ */
+DIError WrapperNuFX::FindNewThread(NuRecordIdx recordIdx,
+    NuThreadIdx threadIdx, const NuThread** ppThread)
+{
+    const NuRecord* pRecord;
+    const NuThread* pThread;
+    NuError nerr;
+    int idx;
+
+    nerr = NuGetRecord(fpArchive, recordIdx, &pRecord);
+    if (nerr != kNuErrNone) {
+        LOGI(" NuFX unable to get new record (err=%d)", nerr);
+        return kDIErrGeneric;
+    }
+    for (idx = 0; idx < (int)NuRecordGetNumThreads(pRecord); idx++) {
+        pThread = NuGetThread(pRecord, idx);
+        if (pThread->threadIdx == threadIdx) {
+            *ppThread = pThread;
+            return kDIErrNone;
+        }
+    }
+    LOGI(" NuFX new thread %d not found", threadIdx);
+    return kDIErrGeneric;
+}
+
 /*
  * Write the data using the default compression method.
  *
+ * If the data GFD is a GFDNuFX we opened read-write, we keep the thread
+ * in LZW/1 and have the GFD build it: only the chunks that were modified
+ * get recompressed.  This ignores the compression type.
+ *
  * Doesn't touch "pWrapperGFD" or "pWrappedLen".  Could probably update
  * "pWrappedLen", but that's really only useful if we have a gzip Outer
  * that wants to know how much data we have.  Because we don't write to
@@ -642,11 +710,30 @@ DIError WrapperNuFX::CloseNuFX(void)
 DIError WrapperNuFX::Flush(GenericFD* pWrapperGFD, GenericFD* pDataGFD,
     di_off_t dataLen, di_off_t* pWrappedLen)
 {
+    DIError dierr = kDIErrNone;
     NuError nerr = kNuErrNone;
     NuFileDetails fileDetails;
     NuRecordIdx recordIdx;
     NuThreadIdx threadIdx;
     NuDataSource* pDataSource = NULL;
+    GFDNuFX* pNuFXGFD = NULL;
+    uint8_t* compBuf = NULL;
+    long compLen;
+    uint16_t threadCRC;
+
+    if (fUpdateChunks) {
+        /*
+         * Do this before touching the archive.  On success, the GFD has
+         * closed its copy of the archive file, so we have to call Finish
+         * or Cancel before leaving.
+         */
+        pNuFXGFD = (GFDNuFX*) pDataGFD;
+        dierr = pNuFXGFD->BuildUpdate(&compBuf, &compLen, &threadCRC);
+        if (dierr != kDIErrNone) {
+            LOGI(" NuFX unable to build updated thread (err=%d)", dierr);
+            return dierr;
+        }
+    }
 
     if (fThreadIdx != 0) {
         /*
@@ -666,9 +753,11 @@ DIError WrapperNuFX::Flush(GenericFD* pWrapperGFD, GenericFD* pDataGFD,
 
     assert((dataLen % 512) == 0);
 
-    nerr = NuSetValue(fpArchive, kNuValueDataCompression,
-                fCompressType + kNuCompressNone);
-    if (nerr != kNuErrNone) {
+    if (pNuFXGFD != NULL) {
+        /* already compressed */
+    } else if ((nerr = NuSetValue(fpArchive, kNuValueDataCompression,
+                fCompressType + kNuCompressNone)) != kNuErrNone)
+    {
         LOGI("WARNING: unable to set compression to format %d",
             fCompressType);
         nerr = kNuErrNone;
@@ -714,9 +803,16 @@ DIError WrapperNuFX::Flush(GenericFD* pWrapperGFD, GenericFD* pDataGFD,
      * a somewhat unwholesome manner.  However, there's no other way to
      * feed the data into NufxLib.
      */
-    nerr = NuCreateDataSourceForBuffer(kNuThreadFormatUncompressed, 0,
-            (const uint8_t*) ((GFDBuffer*) pDataGFD)->GetBuffer(),
-            0, (long) dataLen, NULL, &pDataSource);
+    if (pNuFXGFD != NULL) {
+        nerr = NuCreateDataSourceForBuffer(kNuThreadFormatLZW1,
+                (uint32_t) dataLen, compBuf, 0, compLen, NULL, &pDataSource);
+        if (nerr == kNuErrNone)
+            nerr = NuDataSourceSetRawCrc(pDataSource, threadCRC);
+    } else {
+        nerr = NuCreateDataSourceForBuffer(kNuThreadFormatUncompressed, 0,
+                (const uint8_t*) ((GFDBuffer*) pDataGFD)->GetBuffer(),
+                0, (long) dataLen, NULL, &pDataSource);
+    }
     if (nerr != kNuErrNone) {
         LOGI(" NuFX unable to create NufxLib data source (nerr=%d)", nerr);
         goto bail;
@@ -748,11 +844,23 @@ DIError WrapperNuFX::Flush(GenericFD* pWrapperGFD, GenericFD* pDataGFD,
     /* update the threadID */
     fThreadIdx = threadIdx;
 
+    if (pNuFXGFD != NULL) {
+        const NuThread* pThread;
+
+        dierr = FindNewThread(recordIdx, threadIdx, &pThread);
+        if (dierr == kDIErrNone)
+            dierr = pNuFXGFD->FinishUpdate(pThread);
+        pNuFXGFD = NULL;
+    }
+
 bail:
     NuFreeDataSource(pDataSource);
+    if (pNuFXGFD != NULL)
+        (void) pNuFXGFD->CancelUpdate();
+    delete[] compBuf;
     if (nerr != kNuErrNone)
         return kDIErrGeneric;
-    return kDIErrNone;
+    return dierr;
 }
 
 /*
@@ -1041,6 +1149,8 @@ const int kDC42ChecksumOffset = 72;     // where the checksum lives
 const int kDC42DataOffset = 84;         // header is always this long
 const int kDC42PrivateMagic = 0x100;
 const int kDC42FakeTagLen = 19200;      // add a "fake" tag to match Mac
+const int kDC42BlockSize = 512;
+const int kDC42NumBlocks = 1600;        // 800K
 
 typedef struct DiskImgLib::DC42Header {
     char        diskName[kDC42NameLen+1];   // from pascal string
@@ -1189,41 +1299,74 @@ DIError WrapperDiskCopy42::WriteHeader(GenericFD* pGFD, const DC42Header* pHeade
 /*
  * Compute the funky DiskCopy checksum.
  *
- * Position "pGFD" at the start of data.
- */
-/*static*/ DIError WrapperDiskCopy42::ComputeChecksum(GenericFD* pGFD, uint32_t* pChecksum)
+ * Each 16-bit word is added in and the result rotated right.  The carry
+ * out of the high bit is lost, so the contributions of individual blocks
+ * can't be computed separately and combined.  What we can do is resume:
+ * if we know the running value at the start of a block, we only need to
+ * scan from there to the end.
+ *
+ * Position "pGFD" at the start of "startBlock".  If "blockChecksum" is
+ * non-NULL, it holds kDC42NumBlocks+1 entries, with the running value at
+ * the start of each block and the final result at the end.  Entries from
+ * "startBlock" on are updated.  Blocks at or past "cleanBlock" are known
+ * to be unchanged, so if the running value there matches what we had
+ * before, the rest of the result will too and we can stop early.  Pass
+ * kDC42NumBlocks to scan everything.
+ */
+/*static*/ DIError WrapperDiskCopy42::ComputeChecksum(GenericFD* pGFD,
+    int startBlock, int cleanBlock, uint32_t* blockChecksum,
+    uint32_t* pChecksum)
 {
     DIError dierr = kDIErrNone;
-    uint8_t buf[512];
-    long dataRem = 800 * 1024 /*pHeader->dataSize*/;
+    uint8_t buf[kDC42BlockSize * 16];
     uint32_t checksum;
+    int block;
 
-    assert(dataRem % sizeof(buf) == 0);
-    assert((sizeof(buf) & 0x01) == 0);  // we take it two bytes at a time
+    assert(startBlock >= 0 && startBlock <= kDC42NumBlocks);
+    assert(startBlock == 0 || blockChecksum != NULL);
+    assert(kDC42NumBlocks % (sizeof(buf) / kDC42BlockSize) == 0);
 
-    checksum = 0;
-    while (dataRem) {
-        int i;
+    checksum = (startBlock == 0) ? 0 : blockChecksum[startBlock];
+    block = startBlock;
+    while (block < kDC42NumBlocks) {
+        int chunkBlocks = sizeof(buf) / kDC42BlockSize;
+        int b, i;
+
+        if (chunkBlocks > kDC42NumBlocks - block)
+            chunkBlocks = kDC42NumBlocks - block;
 
-        dierr = pGFD->Read(buf, sizeof(buf));
+        dierr = pGFD->Read(buf, chunkBlocks * kDC42BlockSize);
         if (dierr != kDIErrNone) {
-            LOGI(" DC42 read failed, dataRem=%ld (err=%d)", dataRem, dierr);
+            LOGI(" DC42 read failed, block=%d (err=%d)", block, dierr);
             return dierr;
         }
 
-        for (i = 0; i < (int) sizeof(buf); i += 2) {
-            uint16_t val = GetShortBE(buf+i);
+        for (b = 0; b < chunkBlocks; b++, block++) {
+            const uint8_t* ptr = buf + b * kDC42BlockSize;
 
-            checksum += val;
-            if (checksum & 0x01)
-                checksum = checksum >> 1 | 0x80000000;
-            else
-                checksum = checksum >> 1;
-        }
+            if (blockChecksum != NULL) {
+                if (block >= cleanBlock && blockChecksum[block] == checksum) {
+                    LOGD(" DC42 checksum unchanged from block %d on", block);
+                    *pChecksum = blockChecksum[kDC42NumBlocks];
+                    return kDIErrNone;
+                }
+                blockChecksum[block] = checksum;
+            }
 
-        dataRem -= sizeof(buf);
+            for (i = 0; i < kDC42BlockSize; i += 2) {
+                uint16_t val = GetShortBE(ptr+i);
+
+                checksum += val;
+                if (checksum & 0x01)
+                    checksum = checksum >> 1 | 0x80000000;
+                else
+                    checksum = checksum >> 1;
+            }
+        }
     }
 
+    if (blockChecksum != NULL)
+        blockChecksum[kDC42NumBlocks] = checksum;
     *pChecksum = checksum;
 
     return dierr;
@@ -1247,9 +1390,18 @@ DIError WrapperDiskCopy42::Prep(GenericFD* pGFD, di_off_t wrappedLength,
 
     /*
      * Verify checksum.  File should already be seeked to appropriate place.
+     *
+     * If we're going to be writing, hang on to the running checksum at
+     * each block so Flush only has to rescan from the first changed block.
      */
     uint32_t checksum;
-    dierr = ComputeChecksum(pGFD, &checksum);
+    if (!readOnly) {
+        delete[] fBlockChecksum;
+        fBlockChecksum = new uint32_t[kDC42NumBlocks+1];
+        if (fBlockChecksum == NULL)
+            return kDIErrMalloc;
+    }
+    dierr = ComputeChecksum(pGFD, 0, kDC42NumBlocks, fBlockChecksum, &checksum);
     if (dierr != kDIErrNone)
         return dierr;
 
@@ -1295,6 +1447,24 @@ DIError WrapperDiskCopy42::Create(di_off_t length, DiskImg::PhysicalFormat physi
         return dierr;
     }
 
+    /* add the tag bytes; these never change, so Flush leaves them alone */
+    dierr = pWrapperGFD->Seek(kDC42DataOffset + length, kSeekSet);
+    if (dierr != kDIErrNone)
+        return dierr;
+    char* tmpBuf;
+    tmpBuf = new char[kDC42FakeTagLen];
+    if (tmpBuf == NULL)
+        return kDIErrMalloc;
+    memset(tmpBuf, 0, kDC42FakeTagLen);
+    dierr = pWrapperGFD->Write(tmpBuf, kDC42FakeTagLen, NULL);
+    delete[] tmpBuf;
+    if (dierr != kDIErrNone)
+        return dierr;
+
+    /* no block checksums yet; first Flush will scan the whole thing */
+    delete[] fBlockChecksum;
+    fBlockChecksum = NULL;
+
     *pWrappedLength = length + kDC42DataOffset;
     *pDataFD = new GFDGFD;
     return ((GFDGFD*)*pDataFD)->Open(pWrapperGFD, kDC42DataOffset, false);
@@ -1302,24 +1472,55 @@ DIError WrapperDiskCopy42::Create(di_off_t length, DiskImg::PhysicalFormat physi
 
 /*
  * We only use GFDGFD, so there's no data to write.  However, we do need
- * to update the checksum, and append our "fake" tag section.
+ * to update the checksum.  (The "fake" tag section was added by Create.)
+ *
+ * The GFDGFD keeps track of the range of data that has been written, so
+ * we only need to rescan from the first block in that range.
  */
 DIError WrapperDiskCopy42::Flush(GenericFD* pWrapperGFD, GenericFD* pDataGFD,
     di_off_t dataLen, di_off_t* pWrappedLen)
 {
     DIError dierr;
+    GFDGFD* pGFDGFD = (GFDGFD*) pDataGFD;
+    di_off_t dirtyStart, dirtyEnd;
+    int startBlock, cleanBlock;
     uint32_t checksum;
 
+    if (fBlockChecksum == NULL) {
+        /* newly-created image, scan it all */
+        fBlockChecksum = new uint32_t[kDC42NumBlocks+1];
+        if (fBlockChecksum == NULL)
+            return kDIErrMalloc;
+        startBlock = 0;
+        cleanBlock = kDC42NumBlocks;
+    } else if (pGFDGFD->GetDirtyRange(&dirtyStart, &dirtyEnd)) {
+        startBlock = (int) (dirtyStart / kDC42BlockSize);
+        cleanBlock = (int) ((dirtyEnd + kDC42BlockSize-1) / kDC42BlockSize);
+        if (startBlock > kDC42NumBlocks)
+            startBlock = kDC42NumBlocks;
+    } else {
+        LOGI(" DC42 no data changes, checksum unchanged");
+        return kDIErrNone;
+    }
+    LOGI(" DC42 updating checksum from block %d (changes end before %d)",
+        startBlock, cleanBlock);
+
     /* compute the data checksum */
-    dierr = pWrapperGFD->Seek(kDC42DataOffset, kSeekSet);
+    dierr = pWrapperGFD->Seek(kDC42DataOffset + startBlock * kDC42BlockSize,
+                kSeekSet);
     if (dierr != kDIErrNone)
         goto bail;
 
-    dierr = ComputeChecksum(pWrapperGFD, &checksum);
+    dierr = ComputeChecksum(pWrapperGFD, startBlock, cleanBlock,
+                fBlockChecksum, &checksum);
     if (dierr != kDIErrNone) {
         LOGI(" DC42 failed while computing checksum (err=%d)", dierr);
+        /* don't trust the partial results */
+        delete[] fBlockChecksum;
+        fBlockChecksum = NULL;
         goto bail;
     }
+    pGFDGFD->ClearDirtyRange();
 
     /* write it into the wrapper */
     dierr = pWrapperGFD->Seek(kDC42ChecksumOffset, kSeekSet);
@@ -1330,18 +1531,6 @@ DIError WrapperDiskCopy42::Flush(GenericFD* pWrapperGFD, GenericFD* pDataGFD,
     if (dierr != kDIErrNone)
         goto bail;
 
-    /* add the tag bytes */
-    dierr = pWrapperGFD->Seek(kDC42DataOffset + 800*1024, kSeekSet);
-    char* tmpBuf;
-    tmpBuf = new char[kDC42FakeTagLen];
-    if (tmpBuf == NULL)
-        return kDIErrMalloc;
-    memset(tmpBuf, 0, kDC42FakeTagLen);
-    dierr = pWrapperGFD->Write(tmpBuf, kDC42FakeTagLen, NULL);
-    delete[] tmpBuf;
-    if (dierr != kDIErrNone)
-        goto bail;
-
 bail:
     return dierr;
 }
@@ -2122,6 +2311,7 @@ DIError WrapperFDI::Unpack35(GenericFD* pGFD, GenericFD** ppNewGFD, int numCyls,
     DIError dierr = kDIErrNone;
     GFDBuffer* pNewGFD = NULL;
     uint8_t* buf = NULL;
+    uint8_t* blockBuf;
 
     pGFD->Rewind();
 
@@ -2139,6 +2329,7 @@ DIError WrapperFDI::Unpack35(GenericFD* pGFD, GenericFD** ppNewGFD, int numCyls,
     dierr = pNewGFD->Open(buf, 800 * 1024, true, false, false);
     if (dierr != kDIErrNone)
         goto bail;
+    blockBuf = buf;  // blocks are decoded straight into the GFD's storage
     buf = NULL;      // now owned by pNewGFD;
 
     *ppBadBlockMap = new LinearBitmap(1600);
@@ -2147,7 +2338,7 @@ DIError WrapperFDI::Unpack35(GenericFD* pGFD, GenericFD** ppNewGFD, int numCyls,
         goto bail;
     }
 
-    dierr = UnpackDisk35(pGFD, pNewGFD, numCyls, numHeads, *ppBadBlockMap);
+    dierr = UnpackDisk35(pGFD, blockBuf, numCyls, numHeads, *ppBadBlockMap);
     if (dierr != kDIErrNone)
         goto bail;
 
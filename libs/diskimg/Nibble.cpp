@@ -612,38 +612,210 @@ DIError DiskImg::SaveNibbleTrack(void)
 
 
 /*
- * Count up the number of readable sectors found on this track, and
+ * Load a nibble track into a private buffer and record every offset that
+ * could be the start of an address field for any of the NibbleDescrs in
+ * our table.  This is a single pass over the track; the per-descriptor
+ * checks are done later, by ScoreNibbleTrack, against the short list of
+ * candidates.
+ *
+ * The buffers in "pIndex" must be released with FreeNibbleTrackIndex,
+ * even on failure.
+ */
+DIError DiskImg::IndexNibbleTrack(int track, NibbleTrackIndex* pIndex)
+{
+    DIError dierr;
+    bool wantSecond[256];
+    uint8_t (*pairs)[2] = NULL;
+    int numPairs = 0;
+    int i, j;
+
+    assert(track >= 0 && track < kTrackCount525);
+
+    pIndex->track = track;
+    pIndex->trackLen = GetNibbleTrackLength(track);
+    pIndex->buf = NULL;
+    pIndex->addrPosn = NULL;
+    pIndex->numAddrPosn = 0;
+    assert(pIndex->trackLen > 0 && pIndex->trackLen <= kTrackAllocSize);
+
+    pIndex->buf = new uint8_t[pIndex->trackLen];
+    pIndex->addrPosn = new int[pIndex->trackLen];
+    if (pIndex->buf == NULL || pIndex->addrPosn == NULL)
+        return kDIErrMalloc;
+
+    dierr = CopyBytesOut(pIndex->buf, GetNibbleTrackOffset(track),
+                pIndex->trackLen);
+    if (dierr != kDIErrNone)
+        return dierr;
+
+    pairs = new uint8_t[fNumNibbleDescrEntries][2];
+    if (pairs == NULL)
+        return kDIErrMalloc;
+
+    /*
+     * Gather the distinct 2nd/3rd address prolog bytes.  The first byte
+     * is checked per-descriptor, because kNibbleSpecialSkipFirstAddrByte
+     * ignores it.
+     */
+    memset(wantSecond, 0, sizeof(wantSecond));
+    for (i = 0; i < fNumNibbleDescrEntries; i++) {
+        const NibbleDescr* pDescr = &fpNibbleDescrTable[i];
+        if (pDescr->numSectors == 0)
+            continue;
+        for (j = 0; j < numPairs; j++) {
+            if (pairs[j][0] == pDescr->addrProlog[1] &&
+                pairs[j][1] == pDescr->addrProlog[2])
+            {
+                break;
+            }
+        }
+        if (j == numPairs) {
+            pairs[numPairs][0] = pDescr->addrProlog[1];
+            pairs[numPairs][1] = pDescr->addrProlog[2];
+            numPairs++;
+            wantSecond[pDescr->addrProlog[1]] = true;
+        }
+    }
+
+    CircularBufferAccess buffer(pIndex->buf, pIndex->trackLen);
+    for (i = 0; i < pIndex->trackLen; i++) {
+        uint8_t second = buffer[i+1];
+        if (!wantSecond[second])
+            continue;
+        uint8_t third = buffer[i+2];
+        for (j = 0; j < numPairs; j++) {
+            if (pairs[j][0] == second && pairs[j][1] == third) {
+                pIndex->addrPosn[pIndex->numAddrPosn++] = i;
+                break;
+            }
+        }
+    }
+    delete[] pairs;
+
+    LOGI("   Indexed track %d: %d candidate address fields",
+        track, pIndex->numAddrPosn);
+    return kDIErrNone;
+}
+
+/*
+ * Release the buffers held by a NibbleTrackIndex.
+ */
+void DiskImg::FreeNibbleTrackIndex(NibbleTrackIndex* pIndex)
+{
+    delete[] pIndex->buf;
+    delete[] pIndex->addrPosn;
+    pIndex->buf = NULL;
+    pIndex->addrPosn = NULL;
+    pIndex->numAddrPosn = 0;
+}
+
+/*
+ * Count up the number of readable sectors found on an indexed track, and
  * return it.  If "pVol" is non-NULL, return the volume number from
  * one of the readable sectors.
+ *
+ * This must give exactly the same answer as calling FindNibbleSectorStart
+ * for every sector and decoding what it finds.  FindNibbleSectorStart
+ * returns the first offset that passes the checks for the requested
+ * sector, so we walk the candidates in track order once and keep the
+ * first hit for each sector.
  */
-int DiskImg::TestNibbleTrack(int track, const NibbleDescr* pNibbleDescr,
-    int* pVol)
+int DiskImg::ScoreNibbleTrack(const NibbleTrackIndex* pIndex,
+    const NibbleDescr* pNibbleDescr, int* pVol)
 {
-    long trackLen;
+    const int kMaxDataReach = 48;       // must match FindNibbleSectorStart
+    int sectorStart[16];
+    int sectorVol[16];
+    int track = pIndex->track;
+    int numSectors = pNibbleDescr->numSectors;
+    int numFound = 0;
     int count = 0;
+    int n, i, j;
 
-    assert(track >= 0 && track < kTrackCount525);
     assert(pNibbleDescr != NULL);
+    assert(numSectors > 0 && numSectors <= (int) NELEM(sectorStart));
+
+    for (i = 0; i < numSectors; i++)
+        sectorStart[i] = -1;
 
-    if (LoadNibbleTrack(track, &trackLen) != kDIErrNone) {
-        LOGI("   DI FindNibbleSectorStart: LoadNibbleTrack failed");
+    if (pIndex->buf == NULL) {
+        LOGI("   Track %d was not loaded", track);
         return 0;
     }
+    CircularBufferAccess buffer(pIndex->buf, pIndex->trackLen);
 
-    CircularBufferAccess buffer(fNibbleTrackBuf, trackLen);
+    for (n = 0; n < pIndex->numAddrPosn && numFound < numSectors; n++) {
+        i = pIndex->addrPosn[n];
+
+        if (buffer[i+1] != pNibbleDescr->addrProlog[1] ||
+            buffer[i+2] != pNibbleDescr->addrProlog[2])
+        {
+            continue;
+        }
+        if (pNibbleDescr->special != kNibbleSpecialSkipFirstAddrByte &&
+            buffer[i] != pNibbleDescr->addrProlog[0])
+        {
+            continue;
+        }
+
+        short hdrVol, hdrTrack, hdrSector, hdrChksum;
+        DecodeAddr(buffer, i+3, &hdrVol, &hdrTrack, &hdrSector, &hdrChksum);
+
+        if (pNibbleDescr->addrVerifyTrack && track != hdrTrack)
+            continue;
+        if (pNibbleDescr->addrVerifyChecksum) {
+            if ((pNibbleDescr->addrChecksumSeed ^
+                hdrVol ^ hdrTrack ^ hdrSector ^ hdrChksum) != 0)
+            {
+                continue;
+            }
+        }
 
-    int i, sectorIdx;
-    for (i = 0; i < pNibbleDescr->numSectors; i++) {
-        int vol;
-        sectorIdx = FindNibbleSectorStart(buffer, track, i, pNibbleDescr, &vol);
-        if (sectorIdx >= 0) {
-            if (pVol != NULL)
-                *pVol = vol;
-
-            uint8_t sctBuf[256];
-            if (DecodeNibbleData(buffer, sectorIdx, sctBuf, pNibbleDescr) == kDIErrNone)
-                count++;
+        i += 3;
+
+        for (j = 0; j < pNibbleDescr->addrEpilogVerifyCount; j++) {
+            if (buffer[i+8+j] != pNibbleDescr->addrEpilog[j])
+                break;
+        }
+        if (j != pNibbleDescr->addrEpilogVerifyCount)
+            continue;
+
+        if (pNibbleDescr->special == kNibbleSpecialMuse) {
+            if (track > 2) {
+                if ((hdrSector & 0x01) != 0)
+                    continue;
+                hdrSector /= 2;
+            }
         }
+
+        if (hdrSector < 0 || hdrSector >= numSectors ||
+            sectorStart[hdrSector] >= 0)
+        {
+            continue;
+        }
+
+        for (j = 0; j < kMaxDataReach; j++) {
+            if (buffer[i + j] == pNibbleDescr->dataProlog[0] &&
+                buffer[i + j +1] == pNibbleDescr->dataProlog[1] &&
+                buffer[i + j +2] == pNibbleDescr->dataProlog[2])
+            {
+                sectorStart[hdrSector] = buffer.Normalize(i + j + 3);
+                sectorVol[hdrSector] = hdrVol;
+                numFound++;
+                break;
+            }
+        }
+    }
+
+    for (i = 0; i < numSectors; i++) {
+        if (sectorStart[i] < 0)
+            continue;
+        if (pVol != NULL)
+            *pVol = sectorVol[i];
+
+        uint8_t sctBuf[256];
+        if (DecodeNibbleData(buffer, sectorStart[i], sctBuf, pNibbleDescr) == kDIErrNone)
+            count++;
     }
 
     LOGI("   Tests on track=%d with '%s' returning count=%d",
@@ -680,33 +852,72 @@ DIError DiskImg::AnalyzeNibbleData(void)
      * Try to read sectors from tracks 1, 16, 17, and 26.  If we can get
      * at least 13 out of 16 (or 10 out of 13) on three out of four tracks,
      * we have a winner.
+     *
+     * Each test track is read and indexed once, then every descriptor is
+     * scored against the index.  The results are walked in table order
+     * so the first descriptor to qualify still wins.  The volume number
+     * comes from track 17 of the most recent descriptor that found a
+     * sector there, which is what the original one-at-a-time loop did.
      */
-    int i, good, goodTracks;
+    static const int kTestTracks[] = { 1, 16, 17, 26 };
+    const int kVolTrackIdx = 2;
+    NibbleTrackIndex index[NELEM(kTestTracks)];
+    int* goodTracks = NULL;
+    int* trackVol = NULL;
+    DIError dierr = kDIErrNone;
+    int i, t, good;
     int protoVol = kVolumeNumNotSet;
 
+    goodTracks = new int[fNumNibbleDescrEntries];
+    trackVol = new int[fNumNibbleDescrEntries];
+    if (goodTracks == NULL || trackVol == NULL) {
+        delete[] goodTracks;
+        delete[] trackVol;
+        return kDIErrMalloc;
+    }
+    memset(index, 0, sizeof(index));
+
+    for (t = 0; t < (int) NELEM(kTestTracks); t++) {
+        dierr = IndexNibbleTrack(kTestTracks[t], &index[t]);
+        if (dierr != kDIErrNone) {
+            LOGI("   DI AnalyzeNibbleData: unable to index track %d",
+                kTestTracks[t]);
+            /* an unreadable track has no good sectors */
+            index[t].numAddrPosn = 0;
+            dierr = kDIErrNone;
+        }
+    }
+
     for (i = 0; i < fNumNibbleDescrEntries; i++) {
-        if (fpNibbleDescrTable[i].numSectors == 0) {
+        const NibbleDescr* pDescr = &fpNibbleDescrTable[i];
+
+        goodTracks[i] = 0;
+        trackVol[i] = kVolumeNumNotSet;
+        if (pDescr->numSectors == 0) {
             /* uninitialized "custom" entry */
-            LOGI("  Skipping '%s'", fpNibbleDescrTable[i].description);
+            LOGI("  Skipping '%s'", pDescr->description);
             continue;
         }
-        LOGI("  Trying '%s'", fpNibbleDescrTable[i].description);
-        goodTracks = 0;
-
-        good = TestNibbleTrack(1, &fpNibbleDescrTable[i], NULL);
-        if (good > fpNibbleDescrTable[i].numSectors - 4)
-            goodTracks++;
-        good = TestNibbleTrack(16, &fpNibbleDescrTable[i], NULL);
-        if (good > fpNibbleDescrTable[i].numSectors - 4)
-            goodTracks++;
-        good = TestNibbleTrack(17, &fpNibbleDescrTable[i], &protoVol);
-        if (good > fpNibbleDescrTable[i].numSectors - 4)
-            goodTracks++;
-        good = TestNibbleTrack(26, &fpNibbleDescrTable[i], NULL);
-        if (good > fpNibbleDescrTable[i].numSectors - 4)
-            goodTracks++;
-
-        if (goodTracks >= 3) {
+        LOGI("  Trying '%s'", pDescr->description);
+
+        for (t = 0; t < (int) NELEM(kTestTracks); t++) {
+            good = ScoreNibbleTrack(&index[t], pDescr,
+                        t == kVolTrackIdx ? &trackVol[i] : NULL);
+            if (good > pDescr->numSectors - 4)
+                goodTracks[i]++;
+        }
+    }
+
+    for (t = 0; t < (int) NELEM(kTestTracks); t++)
+        FreeNibbleTrackIndex(&index[t]);
+
+    for (i = 0; i < fNumNibbleDescrEntries; i++) {
+        if (fpNibbleDescrTable[i].numSectors == 0)
+            continue;
+        if (trackVol[i] != kVolumeNumNotSet)
+            protoVol = trackVol[i];
+
+        if (goodTracks[i] >= 3) {
             LOGI("  Looks like '%s' (%d-sector), vol=%d",
                 fpNibbleDescrTable[i].description,
                 fpNibbleDescrTable[i].numSectors, protoVol);
@@ -715,6 +926,9 @@ DIError DiskImg::AnalyzeNibbleData(void)
             break;
         }
     }
+    delete[] goodTracks;
+    delete[] trackVol;
+
     if (i == fNumNibbleDescrEntries) {
         LOGI("AnalyzeNibbleData did not find matching NibbleDescr");
         return kDIErrBadNibbleSectors;
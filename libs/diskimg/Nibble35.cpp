@@ -109,6 +109,105 @@ enum {
 /*static*/ DIError DiskImg::UnpackNibbleTrack35(const uint8_t* nibbleBuf,
     long nibbleLen, uint8_t* outputBuf, int cyl, int head,
     LinearBitmap* pBadBlockMap)
+{
+    bool badSector[kMaxSectorsPerTrack];
+    int i;
+
+    DecodeNibbleTrack35(nibbleBuf, nibbleLen, outputBuf, cyl, head,
+        badSector);
+
+    for (i = SectorsPerTrack35(cyl)-1; i >= 0; i--) {
+        if (badSector[i])
+            pBadBlockMap->Set(CylHeadSect35ToBlock(cyl, head, i));
+    }
+
+    return kDIErrNone;      // maybe return an error if nothing found?
+}
+
+/*
+ * Arguments for UnpackTrack35Worker.
+ */
+typedef struct UnpackDisk35Work {
+    const uint8_t* const*   nibbleBufs;
+    const long*             nibbleLens;
+    int                     numHeads;
+    uint8_t*                outputBuf;
+    bool*                   badSectors;     // kMaxSectorsPerTrack per track
+} UnpackDisk35Work;
+
+/*
+ * Decode one track for UnpackNibbleDisk35.  Each track writes to its own
+ * span of the output and its own slice of "badSectors", so these can run
+ * concurrently.
+ */
+static void UnpackTrack35Worker(int trk, void* arg)
+{
+    UnpackDisk35Work* pWork = (UnpackDisk35Work*) arg;
+    int cyl = trk / pWork->numHeads;
+    int head = trk % pWork->numHeads;
+
+    DiskImg::DecodeNibbleTrack35(pWork->nibbleBufs[trk],
+        pWork->nibbleLens[trk],
+        pWork->outputBuf + DiskImg::CylHeadSect35ToBlock(cyl, head, 0) * kBlockSize,
+        cyl, head, &pWork->badSectors[trk * kMaxSectorsPerTrack]);
+}
+
+/*
+ * Unpack all of the nibble tracks on a 3.5" disk at once.
+ *
+ * "nibbleBufs" and "nibbleLens" hold (numCyls * numHeads) tracks, in
+ * cylinder-major order.  The decoded blocks are written straight into
+ * "outputBuf" in ProDOS block order, so it must be able to hold every
+ * block on those cylinders (800K for a full disk).
+ *
+ * The tracks are independent, so they're decoded in parallel.  The bad
+ * block map isn't thread-safe, so it's updated after they finish.
+ */
+/*static*/ DIError DiskImg::UnpackNibbleDisk35(const uint8_t* const* nibbleBufs,
+    const long* nibbleLens, int numCyls, int numHeads, uint8_t* outputBuf,
+    LinearBitmap* pBadBlockMap)
+{
+    UnpackDisk35Work work;
+    int numTracks = numCyls * numHeads;
+    int trk, i;
+
+    assert(numCyls > 0 && numCyls <= kCylindersPerDisk);
+    assert(numHeads == kHeadsPerCylinder);
+
+    work.nibbleBufs = nibbleBufs;
+    work.nibbleLens = nibbleLens;
+    work.numHeads = numHeads;
+    work.outputBuf = outputBuf;
+    work.badSectors = new bool[numTracks * kMaxSectorsPerTrack];
+    if (work.badSectors == NULL)
+        return kDIErrMalloc;
+
+    RunParallel(numTracks, UnpackTrack35Worker, &work);
+
+    for (trk = 0; trk < numTracks; trk++) {
+        int cyl = trk / numHeads;
+        int head = trk % numHeads;
+        for (i = SectorsPerTrack35(cyl)-1; i >= 0; i--) {
+            if (work.badSectors[trk * kMaxSectorsPerTrack + i])
+                pBadBlockMap->Set(CylHeadSect35ToBlock(cyl, head, i));
+        }
+    }
+
+    delete[] work.badSectors;
+    return kDIErrNone;
+}
+
+/*
+ * Decode all of the sectors on a nibble track into "outputBuf", which
+ * must be able to hold 512 * 12 sectors.  On return, "badSector" (which
+ * must hold kMaxSectorsPerTrack entries) says which of the track's
+ * sectors were missing or failed their checksum.
+ *
+ * This doesn't touch anything shared, so it's safe to call on several
+ * tracks at once.
+ */
+/*static*/ void DiskImg::DecodeNibbleTrack35(const uint8_t* nibbleBuf,
+    long nibbleLen, uint8_t* outputBuf, int cyl, int head, bool* badSector)
 {
     CircularBufferAccess buffer(nibbleBuf, nibbleLen);
     bool foundSector[kMaxSectorsPerTrack];
@@ -118,6 +217,7 @@ enum {
     int i;
 
     memset(&foundSector, 0, sizeof(foundSector));
+    memset(badSector, 0, kMaxSectorsPerTrack * sizeof(bool));
 
     i = 0;
     while (i < nibbleLen) {
@@ -150,37 +250,23 @@ enum {
                     LOGI("Nib35:  marking cyl=%d head=%d sect=%d (block=%d)",
                         cyl, head, sector,
                         CylHeadSect35ToBlock(cyl, head, sector));
-                    pBadBlockMap->Set(CylHeadSect35ToBlock(cyl, head, sector));
+                    badSector[sector] = true;
                 }
             }
         }
     }
 
     /*
-     * Check to see if we have all our parts.  Anything missing sets
-     * a flag in the "bad block" map.
+     * Check to see if we have all our parts.  Anything missing gets
+     * flagged as bad.
      */
     for (i = SectorsPerTrack35(cyl)-1; i >= 0; i--) {
         if (!foundSector[i]) {
             LOGI("Nib35: didn't find cyl=%d head=%d sect=%d (block=%d)",
                 cyl, head, i, CylHeadSect35ToBlock(cyl, head, i));
-            pBadBlockMap->Set(CylHeadSect35ToBlock(cyl, head, i));
-        }
-
-        /*
-        // DEBUG test
-        if ((cyl == 0 || cyl == 12 || cyl == 79) &&
-            (head == (cyl & 0x01)) &&
-            (i == 1 || i == 7))
-        {
-            LOGI("DEBUG: setting bad %d/%d/%d (%d)",
-                cyl, head, i, CylHeadSect35ToBlock(cyl, head, i));
-            pBadBlockMap->Set(CylHeadSect35ToBlock(cyl, head, i));
+            badSector[i] = true;
         }
-        */
     }
-
-    return kDIErrNone;      // maybe return an error if nothing found?
 }
 
 /*
@@ -277,7 +363,6 @@ enum {
 {
     const int kMaxDataReach35 = 48;       // fairly arbitrary
     uint8_t* sectorBufStart = sectorBuf;
-    uint8_t part0[kChunkSize35], part1[kChunkSize35], part2[kChunkSize35];
     unsigned int chk0, chk1, chk2;
     uint8_t val, nib0, nib1, nib2, twos;
     int i, off;
@@ -300,53 +385,60 @@ enum {
     }
 
     /*
-     * Assemble 8-bit bytes from 6&2 encoded values.
+     * The data field can wrap around the end of the track buffer.  In
+     * the usual case it doesn't, and we can walk it with a plain pointer;
+     * otherwise, make a straight copy.
      */
-    off = start;
+    uint8_t linearBuf[kOffsetToChecksum];
+    const uint8_t* inPtr = buffer.GetLinearSpan(start, kOffsetToChecksum);
+    if (inPtr == NULL) {
+        for (i = 0; i < kOffsetToChecksum; i++)
+            linearBuf[i] = buffer[start + i];
+        inPtr = linearBuf;
+    }
+    const uint8_t* inStart = inPtr;
+
+    /*
+     * Convert each group of four 6&2 disk bytes into three 8-bit values
+     * and run them through the checksum as we go.  The checksum is a
+     * rotate-with-carry chain, so it has to be computed in order; keeping
+     * it in the same pass avoids a second trip through the data.
+     */
+    chk0 = chk1 = chk2 = 0;
     for (i = 0; i < kChunkSize35; i++) {
-        twos = kInvDiskBytes62[buffer[off++]];
-        nib0 = kInvDiskBytes62[buffer[off++]];
-        nib1 = kInvDiskBytes62[buffer[off++]];
-        if (i != kChunkSize35-1)
-            nib2 = kInvDiskBytes62[buffer[off++]];
-        else
+        uint8_t b0, b1, b2;
+
+        twos = kInvDiskBytes62[inPtr[0]];
+        nib0 = kInvDiskBytes62[inPtr[1]];
+        nib1 = kInvDiskBytes62[inPtr[2]];
+        if (i != kChunkSize35-1) {
+            nib2 = kInvDiskBytes62[inPtr[3]];
+            inPtr += 4;
+        } else {
             nib2 = 0;
+            inPtr += 3;
+        }
 
-        if (twos == kInvInvalidValue ||
-            nib0 == kInvInvalidValue ||
-            nib1 == kInvInvalidValue ||
-            nib2 == kInvInvalidValue)
-        {
+        /* kInvInvalidValue is the only entry with the high bit set */
+        if (((twos | nib0 | nib1 | nib2) & 0x80) != 0) {
             // junk found
+            off = start + (int) (inPtr - inStart);
             LOGI("Nib25: found invalid disk byte in sector data at %d",
                 off - start);
             LOGI("       (one of 0x%02x 0x%02x 0x%02x 0x%02x)",
                 buffer[off-4], buffer[off-3], buffer[off-2], buffer[off-1]);
             return false;
-            //if (twos == kInvInvalidValue)
-            //  twos = 0;
-            //if (nib0 == kInvInvalidValue)
-            //  nib0 = 0;
-            //if (nib1 == kInvInvalidValue)
-            //  nib1 = 0;
-            //if (nib2 == kInvInvalidValue)
-            //  nib2 = 0;
         }
 
-        part0[i] = nib0 | ((twos << 2) & 0xc0);
-        part1[i] = nib1 | ((twos << 4) & 0xc0);
-        part2[i] = nib2 | ((twos << 6) & 0xc0);
-    }
-    assert(off == start + kOffsetToChecksum);
+        b0 = nib0 | ((twos << 2) & 0xc0);
+        b1 = nib1 | ((twos << 4) & 0xc0);
+        b2 = nib2 | ((twos << 6) & 0xc0);
 
-    chk0 = chk1 = chk2 = 0;
-    i = 0;
-    while (true) {
         chk0 = (chk0 & 0xff) << 1;
         if (chk0 & 0x0100)
             chk0++;
 
-        val = part0[i] ^ chk0;
+        val = b0 ^ chk0;
         chk2 += val;
         if (chk0 & 0x0100) {
             chk2++;
@@ -354,7 +446,7 @@ enum {
         }
         *sectorBuf++ = val;
 
-        val = part1[i] ^ chk2;
+        val = b1 ^ chk2;
         chk1 += val;
         if (chk2 > 0xff) {
             chk1++;
@@ -362,21 +454,19 @@ enum {
         }
         *sectorBuf++ = val;
 
-        if (sectorBuf - sectorBufStart == 524)
+        if (i == kChunkSize35-1)
             break;
 
-        val = part2[i] ^ chk1;
+        val = b2 ^ chk1;
         chk0 += val;
         if (chk1 > 0xff) {
             chk0++;
             chk1 &= 0xff;
         }
         *sectorBuf++ = val;
-
-        i++;
-        assert(i < kChunkSize35);
-        //LOGI("i = %d, diff=%d", i, sectorBuf - sectorBufStart);
     }
+    assert(sectorBuf - sectorBufStart == kSectorSize35);
+    off = start + kOffsetToChecksum;
 
     calcChecksum[0] = chk0;
     calcChecksum[1] = chk1;
@@ -8,14 +8,207 @@
  *
  * TODO: for safety, these should compress into a temp file and then rename
  * the temp file over the original.  The current implementation just
- * truncates the open file descriptor or reopens the original file.  Both
- * risk data loss if the program or system crashes while the data is being
- * written to disk.
+ * truncates the open file descriptor, which risks data loss if the program
+ * or system crashes while the data is being written to disk.
  */
 #include "StdAfx.h"
 #include "DiskImgPriv.h"
 #define DEF_MEM_LEVEL 8     // normally in zutil.h
 
+/* see DiskImg::SetGzipRandomAccess() */
+bool DiskImgLib::gGzipRandomAccess = true;
+bool DiskImgLib::gGzipIndexFile = false;
+
+
+/*
+ * ===========================================================================
+ *      OuterWrapper
+ * ===========================================================================
+ */
+
+/*
+ * One piece of a parallel deflate.  "dict" points at up to 32K of input
+ * that immediately precedes "in", which primes the compressor so we don't
+ * lose much by splitting the data up.
+ */
+struct DeflateChunk {
+    const uint8_t*  dict;
+    long            dictLen;
+    const uint8_t*  in;
+    long            inLen;
+    uint8_t*        out;
+    long            outLen;             // in: buffer size; out: data len
+    bool            last;
+    uint32_t        crc;
+    DIError         dierr;
+};
+struct DeflateBatch {
+    DeflateChunk*   chunks;
+    int             level;
+};
+
+/*
+ * Compress one chunk (RunParallel worker).
+ *
+ * Everything but the last chunk ends with a sync flush, which leaves the
+ * output byte-aligned without marking the final block, so the pieces can
+ * be concatenated into a single deflate stream.
+ */
+static void DeflateChunkWorker(int idx, void* arg)
+{
+    DeflateBatch* pBatch = (DeflateBatch*) arg;
+    DeflateChunk* pChunk = &pBatch->chunks[idx];
+    z_stream zstream;
+    int zerr;
+
+    pChunk->crc = crc32(0L, pChunk->in, pChunk->inLen);
+
+    memset(&zstream, 0, sizeof(zstream));
+    zerr = deflateInit2(&zstream, pBatch->level, Z_DEFLATED, -MAX_WBITS,
+                DEF_MEM_LEVEL, Z_DEFAULT_STRATEGY);
+    if (zerr != Z_OK) {
+        pChunk->dierr = kDIErrInternal;
+        return;
+    }
+    if (pChunk->dictLen > 0) {
+        zerr = deflateSetDictionary(&zstream, pChunk->dict,
+                    pChunk->dictLen);
+        if (zerr != Z_OK) {
+            pChunk->dierr = kDIErrInternal;
+            goto bail;
+        }
+    }
+
+    zstream.next_in = (Bytef*) pChunk->in;
+    zstream.avail_in = pChunk->inLen;
+    zstream.next_out = pChunk->out;
+    zstream.avail_out = pChunk->outLen;
+    zerr = deflate(&zstream, pChunk->last ? Z_FINISH : Z_SYNC_FLUSH);
+    if ((pChunk->last && zerr != Z_STREAM_END) ||
+        (!pChunk->last && (zerr != Z_OK || zstream.avail_out == 0)))
+    {
+        /* output buffer is sized so this can't happen */
+        pChunk->dierr = kDIErrInternal;
+        goto bail;
+    }
+
+    pChunk->outLen = zstream.next_out - pChunk->out;
+    pChunk->dierr = kDIErrNone;
+
+bail:
+    deflateEnd(&zstream);
+}
+
+/*
+ * Compress "srcLen" bytes from "pSrc" into a raw deflate stream on "pDst",
+ * along the lines of "pigz".
+ *
+ * The input is split into kDeflateChunkSize pieces that are compressed
+ * independently on several threads, each primed with the 32K of data that
+ * precedes it.  The result is an ordinary deflate stream that any inflater
+ * can handle.  Returns the compressed length and the CRC of the input.
+ */
+/*static*/ DIError OuterWrapper::DeflateParallel(GenericFD* pDst,
+    GenericFD* pSrc, di_off_t srcLen, int level, di_off_t* pCompLength,
+    uint32_t* pCRC)
+{
+    DIError dierr = kDIErrNone;
+    const long kOutChunkSize = kDeflateChunkSize + kDeflateChunkSize / 8 + 1024;
+    DeflateChunk chunks[kDeflateBatchChunks];
+    DeflateBatch batch;
+    uint8_t* inBuf = NULL;
+    uint8_t* outBuf = NULL;
+    di_off_t compLength = 0;
+    long dictAvail = 0;
+    uint32_t crc;
+    bool lastSeen = false;
+    int i;
+
+    inBuf = new uint8_t[kDeflateDictSize +
+                        kDeflateBatchChunks * kDeflateChunkSize];
+    outBuf = new uint8_t[kDeflateBatchChunks * kOutChunkSize];
+    if (inBuf == NULL || outBuf == NULL) {
+        dierr = kDIErrMalloc;
+        goto bail;
+    }
+
+    batch.chunks = chunks;
+    batch.level = level;
+    crc = crc32(0L, Z_NULL, 0);
+
+    while (!lastSeen) {
+        uint8_t* dataStart = inBuf + kDeflateDictSize;
+        int numChunks = 0;
+
+        /*
+         * Fill up the batch.  Always produce at least one chunk, so that
+         * empty input still yields a valid (empty) stream.
+         */
+        while (numChunks < kDeflateBatchChunks && !lastSeen) {
+            DeflateChunk* pChunk = &chunks[numChunks];
+            long getSize;
+
+            getSize = (srcLen > kDeflateChunkSize) ?
+                        kDeflateChunkSize : (long) srcLen;
+            pChunk->in = dataStart + numChunks * kDeflateChunkSize;
+            pChunk->inLen = getSize;
+            if (getSize != 0) {
+                dierr = pSrc->Read((void*) pChunk->in, getSize);
+                if (dierr != kDIErrNone) {
+                    LOGI("deflate read failed");
+                    goto bail;
+                }
+            }
+            srcLen -= getSize;
+
+            pChunk->dictLen = (dictAvail > kDeflateDictSize) ?
+                        kDeflateDictSize : dictAvail;
+            pChunk->dict = pChunk->in - pChunk->dictLen;
+            pChunk->out = outBuf + numChunks * kOutChunkSize;
+            pChunk->outLen = kOutChunkSize;
+            pChunk->last = lastSeen = (srcLen == 0);
+            pChunk->dierr = kDIErrGeneric;
+
+            dictAvail += getSize;
+            numChunks++;
+        }
+
+        RunParallel(numChunks, DeflateChunkWorker, &batch);
+
+        for (i = 0; i < numChunks; i++) {
+            DeflateChunk* pChunk = &chunks[i];
+
+            if (pChunk->dierr != kDIErrNone) {
+                LOGI("zlib deflate of chunk failed");
+                dierr = pChunk->dierr;
+                goto bail;
+            }
+            dierr = pDst->Write(pChunk->out, pChunk->outLen);
+            if (dierr != kDIErrNone) {
+                LOGI("write failed in deflate");
+                goto bail;
+            }
+            compLength += pChunk->outLen;
+            crc = crc32_combine(crc, pChunk->crc, pChunk->inLen);
+        }
+
+        /* keep the tail of this batch as the dictionary for the next */
+        if (!lastSeen) {
+            uint8_t* dataEnd = dataStart + numChunks * kDeflateChunkSize;
+            memcpy(inBuf, dataEnd - kDeflateDictSize, kDeflateDictSize);
+        }
+    }
+
+    LOGI("+++ deflated to %ld bytes", (long) compLength);
+    *pCompLength = compLength;
+    *pCRC = crc;
+
+bail:
+    delete[] inBuf;
+    delete[] outBuf;
+    return dierr;
+}
+
 
 /*
  * ===========================================================================
@@ -36,7 +229,6 @@
  */
 /*static*/ DIError OuterGzip::Test(GenericFD* pGFD, di_off_t outerLength)
 {
-    const int kGzipMagic = 0x8b1f;  // 0x1f 0x8b
     uint16_t magic, magicBuf;
     const char* imagePath;
 
@@ -62,12 +254,153 @@
 }
 
 /*
- * The gzip file format has a length embedded in the footer, but
- * unfortunately there is no interface to access it.  So, we have
- * to keep reading until we run out of data, extending the buffer
- * to accommodate the new data each time.  (We could also just read
- * the footer directly, but that requires that there are no garbage
- * bytes at the end of the file, which is a real concern on some FTP sites.)
+ * Read the ISIZE field from the gzip trailer.  This is the uncompressed
+ * length mod 2^32, but it's only a hint: there may be garbage at the end
+ * of the file, or more than one member.
+ */
+DIError OuterGzip::ReadSizeHint(GenericFD* pOuterGFD, di_off_t outerLength,
+    uint32_t* pSize)
+{
+    DIError dierr;
+    uint8_t sizeBuf[4];
+
+    if (outerLength < kMinGzipLen)
+        return kDIErrNotSupported;
+    dierr = pOuterGFD->Seek(outerLength - 4, kSeekSet);
+    if (dierr != kDIErrNone)
+        return dierr;
+    dierr = pOuterGFD->Read(sizeBuf, sizeof(sizeBuf));
+    if (dierr != kDIErrNone)
+        return dierr;
+    *pSize = GetLongLE(sizeBuf);
+    return kDIErrNone;
+}
+
+/*
+ * Expand the gzip file into a buffer allocated from the ISIZE hint.
+ *
+ * We inflate straight from the file into the final buffer, so there's
+ * one allocation and no copying.  zlib checks the CRC and length in the
+ * trailer for us.  If the hint turns out to be wrong -- junk at the end
+ * of the file, more than one member, a truncated or damaged stream --
+ * we return kDIErrNotSupported and let ExtractGzipImage() sort it out.
+ */
+DIError OuterGzip::ExtractPresized(GenericFD* pOuterGFD, di_off_t outerLength,
+    char** pBuf, di_off_t* pLength)
+{
+    DIError dierr = kDIErrNone;
+    const size_t kReadBufSize = 256 * 1024;
+    uint8_t* readBuf = NULL;
+    char* buf = NULL;
+    z_stream zstream;
+    bool zinit = false;
+    di_off_t endPosn;
+    uint32_t size;
+    int zerr;
+
+    dierr = ReadSizeHint(pOuterGFD, outerLength, &size);
+    if (dierr != kDIErrNone)
+        return dierr;
+    if (size == 0 || size > kMaxUncompressedSize) {
+        LOGI("  ExGZ size hint %u not usable", size);
+        return kDIErrNotSupported;
+    }
+
+    dierr = pOuterGFD->Seek(0, kSeekSet);
+    if (dierr != kDIErrNone)
+        return dierr;
+
+    readBuf = new uint8_t[kReadBufSize];
+    buf = new char[size];
+    if (readBuf == NULL || buf == NULL) {
+        dierr = kDIErrMalloc;
+        goto bail;
+    }
+
+    memset(&zstream, 0, sizeof(zstream));
+    zstream.next_out = (Bytef*) buf;
+    zstream.avail_out = size;
+
+    /* 16 means "gzip header only" */
+    zerr = inflateInit2(&zstream, MAX_WBITS + 16);
+    if (zerr != Z_OK) {
+        LOGI("  ExGZ inflateInit2 failed (zerr=%d)", zerr);
+        dierr = kDIErrInternal;
+        goto bail;
+    }
+    zinit = true;
+
+    do {
+        if (zstream.avail_in == 0) {
+            size_t actual;
+
+            dierr = pOuterGFD->Read(readBuf, kReadBufSize, &actual);
+            if (dierr == kDIErrEOF || (dierr == kDIErrNone && actual == 0)) {
+                LOGI("  ExGZ ran out of data at %lu", zstream.total_out);
+                dierr = kDIErrNotSupported;
+                goto bail;
+            } else if (dierr != kDIErrNone) {
+                goto bail;
+            }
+            zstream.next_in = readBuf;
+            zstream.avail_in = actual;
+        }
+
+        zerr = inflate(&zstream, Z_NO_FLUSH);
+        if (zerr != Z_OK && zerr != Z_STREAM_END) {
+            /* Z_BUF_ERROR here means the output didn't fit */
+            LOGI("  ExGZ presized inflate failed (zerr=%d, out=%lu)",
+                zerr, zstream.total_out);
+            dierr = kDIErrNotSupported;
+            goto bail;
+        }
+    } while (zerr == Z_OK);
+
+    if (zstream.total_out != size) {
+        LOGI("  ExGZ size mismatch (%lu vs hint %u)", zstream.total_out, size);
+        dierr = kDIErrNotSupported;
+        goto bail;
+    }
+
+    /*
+     * If another member follows, the hint came from its trailer, and the
+     * match was a coincidence.  Let the slow path gather up all of it.
+     */
+    endPosn = pOuterGFD->Tell() - zstream.avail_in;
+    if (outerLength - endPosn >= 2) {
+        uint8_t magicBuf[2];
+
+        dierr = pOuterGFD->Seek(endPosn, kSeekSet);
+        if (dierr == kDIErrNone)
+            dierr = pOuterGFD->Read(magicBuf, sizeof(magicBuf));
+        if (dierr != kDIErrNone)
+            goto bail;
+        if (GetShortLE(magicBuf) == kGzipMagic) {
+            LOGI("  ExGZ found a second gzip member");
+            dierr = kDIErrNotSupported;
+            goto bail;
+        }
+    }
+
+    *pBuf = buf;
+    *pLength = size;
+    buf = NULL;
+    LOGI("  ExGZ presized load, size = %u", size);
+
+bail:
+    if (zinit)
+        inflateEnd(&zstream);
+    delete[] readBuf;
+    delete[] buf;
+    return dierr;
+}
+
+/*
+ * The gzip file format has a length embedded in the footer, but it can't
+ * always be trusted (see ExtractPresized).  When it can't, we have to keep
+ * reading until we run out of data, extending the buffer to accommodate
+ * the new data each time.  Garbage bytes at the end of the file are a
+ * real concern on some FTP sites.
  *
  * Start out by trying sizes that we think will work (140K, 800K),
  * then grow quickly.
@@ -79,7 +412,8 @@
  * to a temp file, or allowing the caller to specify what the largest
  * size they can handle is.
  */
-DIError OuterGzip::ExtractGzipImage(gzFile gzfp, char** pBuf, di_off_t* pLength)
+DIError OuterGzip::ExtractGzipImage(gzFile gzfp, char** pBuf, di_off_t* pLength,
+    di_off_t* pAllocLength)
 {
     DIError dierr = kDIErrNone;
     const int kMinEmpty = 256 * 1024;
@@ -95,6 +429,7 @@ DIError OuterGzip::ExtractGzipImage(gzFile gzfp, char** pBuf, di_off_t* pLength)
     assert(gzfp != NULL);
     assert(pBuf != NULL);
     assert(pLength != NULL);
+    assert(pAllocLength != NULL);
 
     curSize = 0;
     maxSize = kStartSize;
@@ -202,10 +537,12 @@ DIError OuterGzip::ExtractGzipImage(gzFile gzfp, char** pBuf, di_off_t* pLength)
         delete[] buf;
         buf = newBuf;
         newBuf = NULL;
+        maxSize = curSize;
     }
 
     *pBuf = buf;
     *pLength = curSize;
+    *pAllocLength = maxSize;
     LOGI("  ExGZ final size = %ld", curSize);
 
     buf = NULL;
@@ -216,8 +553,74 @@ bail:
     return dierr;
 }
 
+/* suffix for the random-access index file */
+/*static*/ const char* OuterGzip::kIndexFileExt = ".gzidx";
+
+/*
+ * Set up random access to a large gzip file.  Rather than expanding the
+ * whole thing, we hand back a GFDGzip that expands pieces as they're read.
+ *
+ * Returns kDIErrNotSupported if the file is small enough that we might as
+ * well just expand it, or has a structure GFDGzip doesn't handle.
+ */
+DIError OuterGzip::LoadRandomAccess(GenericFD* pOuterGFD,
+    di_off_t outerLength, di_off_t* pWrapperLength,
+    GenericFD** ppWrapperGFD)
+{
+    DIError dierr = kDIErrNone;
+    GFDGzip* pNewGFD = NULL;
+    char* indexPath = NULL;
+    const char* imagePath;
+    uint32_t size;
+
+    imagePath = pOuterGFD->GetPathName();
+    assert(imagePath != NULL);
+
+    /*
+     * The ISIZE field in the trailer is only a hint -- there may be junk
+     * at the end of the file -- but it's good enough to decide whether
+     * this is worth doing.
+     */
+    dierr = ReadSizeHint(pOuterGFD, outerLength, &size);
+    if (dierr != kDIErrNone)
+        return dierr;
+    if (size < kMinRandomAccessSize)
+        return kDIErrNotSupported;
+
+    if (gGzipIndexFile) {
+        indexPath = new char[strlen(imagePath) + strlen(kIndexFileExt) + 1];
+        if (indexPath == NULL)
+            return kDIErrMalloc;
+        strcpy(indexPath, imagePath);
+        strcat(indexPath, kIndexFileExt);
+    }
+
+    pNewGFD = new GFDGzip;
+    if (pNewGFD == NULL) {
+        dierr = kDIErrMalloc;
+        goto bail;
+    }
+    dierr = pNewGFD->Open(pOuterGFD, outerLength, kMaxUncompressedSize,
+                indexPath);
+    if (dierr != kDIErrNone)
+        goto bail;
+
+    LOGI("  GZ random access, length=%ld", (long) pNewGFD->GetLength());
+    *pWrapperLength = pNewGFD->GetLength();
+    *ppWrapperGFD = pNewGFD;
+    pNewGFD = NULL;
+
+bail:
+    delete pNewGFD;
+    delete[] indexPath;
+    return dierr;
+}
+
 /*
  * Open the archive, and extract the disk image into a memory buffer.
+ *
+ * Large images opened read-only are expanded on demand instead (see
+ * LoadRandomAccess).
  */
 DIError OuterGzip::Load(GenericFD* pOuterGFD, di_off_t outerLength, bool readOnly,
     di_off_t* pWrapperLength, GenericFD** ppWrapperGFD)
@@ -226,6 +629,7 @@ DIError OuterGzip::Load(GenericFD* pOuterGFD, di_off_t outerLength, bool readOnl
     GFDBuffer* pNewGFD = NULL;
     char* buf = NULL;
     di_off_t length = -1;
+    di_off_t allocLength = -1;
     const char* imagePath;
     gzFile gzfp = NULL;
 
@@ -235,6 +639,28 @@ DIError OuterGzip::Load(GenericFD* pOuterGFD, di_off_t outerLength, bool readOnl
         return kDIErrNotSupported;
     }
 
+    if (readOnly && gGzipRandomAccess) {
+        dierr = LoadRandomAccess(pOuterGFD, outerLength, pWrapperLength,
+                    ppWrapperGFD);
+        if (dierr == kDIErrNone || dierr == kDIErrTooBig)
+            return dierr;
+        if (dierr != kDIErrNotSupported) {
+            LOGI("  GZ random access failed (err=%d), expanding instead",
+                dierr);
+        }
+        dierr = kDIErrNone;
+    }
+
+    dierr = ExtractPresized(pOuterGFD, outerLength, &buf, &length);
+    if (dierr == kDIErrNone) {
+        allocLength = length;
+        goto loaded;
+    }
+    if (dierr != kDIErrNotSupported)
+        goto bail;
+    LOGI("  GZ presized load declined, falling back to gzread");
+    dierr = kDIErrNone;
+
     gzfp = gzopen(imagePath, "rb");        // use "readOnly" here
     if (gzfp == NULL) { // DON'T retry RO -- should be done at higher level?
         LOGI("gzopen failed, errno=%d", errno);
@@ -242,16 +668,18 @@ DIError OuterGzip::Load(GenericFD* pOuterGFD, di_off_t outerLength, bool readOnl
         goto bail;
     }
 
-    dierr = ExtractGzipImage(gzfp, &buf, &length);
+    dierr = ExtractGzipImage(gzfp, &buf, &length, &allocLength);
     if (dierr != kDIErrNone)
         goto bail;
 
+loaded:
     /*
      * Everything is going well.  Now we substitute a memory-based GenericFD
-     * for the existing GenericFD.
+     * for the existing GenericFD.  The buffer usually has some room left
+     * at the end, so let the GFD know about it.
      */
     pNewGFD = new GFDBuffer;
-    dierr = pNewGFD->Open(buf, length, true, false, readOnly);
+    dierr = pNewGFD->Adopt(buf, length, allocLength, false, readOnly);
     if (dierr != kDIErrNone)
         goto bail;
     buf = NULL;      // now owned by pNewGFD;
@@ -269,6 +697,7 @@ bail:
     if (dierr != kDIErrNone) {
         delete pNewGFD;
     }
+    delete[] buf;
     if (gzfp != NULL)
         gzclose(gzfp);
     return dierr;
@@ -278,67 +707,55 @@ bail:
  * Save the contents of "pWrapperGFD" to the file pointed to by
  * "pOuterGFD".
  *
- * "pOuterGFD" isn't disturbed (same as Load).  All we want is to get the
- * filename and then do everything through gzio.
+ * We write a single gzip member by hand, so that we can compress the
+ * image with DeflateParallel instead of pushing it through gzio.
  */
 DIError OuterGzip::Save(GenericFD* pOuterGFD, GenericFD* pWrapperGFD,
     di_off_t wrapperLength)
 {
     DIError dierr = kDIErrNone;
-    const char* imagePath;
-    gzFile gzfp = NULL;
+    di_off_t compressedLen;
+    uint32_t crc;
+
+    /* magic, CM=deflate, no flags, no mtime, no XFL, OS unknown */
+    static const uint8_t kGzipHeader[10] = {
+        0x1f, 0x8b, Z_DEFLATED, 0, 0, 0, 0, 0, 0, 0xff
+    };
 
     LOGI(" GZ save (wrapperLen=%ld)", (long) wrapperLength);
     assert(wrapperLength > 0);
 
-    /*
-     * Reopen the file.
-     */
-    imagePath = pOuterGFD->GetPathName();
-    if (imagePath == NULL) {
-        assert(false);      // should've been caught long ago
-        return kDIErrNotSupported;
-    }
-
-    gzfp = gzopen(imagePath, "wb");
-    if (gzfp == NULL) {
-        LOGI("gzopen for write failed, errno=%d", errno);
-        dierr = kDIErrGeneric;
+    dierr = pOuterGFD->Rewind();
+    if (dierr != kDIErrNone)
+        goto bail;
+    dierr = pOuterGFD->Truncate();
+    if (dierr != kDIErrNone)
         goto bail;
-    }
-
-    char buf[16384];
-    size_t actual;
-    long written, totalWritten;
-
-    pWrapperGFD->Rewind();
 
-    totalWritten = 0;
-    while (wrapperLength > 0) {
-        dierr = pWrapperGFD->Read(buf, sizeof(buf), &actual);
-        if (dierr == kDIErrEOF) {
-            dierr = kDIErrNone;
-            break;
-        }
-        if (dierr != kDIErrNone) {
-            LOGI("Error reading source GFD during gzip save (err=%d)",dierr);
-            goto bail;
-        }
-        assert(actual > 0);
+    dierr = pWrapperGFD->Rewind();
+    if (dierr != kDIErrNone)
+        goto bail;
 
-        written = gzwrite(gzfp, buf, actual);
-        if (written == 0) {
-            LOGE("Failed writing %lu bytes to gzio", (unsigned long) actual);
-            dierr = kDIErrGeneric;
-            goto bail;
-        }
+    dierr = pOuterGFD->Write(kGzipHeader, sizeof(kGzipHeader));
+    if (dierr != kDIErrNone)
+        goto bail;
 
-        totalWritten += written;
-        wrapperLength -= actual;
+    dierr = DeflateParallel(pOuterGFD, pWrapperGFD, wrapperLength,
+                Z_DEFAULT_COMPRESSION, &compressedLen, &crc);
+    if (dierr != kDIErrNone) {
+        LOGI("Error compressing during gzip save (err=%d)", dierr);
+        goto bail;
     }
-    assert(wrapperLength == 0);     // not expecting any slop
 
-    LOGD(" GZ wrote %ld bytes", totalWritten);
+    /* trailer: CRC32 and ISIZE */
+    dierr = WriteLongLE(pOuterGFD, crc);
+    if (dierr != kDIErrNone)
+        goto bail;
+    dierr = WriteLongLE(pOuterGFD, (uint32_t) wrapperLength);
+    if (dierr != kDIErrNone)
+        goto bail;
+
+    LOGD(" GZ wrote %ld bytes", (long) compressedLen);
 
     /*
      * Success!
@@ -346,8 +763,6 @@ DIError OuterGzip::Save(GenericFD* pOuterGFD, GenericFD* pWrapperGFD,
     assert(dierr == kDIErrNone);
 
 bail:
-    if (gzfp != NULL)
-        gzclose(gzfp);
     return dierr;
 }
 
@@ -522,8 +937,8 @@ DIError OuterZip::Save(GenericFD* pOuterGFD, GenericFD* pWrapperGFD,
     uint32_t crc;
     di_off_t compressedLen;
     if (lfh.fCompressionMethod == kCompressDeflated) {
-        dierr = DeflateGFDToGFD(pOuterGFD, pWrapperGFD, wrapperLength,
-                    &compressedLen, &crc);
+        dierr = DeflateParallel(pOuterGFD, pWrapperGFD, wrapperLength,
+                    Z_BEST_COMPRESSION, &compressedLen, &crc);
         if (dierr != kDIErrNone)
             goto bail;
     } else if (lfh.fCompressionMethod == kCompressStored) {
@@ -982,127 +1397,6 @@ void OuterZip::DOSTime(time_t when, uint16_t* pDate, uint16_t* pTime)
     *pTime = ptm->tm_hour << 11 | ptm->tm_min << 5 | ptm->tm_sec >> 1;
 }
 
-/*
- * Compress "length" bytes of data from "pSrc" to "pDst".
- */
-DIError OuterZip::DeflateGFDToGFD(GenericFD* pDst, GenericFD* pSrc,
-    di_off_t srcLen, di_off_t* pCompLength, uint32_t* pCRC)
-{
-    DIError dierr = kDIErrNone;
-    const size_t kBufSize = 32768;
-    uint8_t* inBuf = NULL;
-    uint8_t* outBuf = NULL;
-    z_stream zstream;
-    uint32_t crc;
-    int zerr;
-
-    /*
-     * Create an input buffer and an output buffer.
-     */
-    inBuf = new uint8_t[kBufSize];
-    outBuf = new uint8_t[kBufSize];
-    if (inBuf == NULL || outBuf == NULL) {
-        dierr = kDIErrMalloc;
-        goto bail;
-    }
-
-    /*
-     * Initialize the zlib stream.
-     */
-    memset(&zstream, 0, sizeof(zstream));
-    zstream.zalloc = Z_NULL;
-    zstream.zfree = Z_NULL;
-    zstream.opaque = Z_NULL;
-    zstream.next_in = NULL;
-    zstream.avail_in = 0;
-    zstream.next_out = outBuf;
-    zstream.avail_out = kBufSize;
-    zstream.data_type = Z_UNKNOWN;
-
-    zerr = deflateInit2(&zstream, Z_BEST_COMPRESSION,
-        Z_DEFLATED, -MAX_WBITS, DEF_MEM_LEVEL, Z_DEFAULT_STRATEGY);
-    if (zerr != Z_OK) {
-        dierr = kDIErrInternal;
-        if (zerr == Z_VERSION_ERROR) {
-            LOGI("Installed zlib is not compatible with linked version (%s)",
-                ZLIB_VERSION);
-        } else {
-            LOGI("Call to deflateInit2 failed (zerr=%d)", zerr);
-        }
-        goto bail;
-    }
-
-    crc = crc32(0L, Z_NULL, 0);
-
-    /*
-     * Loop while we have data.
-     */
-    do {
-        long getSize;
-        int flush;
-
-        /* only read if the input is empty */
-        if (zstream.avail_in == 0 && srcLen) {
-            getSize = (srcLen > (long) kBufSize) ? kBufSize : (long) srcLen;
-            LOGI("+++ reading %ld bytes", getSize);
-
-            dierr = pSrc->Read(inBuf, getSize);
-            if (dierr != kDIErrNone) {
-                LOGI("deflate read failed");
-                goto z_bail;
-            }
-
-            srcLen -= getSize;
-
-            crc = crc32(crc, inBuf, getSize);
-
-            zstream.next_in = inBuf;
-            zstream.avail_in = getSize;
-        }
-
-        if (srcLen == 0)
-            flush = Z_FINISH;       /* tell zlib that we're done */
-        else
-            flush = Z_NO_FLUSH;     /* more to come! */
-
-        zerr = deflate(&zstream, flush);
-        if (zerr != Z_OK && zerr != Z_STREAM_END) {
-            LOGI("zlib deflate call failed (zerr=%d)", zerr);
-            dierr = kDIErrInternal;
-            goto z_bail;
-        }
-
-        /* write when we're full or when we're done */
-        if (zstream.avail_out == 0 ||
-            (zerr == Z_STREAM_END && zstream.avail_out != kBufSize))
-        {
-            LOGI("+++ writing %ld bytes", zstream.next_out - outBuf);
-            dierr = pDst->Write(outBuf, zstream.next_out - outBuf);
-            if (dierr != kDIErrNone) {
-                LOGI("write failed in deflate");
-                goto z_bail;
-            }
-
-            zstream.next_out = outBuf;
-            zstream.avail_out = kBufSize;
-        }
-    } while (zerr == Z_OK);
-
-    assert(zerr == Z_STREAM_END);       /* other errors should've been caught */
-
-    *pCompLength = zstream.total_out;
-    *pCRC = crc;
-
-z_bail:
-    deflateEnd(&zstream);        /* free up any allocated structures */
-
-bail:
-    delete[] inBuf;
-    delete[] outBuf;
-
-    return dierr;
-}
-
 /*
  * Set the "fExtension" field.
  */
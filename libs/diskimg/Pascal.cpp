@@ -1258,6 +1258,7 @@ DIError DiskFSPascal::RenameFile(A2File* pGenericFile, const char* newName)
     pEntry[0x06] = strlen(normalName);
     memcpy(&pEntry[0x07], normalName, A2FilePascal::kMaxFileName);
     strcpy(pFile->fFileName, normalName);
+    FilePathChanged(pFile);
 
     dierr = SaveCatalog();
     if (dierr != kDIErrNone)
@@ -38,6 +38,9 @@ const int kMaxDirectoryDepth = 64;      // not sure what ProDOS limit is
 const int kEntriesPerBlock = 0x0d;      // expected value for entries per blk
 const int kEntryLength = 0x27;          // expected value for dir entry len
 const int kTypeDIR = 0x0f;
+const int kReadChunk = 256;             // max blocks per fork read call
+const int kWriteChunk = 256;            // max blocks per fork write call
+const int kMaxIndexBlocks = 128;        // index blocks in a 16MB tree file
 
 
 /*
@@ -60,6 +63,161 @@ typedef struct DiskFSProDOS::DirHeader {
     uint8_t     parentEntryLength;
 } DirHeader;
 
+/*
+ * Index of the entries in one directory.
+ *
+ * Entries are numbered by "slot": slot N is entry (N % kEntriesPerBlock) of
+ * the Nth block in the directory, so slot 0 is the directory header.  Names
+ * are kept in a hash table and compared without regard to case.  Free slots
+ * are tracked in a bitmap (high bit first, like the volume bitmap), which we
+ * search from the lowest slot that might be free, so that we always hand out
+ * the first available entry the way ProDOS does.
+ *
+ * This mirrors what's on disk.  Callers update it after the directory
+ * blocks have been written, never before.
+ */
+class DiskFSProDOS::DirIndex {
+public:
+    DirIndex(A2FileProDOS* pDir) : fpNext(NULL), fpDir(pDir), fNumBlocks(0),
+        fMaxBlocks(0), fBlocks(NULL), fNames(NULL), fKeyBlocks(NULL),
+        fChain(NULL), fFreeMap(NULL), fBuckets(NULL), fNumBuckets(0),
+        fFirstFree(0)
+        {}
+    ~DirIndex(void) {
+        delete[] fBlocks;
+        delete[] fNames;
+        delete[] fKeyBlocks;
+        delete[] fChain;
+        delete[] fFreeMap;
+        delete[] fBuckets;
+    }
+
+    A2FileProDOS* GetDir(void) const { return fpDir; }
+    long GetNumBlocks(void) const { return fNumBlocks; }
+    uint16_t GetBlock(long idx) const {
+        assert(idx >= 0 && idx < fNumBlocks);
+        return fBlocks[idx];
+    }
+    uint16_t GetKeyBlock(long slot) const {
+        assert(slot > 0 && slot < fNumBlocks * kEntriesPerBlock);
+        return fKeyBlocks[slot];
+    }
+    bool IsSlotFree(long slot) const {
+        return (fFreeMap[slot / 64] & (kHighBit >> (slot & 63))) != 0;
+    }
+
+    void AddBlock(uint16_t block);
+    void AddName(long slot, const char* name, uint16_t keyBlock);
+    void RemoveName(long slot);
+    long FindName(const char* name) const;
+    long FindFreeSlot(void);
+    long FindSlot(uint16_t block, int entryIdx) const;
+
+    DirIndex*       fpNext;         // next index in DiskFSProDOS list
+
+private:
+    static const uint64_t kHighBit = 0x8000000000000000ULL;
+    typedef char NameBuf[A2FileProDOS::kMaxFileName+1];
+
+    static unsigned long HashName(const char* name);
+    static bool NamesMatch(const char* name1, const char* name2);
+    void SetSlotFree(long slot, bool isFree) {
+        if (isFree)
+            fFreeMap[slot / 64] |= kHighBit >> (slot & 63);
+        else
+            fFreeMap[slot / 64] &= ~(kHighBit >> (slot & 63));
+    }
+    void Rehash(void);
+
+    A2FileProDOS*   fpDir;          // directory we describe
+    long            fNumBlocks;
+    long            fMaxBlocks;     // capacity of the arrays below
+    uint16_t*       fBlocks;        // directory blocks, in chain order
+    NameBuf*        fNames;         // per slot: name, if slot in use
+    uint16_t*       fKeyBlocks;     // per slot: key block, if slot in use
+    long*           fChain;         // per slot: next slot in bucket, or -1
+    uint64_t*       fFreeMap;       // per slot: bit set if unused
+    long*           fBuckets;       // first slot in each bucket, or -1
+    long            fNumBuckets;    // always a power of 2
+    long            fFirstFree;     // no free slots below this one
+};
+
+/*
+ * File structure blocks (sapling index blocks, tree master and index
+ * blocks) for a stretch of the file list, read ahead of time by
+ * ScanFileUsage.
+ *
+ * Blocks are requested in file order, then sorted and read with as few
+ * ReadBlocks calls as we can manage.  Index blocks usually sit between the
+ * data blocks of small files, so we read through short gaps rather than
+ * seeking over them; copying a few unwanted blocks is cheaper than another
+ * trip through the file or device layer.
+ *
+ * Tree index blocks aren't known until the master blocks are in, so those
+ * go in a second round.  Anything that couldn't be read is left out;
+ * LoadBlockList falls back to reading it directly, which gets the same data
+ * or the same error it always did.
+ */
+class DiskFSProDOS::ScanBatch {
+public:
+    ScanBatch(void) : fEntries(NULL), fNumEntries(0), fNumSorted(0),
+        fMaxEntries(0), fNumReserved(0), fTrees(NULL), fNumTrees(0),
+        fData(NULL), fNumSlots(0), fRunBuf(NULL)
+        {}
+    ~ScanBatch(void) {
+        delete[] fEntries;
+        delete[] fTrees;
+        delete[] fData;
+        delete[] fRunBuf;
+    }
+
+    DIError Create(long maxEntries);
+    void Reset(void) {
+        fNumEntries = fNumSorted = fNumReserved = fNumTrees = fNumSlots = 0;
+    }
+    long GetRoom(void) const { return fMaxEntries - fNumReserved; }
+
+    static long BlocksNeeded(int storageType, long eof);
+    void AddFork(int storageType, uint16_t keyBlock, long eof);
+    void Read(DiskImg* pImg);
+    const uint8_t* FindBlock(uint16_t block) const;
+
+private:
+    enum { kSlotPending = -2, kSlotFailed = -1 };
+    enum {
+        kMaxRunBlocks = 256,        // largest single read, in blocks
+        kMaxGapBlocks = 32,         // read through gaps up to this size
+    };
+    typedef struct Entry {
+        uint16_t    block;
+        long        slot;           // index into fData, or kSlot*
+    } Entry;
+    typedef struct TreeFork {
+        uint16_t    masterBlock;
+        int         numIndices;
+    } TreeFork;
+
+    static int CompareEntries(const void* vp1, const void* vp2);
+    void AddBlock(uint16_t block) {
+        assert(fNumEntries < fMaxEntries);
+        fEntries[fNumEntries].block = block;
+        fEntries[fNumEntries].slot = kSlotPending;
+        fNumEntries++;
+    }
+    void ReadPending(DiskImg* pImg);
+
+    Entry*          fEntries;
+    long            fNumEntries;
+    long            fNumSorted;     // leading entries sorted by block
+    long            fMaxEntries;
+    long            fNumReserved;   // entries promised to AddFork callers
+    TreeFork*       fTrees;         // trees whose index blocks we want
+    long            fNumTrees;
+    uint8_t*        fData;          // fMaxEntries blocks of data
+    long            fNumSlots;      // blocks in use in fData
+    uint8_t*        fRunBuf;        // kMaxRunBlocks blocks
+};
+
 
 /*
  * See if this looks like a ProDOS volume.
@@ -135,21 +293,28 @@ DIError DiskFSProDOS::Initialize(InitMode initMode)
 
     fDiskIsGood = false;        // hosed until proven innocent
     fEarlyDamage = false;
+    fLazyInit = (initMode == kInitLazy);
 
     /*
      * NOTE: we'd probably be better off with fTotalBlocks, since that's how
      * big the disk *thinks* it is, especially on a CFFA or MacPart subvol.
      * However, we know that the image block count is the absolute maximum,
      * so while it may not be a tight bound it is an upper bound.
+     *
+     * With kInitLazy the map waits for LoadVolumeUsage.
      */
-    fVolumeUsage.Create(fpImg->GetNumBlocks());
+    if (!fLazyInit)
+        fVolumeUsage.Create(fpImg->GetNumBlocks());
 
     dierr = LoadVolHeader();
     if (dierr != kDIErrNone)
         goto bail;
     DumpVolHeader();
 
-    dierr = ScanVolBitmap();
+    if (fLazyInit)
+        dierr = LoadVolBitmap();
+    else
+        dierr = ScanVolBitmap();
     if (dierr != kDIErrNone)
         goto bail;
 
@@ -175,6 +340,16 @@ DIError DiskFSProDOS::Initialize(InitMode initMode)
         goto bail;
     }
 
+    if (fLazyInit) {
+        /*
+         * That only read the volume directory.  Check what we can without
+         * a usage map; the rest is checked as it gets loaded.
+         */
+        LOGI(" ProDOS - lazy init, deferring subdirs and usage scan");
+        fDiskIsGood = CheckDiskIsGood();
+        goto bail;
+    }
+
     sprintf(msg, "Processing %s", fVolumeName);
     if (!fpImg->UpdateScanProgress(msg)) {
         LOGI(" ProDOS cancelled by user");
@@ -214,6 +389,130 @@ bail:
     return dierr;
 }
 
+/*
+ * Make sure every directory named in "pathName", including the last
+ * component if it's a directory, has been loaded.  Only does anything
+ * after a kInitLazy Initialize.
+ *
+ * The cost depends on the size of the directories along the path, not
+ * on how many files the volume holds.
+ */
+DIError DiskFSProDOS::LoadFilesForPath(const char* pathName)
+{
+    DIError dierr = kDIErrNone;
+    A2FileProDOS* pDir;
+    char* pathBuf;
+    char* cp;
+
+    if (!fLazyInit)
+        return kDIErrNone;
+
+    pathBuf = new char[strlen(pathName)+1];
+    if (pathBuf == NULL)
+        return kDIErrMalloc;
+    strcpy(pathBuf, pathName);
+
+    cp = pathBuf;
+    while (true) {
+        cp = strchr(cp, kDIFssep);
+        if (cp != NULL)
+            *cp = '\0';
+
+        pDir = (A2FileProDOS*) FindFileByName(pathBuf);
+        if (pDir == NULL)
+            break;          // nothing below it can exist either
+        if (pDir->fDirPending) {
+            dierr = LoadDirectory(pDir);
+            if (dierr != kDIErrNone)
+                goto bail;
+        }
+
+        if (cp == NULL)
+            break;
+        *cp++ = kDIFssep;
+    }
+
+bail:
+    delete[] pathBuf;
+    return dierr;
+}
+
+/*
+ * Finish what a kInitLazy Initialize put off: load the rest of the
+ * directories, then build and check the volume usage map the way a full
+ * Initialize would have.  Called by GetVolumeUsageMap.
+ *
+ * Sub-volumes are not scanned.
+ */
+DIError DiskFSProDOS::LoadVolumeUsage(void)
+{
+    DIError dierr = kDIErrNone;
+    A2FileProDOS* pFile;
+
+    if (!fLazyInit)
+        return kDIErrNone;
+
+    /* entries are inserted right after their directory, so one pass does */
+    pFile = (A2FileProDOS*) GetNextFile(NULL);
+    while (pFile != NULL) {
+        if (pFile->fDirPending) {
+            dierr = LoadDirectory(pFile);
+            if (dierr != kDIErrNone)
+                return dierr;
+        }
+        pFile = (A2FileProDOS*) GetNextFile(pFile);
+    }
+
+    LOGI(" ProDOS building usage map for lazy init");
+    fVolumeUsage.Create(fpImg->GetNumBlocks());
+    fLazyInit = false;
+
+    dierr = ScanVolBitmap();
+    if (dierr != kDIErrNone)
+        goto bail;
+
+    /*
+     * RecursiveDirAdd couldn't mark the directory blocks without a map.
+     * The volume dir comes first; after that, only real subdirectory
+     * entries were descended into.
+     */
+    pFile = (A2FileProDOS*) GetNextFile(NULL);
+    MarkDirBlocks(pFile);
+    pFile = (A2FileProDOS*) GetNextFile(pFile);
+    while (pFile != NULL) {
+        if (pFile->fDirEntry.storageType == A2FileProDOS::kStorageDirectory)
+            MarkDirBlocks(pFile);
+        pFile = (A2FileProDOS*) GetNextFile(pFile);
+    }
+
+    dierr = ScanFileUsage();
+    if (dierr != kDIErrNone) {
+        if (dierr == kDIErrCancelled)
+            goto bail;
+
+        /* this might not be fatal; just means that *some* files are bad */
+        LOGI("WARNING: ScanFileUsage returned err=%d", dierr);
+        dierr = kDIErrNone;
+        fpImg->AddNote(DiskImg::kNoteWarning,
+            "Some errors were encountered while scanning files.");
+        fEarlyDamage = true;    // make sure we know it's damaged
+    }
+
+    /* the usage notes are new; the file notes may have been added already */
+    if (!CheckVolumeUsage())
+        fDiskIsGood = false;
+    if (fDiskIsGood) {
+        if (fEarlyDamage || !CheckFileQuality(GetNextFile(NULL), NULL))
+            fDiskIsGood = false;
+    }
+
+bail:
+    /* we can't finish the map, so don't trust the disk */
+    if (dierr != kDIErrNone)
+        fDiskIsGood = false;
+    return dierr;
+}
+
 /*
  * Read some interesting fields from the volume header.
  *
@@ -454,6 +753,9 @@ void DiskFSProDOS::DumpVolHeader(void)
 /*
  * Load the disk's volume bitmap into the object's "fBlockUseMap" pointer.
  *
+ * The map stays resident once it has been read, so this only goes to the
+ * disk the first time.
+ *
  * Does not attempt to analyze the data.
  */
 DIError DiskFSProDOS::LoadVolBitmap(void)
@@ -466,39 +768,47 @@ DIError DiskFSProDOS::LoadVolBitmap(void)
     if (fTotalBlocks <= kVolHeaderBlock)
         return kDIErrBadDiskImage;
 
-    /* should not already be allocated */
-    assert(fBlockUseMap == NULL);
-    delete[] fBlockUseMap;      // just in case
+    /* changes from the previous operation should have been saved or freed */
+    assert(fBitmapPending == 0);
+    if (fBlockUseMap != NULL)
+        return kDIErrNone;
 
     bitBlock = fBitMapPointer;
 
     numBlocks = GetNumBitmapBlocks();   // based on fTotalBlocks
     assert(numBlocks > 0);
+    assert(numBlocks <= 32);            // one bit each in fBitmapDirty
 
     fBlockUseMap = new uint8_t[kBlkSize * numBlocks];
-    if (fBlockUseMap == NULL)
+    fSavedBlockUseMap = new uint8_t[kBlkSize * numBlocks];
+    if (fBlockUseMap == NULL || fSavedBlockUseMap == NULL) {
+        DropVolBitmap();
         return kDIErrMalloc;
+    }
 
     while (numBlocks--) {
         dierr = fpImg->ReadBlock(bitBlock + numBlocks,
                     fBlockUseMap + kBlkSize * numBlocks);
         if (dierr != kDIErrNone) {
-            delete[] fBlockUseMap;
-            fBlockUseMap = NULL;
+            DropVolBitmap();
             return dierr;
         }
     }
+    memcpy(fSavedBlockUseMap, fBlockUseMap, kBlkSize * GetNumBitmapBlocks());
 
     return kDIErrNone;
 }
 
 /*
  * Save our copy of the volume bitmap.
+ *
+ * This commits the changes made since the map was loaded.  The bitmap
+ * blocks themselves are written by FlushVolBitmap, right away if
+ * kParmProDOS_WriteThroughBitmap is set, otherwise whenever we're flushed.
  */
 DIError DiskFSProDOS::SaveVolBitmap(void)
 {
-    DIError dierr = kDIErrNone;
-    int bitBlock, numBlocks;
+    int i, numBlocks;
 
     if (fBlockUseMap == NULL) {
         assert(false);
@@ -507,30 +817,93 @@ DIError DiskFSProDOS::SaveVolBitmap(void)
     assert(fBitMapPointer > kVolHeaderBlock);
     assert(fTotalBlocks > kVolHeaderBlock);
 
-    bitBlock = fBitMapPointer;
-
     numBlocks = GetNumBitmapBlocks();
     assert(numBlocks > 0);
 
-    while (numBlocks--) {
-        dierr = fpImg->WriteBlock(bitBlock + numBlocks,
-                    fBlockUseMap + kBlkSize * numBlocks);
-        if (dierr != kDIErrNone)
-            return dierr;
+    for (i = 0; i < numBlocks; i++) {
+        if (fBitmapPending & (1UL << i)) {
+            memcpy(fSavedBlockUseMap + kBlkSize * i,
+                fBlockUseMap + kBlkSize * i, kBlkSize);
+        }
     }
+    fBitmapDirty |= fBitmapPending;
+    fBitmapPending = 0;
+
+    if (GetParameter(kParmProDOS_WriteThroughBitmap) != 0)
+        return FlushVolBitmap();
 
     return kDIErrNone;
 }
 
 /*
- * Throw away the volume bitmap, discarding any unsaved changes.
+ * Throw away any changes made to the volume bitmap since it was last
+ * saved.  The map itself stays loaded.
  *
  * It's okay to call this if the bitmap isn't loaded.
  */
 void DiskFSProDOS::FreeVolBitmap(void)
+{
+    int i, numBlocks;
+
+    if (fBlockUseMap == NULL || fBitmapPending == 0)
+        return;
+
+    numBlocks = GetNumBitmapBlocks();
+    for (i = 0; i < numBlocks; i++) {
+        if (fBitmapPending & (1UL << i)) {
+            memcpy(fBlockUseMap + kBlkSize * i,
+                fSavedBlockUseMap + kBlkSize * i, kBlkSize);
+        }
+    }
+    fBitmapPending = 0;
+}
+
+/*
+ * Write the bitmap blocks holding saved changes to the disk.
+ */
+DIError DiskFSProDOS::FlushVolBitmap(void)
+{
+    DIError dierr = kDIErrNone;
+    int i, numBlocks;
+
+    if (fBitmapDirty == 0)
+        return kDIErrNone;
+    assert(fSavedBlockUseMap != NULL);
+
+    if (fpImg == NULL || fpImg->GetReadOnly()) {
+        LOGW("ProDOS can't write volume bitmap, discarding changes");
+        return kDIErrAccessDenied;
+    }
+
+    numBlocks = GetNumBitmapBlocks();
+    for (i = 0; i < numBlocks; i++) {
+        if (!(fBitmapDirty & (1UL << i)))
+            continue;
+
+        dierr = fpImg->WriteBlock(fBitMapPointer + i,
+                    fSavedBlockUseMap + kBlkSize * i);
+        if (dierr != kDIErrNone) {
+            LOGI(" ProDOS failed writing bitmap block %d (err=%d)",
+                fBitMapPointer + i, dierr);
+            return dierr;
+        }
+        fBitmapDirty &= ~(1UL << i);
+    }
+
+    return kDIErrNone;
+}
+
+/*
+ * Discard the resident bitmap, along with any changes that haven't been
+ * flushed.
+ */
+void DiskFSProDOS::DropVolBitmap(void)
 {
     delete[] fBlockUseMap;
     fBlockUseMap = NULL;
+    delete[] fSavedBlockUseMap;
+    fSavedBlockUseMap = NULL;
+    fBitmapPending = fBitmapDirty = 0;
 }
 
 /*
@@ -601,6 +974,7 @@ DIError DiskFSProDOS::CreateEmptyBlockMap(void)
     DIError dierr;
 
     /* load from disk; this is just to allocate the data structures */
+    DropVolBitmap();
     dierr = LoadVolBitmap();
     if (dierr != kDIErrNone)
         return dierr;
@@ -617,7 +991,10 @@ DIError DiskFSProDOS::CreateEmptyBlockMap(void)
     for ( ; block < fTotalBlocks; block++)
         SetBlockUseEntry(block, false);
 
+    /* the formatter lets go of the disk when it's done, so write it now */
     dierr = SaveVolBitmap();
+    if (dierr == kDIErrNone)
+        dierr = FlushVolBitmap();
     FreeVolBitmap();
     if (dierr != kDIErrNone)
         return dierr;
@@ -664,10 +1041,13 @@ void DiskFSProDOS::SetBlockUseEntry(long block, bool inUse)
 
     offset = block / 8;
     mask = 0x80 >> (block & 0x07);
+    if (((fBlockUseMap[offset] & mask) == 0) == inUse)
+        return;
     if (!inUse)
         fBlockUseMap[offset] |= mask;
     else
         fBlockUseMap[offset] &= ~mask;
+    fBitmapPending |= 1UL << (offset / kBlkSize);
 }
 
 /*
@@ -696,6 +1076,100 @@ bool DiskFSProDOS::ScanForExtraEntries(void) const
     return false;
 }
 
+/*
+ * Count the leading zero bits in a nonzero 64-bit value.
+ */
+static inline int CountLeadingZeroes64(uint64_t val)
+{
+    assert(val != 0);
+#if defined(__GNUC__)
+    return __builtin_clzll(val);
+#else
+    int count = 0;
+    while ((val & 0x8000000000000000ULL) == 0) {
+        count++;
+        val <<= 1;
+    }
+    return count;
+#endif
+}
+
+/*
+ * Get 64 entries from the block use map.  The map is stored high bit
+ * first, so reading the bytes big-endian puts the lowest-numbered block
+ * in the high bit.
+ */
+static inline uint64_t GetBlockUseWord(const uint8_t* ptr)
+{
+    return (uint64_t) ptr[0] << 56 | (uint64_t) ptr[1] << 48 |
+           (uint64_t) ptr[2] << 40 | (uint64_t) ptr[3] << 32 |
+           (uint64_t) ptr[4] << 24 | (uint64_t) ptr[5] << 16 |
+           (uint64_t) ptr[6] << 8  | (uint64_t) ptr[7];
+}
+
+/*
+ * Find the first free block in [start, end).
+ *
+ * The map is always a whole number of 512-byte blocks, so reading a full
+ * 64-bit word never runs off the end.
+ *
+ * Returns the block number, or -1 if there are no free blocks in range.
+ */
+long DiskFSProDOS::FindFreeBlock(long start, long end) const
+{
+    assert(fBlockUseMap != NULL);
+    assert(end <= fTotalBlocks);
+
+    if (start >= end)
+        return -1;
+
+    long word = start / 64;
+    uint64_t bits = GetBlockUseWord(fBlockUseMap + word * 8);
+    bits &= ~0ULL >> (start & 63);      // ignore entries before "start"
+
+    while (bits == 0) {
+        word++;
+        if (word * 64 >= end)
+            return -1;
+        bits = GetBlockUseWord(fBlockUseMap + word * 8);
+    }
+
+    long block = word * 64 + CountLeadingZeroes64(bits);
+    if (block >= end)
+        return -1;
+    return block;
+}
+
+/*
+ * Find the first in-use block in [start, end).
+ *
+ * Returns the block number, or "end" if every block in range is free.
+ */
+long DiskFSProDOS::FindUsedBlock(long start, long end) const
+{
+    assert(fBlockUseMap != NULL);
+    assert(end <= fTotalBlocks);
+
+    if (start >= end)
+        return end;
+
+    long word = start / 64;
+    uint64_t bits = ~GetBlockUseWord(fBlockUseMap + word * 8);
+    bits &= ~0ULL >> (start & 63);
+
+    while (bits == 0) {
+        word++;
+        if (word * 64 >= end)
+            return end;
+        bits = ~GetBlockUseWord(fBlockUseMap + word * 8);
+    }
+
+    long block = word * 64 + CountLeadingZeroes64(bits);
+    if (block >= end)
+        return end;
+    return block;
+}
+
 /*
  * Allocate a new block on a ProDOS volume.
  *
@@ -705,53 +1179,273 @@ bool DiskFSProDOS::ScanForExtraEntries(void) const
  */
 long DiskFSProDOS::AllocBlock(void)
 {
+    uint16_t block;
+
+    if (AllocBlocks(1, &block) != kDIErrNone)
+        return -1;
+    return block;
+}
+
+/*
+ * Allocate "count" blocks, storing the block numbers in "blockList".
+ *
+ * The search picks up where the last one left off and wraps around once,
+ * so the blocks come back in ascending order unless we wrapped.  Blocks 0
+ * and 1 (the boot blocks) are never handed out.
+ *
+ * Only touches the in-memory copy.  If there isn't room for all of them,
+ * nothing is allocated and kDIErrDiskFull is returned.
+ */
+DIError DiskFSProDOS::AllocBlocks(long count, uint16_t* blockList)
+{
+    assert(fBlockUseMap != NULL);
+    assert(count >= 0);
+
+    long cursor = fAllocCursor;
+    if (cursor < kVolHeaderBlock || cursor >= fTotalBlocks)
+        cursor = kVolHeaderBlock;
+
+    long block = cursor;
+    long end = fTotalBlocks;
+    bool wrapped = false;
+    long found = 0;
+
+    while (found < count) {
+        block = FindFreeBlock(block, end);
+        if (block < 0) {
+            if (wrapped || cursor == kVolHeaderBlock)
+                break;
+            wrapped = true;
+            block = kVolHeaderBlock;
+            end = cursor;
+            continue;
+        }
+
+        SetBlockUseEntry(block, true);
+        blockList[found++] = (uint16_t) block;
+        block++;
+    }
+
+    if (found < count) {
+        LOGI("ProDOS: NOTE: AllocBlocks(%ld) just failed (found %ld)",
+            count, found);
+        while (found--)
+            SetBlockUseEntry(blockList[found], false);
+        return kDIErrDiskFull;
+    }
+
+    fAllocCursor = block;
+    return kDIErrNone;
+}
+
+/*
+ * Allocate "count" blocks for a fork that's being extended, storing the
+ * block numbers in "blockList".
+ *
+ * We take as much as we can of the free run that starts right after
+ * "prevBlock", the last block the fork already has, so the fork stays
+ * contiguous.  Whatever doesn't fit there comes from AllocBlocks.
+ *
+ * Only touches the in-memory copy.  If there isn't room for all of them,
+ * nothing is allocated and kDIErrDiskFull is returned.
+ */
+DIError DiskFSProDOS::AllocBlocksAfter(long prevBlock, long count,
+    uint16_t* blockList)
+{
+    DIError dierr;
+    long start, end, found;
+
     assert(fBlockUseMap != NULL);
+    assert(count >= 0);
+
+    start = prevBlock + 1;
+    if (start <= kVolHeaderBlock || start >= fTotalBlocks)
+        return AllocBlocks(count, blockList);
+
+    end = start + count;
+    if (end > fTotalBlocks)
+        end = fTotalBlocks;
+    end = FindUsedBlock(start, end);
+
+    for (found = 0; start + found < end; found++) {
+        SetBlockUseEntry(start + found, true);
+        blockList[found] = (uint16_t) (start + found);
+    }
+
+    if (found < count) {
+        dierr = AllocBlocks(count - found, blockList + found);
+        if (dierr != kDIErrNone) {
+            while (found--)
+                SetBlockUseEntry(blockList[found], false);
+            return dierr;
+        }
+    } else {
+        fAllocCursor = end;
+    }
+
+    return kDIErrNone;
+}
+
+/*
+ * A run of free blocks, used by AllocExtents.
+ */
+typedef struct FreeExtent {
+    long    start;
+    long    count;
+} FreeExtent;
+
+/* qsort comparators */
+static int CompareExtentsBySize(const void* vp1, const void* vp2)
+{
+    const FreeExtent* pExt1 = (const FreeExtent*) vp1;
+    const FreeExtent* pExt2 = (const FreeExtent*) vp2;
+
+    /* largest first; ties go to the lower block number */
+    if (pExt1->count != pExt2->count)
+        return (pExt1->count > pExt2->count) ? -1 : 1;
+    return (pExt1->start < pExt2->start) ? -1 : 1;
+}
+static int CompareExtentsByStart(const void* vp1, const void* vp2)
+{
+    const FreeExtent* pExt1 = (const FreeExtent*) vp1;
+    const FreeExtent* pExt2 = (const FreeExtent*) vp2;
+
+    return (pExt1->start < pExt2->start) ? -1 : 1;
+}
+
+/*
+ * Allocate "count" blocks in as few contiguous runs as possible, storing
+ * the block numbers in "blockList" in disk order.
+ *
+ * If one free run can hold everything, we use the smallest one that
+ * does (best fit).  Otherwise we take the largest runs until what's left
+ * fits in a single run, and use the best fit for that.  Either way the
+ * number of runs is the minimum possible.
+ *
+ * Meant for allocating whole forks at once; use AllocBlock for one-offs.
+ * Only touches the in-memory copy.  If there isn't room, nothing is
+ * allocated and kDIErrDiskFull is returned.
+ */
+DIError DiskFSProDOS::AllocExtents(long count, uint16_t* blockList)
+{
+    FreeExtent* extents = NULL;
+    long numExtents, numChosen, freeBlocks, remaining;
+    long bestStart, bestCount;
+    long block, i, j;
+
+    assert(fBlockUseMap != NULL);
+    assert(count >= 0);
+
+    if (count == 0)
+        return kDIErrNone;
 
-#if 0   // whoa... this is REALLY slow
     /*
-     * Run through the entire set of blocks until we find one that's not
-     * allocated.  We could probably make this faster by scanning bytes and
-     * then shifting bits, but this is easier and fast enough.
-     *
-     * We don't scan block 0 because (a) it should never be available and
-     * (b) it has a special meaning in some circumstances.  We could probably
-     * start at kVolHeaderBlock+kVolHeaderNumBlocks.
+     * Look for the smallest free run that holds everything.  That's the
+     * usual case, and it doesn't require keeping track of the runs, so we
+     * just count them.  A run that fits exactly can't be beaten, so we
+     * stop looking when we find one.
      */
-    long block;
-    for (block = kVolHeaderBlock; block < fTotalBlocks; block++) {
-        if (!GetBlockUseEntry(block)) {
-            SetBlockUseEntry(block, true);
-            return block;
+    numExtents = freeBlocks = 0;
+    bestStart = -1;
+    bestCount = 0;
+    block = kVolHeaderBlock;
+    while (true) {
+        long start = FindFreeBlock(block, fTotalBlocks);
+        if (start < 0)
+            break;
+        block = FindUsedBlock(start, fTotalBlocks);
+        freeBlocks += block - start;
+        numExtents++;
+
+        if (block - start >= count &&
+            (bestStart < 0 || block - start < bestCount))
+        {
+            bestStart = start;
+            bestCount = block - start;
+            if (bestCount == count)
+                break;
         }
     }
-#endif
 
-    int offset;
-    int maxOffset = (fTotalBlocks + 7) / 8;
+    if (bestStart >= 0) {
+        for (i = 0; i < count; i++) {
+            assert(!GetBlockUseEntry(bestStart + i));
+            SetBlockUseEntry(bestStart + i, true);
+            blockList[i] = (uint16_t) (bestStart + i);
+        }
+        LOGD(" ProDOS allocated %ld blocks in 1 extent", count);
+        return kDIErrNone;
+    }
 
-    for (offset = 0; offset < maxOffset; offset++) {
-        if (fBlockUseMap[offset] != 0) {
-            /* got one, figure out which */
-            int subBlock = 0;
-            uint8_t uch = fBlockUseMap[offset];
-            while ((uch & 0x80) == 0) {
-                subBlock++;
-                uch <<= 1;
-            }
+    if (freeBlocks < count) {
+        LOGI("ProDOS: NOTE: AllocExtents(%ld) failed (%ld free)",
+            count, freeBlocks);
+        return kDIErrDiskFull;
+    }
+
+    /*
+     * Nothing is big enough on its own, so we'll need several runs.  We
+     * know how many there are now, so gather them up.
+     */
+    extents = new FreeExtent[numExtents];
+    if (extents == NULL)
+        return kDIErrMalloc;
+
+    i = 0;
+    block = kVolHeaderBlock;
+    while (i < numExtents) {
+        long start = FindFreeBlock(block, fTotalBlocks);
+        assert(start >= 0);
+        block = FindUsedBlock(start, fTotalBlocks);
+        extents[i].start = start;
+        extents[i].count = block - start;
+        i++;
+    }
+
+    /*
+     * Sort largest-first and take runs until the remainder fits in what's
+     * left.  Then look for the smallest run that holds the remainder;
+     * since the list is sorted, that's the last one that's big enough.
+     */
+    qsort(extents, numExtents, sizeof(FreeExtent), CompareExtentsBySize);
+
+    numChosen = 0;
+    remaining = count;
+    while (remaining > extents[numChosen].count) {
+        remaining -= extents[numChosen].count;
+        numChosen++;
+    }
+    for (j = numChosen; j + 1 < numExtents; j++) {
+        if (extents[j + 1].count < remaining)
+            break;
+    }
+    extents[j].count = remaining;
+    if (j != numChosen) {
+        FreeExtent tmp = extents[numChosen];
+        extents[numChosen] = extents[j];
+        extents[j] = tmp;
+    }
+    numChosen++;
+
+    /* hand them out in disk order */
+    qsort(extents, numChosen, sizeof(FreeExtent), CompareExtentsByStart);
 
-            long block = offset * 8 + subBlock;
+    j = 0;
+    for (i = 0; i < numChosen; i++) {
+        for (block = extents[i].start;
+            block < extents[i].start + extents[i].count; block++)
+        {
             assert(!GetBlockUseEntry(block));
             SetBlockUseEntry(block, true);
-            if (block == 0 || block == 1) {
-                LOGI("PRODOS: GLITCH: rejecting alloc of block 0");
-                continue;
-            }
-            return block;
+            blockList[j++] = (uint16_t) block;
         }
     }
+    assert(j == count);
 
-    LOGI("ProDOS: NOTE: AllocBlock just failed!");
-    return -1;
+    LOGD(" ProDOS allocated %ld blocks in %ld extent(s)", count, numChosen);
+
+    delete[] extents;
+    return kDIErrNone;
 }
 
 /*
@@ -813,7 +1507,7 @@ DIError DiskFSProDOS::RecursiveDirAdd(A2File* pParent, uint16_t dirBlock,
     DirHeader header;
     uint8_t blkBuf[kBlkSize];
     int numEntries, iterations, foundCount;
-    bool first;
+    bool first, unmarked = false;
 
     /* if we get too deep, assume it's a loop */
     if (depth > kMaxDirectoryDepth) {
@@ -837,7 +1531,20 @@ DIError DiskFSProDOS::RecursiveDirAdd(A2File* pParent, uint16_t dirBlock,
         dierr = fpImg->ReadBlock(dirBlock, blkBuf);
         if (dierr != kDIErrNone)
             goto bail;
-        if (pParent->IsVolumeDirectory())
+        if (!fVolumeUsage.GetInitialized()) {
+            /* lazy load, no usage map; all we can check is the bitmap */
+            if (!unmarked &&
+                (dirBlock >= fTotalBlocks || !GetBlockUseEntry(dirBlock)))
+            {
+                LOGI(" ProDOS dir block %u not marked used in base='%s'",
+                    dirBlock, basePath);
+                fpImg->AddNote(DiskImg::kNoteWarning,
+                    "Directory '%s' uses blocks not marked used.",
+                    pParent->GetPathName());
+                fEarlyDamage = true;
+                unmarked = true;
+            }
+        } else if (pParent->IsVolumeDirectory())
             SetBlockUsage(dirBlock, VolumeUsage::kChunkPurposeVolumeDir);
         else
             SetBlockUsage(dirBlock, VolumeUsage::kChunkPurposeSubdir);
@@ -887,7 +1594,8 @@ bail:
 /*
  * Slurp the entries out of a single ProDOS directory block.
  *
- * Recursively calls RecursiveDirAdd for directories.
+ * Recursively calls RecursiveDirAdd for directories, unless we're doing a
+ * lazy init, in which case they're left for LoadDirectory.
  *
  * "*pFound" is increased by the number of valid entries found in this block.
  */
@@ -950,8 +1658,24 @@ DIError DiskFSProDOS::SlurpEntries(A2File* pParent, const DirHeader* pHeader,
             }
         }
 
+        if (fLazyInit) {
+            /* no usage scan to find holes yet; assume there aren't any */
+            if (pEntry->storageType == A2FileProDOS::kStorageExtended) {
+                pFile->fSparseDataEof = pFile->fExtData.eof;
+                pFile->fSparseRsrcEof = pFile->fExtRsrc.eof;
+            } else if (A2FileProDOS::IsRegularFile(pEntry->storageType)) {
+                pFile->fSparseDataEof = pEntry->eof;
+                pFile->fSparseRsrcEof = 0;
+            }
+        }
+
         //pFile->Dump();
-        AddFileToList(pFile);
+        if (fpLoadPrev != NULL) {
+            InsertFileInList(pFile, fpLoadPrev);
+            fpLoadPrev = pFile;
+        } else {
+            AddFileToList(pFile);
+        }
         (*pCount)++;
 
         if (!fpImg->UpdateScanProgress(NULL)) {
@@ -960,7 +1684,11 @@ DIError DiskFSProDOS::SlurpEntries(A2File* pParent, const DirHeader* pHeader,
             goto bail;
         }
 
-        if (pEntry->storageType == A2FileProDOS::kStorageDirectory) {
+        if (pEntry->storageType == A2FileProDOS::kStorageDirectory &&
+            fLazyInit)
+        {
+            pFile->fDirPending = true;
+        } else if (pEntry->storageType == A2FileProDOS::kStorageDirectory) {
             // don't need to check for kStorageVolumeDirHeader here
             dierr = RecursiveDirAdd(pFile, pEntry->keyPointer,
                         pFile->GetPathName(), depth+1);
@@ -979,6 +1707,104 @@ bail:
     return dierr;
 }
 
+/*
+ * Read the entries of a subdirectory that a lazy init left for later.
+ *
+ * They're inserted right after the directory itself, so the list ends up
+ * in the same order the recursive descent in Initialize would produce.
+ * Problems are handled the same way, too: the directory is marked as
+ * damaged, and the disk is no longer considered good.
+ */
+DIError DiskFSProDOS::LoadDirectory(A2FileProDOS* pDir)
+{
+    DIError dierr;
+    A2File* pEnd;
+    A2File* pAncestor;
+    int depth;
+
+    assert(pDir->fDirPending);
+    assert(fpLoadPrev == NULL);
+    pDir->fDirPending = false;
+
+    /* this is how deep the recursive descent would be */
+    depth = 0;
+    for (pAncestor = pDir->GetParent(); pAncestor != NULL;
+        pAncestor = pAncestor->GetParent())
+    {
+        depth++;
+    }
+
+    LOGD(" ProDOS loading dir '%s'", pDir->GetPathName());
+    pEnd = GetNextFile(pDir);
+    fpLoadPrev = pDir;
+    dierr = RecursiveDirAdd(pDir, pDir->fDirEntry.keyPointer,
+                pDir->GetPathName(), depth);
+    fpLoadPrev = NULL;
+    if (dierr != kDIErrNone) {
+        LOGI(" ProDOS failed loading dir '%s' (err=%d)",
+            pDir->GetPathName(), dierr);
+        pDir->SetQuality(A2File::kQualityDamaged);
+        if (dierr != kDIErrCancelled)
+            dierr = kDIErrNone;
+    }
+
+    if (fDiskIsGood) {
+        if (fEarlyDamage || !CheckFileQuality(pDir, pEnd))
+            fDiskIsGood = false;
+    }
+
+    return dierr;
+}
+
+/*
+ * Mark a directory's blocks in the usage map, following the same chain
+ * RecursiveDirAdd does and stopping where it would give up.  Used when
+ * the map is built after the directory was loaded.
+ */
+void DiskFSProDOS::MarkDirBlocks(A2FileProDOS* pDir)
+{
+    DirHeader header;
+    uint8_t blkBuf[kBlkSize];
+    uint16_t dirBlock = pDir->fDirEntry.keyPointer;
+    A2File* pAncestor;
+    int depth, iterations = 0;
+
+    depth = 0;
+    for (pAncestor = pDir->GetParent(); pAncestor != NULL;
+        pAncestor = pAncestor->GetParent())
+    {
+        depth++;
+    }
+    if (depth > kMaxDirectoryDepth)
+        return;
+    if (dirBlock < kVolHeaderBlock || dirBlock >= fpImg->GetNumBlocks())
+        return;
+
+    while (dirBlock && iterations < kMaxCatalogIterations) {
+        if (fpImg->ReadBlock(dirBlock, blkBuf) != kDIErrNone)
+            return;
+        if (pDir->IsVolumeDirectory())
+            SetBlockUsage(dirBlock, VolumeUsage::kChunkPurposeVolumeDir);
+        else
+            SetBlockUsage(dirBlock, VolumeUsage::kChunkPurposeSubdir);
+
+        if (iterations == 0 && GetDirHeader(blkBuf, &header) != kDIErrNone)
+            return;
+
+        /* SlurpEntries bails if the last entry starts past the block */
+        if (4 + (header.entriesPerBlock-1) * header.entryLength >= kBlkSize)
+            return;
+
+        dirBlock = GetShortLE(&blkBuf[0x02]);
+        if (dirBlock != 0 &&
+            (dirBlock < 2 || dirBlock >= fpImg->GetNumBlocks()))
+        {
+            return;
+        }
+        iterations++;
+    }
+}
+
 /*
  * Pull the directory header out of the first block of a directory.
  */
@@ -1066,17 +1892,39 @@ bail:
  * volume usage map.  This is important for detecting damage, and makes
  * later accesses easier.
  *
+ * The index blocks for a stretch of files are read in one go before we
+ * walk through them (see ScanBatch), so we're not seeking all over the
+ * disk for one block at a time.  The files are still processed in list
+ * order, so the usage map comes out the same either way.  Batching can be
+ * turned off with kParmProDOS_BatchScanReads.
+ *
  * As a side-effect, we set the "sparse" length for the file.
  */
 DIError DiskFSProDOS::ScanFileUsage(void)
 {
+    const long kScanBatchBlocks = 8192;     // 4MB
+    const bool batchReads = (GetParameter(kParmProDOS_BatchScanReads) != 0);
     DIError dierr = kDIErrNone;
     A2FileProDOS* pFile;
+    A2FileProDOS* pBatchEnd;
+    ScanBatch batch;
     long blockCount, indexCount, sparseCount;
     uint16_t* blockList = NULL;
     uint16_t* indexList = NULL;
 
+    if (batchReads) {
+        /* no point in making room for more blocks than the disk has */
+        if (fpImg->GetNumBlocks() < kScanBatchBlocks)
+            dierr = batch.Create(fpImg->GetNumBlocks());
+        else
+            dierr = batch.Create(kScanBatchBlocks);
+        if (dierr != kDIErrNone)
+            goto bail;
+        fpScanBatch = &batch;
+    }
+
     pFile = (A2FileProDOS*) GetNextFile(NULL);
+    pBatchEnd = pFile;
     while (pFile != NULL) {
         if (!fpImg->UpdateScanProgress(NULL)) {
             LOGI(" ProDOS cancelled by user");
@@ -1084,6 +1932,9 @@ DIError DiskFSProDOS::ScanFileUsage(void)
             goto bail;
         }
 
+        if (batchReads && pFile == pBatchEnd)
+            pBatchEnd = FillScanBatch(pFile, &batch);
+
         //pFile->Dump();
         if (pFile->GetQuality() == A2File::kQualityDamaged)
             goto skip;
@@ -1116,7 +1967,7 @@ DIError DiskFSProDOS::ScanFileUsage(void)
             indexList = NULL;
 
             /* data fork */
-            if (!A2FileProDOS::IsRegularFile(pFile->fExtRsrc.storageType)) {
+            if (!A2FileProDOS::IsRegularFile(pFile->fExtData.storageType)) {
                 dierr = kDIErrBadFile;
             } else {
                 dierr = pFile->LoadBlockList(pFile->fExtData.storageType,
@@ -1203,9 +2054,80 @@ skip:
     dierr = kDIErrNone;
 
 bail:
+    fpScanBatch = NULL;
     return dierr;
 }
 
+/*
+ * Read the index blocks for the files starting at "pFile" into "pBatch",
+ * stopping when the batch is full.
+ *
+ * Returns the first file that didn't fit, or NULL if we reached the end
+ * of the list.
+ */
+A2FileProDOS* DiskFSProDOS::FillScanBatch(A2FileProDOS* pFile,
+    ScanBatch* pBatch)
+{
+    A2FileProDOS* pStart = pFile;
+
+    pBatch->Reset();
+    while (pFile != NULL) {
+        int storageType[2];
+        uint16_t keyBlock[2];
+        long eof[2];
+        long needed = 0;
+        int numForks = 0;
+        int i;
+
+        /* same forks, in the same order, as ScanFileUsage */
+        if (pFile->GetQuality() == A2File::kQualityDamaged) {
+            /* skipped */
+        } else if (pFile->fDirEntry.storageType == A2FileProDOS::kStorageExtended) {
+            storageType[numForks] = pFile->fExtRsrc.storageType;
+            keyBlock[numForks] = pFile->fExtRsrc.keyBlock;
+            eof[numForks++] = pFile->fExtRsrc.eof;
+            storageType[numForks] = pFile->fExtData.storageType;
+            keyBlock[numForks] = pFile->fExtData.keyBlock;
+            eof[numForks++] = pFile->fExtData.eof;
+        } else {
+            storageType[numForks] = pFile->fDirEntry.storageType;
+            keyBlock[numForks] = pFile->fDirEntry.keyPointer;
+            eof[numForks++] = pFile->fDirEntry.eof;
+        }
+
+        for (i = 0; i < numForks; i++)
+            needed += ScanBatch::BlocksNeeded(storageType[i], eof[i]);
+        if (needed > pBatch->GetRoom()) {
+            /* a single file can't need more than a couple hundred */
+            assert(pFile != pStart);
+            break;
+        }
+        for (i = 0; i < numForks; i++)
+            pBatch->AddFork(storageType[i], keyBlock[i], eof[i]);
+
+        pFile = (A2FileProDOS*) GetNextFile(pFile);
+    }
+
+    pBatch->Read(fpImg);
+    return pFile;
+}
+
+/*
+ * Read a file's index or master block, using the block ScanFileUsage read
+ * ahead of time if there is one.
+ */
+DIError DiskFSProDOS::ReadIndexBlock(uint16_t block, uint8_t* blkBuf)
+{
+    if (fpScanBatch != NULL) {
+        const uint8_t* data = fpScanBatch->FindBlock(block);
+        if (data != NULL) {
+            memcpy(blkBuf, data, kBlkSize);
+            return kDIErrNone;
+        }
+    }
+    return fpImg->ReadBlock(block, blkBuf);
+}
+
 /*
  * Scan a block list into the volume usage map.
  */
@@ -1788,9 +2710,7 @@ DIError DiskFSProDOS::CreateFile(const CreateParms* pParms, A2File** ppNewFile)
     char* basePath = NULL;
     char* fileName = NULL;
     A2FileProDOS* pSubdir = NULL;
-    A2FileDescr* pOpenSubdir = NULL;
     A2FileProDOS* pNewFile = NULL;
-    uint8_t* subdirBuf = NULL;
     const bool allowLowerCase = (GetParameter(kParmProDOS_AllowLowerCase) != 0);
     const bool createUnique = (GetParameter(kParm_CreateUnique) != 0);
     char upperName[A2FileProDOS::kMaxFileName+1];
@@ -1924,6 +2844,16 @@ DIError DiskFSProDOS::CreateFile(const CreateParms* pParms, A2File** ppNewFile)
         goto bail;
     }
 
+    /*
+     * After a lazy init, GetFileByName just loaded the directories along
+     * the path, and may have found damage a full scan would have caught.
+     */
+    assert(!pSubdir->fDirPending);
+    if (!fDiskIsGood) {
+        dierr = kDIErrBadDiskImage;
+        goto bail;
+    }
+
     /*
      * Load the block usage map into memory.  All changes, to the end of this
      * function, are made to the in-memory copy and can be "undone" by simply
@@ -1934,28 +2864,14 @@ DIError DiskFSProDOS::CreateFile(const CreateParms* pParms, A2File** ppNewFile)
         return dierr;
 
     /*
-     * Load the subdir or volume dir into memory, and alloc a new directory
-     * entry.
+     * Get the index for the subdir or volume dir.  This reads the directory
+     * the first time through; after that we only touch the blocks we change.
      */
-    dierr = pSubdir->Open(&pOpenSubdir, false);
-    if (dierr != kDIErrNone)
-        goto bail;
-
-    uint8_t* dirEntryPtr;
-    long dirLen;
-    uint16_t dirBlock, dirKeyBlock;
-    int dirEntrySlot;
-    dierr = AllocDirEntry(pOpenSubdir, &subdirBuf, &dirLen, &dirEntryPtr,
-                &dirKeyBlock, &dirEntrySlot, &dirBlock);
+    DirIndex* pDirIndex;
+    dierr = GetDirIndex(pSubdir, &pDirIndex);
     if (dierr != kDIErrNone)
         goto bail;
 
-    assert(subdirBuf != NULL);
-    assert(dirLen > 0);
-    assert(dirKeyBlock > 0);
-    assert(dirEntrySlot >= 0);
-    assert(dirBlock > 0);
-
     /*
      * Create a copy of the filename with everything in upper case and spaces
      * changed to periods.
@@ -1972,10 +2888,10 @@ DIError DiskFSProDOS::CreateFile(const CreateParms* pParms, A2File** ppNewFile)
     if (createUnique &&
         pParms->storageType != A2FileProDOS::kStorageDirectory)
     {
-        MakeFileNameUnique(subdirBuf, dirLen, upperName);
+        MakeFileNameUnique(pDirIndex, upperName);
     } else {
         /* check to see if it already exists */
-        if (NameExistsInDir(subdirBuf, dirLen, upperName)) {
+        if (NameExistsInDir(pDirIndex, upperName)) {
             if (pParms->storageType == A2FileProDOS::kStorageDirectory)
                 dierr = kDIErrDirectoryExists;
             else
@@ -1984,6 +2900,41 @@ DIError DiskFSProDOS::CreateFile(const CreateParms* pParms, A2File** ppNewFile)
         }
     }
 
+    /*
+     * Find the first available directory entry.  If the directory is full,
+     * and it's not the volume dir, grab a block to extend it with.  Nothing
+     * is written until we know everything else has worked.
+     */
+    long dirSlot, newDirBlock;
+    uint16_t dirBlock, dirKeyBlock;
+    int dirEntrySlot;
+
+    newDirBlock = -1;
+    dirSlot = pDirIndex->FindFreeSlot();
+    if (dirSlot < 0) {
+        if (pSubdir->IsVolumeDirectory()) {
+            /* can't extend the volume dir */
+            dierr = kDIErrVolumeDirFull;
+            goto bail;
+        }
+
+        LOGI(" ProDOS ran out of directory space, adding another block");
+        newDirBlock = AllocBlock();
+        if (newDirBlock < 0) {
+            dierr = kDIErrDiskFull;
+            goto bail;
+        }
+        dirSlot = pDirIndex->GetNumBlocks() * kEntriesPerBlock;
+        dirBlock = (uint16_t) newDirBlock;
+    } else {
+        dirBlock = pDirIndex->GetBlock(dirSlot / kEntriesPerBlock);
+    }
+    dirEntrySlot = (dirSlot % kEntriesPerBlock) +1;
+    dirKeyBlock = pSubdir->fDirEntry.keyPointer;
+    assert(dirSlot > 0);
+    assert(dirBlock > 0);
+    assert(dirKeyBlock > 0);
+
     /*
      * Allocate file storage and initialize:
      *  - For directory, a single block with the directory header.
@@ -2005,6 +2956,34 @@ DIError DiskFSProDOS::CreateFile(const CreateParms* pParms, A2File** ppNewFile)
     assert(keyBlock > 0);
     assert(newEOF >= 0);
 
+    /*
+     * Extend the directory if we need to, and read the block that holds the
+     * new entry.  If this succeeds, we can no longer undo what we have done
+     * by simply bailing.  Assuming this isn't a nibble image with I/O
+     * errors, we shouldn't fail from here on.
+     */
+    if (newDirBlock > 0) {
+        dierr = ExtendDirectory(pSubdir, pDirIndex, (uint16_t) newDirBlock);
+        if (dierr != kDIErrNone) {
+            LOGI(" ProDOS unable to extend directory");
+            goto bail;
+        }
+    }
+
+    uint8_t dirBlkBuf[kBlkSize];
+    uint8_t* dirEntryPtr;
+    dierr = fpImg->ReadBlock(dirBlock, dirBlkBuf);
+    if (dierr != kDIErrNone)
+        goto bail;
+    dirEntryPtr = dirBlkBuf + 4 + (dirEntrySlot-1) * kEntryLength;
+    if ((dirEntryPtr[0x00] & 0xf0) != 0) {
+        LOGI(" ProDOS GLITCH: dir entry %d in block %u is not free",
+            dirEntrySlot, dirBlock);
+        assert(false);
+        dierr = kDIErrBadDirectory;
+        goto bail;
+    }
+
     /*
      * Fill out the newly-created directory entry pointed to by "dirEntryPtr".
      *
@@ -2045,20 +3024,30 @@ DIError DiskFSProDOS::CreateFile(const CreateParms* pParms, A2File** ppNewFile)
     PutShortLE(&dirEntryPtr[0x25], dirKeyBlock);
 
     /*
-     * Write updated directory.  If this succeeds, we can no longer undo
-     * what we have done by simply bailing.  If this fails partway through,
-     * we might have a corrupted disk, so it's best to ensure that it's not
-     * going to fail before we call.
-     *
-     * Assuming this isn't a nibble image with I/O errors, the only way we
-     * can really fail is by running out of disk space.  The block has been
-     * pre-allocated, so this should always work.
+     * Write the entry, and bump the file count in the directory header.  The
+     * header is in the directory's key block, which may be the one we just
+     * modified.
      */
-    dierr = pOpenSubdir->Write(subdirBuf, dirLen);
+    if (dirBlock == dirKeyBlock)
+        PutShortLE(&dirBlkBuf[0x25], GetShortLE(&dirBlkBuf[0x25]) + 1);
+    dierr = fpImg->WriteBlock(dirBlock, dirBlkBuf);
     if (dierr != kDIErrNone) {
-        LOGI(" ProDOS directory write failed (dirLen=%ld)", dirLen);
+        LOGI(" ProDOS directory write failed (block=%u)", dirBlock);
         goto bail;
     }
+    if (dirBlock != dirKeyBlock) {
+        uint8_t hdrBuf[kBlkSize];
+
+        dierr = fpImg->ReadBlock(dirKeyBlock, hdrBuf);
+        if (dierr != kDIErrNone)
+            goto bail;
+        PutShortLE(&hdrBuf[0x25], GetShortLE(&hdrBuf[0x25]) + 1);
+        dierr = fpImg->WriteBlock(dirKeyBlock, hdrBuf);
+        if (dierr != kDIErrNone) {
+            LOGI(" ProDOS directory write failed (block=%u)", dirKeyBlock);
+            goto bail;
+        }
+    }
 
     /*
      * Flush updated block usage map.
@@ -2067,6 +3056,8 @@ DIError DiskFSProDOS::CreateFile(const CreateParms* pParms, A2File** ppNewFile)
     if (dierr != kDIErrNone)
         goto bail;
 
+    pDirIndex->AddName(dirSlot, upperName, (uint16_t) keyBlock);
+
     /*
      * Success!
      *
@@ -2126,23 +3117,20 @@ DIError DiskFSProDOS::CreateFile(const CreateParms* pParms, A2File** ppNewFile)
      * matches that of the previous item in the list.
      *
      * We wouldn't be this far if the disk were damaged, so we don't have to
-     * worry too much about weirdness.  The directory entry allocator always
-     * returns the first available, so we know the previous entry is valid.
+     * worry too much about weirdness.  The directory index always hands out
+     * the first available entry, so we know the previous entry is valid.
      */
-    uint8_t* prevDirEntryPtr;
-    prevDirEntryPtr = GetPrevDirEntry(subdirBuf, dirEntryPtr);
-    if (prevDirEntryPtr == NULL) {
+    if (dirSlot == 1) {
         /* previous entry is volume or subdir header */
         InsertFileInList(pNewFile, pNewFile->GetParent());
         LOGI("Inserted '%s' after '%s'",
             pNewFile->GetPathName(), pNewFile->GetParent()->GetPathName());
     } else {
-        /* dig out the key block pointer and find the matching file */
-        uint16_t prevKeyBlock;
-        assert((prevDirEntryPtr[0x00] & 0xf0) != 0);        // verify storage type
-        prevKeyBlock = GetShortLE(&prevDirEntryPtr[0x11]);
+        /* find the file whose key block matches the previous entry */
+        assert(!pDirIndex->IsSlotFree(dirSlot-1));
         A2File* pPrev;
-        pPrev = FindFileByKeyBlock(pNewFile->GetParent(), prevKeyBlock);
+        pPrev = FindFileByKeyBlock(pNewFile->GetParent(),
+                    pDirIndex->GetKeyBlock(dirSlot-1));
         if (pPrev == NULL) {
             /* should be impossible! */
             assert(false);
@@ -2160,11 +3148,8 @@ DIError DiskFSProDOS::CreateFile(const CreateParms* pParms, A2File** ppNewFile)
 
 bail:
     delete pNewFile;
-    if (pOpenSubdir != NULL)
-        pOpenSubdir->Close();   // writes updated dir entry in parent dir
     FreeVolBitmap();
     delete[] normalizedPath;
-    delete[] subdirBuf;
     delete[] fileName;
     delete[] basePath;
     LOGI(" ProDOS ---^--- CreateFile '%s' DONE", pParms->pathName);
@@ -2228,15 +3213,15 @@ DIError DiskFSProDOS::AllocInitialFileStorage(const CreateParms* pParms,
         if (dierr != kDIErrNone)
             goto bail;
     } else if (pParms->storageType == A2FileProDOS::kStorageExtended) {
+        uint16_t newBlocks[3];
         long dataBlock, rsrcBlock;
 
-        dataBlock = AllocBlock();
-        rsrcBlock = AllocBlock();
-        keyBlock = AllocBlock();
-        if (dataBlock < 0 || rsrcBlock < 0 || keyBlock < 0) {
-            dierr = kDIErrDiskFull;
+        dierr = AllocBlocks(3, newBlocks);
+        if (dierr != kDIErrNone)
             goto bail;
-        }
+        dataBlock = newBlocks[0];
+        rsrcBlock = newBlocks[1];
+        keyBlock = newBlocks[2];
         blocksUsed = 3;
         newEOF = kBlkSize;
 
@@ -2311,6 +3296,9 @@ bail:
  * This function doesn't set anything; it's effectively "const" except
  * that LoadVolBitmap is inherently non-const.
  *
+ * After a lazy init there's no usage map yet, so only the files loaded so
+ * far are examined; LoadVolumeUsage does the rest.
+ *
  * Returns "true" if disk appears to be perfect, "false" otherwise.
  */
 bool DiskFSProDOS::CheckDiskIsGood(void)
@@ -2345,11 +3333,49 @@ bool DiskFSProDOS::CheckDiskIsGood(void)
 
     /*
      * Check for used blocks that aren't marked in-use.
-     *
-     * This requires that VolumeUsage be accurate.  Since this function is
-     * only run during initial startup, any later deviation between VU and
-     * the block use map is irrelevant.
      */
+    if (fVolumeUsage.GetInitialized() && !CheckVolumeUsage())
+        result = false;
+
+    /*
+     * Check for bits set past the end of the actually-needed bits.  For
+     * some reason P8 and GS/OS both examine these bits, and GS/OS will
+     * freak out completely and claim the disk is unrecognizeable ("would
+     * you like to format?") if they're set.
+     */
+    if (ScanForExtraEntries()) {
+        fpImg->AddNote(DiskImg::kNoteWarning,
+            "Blocks past the end of the disk are marked 'in use' in the"
+            " volume bitmap.");
+        /* don't flunk the disk just for this */
+    }
+
+    /*
+     * Scan for "damaged" or "suspicious" files diagnosed earlier.
+     */
+    if (!CheckFileQuality(GetNextFile(NULL), NULL))
+        result = false;
+
+bail:
+    FreeVolBitmap();
+    return result;
+}
+
+/*
+ * Compare the VolumeUsage map against the volume bitmap, adding notes for
+ * used blocks that aren't marked in-use and blocks with conflicting uses.
+ *
+ * This requires that VolumeUsage be accurate.  Since this is only run
+ * right after the map is built, any later deviation between VU and the
+ * block use map is irrelevant.
+ *
+ * Returns "false" if the disk shouldn't be written to.
+ */
+bool DiskFSProDOS::CheckVolumeUsage(void)
+{
+    DIError dierr;
+    bool result = true;
+
     VolumeUsage::ChunkState cstate;
     long blk, notMarked, extraUsed, conflicts;
     notMarked = extraUsed = conflicts = 0;
@@ -2358,8 +3384,7 @@ bool DiskFSProDOS::CheckDiskIsGood(void)
         if (dierr != kDIErrNone) {
             fpImg->AddNote(DiskImg::kNoteWarning,
                 "Internal volume usage error on blk=%ld.", blk);
-            result = false;
-            goto bail;
+            return false;
         }
 
         if (cstate.isUsed && !cstate.isMarkedUsed)
@@ -2388,38 +3413,38 @@ bool DiskFSProDOS::CheckDiskIsGood(void)
         result = false;     // kinda bad -- file deletion leads to trouble
     }
 
-    /*
-     * Check for bits set past the end of the actually-needed bits.  For
-     * some reason P8 and GS/OS both examine these bits, and GS/OS will
-     * freak out completely and claim the disk is unrecognizeable ("would
-     * you like to format?") if they're set.
-     */
-    if (ScanForExtraEntries()) {
-        fpImg->AddNote(DiskImg::kNoteWarning,
-            "Blocks past the end of the disk are marked 'in use' in the"
-            " volume bitmap.");
-        /* don't flunk the disk just for this */
-    }
+    return result;
+}
 
-    /*
-     * Scan for "damaged" or "suspicious" files diagnosed earlier.
-     */
-    bool damaged, suspicious;
-    ScanForDamagedFiles(&damaged, &suspicious);
+/*
+ * Look for "damaged" or "suspicious" files diagnosed earlier, from "pFile"
+ * up to (but not including) "pEnd".
+ *
+ * Returns "false", after adding a note, if any turn up.
+ */
+bool DiskFSProDOS::CheckFileQuality(A2File* pFile, A2File* pEnd)
+{
+    bool damaged = false;
+    bool suspicious = false;
+
+    while (pFile != pEnd) {
+        if (pFile->GetQuality() == A2File::kQualityDamaged)
+            damaged = true;
+        if (pFile->GetQuality() != A2File::kQualityGood)
+            suspicious = true;
+        pFile = GetNextFile(pFile);
+    }
 
     if (damaged) {
         fpImg->AddNote(DiskImg::kNoteWarning,
             "One or more files are damaged.");
-        result = false;
+        return false;
     } else if (suspicious) {
         fpImg->AddNote(DiskImg::kNoteWarning,
             "One or more files look suspicious.");
-        result = false;
+        return false;
     }
-
-bail:
-    FreeVolBitmap();
-    return result;
+    return true;
 }
 
 /*
@@ -2781,267 +3806,461 @@ void DiskFSProDOS::UpperCaseName(char* upperName, const char* name)
             upperName[i] = toupper(ch);
     }
 
-    /* null terminate with prejudice -- we memcpy this buffer into subdirs */
-    for ( ; i <= A2FileProDOS::kMaxFileName; i++)
-        upperName[i] = '\0';
+    /* null terminate with prejudice -- we memcpy this buffer into subdirs */
+    for ( ; i <= A2FileProDOS::kMaxFileName; i++)
+        upperName[i] = '\0';
+}
+
+/*
+ * ===========================================================================
+ *      DiskFSProDOS::DirIndex
+ * ===========================================================================
+ */
+
+/*
+ * Hash a filename, ignoring case.  (FNV-1a.)
+ */
+/*static*/ unsigned long DiskFSProDOS::DirIndex::HashName(const char* name)
+{
+    uint32_t hash = 2166136261U;
+
+    while (*name != '\0') {
+        hash ^= (uint8_t) toupper(*name++);
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+/*
+ * Compare two filenames, ignoring case.
+ */
+/*static*/ bool DiskFSProDOS::DirIndex::NamesMatch(const char* name1,
+    const char* name2)
+{
+    while (*name1 != '\0') {
+        if (toupper(*name1++) != toupper(*name2++))
+            return false;
+    }
+    return (*name2 == '\0');
+}
+
+/*
+ * Append a block to the directory.  All of its entries start out free,
+ * except for the directory header in the first block.
+ */
+void DiskFSProDOS::DirIndex::AddBlock(uint16_t block)
+{
+    if (fNumBlocks == fMaxBlocks) {
+        long newMax = (fMaxBlocks == 0) ? 4 : fMaxBlocks * 2;
+        long oldSlots = fMaxBlocks * kEntriesPerBlock;
+        long newSlots = newMax * kEntriesPerBlock;
+        long oldWords = (oldSlots + 63) / 64;
+        long newWords = (newSlots + 63) / 64;
+
+        uint16_t* newBlocks = new uint16_t[newMax];
+        NameBuf* newNames = new NameBuf[newSlots];
+        uint16_t* newKeyBlocks = new uint16_t[newSlots];
+        long* newChain = new long[newSlots];
+        uint64_t* newFreeMap = new uint64_t[newWords];
+
+        if (fMaxBlocks != 0) {
+            memcpy(newBlocks, fBlocks, sizeof(uint16_t) * fNumBlocks);
+            memcpy(newNames, fNames, sizeof(NameBuf) * oldSlots);
+            memcpy(newKeyBlocks, fKeyBlocks, sizeof(uint16_t) * oldSlots);
+            memcpy(newChain, fChain, sizeof(long) * oldSlots);
+            memcpy(newFreeMap, fFreeMap, sizeof(uint64_t) * oldWords);
+        }
+        memset(newFreeMap + oldWords, 0,
+            sizeof(uint64_t) * (newWords - oldWords));
+
+        delete[] fBlocks;
+        delete[] fNames;
+        delete[] fKeyBlocks;
+        delete[] fChain;
+        delete[] fFreeMap;
+        fBlocks = newBlocks;
+        fNames = newNames;
+        fKeyBlocks = newKeyBlocks;
+        fChain = newChain;
+        fFreeMap = newFreeMap;
+        fMaxBlocks = newMax;
+    }
+
+    long firstSlot = fNumBlocks * kEntriesPerBlock;
+    long slot;
+
+    fBlocks[fNumBlocks++] = block;
+    for (slot = firstSlot; slot < firstSlot + kEntriesPerBlock; slot++) {
+        fNames[slot][0] = '\0';
+        fKeyBlocks[slot] = 0;
+        fChain[slot] = -1;
+        SetSlotFree(slot, slot != 0);
+    }
+
+    if (fNumBlocks * kEntriesPerBlock > fNumBuckets)
+        Rehash();
+}
+
+/*
+ * Rebuild the hash table with at least one bucket per slot.
+ */
+void DiskFSProDOS::DirIndex::Rehash(void)
+{
+    long numSlots = fNumBlocks * kEntriesPerBlock;
+    long slot;
+
+    fNumBuckets = 16;
+    while (fNumBuckets < numSlots)
+        fNumBuckets *= 2;
+    delete[] fBuckets;
+    fBuckets = new long[fNumBuckets];
+    memset(fBuckets, 0xff, sizeof(long) * fNumBuckets);     // all -1
+
+    for (slot = 1; slot < numSlots; slot++) {
+        if (IsSlotFree(slot))
+            continue;
+        long bucket = HashName(fNames[slot]) & (fNumBuckets-1);
+        fChain[slot] = fBuckets[bucket];
+        fBuckets[bucket] = slot;
+    }
+}
+
+/*
+ * Record a name in a free slot.
+ */
+void DiskFSProDOS::DirIndex::AddName(long slot, const char* name,
+    uint16_t keyBlock)
+{
+    assert(slot > 0 && slot < fNumBlocks * kEntriesPerBlock);
+    assert(IsSlotFree(slot));
+
+    strncpy(fNames[slot], name, A2FileProDOS::kMaxFileName);
+    fNames[slot][A2FileProDOS::kMaxFileName] = '\0';
+    fKeyBlocks[slot] = keyBlock;
+    SetSlotFree(slot, false);
+
+    long bucket = HashName(fNames[slot]) & (fNumBuckets-1);
+    fChain[slot] = fBuckets[bucket];
+    fBuckets[bucket] = slot;
+}
+
+/*
+ * Forget the name in a slot, making it available again.
+ */
+void DiskFSProDOS::DirIndex::RemoveName(long slot)
+{
+    assert(slot > 0 && slot < fNumBlocks * kEntriesPerBlock);
+    assert(!IsSlotFree(slot));
+
+    long* pLink = &fBuckets[HashName(fNames[slot]) & (fNumBuckets-1)];
+    while (*pLink != slot) {
+        assert(*pLink >= 0);
+        pLink = &fChain[*pLink];
+    }
+    *pLink = fChain[slot];
+
+    fNames[slot][0] = '\0';
+    fKeyBlocks[slot] = 0;
+    fChain[slot] = -1;
+    SetSlotFree(slot, true);
+    if (slot < fFirstFree)
+        fFirstFree = slot;
+}
+
+/*
+ * Find the slot holding "name".
+ *
+ * Returns the slot number, or -1 if the name isn't in the directory.
+ */
+long DiskFSProDOS::DirIndex::FindName(const char* name) const
+{
+    long slot = fBuckets[HashName(name) & (fNumBuckets-1)];
+
+    while (slot >= 0) {
+        if (NamesMatch(fNames[slot], name))
+            return slot;
+        slot = fChain[slot];
+    }
+    return -1;
+}
+
+/*
+ * Find the first free slot.  The slot stays free until AddName is called.
+ *
+ * Returns the slot number, or -1 if the directory is full.
+ */
+long DiskFSProDOS::DirIndex::FindFreeSlot(void)
+{
+    long numSlots = fNumBlocks * kEntriesPerBlock;
+    long word = fFirstFree / 64;
+    uint64_t bits;
+
+    if (fFirstFree >= numSlots)
+        return -1;
+
+    /* bits past the last slot are never set, so no need to mask them */
+    bits = fFreeMap[word] & (~0ULL >> (fFirstFree & 63));
+    while (bits == 0) {
+        word++;
+        if (word * 64 >= numSlots) {
+            fFirstFree = numSlots;
+            return -1;
+        }
+        bits = fFreeMap[word];
+    }
+
+    fFirstFree = word * 64 + CountLeadingZeroes64(bits);
+    assert(fFirstFree < numSlots);
+    return fFirstFree;
+}
+
+/*
+ * Convert a directory block and entry index (as stored in A2FileProDOS) to
+ * a slot number.
+ *
+ * Returns the slot number, or -1 if the block isn't part of the directory.
+ */
+long DiskFSProDOS::DirIndex::FindSlot(uint16_t block, int entryIdx) const
+{
+    long idx;
+
+    assert(entryIdx >= 0 && entryIdx < kEntriesPerBlock);
+    for (idx = 0; idx < fNumBlocks; idx++) {
+        if (fBlocks[idx] == block)
+            return idx * kEntriesPerBlock + entryIdx;
+    }
+    return -1;
+}
+
+
+/*
+ * Get the index for directory "pDir", building it if this is the first
+ * time we've needed it.
+ */
+DIError DiskFSProDOS::GetDirIndex(A2FileProDOS* pDir, DirIndex** ppIndex)
+{
+    DIError dierr;
+    DirIndex* pIndex;
+
+    pIndex = FindDirIndex(pDir);
+    if (pIndex != NULL) {
+        *ppIndex = pIndex;
+        return kDIErrNone;
+    }
+
+    dierr = LoadDirIndex(pDir, &pIndex);
+    if (dierr != kDIErrNone)
+        return dierr;
+
+    pIndex->fpNext = fpDirIndexList;
+    fpDirIndexList = pIndex;
+    *ppIndex = pIndex;
+    return kDIErrNone;
+}
+
+/*
+ * Find the index for directory "pDir", if we've built one.
+ */
+DiskFSProDOS::DirIndex* DiskFSProDOS::FindDirIndex(const A2FileProDOS* pDir) const
+{
+    DirIndex* pIndex;
+
+    for (pIndex = fpDirIndexList; pIndex != NULL; pIndex = pIndex->fpNext) {
+        if (pIndex->GetDir() == pDir)
+            return pIndex;
+    }
+    return NULL;
 }
 
 /*
- * Allocate a new directory entry.  We start by reading the entire thing
- * into memory.  If the current set of allocated directory blocks is full,
- * and we're not operating on the volume dir, we extend the directory.
- *
- * This just allocates the space; it does not fill in any details, except
- * for the prev/next block pointers and the file count in the header.  (One
- * small exception: if we have to extend the directory, the "prev/next" fields
- * of the new block will be filled in.)
- *
- * The volume in-use block map must be loaded before this is called.  If
- * this needs to extend the directory, a new block will be allocated.
- *
- * Returns a pointer to the new entry, and a whole bunch of other stuff:
- *  "ppDir" gets a pointer to newly-allocated memory with the whole directory
- *  "pDirLen" is the size of the *ppDir buffer
- *  "ppDirEntry" gets a memory pointer to the start of the created entry
- *  "pDirKeyBlock" gets the key block of the directory as a whole
- *  "pDirEntrySlot" gets the slot number within the directory block (first is 1)
- *  "pDirBlock" gets the actual block in which the created entry resides
- *
- * The caller should Write the entire thing to "pOpenSubdir" after filling
- * in the new details for the entry.
- *
- * Possible reasons for failure: disk is out of space, volume dir is out
- * of space, pOpenSubdir is screwy.
+ * Read a directory from disk and build an index for it.
  *
- * We guarantee that we will return the first available entry in the current
- * directory.
+ * We follow the chain of blocks from the key block, stopping when it ends
+ * or when we've read as many blocks as the directory's EOF says it has.
  */
-DIError DiskFSProDOS::AllocDirEntry(A2FileDescr* pOpenSubdir, uint8_t** ppDir,
-    long* pDirLen, uint8_t** ppDirEntry, uint16_t* pDirKeyBlock,
-    int* pDirEntrySlot, uint16_t* pDirBlock)
+DIError DiskFSProDOS::LoadDirIndex(A2FileProDOS* pDir, DirIndex** ppIndex)
 {
-    assert(pOpenSubdir != NULL);
-    *ppDirEntry = NULL;
-    *pDirLen = -1;
-    *pDirKeyBlock = 0;
-    *pDirEntrySlot = -1;
-    *pDirBlock = 0;
-
     DIError dierr = kDIErrNone;
-    uint8_t* dirBuf = NULL;
-    long dirLen;
-    A2FileProDOS* pFile;
-    long newBlock = -1;
+    DirIndex* pIndex = NULL;
+    uint8_t blkBuf[kBlkSize];
+    char name[A2FileProDOS::kMaxFileName+1];
+    long dirLen, maxBlocks;
+    uint16_t block;
 
-    /*
-     * Load the subdir into memory.
-     */
-    pFile = (A2FileProDOS*) pOpenSubdir->GetFile();
-    dirLen = (long) pFile->GetDataLength();
-    if (dirLen < 512 || (dirLen % 512) != 0) {
+    dirLen = (long) pDir->GetDataLength();
+    if (dirLen < kBlkSize || (dirLen % kBlkSize) != 0) {
         LOGI(" ProDOS GLITCH: funky dir EOF %ld (quality=%d)",
-            dirLen, pFile->GetQuality());
-        dierr = kDIErrBadFile;
-        goto bail;
-    }
-    dirBuf = new uint8_t[dirLen];
-    if (dirBuf == NULL) {
-        dierr = kDIErrMalloc;
-        goto bail;
-    }
-
-    dierr = pOpenSubdir->Read(dirBuf, dirLen);
-    if (dierr != kDIErrNone)
-        goto bail;
-
-    if (dirBuf[0x23] != kEntryLength ||
-        dirBuf[0x24] != kEntriesPerBlock)
-    {
-        LOGI(" ProDOS GLITCH: funky entries per block %d", dirBuf[0x24]);
-        dierr = kDIErrBadDirectory;
-        goto bail;
+            dirLen, pDir->GetQuality());
+        return kDIErrBadFile;
     }
+    maxBlocks = dirLen / kBlkSize;
 
-    /*
-     * Find the first available entry (storage_type is zero).  We need to
-     * step through this by blocks, because the data is block-oriented.
-     * If we run off the end of the last block, (re)alloc a new one.
-     */
-    uint8_t* pDirEntry;
-    int blockIdx;
-    int entryIdx;
-
-    pDirEntry = NULL;    // make the compiler happy
-    entryIdx = -1;      // make the compiler happy
-
-    for (blockIdx = 0; blockIdx < dirLen / 512; blockIdx++) {
-        pDirEntry = dirBuf + 512*blockIdx + 4;  // skip 4 bytes of prev/next
+    pIndex = new DirIndex(pDir);
 
-        for (entryIdx = 0; entryIdx < kEntriesPerBlock;
-                                        entryIdx++, pDirEntry += kEntryLength)
-        {
-            if ((pDirEntry[0x00] & 0xf0) == 0) {
-                LOGI(" ProDOS  Found empty dir entry in slot %d", entryIdx);
-                break;      // found one; break out of inner loop
-            }
-        }
-        if (entryIdx < kEntriesPerBlock)
-            break;      // out of outer loop
-    }
-    if (blockIdx == dirLen / 512) {
-        if (((dirBuf[0x04] & 0xf0) >> 4) == A2FileProDOS::kStorageVolumeDirHeader)
-        {
-            /* can't extend the volume dir */
-            dierr = kDIErrVolumeDirFull;
+    block = pDir->fDirEntry.keyPointer;
+    while (block != 0 && pIndex->GetNumBlocks() < maxBlocks) {
+        if (block < kVolHeaderBlock || block >= fpImg->GetNumBlocks()) {
+            LOGI(" ProDOS ERROR: directory block %u out of range", block);
+            dierr = kDIErrInvalidBlock;
             goto bail;
         }
+        dierr = fpImg->ReadBlock(block, blkBuf);
+        if (dierr != kDIErrNone)
+            goto bail;
 
-        LOGI(" ProDOS ran out of directory space, adding another block");
-
-        /*
-         * Request an unused block from the system.  Point the "next" pointer
-         * in the last block at it, so that when we go to write this dir
-         * we will know where to put it.
-         */
-        uint8_t* pBlock;
-        pBlock = dirBuf + 512 * (blockIdx-1);
-        if (pBlock[0x02] != 0) {
-            LOGI(" ProDOS GLITCH: adding to block with nonzero next ptr!");
+        if (pIndex->GetNumBlocks() == 0 &&
+            (blkBuf[0x23] != kEntryLength || blkBuf[0x24] != kEntriesPerBlock))
+        {
+            LOGI(" ProDOS GLITCH: funky entries per block %d", blkBuf[0x24]);
             dierr = kDIErrBadDirectory;
             goto bail;
         }
 
-        newBlock = AllocBlock();
-        if (newBlock < 0) {
-            dierr = kDIErrDiskFull;
-            goto bail;
-        }
+        long firstSlot = pIndex->GetNumBlocks() * kEntriesPerBlock;
+        const uint8_t* pDirEntry = blkBuf + 4;  // skip 4 bytes of prev/next
+        int entryIdx;
 
-        PutShortLE(&pBlock[0x02], (uint16_t) newBlock);   // set "next"
+        pIndex->AddBlock(block);
+        for (entryIdx = 0; entryIdx < kEntriesPerBlock;
+                                        entryIdx++, pDirEntry += kEntryLength)
+        {
+            /* skip directory header and unused entries */
+            if (firstSlot + entryIdx == 0 || (pDirEntry[0x00] & 0xf0) == 0)
+                continue;
 
-        /*
-         * Extend our memory buffer to hold the new entry.
-         */
-        uint8_t* newSpace = new uint8_t[dirLen + 512];
-        if (newSpace == NULL) {
-            dierr = kDIErrMalloc;
-            goto bail;
+            int nameLen = pDirEntry[0x00] & 0x0f;
+            memcpy(name, &pDirEntry[0x01], nameLen);
+            name[nameLen] = '\0';
+            pIndex->AddName(firstSlot + entryIdx, name,
+                GetShortLE(&pDirEntry[0x11]));
         }
-        memcpy(newSpace, dirBuf, dirLen);
-        memset(newSpace + dirLen, 0, 512);
-        delete[] dirBuf;
-        dirBuf = newSpace;
-        dirLen += 512;
-
-        /*
-         * Set the "prev" pointer in the new block to point at the last
-         * block of the existing directory structure.
-         */
-        long lastBlock;
-        dierr = pOpenSubdir->GetStorage(blockIdx-1, &lastBlock);
-        if (dierr != kDIErrNone)
-            goto bail;
-        pBlock = dirBuf + 512 * blockIdx;
-        PutShortLE(&pBlock[0x00], (uint16_t) lastBlock);    // set "prev"
-        assert(GetShortLE(&pBlock[0x02]) == 0);             // "next" pointer
 
-        /*
-         * Finally, point pDirEntry at the first entry in the new area.
-         */
-        pDirEntry = pBlock + 4;
-        entryIdx = 0;
-        assert(pDirEntry[0x00] == 0x00);
+        block = GetShortLE(&blkBuf[0x02]);
     }
 
-    /*
-     * Success.  Update the file count in the header.
-     */
-    uint16_t count;
-    count = GetShortLE(&dirBuf[0x25]);
-    count++;
-    PutShortLE(&dirBuf[0x25], count);
-
-    long whichBlock;
-
-    *ppDir = dirBuf;
-    *pDirLen = dirLen;
-    *ppDirEntry = pDirEntry;
-    *pDirKeyBlock = pFile->fDirEntry.keyPointer;
-    *pDirEntrySlot = entryIdx +1;
-    if (blockIdx == ((A2FDProDOS*)pOpenSubdir)->GetBlockCount()) {
-        /* not yet added to block list, so can't use GetStorage */
-        assert(newBlock > 0);
-        *pDirBlock = (uint16_t) newBlock;
-    } else {
-        assert(newBlock < 0);
-        dierr = pOpenSubdir->GetStorage(blockIdx, &whichBlock);
-        assert(dierr == kDIErrNone);
-        *pDirBlock = (uint16_t) whichBlock;
-    }
-    dirBuf = NULL;
+    *ppIndex = pIndex;
+    pIndex = NULL;
 
 bail:
-    delete[] dirBuf;
+    delete pIndex;
     return dierr;
 }
 
 /*
- * Given a pointer to a directory buffer and a pointer to an entry, find the
- * previous entry.  (This is handy when trying to figure out where to insert
- * a new entry into the DiskFS linear file list.)
- *
- * If the previous entry is the first in the list (i.e. it's a volume or
- * subdir header), this returns NULL.
+ * Throw out the index for a directory, e.g. because it was deleted or its
+ * contents were rewritten behind our back.  It'll be rebuilt from disk if
+ * we need it again.
+ */
+void DiskFSProDOS::DiscardDirIndex(A2FileProDOS* pDir)
+{
+    DirIndex** ppLink = &fpDirIndexList;
+
+    while (*ppLink != NULL) {
+        if ((*ppLink)->GetDir() == pDir) {
+            DirIndex* pIndex = *ppLink;
+            *ppLink = pIndex->fpNext;
+            delete pIndex;
+            return;
+        }
+        ppLink = &(*ppLink)->fpNext;
+    }
+}
+
+/*
+ * Throw out all directory indexes.
+ */
+void DiskFSProDOS::FreeDirIndexes(void)
+{
+    while (fpDirIndexList != NULL) {
+        DirIndex* pNext = fpDirIndexList->fpNext;
+        delete fpDirIndexList;
+        fpDirIndexList = pNext;
+    }
+}
+
+/*
+ * Add a block to the end of a (non-volume) directory.
  *
- * This is a little awkward because the directories are chopped up into
- * 512-byte blocks, with 13 entries per block (which doesn't completely fill
- * the block, leaving gaps we have to skip around).  If the previous entry is
- * in the same block we can just return (ptr-0x27), but if it's in a previous
- * block we need to return the last entry in the previous.
+ * "newBlock" must already be marked as in use in the volume bitmap.  We
+ * write the new, empty block, link the old last block to it, and update
+ * the directory's size in its parent's entry and in pDir->fDirEntry.
  */
-uint8_t* DiskFSProDOS::GetPrevDirEntry(uint8_t* buf, uint8_t* ptr)
+DIError DiskFSProDOS::ExtendDirectory(A2FileProDOS* pDir, DirIndex* pIndex,
+    uint16_t newBlock)
 {
-    assert(buf != NULL);
-    assert(ptr != NULL);
+    DIError dierr;
+    uint8_t blkBuf[kBlkSize];
+    uint16_t lastBlock;
 
-    const int kStartOffset = 4;
+    assert(!pDir->IsVolumeDirectory());
+    assert(pDir->fParentDirBlock != 0);
 
-    if (ptr == buf + kStartOffset || ptr == buf + kStartOffset + kEntryLength)
-        return NULL;
+    lastBlock = pIndex->GetBlock(pIndex->GetNumBlocks() - 1);
+    dierr = fpImg->ReadBlock(lastBlock, blkBuf);
+    if (dierr != kDIErrNone)
+        return dierr;
+    if (GetShortLE(&blkBuf[0x02]) != 0) {
+        LOGI(" ProDOS GLITCH: adding to block with nonzero next ptr!");
+        return kDIErrBadDirectory;
+    }
+    PutShortLE(&blkBuf[0x02], newBlock);    // set "next"
 
-    while (ptr - buf > 512)
-        buf += 512;
+    /* write the new block first, so we never link to garbage */
+    uint8_t newBuf[kBlkSize];
+    memset(newBuf, 0, sizeof(newBuf));
+    PutShortLE(&newBuf[0x00], lastBlock);   // set "prev"
+    dierr = fpImg->WriteBlock(newBlock, newBuf);
+    if (dierr != kDIErrNone)
+        return dierr;
+    dierr = fpImg->WriteBlock(lastBlock, blkBuf);
+    if (dierr != kDIErrNone)
+        return dierr;
 
-    assert((ptr - buf - kStartOffset) % kEntryLength == 0);
+    uint16_t newBlocksUsed = (uint16_t) (pIndex->GetNumBlocks() + 1);
+    uint32_t newEOF = (uint32_t) newBlocksUsed * kBlkSize;
 
-    if (ptr == buf + kStartOffset) {
-        /* whoops, went too far */
-        buf -= 512;
-        return buf + kStartOffset + kEntryLength * (kEntriesPerBlock-1);
-    } else {
-        return ptr - kEntryLength;
+    /* update the directory's entry in its parent */
+    dierr = fpImg->ReadBlock(pDir->fParentDirBlock, blkBuf);
+    if (dierr != kDIErrNone)
+        return dierr;
+    uint8_t* pParentPtr = blkBuf + 0x04 + pDir->fParentDirIdx * kEntryLength;
+    if ((pParentPtr[0x00] >> 4) != A2FileProDOS::kStorageDirectory) {
+        LOGW("ProDOS ERROR: parent pointer has wrong entry??");
+        assert(false);
+        return kDIErrInternal;
     }
+    PutShortLE(&pParentPtr[0x13], newBlocksUsed);
+    PutShortLE(&pParentPtr[0x15], (uint16_t) newEOF);
+    pParentPtr[0x17] = (uint8_t) (newEOF >> 16);
+    dierr = fpImg->WriteBlock(pDir->fParentDirBlock, blkBuf);
+    if (dierr != kDIErrNone)
+        return dierr;
+
+    pDir->fDirEntry.blocksUsed = newBlocksUsed;
+    pDir->fDirEntry.eof = newEOF;
+    pDir->fSparseDataEof = newEOF;
+    pIndex->AddBlock(newBlock);
+
+    return kDIErrNone;
 }
 
 /*
  * Make the name pointed to by "fileName" unique within the directory
- * loaded in "subdirBuf".  The name should already be trimmed to 15 chars
+ * described by "pIndex".  The name should already be trimmed to 15 chars
  * or less and converted to upper-case only, and be in a buffer that can
  * hold at least kMaxFileName+1 bytes.
  *
  * Returns an error on failure, which should only happen if there are a
  * large number of files with similar names.
  */
-DIError DiskFSProDOS::MakeFileNameUnique(const uint8_t* dirBuf, long dirLen,
+DIError DiskFSProDOS::MakeFileNameUnique(const DirIndex* pIndex,
     char* fileName)
 {
-    assert(dirBuf != NULL);
-    assert(dirLen > 0);
-    assert((dirLen % 512) == 0);
+    assert(pIndex != NULL);
     assert(fileName != NULL);
     assert(strlen(fileName) <= A2FileProDOS::kMaxFileName);
 
-    if (!NameExistsInDir(dirBuf, dirLen, fileName))
+    if (!NameExistsInDir(pIndex, fileName))
         return kDIErrNone;
 
     LOGI(" ProDOS   found duplicate of '%s', making unique", fileName);
@@ -3094,7 +4313,7 @@ DIError DiskFSProDOS::MakeFileNameUnique(const uint8_t* dirBuf, long dirLen,
         memcpy(fileName + copyOffset, digitBuf, digitLen);
         if (dotLen != 0)
             memcpy(fileName + copyOffset + digitLen, dotBuf, dotLen);
-    } while (NameExistsInDir(dirBuf, dirLen, fileName));
+    } while (NameExistsInDir(pIndex, fileName));
 
     LOGI(" ProDOS  converted to unique name: %s", fileName);
 
@@ -3102,41 +4321,16 @@ DIError DiskFSProDOS::MakeFileNameUnique(const uint8_t* dirBuf, long dirLen,
 }
 
 /*
- * Determine whether the specified file name exists in the raw directory
- * buffer.
+ * Determine whether the specified file name exists in the directory.
  *
  * This should be called with the upper-case-only version of the filename.
  */
-bool DiskFSProDOS::NameExistsInDir(const uint8_t* dirBuf, long dirLen,
+bool DiskFSProDOS::NameExistsInDir(const DirIndex* pIndex,
     const char* fileName)
 {
-    const uint8_t* pDirEntry;
-    int blockIdx;
-    int entryIdx;
-    int nameLen = strlen(fileName);
-
-    assert(nameLen <= A2FileProDOS::kMaxFileName);
-
-    for (blockIdx = 0; blockIdx < dirLen / 512; blockIdx++) {
-        pDirEntry = dirBuf + 512*blockIdx + 4;      // skip 4 bytes of prev/next
-
-        for (entryIdx = 0; entryIdx < kEntriesPerBlock;
-                                        entryIdx++, pDirEntry += kEntryLength)
-        {
-            /* skip directory header */
-            if (blockIdx == 0 && entryIdx == 0)
-                continue;
-
-            if ((pDirEntry[0x00] & 0xf0) != 0 &&
-                (pDirEntry[0x00] & 0x0f) == nameLen &&
-                strncmp((char*) &pDirEntry[0x01], fileName, nameLen) == 0)
-            {
-                return true;
-            }
-        }
-    }
+    assert(strlen(fileName) <= A2FileProDOS::kMaxFileName);
 
-    return false;
+    return (pIndex->FindName(fileName) >= 0);
 }
 
 /*
@@ -3197,9 +4391,11 @@ DIError DiskFSProDOS::DeleteFile(A2File* pGenericFile)
                     &indexCount, &indexList);
         if (dierr != kDIErrNone)
             goto bail;
-        FreeBlocks(blockCount, blockList);
-        if (indexList != NULL)   // no indices for seedling
-            FreeBlocks(indexCount, indexList);
+        dierr = FreeBlocks(blockCount, blockList);
+        if (dierr == kDIErrNone && indexList != NULL)   // no indices for seedling
+            dierr = FreeBlocks(indexCount, indexList);
+        if (dierr != kDIErrNone)
+            goto bail;
         delete[] blockList;
         delete[] indexList;
         indexList = NULL;
@@ -3208,7 +4404,9 @@ DIError DiskFSProDOS::DeleteFile(A2File* pGenericFile)
         blockCount = 1;
         blockList = new uint16_t[blockCount];
         blockList[0] = pFile->fDirEntry.keyPointer;
-        FreeBlocks(blockCount, blockList);
+        dierr = FreeBlocks(blockCount, blockList);
+        if (dierr != kDIErrNone)
+            goto bail;
         delete[] blockList;
         blockList = NULL;
 
@@ -3248,9 +4446,11 @@ DIError DiskFSProDOS::DeleteFile(A2File* pGenericFile)
     if (dierr != kDIErrNone)
         goto bail;
 
-    FreeBlocks(blockCount, blockList);
-    if (indexList != NULL)
-        FreeBlocks(indexCount, indexList);
+    dierr = FreeBlocks(blockCount, blockList);
+    if (dierr == kDIErrNone && indexList != NULL)
+        dierr = FreeBlocks(indexCount, indexList);
+    if (dierr != kDIErrNone)
+        goto bail;
 
     /*
      * Update the directory entry.  After this point, failure gets ugly.
@@ -3287,6 +4487,26 @@ DIError DiskFSProDOS::DeleteFile(A2File* pGenericFile)
         goto bail;
     }
 
+    /*
+     * Free the entry in the parent's index, if it has one.  If this was a
+     * directory, its own index goes away with it.
+     */
+    DirIndex* pParentIndex;
+    pParentIndex = FindDirIndex((A2FileProDOS*) pFile->GetParent());
+    if (pParentIndex != NULL) {
+        long slot = pParentIndex->FindSlot(pFile->fParentDirBlock,
+                        pFile->fParentDirIdx);
+        if (slot > 0 && !pParentIndex->IsSlotFree(slot)) {
+            pParentIndex->RemoveName(slot);
+        } else {
+            LOGI("ProDOS GLITCH: deleted entry not in dir index");
+            assert(false);
+            DiscardDirIndex((A2FileProDOS*) pFile->GetParent());
+        }
+    }
+    if (pFile->IsDirectory())
+        DiscardDirIndex(pFile);
+
     /*
      * Save our updated copy of the volume bitmap to disk.
      */
@@ -3350,13 +4570,16 @@ bail:
     FreeVolBitmap();
     delete[] blockList;
     delete[] indexList;
-    return kDIErrNone;
+    return dierr;
 }
 
 /*
  * Mark all of the blocks in the blockList as free.
  *
- * The in-use map must already be loaded.
+ * The in-use map must already be loaded.  Nothing is freed unless all of
+ * the blocks are marked in use.  On a disk that passed the full scan that
+ * can't happen, but after a lazy init this is the first time anybody has
+ * compared the file's blocks with the bitmap.
  */
 DIError DiskFSProDOS::FreeBlocks(long blockCount, uint16_t* blockList)
 {
@@ -3368,21 +4591,31 @@ DIError DiskFSProDOS::FreeBlocks(long blockCount, uint16_t* blockList)
     assert(blockCount >= 0 && blockCount < 65536);
     assert(blockList != NULL);
 
+    for (i = 0; i < blockCount; i++) {
+        if (blockList[i] == 0)  // expected for "sparse" files
+            continue;
+
+        if (blockList[i] >= fTotalBlocks || !GetBlockUseEntry(blockList[i])) {
+            LOGI("WARNING: freeing unallocated block %u", blockList[i]);
+            fpImg->AddNote(DiskImg::kNoteWarning,
+                "Found a file using blocks not marked used.");
+            fDiskIsGood = false;
+            return kDIErrBadDiskImage;
+        }
+    }
+
     cstate.isUsed = false;
     cstate.isMarkedUsed = false;
     cstate.purpose = VolumeUsage::kChunkPurposeUnknown;
 
     for (i = 0; i < blockCount; i++) {
-        if (blockList[i] == 0)  // expected for "sparse" files
+        if (blockList[i] == 0)
             continue;
 
-        if (!GetBlockUseEntry(blockList[i])) {
-            LOGI("WARNING: freeing unallocated block %u", blockList[i]);
-            assert(false);  // impossible unless disk is "damaged"
-        }
         SetBlockUseEntry(blockList[i], false);
 
-        fVolumeUsage.SetChunkState(blockList[i], &cstate);
+        if (fVolumeUsage.GetInitialized())
+            fVolumeUsage.SetChunkState(blockList[i], &cstate);
     }
 
     return kDIErrNone;
@@ -3411,7 +4644,6 @@ DIError DiskFSProDOS::RenameFile(A2File* pGenericFile, const char* newName)
     DIError dierr = kDIErrNone;
     A2FileProDOS* pFile = (A2FileProDOS*) pGenericFile;
     char upperName[A2FileProDOS::kMaxFileName+1];
-    char upperComp[A2FileProDOS::kMaxFileName+1];
 
     if (pFile == NULL || newName == NULL)
         return kDIErrInvalidArg;
@@ -3427,31 +4659,24 @@ DIError DiskFSProDOS::RenameFile(A2File* pGenericFile, const char* newName)
     LOGI(" ProDOS renaming '%s' to '%s'", pFile->GetPathName(), newName);
 
     /*
-     * Check for duplicates.  We do this by getting the parent subdir and
-     * running through it looking for an upper-case-converted match.
-     *
-     * We start in the list at our parent node, knowing that the kids are
-     * grouped together after it.  However, we can't stop right away,
-     * because some of the kids might be subdirectories themselves.  So we
-     * will probably run through a significant chunk of the list.
+     * Check for duplicates.  The parent's index has the upper-case names of
+     * everything in the directory; finding our own entry is fine, since
+     * we're allowed to change the capitalization of a name.
      */
-    A2File* pParent = pFile->GetParent();
+    A2FileProDOS* pParent = (A2FileProDOS*) pFile->GetParent();
     A2File* pCur;
+    DirIndex* pDirIndex;
+    long dirSlot, dupSlot;
 
     UpperCaseName(upperName, newName);
-    pCur = GetNextFile(pParent);
-    assert(pCur != NULL);    // at the very least, pFile is in this dir
-    while (pCur != NULL) {
-        if (pCur != pFile && pCur->GetParent() == pParent) {
-            /* one of our siblings; see if the name matches */
-            UpperCaseName(upperComp, pCur->GetFileName());
-            if (strcmp(upperName, upperComp) == 0) {
-                LOGI(" ProDOS rename dup found");
-                return kDIErrFileExists;
-            }
-        }
-
-        pCur = GetNextFile(pCur);
+    dierr = GetDirIndex(pParent, &pDirIndex);
+    if (dierr != kDIErrNone)
+        return dierr;
+    dirSlot = pDirIndex->FindSlot(pFile->fParentDirBlock, pFile->fParentDirIdx);
+    dupSlot = pDirIndex->FindName(upperName);
+    if (dupSlot >= 0 && dupSlot != dirSlot) {
+        LOGI(" ProDOS rename dup found");
+        return kDIErrFileExists;
     }
 
     /*
@@ -3541,6 +4766,15 @@ DIError DiskFSProDOS::RenameFile(A2File* pGenericFile, const char* newName)
             goto bail;
     }
 
+    if (dirSlot > 0 && !pDirIndex->IsSlotFree(dirSlot)) {
+        pDirIndex->RemoveName(dirSlot);
+        pDirIndex->AddName(dirSlot, upperName, pFile->fDirEntry.keyPointer);
+    } else {
+        LOGI("ProDOS GLITCH: renamed entry not in dir index");
+        assert(false);
+        DiscardDirIndex(pParent);
+    }
+
     /*
      * At this point the ProDOS filesystem is back in a consistent state.
      * Everything we do from here on is self-inflicted.
@@ -3631,6 +4865,7 @@ DIError DiskFSProDOS::RegeneratePathName(A2FileProDOS* pFile)
 
     LOGI("Replacing '%s' with '%s'", pFile->GetPathName(), buf);
     pFile->SetPathName("", buf);
+    FilePathChanged(pFile);
     delete[] buf;
 
     return kDIErrNone;
@@ -3800,12 +5035,232 @@ DIError DiskFSProDOS::RenameVolume(const char* newName)
 
     /* update the entry in the linear file list */
     pFile->SetPathName(":", fVolumeName);
+    FilePathChanged(pFile);
 
 bail:
     return dierr;
 }
 
 
+/*
+ * ===========================================================================
+ *      DiskFSProDOS::ScanBatch
+ * ===========================================================================
+ */
+
+/*
+ * Allocate storage for up to "maxEntries" blocks.
+ */
+DIError DiskFSProDOS::ScanBatch::Create(long maxEntries)
+{
+    assert(fEntries == NULL);
+    assert(maxEntries > 0);
+
+    fEntries = new Entry[maxEntries];
+    fTrees = new TreeFork[maxEntries];
+    fData = new uint8_t[maxEntries * kBlkSize];
+    fRunBuf = new uint8_t[kMaxRunBlocks * kBlkSize];
+    if (fEntries == NULL || fTrees == NULL || fData == NULL ||
+        fRunBuf == NULL)
+    {
+        return kDIErrMalloc;
+    }
+    fMaxEntries = maxEntries;
+    Reset();
+
+    return kDIErrNone;
+}
+
+/*
+ * Return the number of blocks AddFork will want to read for a fork with
+ * the specified storage type and EOF.  Matches what LoadBlockList reads.
+ */
+/*static*/ long DiskFSProDOS::ScanBatch::BlocksNeeded(int storageType, long eof)
+{
+    long count;
+
+    if (storageType == A2FileProDOS::kStorageSapling)
+        return 1;
+    if (storageType != A2FileProDOS::kStorageTree)
+        return 0;
+
+    count = (eof + kBlkSize -1) / kBlkSize;
+    if (count == 0)
+        count = 1;
+    return 1 + (count + A2FileProDOS::kMaxBlocksPerIndex-1) /
+                A2FileProDOS::kMaxBlocksPerIndex;
+}
+
+/*
+ * Queue up the structure blocks for one fork.  The caller must have checked
+ * GetRoom() against BlocksNeeded().
+ *
+ * Seedlings have nothing to read.  Anything that isn't a regular file is
+ * left for LoadBlockList to reject.
+ */
+void DiskFSProDOS::ScanBatch::AddFork(int storageType, uint16_t keyBlock,
+    long eof)
+{
+    assert(BlocksNeeded(storageType, eof) <= GetRoom());
+    fNumReserved += BlocksNeeded(storageType, eof);
+
+    if (storageType == A2FileProDOS::kStorageSapling) {
+        AddBlock(keyBlock);
+    } else if (storageType == A2FileProDOS::kStorageTree) {
+        AddBlock(keyBlock);
+        fTrees[fNumTrees].masterBlock = keyBlock;
+        fTrees[fNumTrees].numIndices = BlocksNeeded(storageType, eof) - 1;
+        fNumTrees++;
+    }
+}
+
+/*
+ * Read everything that has been queued up.  The master blocks of tree
+ * files are read first, then the index blocks they point to.
+ *
+ * Failures aren't reported; the blocks just won't be found.
+ */
+void DiskFSProDOS::ScanBatch::Read(DiskImg* pImg)
+{
+    long i;
+    int idx;
+
+    ReadPending(pImg);
+
+    for (i = 0; i < fNumTrees; i++) {
+        const uint8_t* blkBuf = FindBlock(fTrees[i].masterBlock);
+        if (blkBuf == NULL)
+            continue;
+        for (idx = 0; idx < fTrees[i].numIndices; idx++) {
+            uint16_t idxBlock;
+
+            idxBlock = blkBuf[idx] | (uint16_t) blkBuf[idx+256] << 8;
+            if (idxBlock != 0)
+                AddBlock(idxBlock);
+        }
+    }
+    fNumTrees = 0;
+
+    ReadPending(pImg);
+}
+
+/* qsort comparator; sorts by block, with blocks we already have first */
+/*static*/ int DiskFSProDOS::ScanBatch::CompareEntries(const void* vp1,
+    const void* vp2)
+{
+    const Entry* pEntry1 = (const Entry*) vp1;
+    const Entry* pEntry2 = (const Entry*) vp2;
+
+    if (pEntry1->block != pEntry2->block)
+        return (pEntry1->block < pEntry2->block) ? -1 : 1;
+    if (pEntry1->slot != pEntry2->slot)
+        return (pEntry1->slot > pEntry2->slot) ? -1 : 1;
+    return 0;
+}
+
+/*
+ * Sort the entries, drop duplicates, and read any blocks we don't have yet.
+ *
+ * Nearby blocks are gathered into a single ReadBlocks call.  If a read
+ * fails we give up on the blocks it covered rather than retrying them one
+ * at a time here, since LoadBlockList will do exactly that.
+ */
+void DiskFSProDOS::ScanBatch::ReadPending(DiskImg* pImg)
+{
+    long numBlocks = pImg->GetNumBlocks();
+    long i, out;
+
+    if (fNumEntries == 0)
+        return;
+
+    qsort(fEntries, fNumEntries, sizeof(Entry), CompareEntries);
+    out = 1;
+    for (i = 1; i < fNumEntries; i++) {
+        if (fEntries[i].block != fEntries[out-1].block)
+            fEntries[out++] = fEntries[i];
+    }
+    fNumEntries = fNumSorted = out;
+
+    i = 0;
+    while (i < fNumEntries) {
+        long first, last, next, k;
+        DIError dierr;
+
+        if (fEntries[i].slot != kSlotPending) {
+            i++;
+            continue;
+        }
+        if (fEntries[i].block == 0 || fEntries[i].block >= numBlocks) {
+            fEntries[i].slot = kSlotFailed;
+            i++;
+            continue;
+        }
+
+        /* extend the run as far as the next pending block that's close by */
+        first = last = i;
+        for (next = i+1; next < fNumEntries; next++) {
+            if (fEntries[next].block >= numBlocks ||
+                fEntries[next].block - fEntries[next-1].block >
+                    kMaxGapBlocks+1 ||
+                fEntries[next].block - fEntries[first].block >=
+                    kMaxRunBlocks)
+            {
+                break;
+            }
+            if (fEntries[next].slot == kSlotPending)
+                last = next;
+        }
+
+        dierr = pImg->ReadBlocks(fEntries[first].block,
+                    fEntries[last].block - fEntries[first].block + 1, fRunBuf);
+        for (k = first; k <= last; k++) {
+            if (fEntries[k].slot != kSlotPending)
+                continue;
+            if (dierr != kDIErrNone) {
+                fEntries[k].slot = kSlotFailed;
+            } else {
+                assert(fNumSlots < fMaxEntries);
+                memcpy(fData + fNumSlots * kBlkSize,
+                    fRunBuf + (fEntries[k].block - fEntries[first].block) *
+                        kBlkSize,
+                    kBlkSize);
+                fEntries[k].slot = fNumSlots++;
+            }
+        }
+        if (dierr != kDIErrNone) {
+            LOGD(" ProDOS ScanBatch read of %d-%d failed (err=%d)",
+                fEntries[first].block, fEntries[last].block, dierr);
+        }
+
+        i = last+1;
+    }
+}
+
+/*
+ * Find a block we've read.  Returns NULL if we don't have it.
+ */
+const uint8_t* DiskFSProDOS::ScanBatch::FindBlock(uint16_t block) const
+{
+    long lo = 0;
+    long hi = fNumSorted - 1;
+
+    while (lo <= hi) {
+        long mid = (lo + hi) / 2;
+
+        if (fEntries[mid].block == block) {
+            if (fEntries[mid].slot < 0)
+                return NULL;
+            return fData + fEntries[mid].slot * kBlkSize;
+        } else if (fEntries[mid].block < block) {
+            lo = mid+1;
+        } else {
+            hi = mid-1;
+        }
+    }
+    return NULL;
+}
+
+
 /*
  * ===========================================================================
  *      A2FileProDOS
@@ -4186,7 +5641,7 @@ DIError A2FileProDOS::LoadBlockList(int storageType, uint16_t keyBlock,
         long countDown = count;
         int idx = 0;
 
-        dierr = fpDiskFS->GetDiskImg()->ReadBlock(keyBlock, blkBuf);
+        dierr = ((DiskFSProDOS*) fpDiskFS)->ReadIndexBlock(keyBlock, blkBuf);
         if (dierr != kDIErrNone)
             goto bail;
 
@@ -4315,7 +5770,7 @@ DIError A2FileProDOS::LoadIndexBlock(uint16_t block, uint16_t* list,
     if (maxCount > kMaxBlocksPerIndex)
         maxCount = kMaxBlocksPerIndex;
 
-    dierr = fpDiskFS->GetDiskImg()->ReadBlock(block, blkBuf);
+    dierr = ((DiskFSProDOS*) fpDiskFS)->ReadIndexBlock(block, blkBuf);
     if (dierr != kDIErrNone)
         goto bail;
 
@@ -4428,6 +5883,76 @@ void A2FileProDOS::Dump(void) const
  * ===========================================================================
  */
 
+/*
+ * Read the blocks in "blockList" into "buf", filling sparse (zero) entries
+ * with zeroes.  Runs of adjacent block numbers are read with a single call.
+ *
+ * Block numbers aren't range-checked when the block list is loaded (only
+ * sanity-checked), so runs that would go past the end of the disk are
+ * left to ReadBlock, which reports the bad one.
+ */
+static DIError ReadBlockRuns(DiskImg* pImg, const uint16_t* blockList,
+    long count, uint8_t* buf)
+{
+    DIError dierr;
+    long i, runLen;
+
+    for (i = 0; i < count; i += runLen) {
+        runLen = 1;
+        if (blockList[i] == 0) {
+            while (i + runLen < count && blockList[i + runLen] == 0)
+                runLen++;
+            memset(buf + i * kBlkSize, 0, runLen * kBlkSize);
+            continue;
+        }
+        while (i + runLen < count &&
+            blockList[i + runLen] == blockList[i] + runLen)
+        {
+            runLen++;
+        }
+
+        if (blockList[i] + runLen > pImg->GetNumBlocks()) {
+            runLen = 1;
+            dierr = pImg->ReadBlock(blockList[i], buf + i * kBlkSize);
+        } else {
+            dierr = pImg->ReadBlocks(blockList[i], runLen, buf + i * kBlkSize);
+        }
+        if (dierr != kDIErrNone)
+            return dierr;
+    }
+
+    return kDIErrNone;
+}
+
+/*
+ * Write "count" blocks from "buf" to the blocks in "blockList", skipping
+ * entries that are zero (sparse).  Runs of adjacent block numbers are
+ * written with a single call.
+ */
+static DIError WriteBlockRuns(DiskImg* pImg, const uint16_t* blockList,
+    long count, const uint8_t* buf)
+{
+    DIError dierr;
+    long i, runLen;
+
+    for (i = 0; i < count; i += runLen) {
+        runLen = 1;
+        if (blockList[i] == 0)
+            continue;
+        while (i + runLen < count &&
+            blockList[i + runLen] == blockList[i] + runLen)
+        {
+            runLen++;
+        }
+
+        dierr = pImg->WriteBlocks(blockList[i], runLen, buf + i * kBlkSize);
+        if (dierr != kDIErrNone)
+            return dierr;
+    }
+
+    return kDIErrNone;
+}
+
 /*
  * Read a chunk of data from whichever fork is open.
  */
@@ -4449,6 +5974,7 @@ DIError A2FDProDOS::Read(void* buf, size_t len, size_t* pActual)
     long incrLen = len;
 
     DIError dierr = kDIErrNone;
+    DiskImg* pImg = fpFile->GetDiskFS()->GetDiskImg();
     uint8_t blkBuf[kBlkSize];
     long blockIndex = (long) (fOffset / kBlkSize);
     int bufOffset = (int) (fOffset % kBlkSize);     // (& 0x01ff)
@@ -4464,32 +5990,45 @@ DIError A2FDProDOS::Read(void* buf, size_t len, size_t* pActual)
 
     assert(blockIndex >= 0 && blockIndex < fBlockCount);
 
+    /*
+     * Whole blocks are read straight into the caller's buffer, a run of
+     * adjacent blocks at a time.  Only a partial block at the start or
+     * end of the request goes through blkBuf.
+     */
     while (len) {
-        if (fBlockList[blockIndex] == 0) {
-            //LOGI(" ProDOS sparse index %d", blockIndex);
-            memset(blkBuf, 0, sizeof(blkBuf));
-        } else {
-            //LOGI(" ProDOS non-sparse index %d", blockIndex);
-            dierr = fpFile->GetDiskFS()->GetDiskImg()->ReadBlock(fBlockList[blockIndex],
-                        blkBuf);
-            if (dierr != kDIErrNone) {
-                LOGI(" ProDOS error reading block [%ld]=%d of '%s'",
-                    blockIndex, fBlockList[blockIndex], fpFile->GetPathName());
-                return dierr;
+        long count;
+
+        if (bufOffset != 0 || len < (size_t) kBlkSize) {
+            count = 1;
+            dierr = ReadBlockRuns(pImg, fBlockList + blockIndex, count, blkBuf);
+            if (dierr == kDIErrNone) {
+                thisCount = kBlkSize - bufOffset;
+                if (thisCount > len)
+                    thisCount = len;
+                memcpy(buf, blkBuf + bufOffset, thisCount);
             }
+        } else {
+            count = len / kBlkSize;
+            if (count > kReadChunk)
+                count = kReadChunk;
+            thisCount = count * kBlkSize;
+            dierr = ReadBlockRuns(pImg, fBlockList + blockIndex, count,
+                        (uint8_t*) buf);
+        }
+        if (dierr != kDIErrNone) {
+            LOGI(" ProDOS error reading blocks [%ld]+%ld of '%s'",
+                blockIndex, count, fpFile->GetPathName());
+            return dierr;
         }
-        thisCount = kBlkSize - bufOffset;
-        if (thisCount > len)
-            thisCount = len;
+        assert(blockIndex + count <= fBlockCount);
 
-        memcpy(buf, blkBuf + bufOffset, thisCount);
         len -= thisCount;
         buf = (char*)buf + thisCount;
 
         bufOffset = 0;
-        blockIndex++;
+        blockIndex += count;
 
-        progressCounter++;
+        progressCounter += count;
         if (progressCounter > 100 && len) {
             progressCounter = 0;
             /*
@@ -4514,34 +6053,95 @@ DIError A2FDProDOS::Read(void* buf, size_t len, size_t* pActual)
     return dierr;
 }
 
+/*
+ * Return the key block for the open fork.
+ */
+uint16_t A2FDProDOS::GetForkKeyBlock(void) const
+{
+    const A2FileProDOS* pFile = (const A2FileProDOS*) fpFile;
+
+    if (pFile->fDirEntry.storageType != A2FileProDOS::kStorageExtended)
+        return pFile->fDirEntry.keyPointer;
+    else if (fOpenRsrcFork)
+        return pFile->fExtRsrc.keyBlock;
+    else
+        return pFile->fExtData.keyBlock;
+}
+
+/*
+ * Make sure fBlockList has room for "count" entries plus the overrun
+ * detection entry.  The list grows geometrically, so a fork written in
+ * lots of small pieces doesn't get copied on every call.
+ */
+DIError A2FDProDOS::GrowBlockList(long count)
+{
+    long have = fBlockListAlloc;
+    uint16_t* newList;
+
+    if (have < fBlockCount+1)
+        have = fBlockCount+1;       // allocated by LoadBlockList
+    if (count+1 <= have)
+        return kDIErrNone;
+
+    if (have * 2 > count+1)
+        count = have * 2 - 1;
+    newList = new uint16_t[count+1];
+    if (newList == NULL)
+        return kDIErrMalloc;
+    memcpy(newList, fBlockList, sizeof(uint16_t) * fBlockCount);
+
+    delete[] fBlockList;
+    fBlockList = newList;
+    fBlockListAlloc = count+1;
+    return kDIErrNone;
+}
+
 /*
  * Write data at the current offset.
  *
  * For simplicity, we assume that there can only be one of two situations:
  *  (1) We're writing a directory, which might expand by one block; or
- *  (2) We're writing all of a brand-new file in one shot.
+ *  (2) We're appending to a fork that was empty when it was opened.
  *
- * Modifies fOpenEOF, fOpenBlocksUsed, fStorageType, and sets fModified.
+ * Forks can be written in any number of calls of any size.  Data blocks
+ * are allocated as they're filled, and the fork grows from seedling to
+ * sapling to tree as it goes.  Index blocks are allocated when the data
+ * they'll point to is, but aren't written until Close, which is also
+ * when fOpenStorageType gets set.
  *
- * HEY: ProSel-16 describes these as fragmented, and it's probably right.
- * The correct way to do this is to allocate index blocks before allocating
- * the blocks they refer to, so that we don't have to jump all over the disk
- * to read the indexes (which, at the moment, appear at the end of the file).
- * A bit tricky, but doable.
+ * Modifies fOpenEOF, fOpenBlocksUsed, and sets fModified.
+ *
+ * Each call allocates all of the storage it needs up front, as a few
+ * contiguous runs, with new index blocks ahead of the data blocks they
+ * refer to.  (ProSel-16 flags files with trailing index blocks as
+ * fragmented, and they're slower to read on real hardware.)
+ *
+ * The first call that needs more than the key block gets the best-fit
+ * run from AllocExtents.  Later calls continue in the free run right
+ * after the fork's last block if there is one, and otherwise fall back
+ * to the next-fit allocator, so a fork written in small pieces stays
+ * contiguous as long as nothing else has taken the blocks after it.
  */
 DIError A2FDProDOS::Write(const void* buf, size_t len, size_t* pActual)
 {
     DIError dierr = kDIErrNone;
     A2FileProDOS* pFile = (A2FileProDOS*) fpFile;
     DiskFSProDOS* pDiskFS = (DiskFSProDOS*) fpFile->GetDiskFS();
+    DiskImg* pImg = pDiskFS->GetDiskImg();
     bool allocSparse = (pDiskFS->GetParameter(DiskFS::kParmProDOS_AllocSparse) != 0);
-    uint8_t blkBuf[kBlkSize];
+    uint8_t firstBuf[kBlkSize];
+    uint8_t headBuf[kBlkSize];
+    uint8_t tailBuf[kBlkSize];
+    uint16_t savedIndex[kMaxIndexBlocks];
+    uint16_t savedFirst, savedHead;
+    uint16_t savedBlocksUsed = fOpenBlocksUsed;
     uint16_t keyBlock;
-
-    if (len >= 0x01000000) {    // 16MB
-        assert(false);
-        return kDIErrInvalidArg;
-    }
+    uint16_t* newBlocks = NULL;
+    bool hadIndexList = (fIndexList != NULL);
+    bool listsChanged = false;
+    bool relocFirst, firstStaged, headStaged, tailStaged;
+    long startOff, endOff, oldCount, newCount, headIdx, tailIdx;
+    long directStart, directEnd;
 
     /* use separate function for directories */
     if (pFile->fDirEntry.storageType == A2FileProDOS::kStorageDirectory ||
@@ -4550,149 +6150,355 @@ DIError A2FDProDOS::Write(const void* buf, size_t len, size_t* pActual)
         return WriteDirectory(buf, len, pActual);
     }
 
-    dierr = pDiskFS->LoadVolBitmap();
-    if (dierr != kDIErrNone)
-        goto bail;
-
-    assert(fOffset == 0);       // big simplifying assumption
-    assert(fOpenEOF == 0);      // another one
-    assert(fOpenBlocksUsed == 1);
+    /*
+     * We can only append, and only to a fork we've been writing from the
+     * start; we don't have the index blocks for anything else.
+     */
+    if (fOffset != fOpenEOF || (fOpenEOF != 0 && !fModified)) {
+        LOGI(" ProDOS can only append to new forks (offset=%ld eof=%ld)",
+            (long) fOffset, (long) fOpenEOF);
+        return kDIErrNotSupported;
+    }
+    if (fOpenEOF + (di_off_t) len >= 0x01000000) {     // 16MB
+        LOGI(" ProDOS write would exceed max fork length");
+        return kDIErrInvalidArg;
+    }
     assert(buf != NULL);
 
     /* nothing to do for zero-length write; don't even set fModified */
     if (len == 0)
+        return kDIErrNone;
+
+    dierr = pDiskFS->LoadVolBitmap();
+    if (dierr != kDIErrNone)
         goto bail;
 
-    if (pFile->fDirEntry.storageType != A2FileProDOS::kStorageExtended)
-        keyBlock = pFile->fDirEntry.keyPointer;
-    else {
-        if (fOpenRsrcFork)
-            keyBlock = pFile->fExtRsrc.keyBlock;
-        else
-            keyBlock = pFile->fExtData.keyBlock;
+    keyBlock = GetForkKeyBlock();
+    startOff = (long) fOpenEOF;
+    endOff = startOff + (long) len;
+    oldCount = fBlockCount;
+    newCount = (endOff + kBlkSize-1) / kBlkSize;
+    headIdx = startOff / kBlkSize;
+    tailIdx = newCount-1;
+    assert(oldCount >= 1);
+    assert(headIdx <= oldCount);
+
+    /*
+     * A partial block at the start has to be merged with what's already
+     * there.  Sparse blocks read as zeroes; while the fork is a seedling,
+     * its only block is the key block.
+     */
+    headStaged = (startOff % kBlkSize) != 0;
+    if (headStaged) {
+        int headOff = startOff % kBlkSize;
+        size_t copyLen = kBlkSize - headOff;
+        if (copyLen > len)
+            copyLen = len;
+
+        assert(headIdx == oldCount-1);
+        if (fBlockList[headIdx] != 0) {
+            dierr = pImg->ReadBlock(fBlockList[headIdx], headBuf);
+            if (dierr != kDIErrNone)
+                goto bail;
+        } else {
+            memset(headBuf, 0, sizeof(headBuf));
+        }
+        memset(headBuf + headOff, 0, kBlkSize - headOff);
+        memcpy(headBuf + headOff, buf, copyLen);
     }
 
     /*
      * Special-case seedling files.  Just write the data into the key block
      * and we're done.
      */
-    if (len <= (size_t)kBlkSize) {
-        memset(blkBuf, 0, sizeof(blkBuf));
-        memcpy(blkBuf, buf, len);
-        dierr = pDiskFS->GetDiskImg()->WriteBlock(keyBlock, blkBuf);
+    if (newCount == 1) {
+        if (!headStaged) {
+            memset(headBuf, 0, sizeof(headBuf));
+            memcpy(headBuf, buf, len);
+        }
+        assert(fBlockList[0] == keyBlock);
+        dierr = pImg->WriteBlock(keyBlock, headBuf);
         if (dierr != kDIErrNone)
             goto bail;
 
-        fOpenEOF = len;
-        fOpenBlocksUsed = 1;
-        assert(fOpenStorageType == A2FileProDOS::kStorageSeedling);
-        fOffset += len;
+        fOpenEOF = endOff;
+        fOffset = endOff;
         fModified = true;
         goto bail;
     }
 
+    /* a partial block at the end is padded out with zeroes */
+    tailStaged = (endOff % kBlkSize) != 0 && !(headStaged && tailIdx == headIdx);
+    if (tailStaged) {
+        memset(tailBuf, 0, sizeof(tailBuf));
+        memcpy(tailBuf, (const uint8_t*) buf + (tailIdx * kBlkSize - startOff),
+            endOff % kBlkSize);
+    }
+
     /*
-     * Start by allocating space for the block list.  The list is always the
-     * same size, regardless of sparse allocations.
-     *
-     * We over-alloc by one so we can have an overrun detection entry.
+     * If the fork is outgrowing its seedling, the data in the key block
+     * has to move so the key block can become an index block.  If it's
+     * a full block we have to get it back from the disk.
      */
-    fBlockCount = (len + kBlkSize-1) / kBlkSize;
-    assert(fBlockCount > 0);
-    delete[] fBlockList;
-    fBlockList = new uint16_t[fBlockCount+1];
-    if (fBlockList == NULL) {
-        dierr = kDIErrMalloc;
-        goto bail;
+    relocFirst = (oldCount == 1);
+    firstStaged = relocFirst && headIdx == 1;
+    if (firstStaged) {
+        assert(fBlockList[0] == keyBlock);
+        dierr = pImg->ReadBlock(keyBlock, firstBuf);
+        if (dierr != kDIErrNone)
+            goto bail;
     }
-    fBlockList[fBlockCount] = A2FileProDOS::kInvalidBlockNum;
+
+    /* blocks we can write straight from the caller's buffer */
+    directStart = headStaged ? headIdx+1 : headIdx;
+    directEnd = endOff / kBlkSize;
+    if (directEnd < directStart)
+        directEnd = directStart;
+
+    dierr = GrowBlockList(newCount);
+    if (dierr != kDIErrNone)
+        goto bail;
+
+    /*
+     * Save the parts of the block list and index list that we're about to
+     * change, so we can back out if we fail or get cancelled.
+     */
+    savedFirst = fBlockList[0];
+    savedHead = (headIdx < oldCount) ? fBlockList[headIdx] : 0;
+    if (fIndexList != NULL)
+        memcpy(savedIndex, fIndexList, sizeof(savedIndex));
+    listsChanged = true;
 
     /*
-     * Write the data blocks to disk, allocating as we go.  We have to treat
-     * the last entry specially because it might not fill an entire block.
+     * Figure out which blocks need storage, and allocate all of them at
+     * once.  Doing it up front means we find out that the disk is full
+     * before we've written anything.
      */
     const uint8_t* blkPtr;
-    long blockIdx;
-    bool allZero;
-    long progressCounter;
+    long blockIdx, firstIdx;
+    long numAlloc, nextAlloc, numIndex, nextIndex, group;
+
+    if (relocFirst)
+        fBlockList[0] = 0;
+    for (blockIdx = oldCount; blockIdx < newCount; blockIdx++)
+        fBlockList[blockIdx] = 0;
+
+    firstIdx = relocFirst ? 0 : headIdx;
+    numAlloc = 0;
+    for (blockIdx = firstIdx; blockIdx < newCount; blockIdx++) {
+        if (fBlockList[blockIdx] != 0)
+            continue;       // partial block already has storage
+
+        if (blockIdx == 0 && firstStaged)
+            blkPtr = firstBuf;
+        else if (blockIdx == headIdx && headStaged)
+            blkPtr = headBuf;
+        else if (blockIdx == tailIdx && tailStaged)
+            blkPtr = tailBuf;
+        else
+            blkPtr = (const uint8_t*) buf + (blockIdx * kBlkSize - startOff);
 
-    progressCounter = 0;
-    allZero = true;
-    blkPtr = (const uint8_t*) buf;
-    for (blockIdx = 0; blockIdx < fBlockCount; blockIdx++) {
-        long newBlock;
-
-        if (blockIdx == fBlockCount-1) {
-            /* for last block, copy partial and move blkPtr */
-            int copyLen = len - (blockIdx * kBlkSize);
-            assert(copyLen > 0 && copyLen <= kBlkSize);
-            memset(blkBuf, 0, sizeof(blkBuf));
-            memcpy(blkBuf, blkPtr, copyLen);
-            blkPtr = blkBuf;
+        /* just flag it for now; the real block number comes later */
+        if (!allocSparse || !IsEmptyBlock(blkPtr)) {
+            fBlockList[blockIdx] = A2FileProDOS::kInvalidBlockNum;
+            numAlloc++;
         }
+    }
 
-        if (allocSparse && IsEmptyBlock(blkPtr))
-            newBlock = 0;
-        else {
-            newBlock = pDiskFS->AllocBlock();
-            fOpenBlocksUsed++;
-            allZero = false;
+    /*
+     * Tree files also need an index block for every 256 entries that
+     * aren't entirely sparse.  If we just became a tree, the blocks we
+     * already wrote need one too.
+     */
+    numIndex = 0;
+    if (newCount > 256) {
+        if (fIndexList == NULL) {
+            fIndexList = new uint16_t[kMaxIndexBlocks];
+            if (fIndexList == NULL) {
+                dierr = kDIErrMalloc;
+                goto bail;
+            }
+            memset(fIndexList, 0, sizeof(uint16_t) * kMaxIndexBlocks);
+        }
+
+        group = (oldCount <= 256) ? 0 : firstIdx / 256;
+        for ( ; group <= tailIdx / 256; group++) {
+            if (fIndexList[group] != 0)
+                continue;
+            for (blockIdx = group * 256;
+                blockIdx < newCount && blockIdx < (group+1) * 256; blockIdx++)
+            {
+                if (fBlockList[blockIdx] != 0) {
+                    fIndexList[group] = A2FileProDOS::kInvalidBlockNum;
+                    numIndex++;
+                    break;
+                }
+            }
         }
+    }
 
-        if (newBlock < 0) {
+    if (numIndex + numAlloc != 0) {
+        newBlocks = new uint16_t[numIndex + numAlloc];
+        if (newBlocks == NULL) {
+            dierr = kDIErrMalloc;
+            goto bail;
+        }
+        if (relocFirst) {
+            dierr = pDiskFS->AllocExtents(numIndex + numAlloc, newBlocks);
+        } else {
+            long prevBlock = 0;
+            for (blockIdx = oldCount-1; blockIdx >= 0; blockIdx--) {
+                if (fBlockList[blockIdx] != 0) {
+                    prevBlock = fBlockList[blockIdx];
+                    break;
+                }
+            }
+            dierr = pDiskFS->AllocBlocksAfter(prevBlock, numIndex + numAlloc,
+                        newBlocks);
+        }
+        if (dierr != kDIErrNone) {
             LOGI(" ProDOS disk full during write!");
-            dierr = kDIErrDiskFull;
             goto bail;
         }
+        fOpenBlocksUsed += numIndex + numAlloc;
+    }
 
-        fBlockList[blockIdx] = (uint16_t) newBlock;
-
-        if (newBlock != 0) {
-            dierr = pDiskFS->GetDiskImg()->WriteBlock(newBlock, blkPtr);
-            if (dierr != kDIErrNone)
-                goto bail;
+    nextIndex = 0;
+    if (numIndex != 0) {
+        for (group = 0; group <= tailIdx / 256; group++) {
+            if (fIndexList[group] == A2FileProDOS::kInvalidBlockNum)
+                fIndexList[group] = newBlocks[nextIndex++];
         }
+    }
+    assert(nextIndex == numIndex);
+    nextAlloc = numIndex;
+    for (blockIdx = firstIdx; blockIdx < newCount; blockIdx++) {
+        if (fBlockList[blockIdx] == A2FileProDOS::kInvalidBlockNum)
+            fBlockList[blockIdx] = newBlocks[nextAlloc++];
+    }
+    assert(nextAlloc == numIndex + numAlloc);
+
+    /*
+     * Write the data blocks.  Runs of adjacent blocks go out in a single
+     * call, straight from the caller's buffer; only partial blocks at the
+     * ends, and a block moving out of a seedling's key block, are staged.
+     *
+     * We update the progress counter and check to see if the "cancel"
+     * button has been hit every kWriteChunk blocks.  We don't call
+     * UpdateProgress after the last block because we could be passing an
+     * offset value larger than the new EOF.  Also, we don't want the
+     * progress bar to hit 100% until we've actually finished.
+     *
+     * If we fail or get cancelled, we don't want to save the disk block
+     * map, because then the blocks would be marked as "used" without
+     * being part of the file.  Since nothing in the file's structure
+     * changes until Close, backing out just means restoring our lists.
+     */
+    if (firstStaged && fBlockList[0] != 0) {
+        dierr = pImg->WriteBlock(fBlockList[0], firstBuf);
+        if (dierr != kDIErrNone)
+            goto bail;
+    }
+    if (headStaged && fBlockList[headIdx] != 0) {
+        dierr = pImg->WriteBlock(fBlockList[headIdx], headBuf);
+        if (dierr != kDIErrNone)
+            goto bail;
+    }
+    for (blockIdx = directStart; blockIdx < directEnd; blockIdx += kWriteChunk) {
+        long count = directEnd - blockIdx;
+        if (count > kWriteChunk)
+            count = kWriteChunk;
 
-        blkPtr += kBlkSize;
+        dierr = WriteBlockRuns(pImg, fBlockList + blockIdx, count,
+                    (const uint8_t*) buf + (blockIdx * kBlkSize - startOff));
+        if (dierr != kDIErrNone)
+            goto bail;
 
-        /*
-         * Update the progress counter and check to see if the "cancel" button
-         * has been hit.  We don't call UpdateProgress on the last block
-         * because we could be passing an offset value larger than "len".
-         * Also, we don't want the progress bar to hit 100% until we've
-         * actually finished.
-         *
-         * We do NOT want to check this after we start writing index blocks.
-         * If we do, we need to make sure that whatever index blocks the file
-         * has match up with what we've allocated in the disk block map.
-         *
-         * We don't want to save the disk block map if the user cancels here,
-         * because then the blocks will be marked as "used" even though the
-         * index blocks for this file haven't been written yet.
-         *
-         * It's tricky to get this right, which is why we allocate space
-         * for the index blocks now -- running out of disk space and
-         * user cancellation are handled the same way.  Once we get to the
-         * point where we're updating the file structure, we can neither be
-         * cancelled nor run out of space.  (We can still hit a bad block,
-         * though, which we currently don't handle.)
-         */
-        progressCounter++;  // update every N blocks
-        if (progressCounter > 100 && blockIdx != fBlockCount) {
-            progressCounter = 0;
-            if (!UpdateProgress(blockIdx * kBlkSize)) {
+        if (blockIdx + count < newCount) {
+            if (!UpdateProgress((blockIdx + count) * kBlkSize)) {
                 dierr = kDIErrCancelled;
                 goto bail;
             }
         }
     }
+    if (tailStaged && fBlockList[tailIdx] != 0) {
+        dierr = pImg->WriteBlock(fBlockList[tailIdx], tailBuf);
+        if (dierr != kDIErrNone)
+            goto bail;
+    }
+
+    fBlockCount = newCount;
+    fBlockList[fBlockCount] = A2FileProDOS::kInvalidBlockNum;
+    fOpenEOF = endOff;
+    fOffset = endOff;
+    fModified = true;
 
-    assert(fBlockList[fBlockCount] == A2FileProDOS::kInvalidBlockNum);
+bail:
+    if (dierr == kDIErrNone) {
+        dierr = pDiskFS->SaveVolBitmap();
+    } else if (listsChanged) {
+        /* back out; the allocations go away with the unsaved bitmap */
+        fBlockList[0] = savedFirst;
+        if (headIdx < oldCount)
+            fBlockList[headIdx] = savedHead;
+        fBlockList[oldCount] = A2FileProDOS::kInvalidBlockNum;
+        if (hadIndexList)
+            memcpy(fIndexList, savedIndex, sizeof(savedIndex));
+        else if (fIndexList != NULL)
+            memset(fIndexList, 0, sizeof(uint16_t) * kMaxIndexBlocks);
+        fOpenBlocksUsed = savedBlocksUsed;
+    }
+
+    /*
+     * We need to check UpdateProgress *after* the volume bitmap has been
+     * saved.  Otherwise we'll have blocks allocated in the file's structure
+     * but not marked in-use in the map when the "dierr" check above fails.
+     */
+    if (dierr == kDIErrNone) {
+        if (!UpdateProgress(fOffset))
+            dierr = kDIErrCancelled;
+    }
+
+    pDiskFS->FreeVolBitmap();
+    delete[] newBlocks;
+    return dierr;
+}
+
+/*
+ * Finish off a fork that was extended by Write: fill in the index blocks
+ * and set fOpenStorageType to match the fork's final size.  Called from
+ * Close.
+ *
+ * The storage for the index blocks was allocated by Write, so there's
+ * nothing here that can run out of space.
+ */
+DIError A2FDProDOS::WriteIndexBlocks(void)
+{
+    DIError dierr = kDIErrNone;
+    DiskImg* pImg = fpFile->GetDiskFS()->GetDiskImg();
+    uint16_t keyBlock = GetForkKeyBlock();
+    uint8_t blkBuf[kBlkSize];
+    uint8_t* indexBuf = NULL;
+    long blockIdx;
+    bool allZero;
+    int i;
+
+    if (fBlockCount <= 1) {
+        /* seedling; the data is already in the key block */
+        assert(fBlockList[0] == keyBlock);
+        fOpenStorageType = A2FileProDOS::kStorageSeedling;
+        return kDIErrNone;
+    }
+
+    allZero = true;
+    for (blockIdx = 0; blockIdx < fBlockCount; blockIdx++) {
+        if (fBlockList[blockIdx] != 0) {
+            allZero = false;
+            break;
+        }
+    }
 
     /*
-     * Now we have a full block map.  Allocate any needed index blocks and
-     * write them.
-     *
      * If our block map is empty, i.e. the entire file is sparse, then
      * there's no need to create a sapling.  We just leave the file in
      * seedling form.  This can only happen for a completely empty file.
@@ -4701,87 +6507,67 @@ DIError A2FDProDOS::Write(const void* buf, size_t len, size_t* pActual)
         LOGI("+++ ProDOS storing large but empty file as seedling");
         /* make sure key block is empty */
         memset(blkBuf, 0, sizeof(blkBuf));
-        dierr = pDiskFS->GetDiskImg()->WriteBlock(keyBlock, blkBuf);
+        dierr = pImg->WriteBlock(keyBlock, blkBuf);
         if (dierr != kDIErrNone)
             goto bail;
         fOpenStorageType = A2FileProDOS::kStorageSeedling;
         fBlockList[0] = keyBlock;
     } else if (fBlockCount <= 256) {
         /* sapling file, write an index block into the key block */
-        //bool allzero = true;  <-- should this be getting used?
-        assert(fBlockCount > 1);
         memset(blkBuf, 0, sizeof(blkBuf));
-        int i;
         for (i = 0; i < fBlockCount; i++) {
-            //if (fBlockList[i] != 0)
-            //    allzero = false;
             blkBuf[i] = fBlockList[i] & 0xff;
             blkBuf[256 + i] = (fBlockList[i] >> 8) & 0xff;
         }
 
-        dierr = pDiskFS->GetDiskImg()->WriteBlock(keyBlock, blkBuf);
+        dierr = pImg->WriteBlock(keyBlock, blkBuf);
         if (dierr != kDIErrNone)
             goto bail;
         fOpenStorageType = A2FileProDOS::kStorageSapling;
     } else {
-        /* tree file, write two or more indexes and write master into key */
-        uint8_t masterBlk[kBlkSize];
-        int idx;
-
-        memset(masterBlk, 0, sizeof(masterBlk));
+        /*
+         * Tree file.  Build the index blocks in memory, write them out
+         * (they're usually adjacent, so this is typically a single call),
+         * and put the master index in the key block.
+         */
+        int numGroups = (fBlockCount + 255) / 256;
+        int group;
 
-        for (idx = 0; idx < fBlockCount; ) {
-            long newBlock;
-            int i;
+        assert(fIndexList != NULL);
+        assert(numGroups <= kMaxIndexBlocks);
+        indexBuf = new uint8_t[numGroups * kBlkSize];
+        if (indexBuf == NULL) {
+            dierr = kDIErrMalloc;
+            goto bail;
+        }
+        memset(indexBuf, 0, numGroups * kBlkSize);
+        memset(blkBuf, 0, sizeof(blkBuf));
 
-            memset(blkBuf, 0, sizeof(blkBuf));
-            for (i = 0; i < 256 && idx < fBlockCount; i++, idx++) {
-                blkBuf[i] = fBlockList[idx] & 0xff;
-                blkBuf[256+i] = (fBlockList[idx] >> 8) & 0xff;
-            }
+        for (blockIdx = 0, group = 0; group < numGroups; group++) {
+            uint8_t* idxPtr = indexBuf + group * kBlkSize;
 
-            /* allocate a new index block, if needed */
-            if (allocSparse && IsEmptyBlock(blkBuf))
-                newBlock = 0;
-            else {
-                newBlock = pDiskFS->AllocBlock();
-                fOpenBlocksUsed++;
-            }
-            if (newBlock != 0) {
-                dierr = pDiskFS->GetDiskImg()->WriteBlock(newBlock, blkBuf);
-                if (dierr != kDIErrNone)
-                    goto bail;
+            for (i = 0; i < 256 && blockIdx < fBlockCount; i++, blockIdx++) {
+                idxPtr[i] = fBlockList[blockIdx] & 0xff;
+                idxPtr[256+i] = (fBlockList[blockIdx] >> 8) & 0xff;
             }
+            assert(IsEmptyBlock(idxPtr) == (fIndexList[group] == 0));
 
-            masterBlk[(idx-1) / 256] = (uint8_t) newBlock;
-            masterBlk[256 + (idx-1)/256] = (uint8_t) (newBlock >> 8);
+            blkBuf[group] = (uint8_t) fIndexList[group];
+            blkBuf[256 + group] = (uint8_t) (fIndexList[group] >> 8);
         }
 
-        dierr = pDiskFS->GetDiskImg()->WriteBlock(keyBlock, masterBlk);
+        dierr = WriteBlockRuns(pImg, fIndexList, numGroups, indexBuf);
+        if (dierr != kDIErrNone)
+            goto bail;
+
+        dierr = pImg->WriteBlock(keyBlock, blkBuf);
         if (dierr != kDIErrNone)
             goto bail;
         fOpenStorageType = A2FileProDOS::kStorageTree;
     }
 
-    fOpenEOF = len;
-    fOffset += len;
-    fModified = true;
-
 bail:
-    if (dierr == kDIErrNone)
-        dierr = pDiskFS->SaveVolBitmap();
-
-    /*
-     * We need to check UpdateProgress *after* the volume bitmap has been
-     * saved.  Otherwise we'll have blocks allocated in the file's structure
-     * but not marked in-use in the map when the "dierr" check above fails.
-     */
-    if (dierr == kDIErrNone) {
-        if (!UpdateProgress(fOffset))
-            dierr = kDIErrCancelled;
-    }
-
-    pDiskFS->FreeVolBitmap();
+    delete[] indexBuf;
     return dierr;
 }
 
@@ -4867,6 +6653,9 @@ DIError A2FDProDOS::WriteDirectory(const void* buf, size_t len, size_t* pActual)
     fModified = true;
 
 bail:
+    /* whatever was written, the directory's index no longer matches it */
+    ((DiskFSProDOS*) fpFile->GetDiskFS())->DiscardDirIndex(
+        (A2FileProDOS*) fpFile);
     return dierr;
 }
 
@@ -4929,6 +6718,16 @@ DIError A2FDProDOS::Close(void)
     if (fModified) {
         A2FileProDOS* pFile = (A2FileProDOS*) fpFile;
         uint8_t blkBuf[kBlkSize];
+
+        /* forks written by Write need their index blocks filled in */
+        if (pFile->fDirEntry.storageType != A2FileProDOS::kStorageDirectory &&
+            pFile->fDirEntry.storageType != A2FileProDOS::kStorageVolumeDirHeader)
+        {
+            dierr = WriteIndexBlocks();
+            if (dierr != kDIErrNone)
+                goto bail;
+        }
+
         uint8_t newStorageType = fOpenStorageType;
         uint16_t newBlocksUsed = fOpenBlocksUsed;
         uint32_t newEOF = (uint32_t) fOpenEOF;  // TODO: assert range
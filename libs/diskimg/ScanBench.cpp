@@ -0,0 +1,258 @@
+/*
+ * CiderPress
+ * Copyright (C) 2026 by CiderPress authors.  All Rights Reserved.
+ * See the file LICENSE for distribution terms.
+ */
+/*
+ * Timing for the ProDOS file usage scan.  We fill a 65535-block volume
+ * with small files that each have an index block, then open it a few
+ * times with kParmProDOS_BatchScanReads on and off, timing the scan
+ * and checking that both ways produce the same results.
+ *
+ * With an argument, that image is scanned instead of a generated one.
+ *
+ * Build with "make scanbench".  Not part of the library.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include "DiskImg.h"
+#include "../nufxlib/NufxLib.h"
+
+using namespace DiskImgLib;
+
+static const char* kTempName = "ScanBench.tmp";
+
+enum {
+    kNumBlocks = 65535,
+    kFilesPerDir = 500,
+    kMinFileLen = 513,          // anything bigger than a block is a sapling
+    kMaxFileLen = 6 * 512,
+    kNumPasses = 3,
+};
+
+/* the library is chatty; set BENCH_VERBOSE to see what it says */
+static void DebugMsgHandler(const char* file, int line, const char* msg)
+{
+    if (getenv("BENCH_VERBOSE") != NULL)
+        fprintf(stderr, "%s:%d %s\n", file, line, msg);
+}
+
+/* NufxLib complains when the image format probe offers it our volume */
+static NuResult NufxErrorMsgHandler(NuArchive* /*pArchive*/, void* vErrorMessage)
+{
+    const NuErrorMessage* pErrorMessage = (const NuErrorMessage*) vErrorMessage;
+
+    if (getenv("BENCH_VERBOSE") != NULL)
+        fprintf(stderr, "nufxlib: %s\n", pErrorMessage->message);
+    return kNuOK;
+}
+
+static double Now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/*
+ * Simple LCG, so the volume is the same every time.
+ */
+static uint32_t gRandState = 1;
+static long NextRand(long range)
+{
+    gRandState = gRandState * 1103515245 + 12345;
+    return (gRandState >> 16) % range;
+}
+
+/*
+ * Create a volume in "imageName" and fill it with small sapling files.
+ */
+static bool BuildVolume(const char* imageName)
+{
+    uint8_t buf[kMaxFileLen];
+    DiskImg img;
+    DiskFS* pDiskFS = NULL;
+    DiskFS::CreateParms parms;
+    A2File* pFile;
+    A2FileDescr* pOpenFile;
+    char pathName[64];
+    long numFiles;
+    DIError dierr;
+    int i;
+
+    for (i = 0; i < kMaxFileLen; i++)
+        buf[i] = (uint8_t) NextRand(256);
+
+    remove(imageName);
+    dierr = img.CreateImage(imageName, NULL, DiskImg::kOuterFormatNone,
+                DiskImg::kFileFormatUnadorned, DiskImg::kPhysicalFormatSectors,
+                NULL, DiskImg::kSectorOrderProDOS, DiskImg::kFormatGenericProDOSOrd,
+                kNumBlocks, false);
+    if (dierr == kDIErrNone)
+        dierr = img.FormatImage(DiskImg::kFormatProDOS, "BENCH");
+    if (dierr == kDIErrNone) {
+        pDiskFS = img.OpenAppropriateDiskFS();
+        if (pDiskFS == NULL)
+            dierr = kDIErrUnsupportedFSFmt;
+    }
+    if (dierr == kDIErrNone)
+        dierr = pDiskFS->Initialize(&img, DiskFS::kInitFull);
+    if (dierr != kDIErrNone) {
+        printf("unable to create volume: %s\n", DIStrError(dierr));
+        delete pDiskFS;
+        return false;
+    }
+
+    numFiles = 0;
+    while (true) {
+        snprintf(pathName, sizeof(pathName), "DIR%ld:F%ld",
+            numFiles / kFilesPerDir, numFiles);
+        memset(&parms, 0, sizeof(parms));
+        parms.pathName = pathName;
+        parms.fssep = ':';
+        parms.storageType = 1;
+        parms.fileType = 0x06;      // BIN
+        parms.access = 0xe3;
+        parms.createWhen = parms.modWhen = time(NULL);
+
+        dierr = pDiskFS->CreateFile(&parms, &pFile);
+        if (dierr == kDIErrNone)
+            dierr = pFile->Open(&pOpenFile, false, false);
+        if (dierr != kDIErrNone)
+            break;
+        dierr = pOpenFile->Write(buf,
+                    kMinFileLen + NextRand(kMaxFileLen - kMinFileLen + 1));
+        pOpenFile->Close();
+        if (dierr != kDIErrNone)
+            break;
+        numFiles++;
+    }
+    if (dierr != kDIErrDiskFull) {
+        printf("stopped after %ld files: %s\n", numFiles, DIStrError(dierr));
+        delete pDiskFS;
+        return false;
+    }
+    printf("built volume with %ld files\n", numFiles);
+
+    delete pDiskFS;
+    img.CloseImage();
+    return true;
+}
+
+/*
+ * Note when the ProDOS code moves on from the directories to the usage
+ * scan, which it announces with "Processing <volume>".
+ */
+static double gScanStart;
+static bool ScanProgress(void* /*cookie*/, const char* str, int /*count*/)
+{
+    if (strncmp(str, "Processing", 10) == 0)
+        gScanStart = Now();
+    return true;
+}
+
+/*
+ * Open "imageName" and time the file usage scan.  "*pResult" gets a hash
+ * of what the scan found, so the two modes can be compared.
+ */
+static bool TimeScan(const char* imageName, bool batchReads,
+    double* pElapsed, unsigned long* pResult)
+{
+    DiskImg img;
+    DiskFS* pDiskFS = NULL;
+    const DiskFS::VolumeUsage* pUsage;
+    DiskFS::VolumeUsage::ChunkState cstate;
+    A2File* pFile;
+    unsigned long hash = 5381;
+    double end;
+    long chunk;
+    DIError dierr;
+
+    dierr = img.OpenImage(imageName, '/', true);
+    if (dierr == kDIErrNone)
+        dierr = img.AnalyzeImage();
+    if (dierr == kDIErrNone) {
+        pDiskFS = img.OpenAppropriateDiskFS();
+        if (pDiskFS == NULL)
+            dierr = kDIErrUnsupportedFSFmt;
+    }
+    if (dierr != kDIErrNone) {
+        printf("%s: open failed: %s\n", imageName, DIStrError(dierr));
+        return false;
+    }
+
+    pDiskFS->SetParameter(DiskFS::kParmProDOS_BatchScanReads, batchReads);
+    img.SetScanProgressCallback(ScanProgress, NULL);
+    gScanStart = 0;
+    dierr = pDiskFS->Initialize(&img, DiskFS::kInitFull);
+    end = Now();
+    if (dierr != kDIErrNone || gScanStart == 0) {
+        printf("%s: scan failed: %s\n", imageName, DIStrError(dierr));
+        delete pDiskFS;
+        return false;
+    }
+    *pElapsed = end - gScanStart;
+
+    for (pFile = pDiskFS->GetNextFile(NULL); pFile != NULL;
+        pFile = pDiskFS->GetNextFile(pFile))
+    {
+        hash = hash * 33 + pFile->GetQuality();
+        hash = hash * 33 + (unsigned long) pFile->GetDataSparseLength();
+        hash = hash * 33 + (unsigned long) pFile->GetRsrcSparseLength();
+    }
+    pUsage = pDiskFS->GetVolumeUsageMap();
+    for (chunk = 0; pUsage != NULL && chunk < pUsage->GetNumChunks(); chunk++) {
+        pUsage->GetChunkState(chunk, &cstate);
+        hash = hash * 33 + cstate.isUsed * 2 + cstate.isMarkedUsed;
+        hash = hash * 33 + cstate.purpose;
+    }
+    *pResult = hash;
+
+    delete pDiskFS;
+    img.CloseImage();
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    const char* imageName = (argc > 1) ? argv[1] : kTempName;
+    double elapsed, best[2];
+    unsigned long result[2];
+    bool ok = true;
+    int pass, mode;
+
+    Global::SetDebugMsgHandler(DebugMsgHandler);
+    NuSetGlobalErrorMessageHandler(NufxErrorMsgHandler);
+    Global::AppInit();
+
+    if (argc <= 1)
+        ok = BuildVolume(imageName);
+
+    /* alternate, so neither one gets all the benefit of a warm cache */
+    best[0] = best[1] = 1e9;
+    for (pass = 0; ok && pass < kNumPasses; pass++) {
+        for (mode = 0; ok && mode < 2; mode++) {
+            ok = TimeScan(imageName, mode != 0, &elapsed, &result[mode]);
+            if (ok && elapsed < best[mode])
+                best[mode] = elapsed;
+        }
+    }
+
+    if (ok) {
+        printf("scan with single reads:  %.3f sec\n", best[0]);
+        printf("scan with batched reads: %.3f sec\n", best[1]);
+        if (result[0] != result[1]) {
+            printf("results differ (%08lx vs %08lx)\n", result[0], result[1]);
+            ok = false;
+        }
+    }
+
+    if (argc <= 1)
+        remove(imageName);
+    Global::AppCleanup();
+    return ok ? 0 : 1;
+}
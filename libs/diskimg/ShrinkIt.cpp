@@ -0,0 +1,1379 @@
+/*
+ * CiderPress
+ * Copyright (C) 2007 by faddenSoft, LLC.  All Rights Reserved.
+ * See the file LICENSE for distribution terms.
+ */
+/*
+ * On-demand expansion of ShrinkIt LZW/1 and LZW/2 disk image threads.
+ *
+ * NufxLib will happily expand a thread, but only all at once, so this has
+ * its own copy of the ShrinkIt expansion code.  It was derived from the
+ * NufxLib implementation (Lzw.c), which has the gory details; the
+ * significant difference here is that we can stop and start on chunk
+ * boundaries, or restart at a table clear in the middle of a chunk.
+ *
+ * A quick summary of the format:
+ *
+ *  LZW/1: crc-lo crc-hi vol rle-escape, then per chunk:
+ *      rle-len-lo rle-len-hi lzw-used [data]
+ *  LZW/2: vol rle-escape, then per chunk:
+ *      rle-len-lo rle-len-hi|0x80 [lzw-len-lo lzw-len-hi] [data]
+ *
+ * Every chunk represents 4096 bytes of output (the last one is padded).
+ * "rle-len" is the length after RLE, or 4096 if RLE wasn't used.  LZW/1
+ * starts each chunk with an empty table; LZW/2 keeps the table until it
+ * fills up or a chunk is stored without LZW.
+ *
+ * Because LZW/1 chunks don't depend on each other, an LZW/1 image can
+ * also be modified: changed chunks are held in memory, and when the
+ * archive is rewritten we recompress those and copy the rest of the
+ * compressed data over untouched.
+ */
+#include "StdAfx.h"
+#include "DiskImgPriv.h"
+
+
+/*
+ * ===========================================================================
+ *      LZW expansion
+ * ===========================================================================
+ */
+
+static const uint32_t kLZWClearCode = 0x0100;
+static const uint32_t kLZWFirstCode = 0x0101;
+static const uint32_t kLZWMaxCode = 0x0fff;
+static const int kLZWBlockSize = 4096;
+
+/* mask and bit width, indexed by the high byte of (entry+1) */
+static const uint32_t kLZWMaskTable[17] = {
+    0x0000, 0x01ff, 0x03ff, 0x03ff,  0x07ff, 0x07ff, 0x07ff, 0x07ff,
+    0x0fff, 0x0fff, 0x0fff, 0x0fff,  0x0fff, 0x0fff, 0x0fff, 0x0fff,
+    0x0fff
+};
+static const uint32_t kLZWBitWidth[17] = {
+    8,9,10,10,11,11,11,11,12,12,12,12,12,12,12,12,12
+};
+
+/* entry in the string table */
+typedef struct LZWEntry {
+    uint16_t    prefix;
+    uint8_t     ch;
+} LZWEntry;
+
+/*
+ * Everything that carries over from one chunk to the next.
+ */
+struct GFDNuFX::LZWState {
+    LZWEntry    table[kLZWMaxCode + 1 - 256];   // codes 0x100-0xfff
+    uint32_t    entry;              // next free table entry
+    uint32_t    oldcode;
+    uint32_t    incode;
+    uint32_t    finalc;
+    bool        resetFix;           // see NufxLib Nu_ExpandLZW2
+
+    uint8_t     stack[kLZWBlockSize];
+    uint8_t     lzwOut[kLZWBlockSize];  // LZW output, before RLE
+
+    void Reset(void) { entry = kLZWFirstCode; resetFix = false; }
+    bool IsEmpty(void) const { return entry == kLZWFirstCode && !resetFix; }
+};
+
+/*
+ * Position in the compressed input.
+ */
+typedef struct LZWInput {
+    const uint8_t*  base;
+    const uint8_t*  ptr;
+    const uint8_t*  end;            // must be padded past this point
+    int             atBit;
+    uint32_t        lastByte;
+} LZWInput;
+
+/*
+ * Where we saw the most recent table clear.
+ */
+typedef struct LZWClear {
+    bool        found;
+    long        inOffset;           // from LZWInput.base
+    int         atBit;
+    long        outOffset;
+} LZWClear;
+
+/*
+ * Get the next LZW code from the input.  The width depends on the number
+ * of entries in the table.
+ */
+static inline uint32_t GetLZWCode(LZWInput* pIn, uint32_t entry)
+{
+    uint32_t numBits, startBit, lastBit;
+    uint32_t value;
+
+    numBits = (entry + 1) >> 8;
+    startBit = pIn->atBit;
+    lastBit = startBit + kLZWBitWidth[numBits];
+
+    if (!startBit)
+        value = *pIn->ptr++;
+    else
+        value = pIn->lastByte;
+
+    if (lastBit > 16) {
+        value |= *pIn->ptr++ << 8;
+        pIn->lastByte = *pIn->ptr++;
+        value |= pIn->lastByte << 16;
+    } else {
+        pIn->lastByte = *pIn->ptr++;
+        value |= pIn->lastByte << 8;
+    }
+
+    pIn->atBit = lastBit & 0x07;
+    return (value >> startBit) & kLZWMaskTable[numBits];
+}
+
+/*
+ * Expand LZW codes into "outBuf" until it holds "outLen" bytes.  Output
+ * begins at "outPos".
+ *
+ * If "atClear" is set, we start as if we'd just seen a table clear.
+ * Otherwise we pick up where the previous chunk left off (an empty table
+ * is treated like a clear).  Table clears are only honored for LZW/2;
+ * if "pClear" is non-NULL, it's updated with the position just past the
+ * last one we see.
+ *
+ * Returns false if the data is damaged.
+ */
+static bool ExpandLZW(GFDNuFX::LZWState* pState, bool isType2, bool atClear,
+    LZWInput* pIn, uint8_t* outBuf, long outPos, long outLen,
+    LZWClear* pClear)
+{
+    LZWEntry* table = pState->table;
+    uint8_t* stack = pState->stack;
+    uint8_t* out = outBuf + outPos;
+    uint8_t* const outEnd = outBuf + outLen;
+    uint32_t entry, oldcode, incode, finalc, ptr;
+    int sp = 0;
+
+    if (!atClear && !pState->IsEmpty()) {
+        entry = pState->entry;
+        oldcode = pState->oldcode;
+        incode = pState->incode;
+        finalc = pState->finalc;
+        pState->resetFix = false;
+        goto main_loop;
+    }
+
+clear_table:
+    entry = kLZWFirstCode;
+    pState->resetFix = false;
+    if (out == outEnd) {
+        /* chunk ended on a table clear */
+        oldcode = incode = finalc = 0;
+        goto main_loop;
+    }
+    if (pIn->ptr >= pIn->end)
+        return false;
+    incode = GetLZWCode(pIn, entry);
+    if (incode > 0xff)
+        return false;
+    finalc = oldcode = incode;
+    *out++ = (uint8_t) incode;
+    if (out == outEnd)
+        pState->resetFix = true;
+
+main_loop:
+    while (out < outEnd) {
+        if (pIn->ptr >= pIn->end)
+            return false;
+        incode = ptr = GetLZWCode(pIn, entry);
+        if (isType2 && incode == kLZWClearCode) {
+            if (pClear != NULL) {
+                pClear->found = true;
+                pClear->inOffset = pIn->ptr - pIn->base;
+                pClear->atBit = pIn->atBit;
+                pClear->outOffset = out - outBuf;
+            }
+            goto clear_table;
+        }
+
+        /* handle KwKwK case */
+        if (ptr >= entry) {
+            if (ptr != entry)
+                return false;
+            stack[sp++] = (uint8_t) finalc;
+            ptr = oldcode;
+        }
+
+        /* chase up the trie */
+        while (ptr > 0xff) {
+            if (sp >= kLZWBlockSize)
+                return false;
+            stack[sp++] = table[ptr - 256].ch;
+            ptr = table[ptr - 256].prefix;
+        }
+
+        finalc = ptr;
+        if (out + sp + 1 > outEnd)
+            return false;
+        *out++ = (uint8_t) ptr;
+        while (sp != 0)
+            *out++ = stack[--sp];
+
+        /* add the new string -- last string plus new char */
+        if (entry > kLZWMaxCode)
+            return false;
+        table[entry - 256].ch = (uint8_t) finalc;
+        table[entry - 256].prefix = (uint16_t) oldcode;
+        entry++;
+        oldcode = incode;
+    }
+
+    pState->entry = entry;
+    pState->oldcode = oldcode;
+    pState->incode = incode;
+    pState->finalc = finalc;
+    return true;
+}
+
+/*
+ * Expand RLE data into 4K of output.
+ */
+static bool ExpandRLE(const uint8_t* in, long inLen, uint8_t escape,
+    uint8_t* out)
+{
+    const uint8_t* inEnd = in + inLen;
+    uint8_t* outEnd = out + kLZWBlockSize;
+    uint8_t uch;
+    int count;
+
+    while (out < outEnd) {
+        if (in >= inEnd)
+            return false;
+        uch = *in++;
+        if (uch == escape) {
+            if (in + 2 > inEnd)
+                return false;
+            uch = *in++;
+            count = *in++;
+            if (out + count >= outEnd)
+                return false;
+            while (count-- >= 0)
+                *out++ = uch;
+        } else {
+            *out++ = uch;
+        }
+    }
+
+    return in == inEnd;
+}
+
+/*
+ * CRC-16/XMODEM, as used by NuFX.
+ */
+static uint16_t CalcCRC16(uint16_t crc, const uint8_t* ptr, long count)
+{
+    static struct CRCTable {
+        uint16_t val[256];
+        CRCTable(void) {
+            for (int i = 0; i < 256; i++) {
+                uint16_t c = (uint16_t) (i << 8);
+                for (int j = 0; j < 8; j++)
+                    c = (c & 0x8000) ? (c << 1) ^ 0x1021 : (c << 1);
+                val[i] = c;
+            }
+        }
+    } sTable;
+
+    while (count--)
+        crc = sTable.val[((crc >> 8) ^ *ptr++) & 0xff] ^ (crc << 8);
+    return crc;
+}
+
+/*
+ * Advance "crc" as if "count" zero bytes had been fed through it.
+ *
+ * The CRC is linear, so crc(seed, A+B) == shift(crc(seed, A), len(B)) ^
+ * crc(0, B).  That lets us keep a zero-seeded CRC for each 4K chunk and
+ * combine them into the stream and thread CRCs without looking at the
+ * data again.  Shifting by a full chunk is the common case, so that
+ * gets a pair of tables.
+ */
+static uint16_t ShiftCRC16(uint16_t crc, long count)
+{
+    static const uint8_t kZeroes[256] = { 0 };
+    static struct ShiftTable {
+        uint16_t hi[256];
+        uint16_t lo[256];
+        ShiftTable(void) {
+            for (int i = 0; i < 256; i++) {
+                uint16_t chi = (uint16_t) (i << 8);
+                uint16_t clo = (uint16_t) i;
+                for (int j = 0; j < kLZWBlockSize / 256; j++) {
+                    chi = CalcCRC16(chi, kZeroes, 256);
+                    clo = CalcCRC16(clo, kZeroes, 256);
+                }
+                hi[i] = chi;
+                lo[i] = clo;
+            }
+        }
+    } sTable;
+
+    if (count == kLZWBlockSize)
+        return sTable.hi[crc >> 8] ^ sTable.lo[crc & 0xff];
+
+    while (count > 0) {
+        long chunk = count < 256 ? count : 256;
+        crc = CalcCRC16(crc, kZeroes, chunk);
+        count -= chunk;
+    }
+    return crc;
+}
+
+
+/*
+ * ===========================================================================
+ *      LZW/1 compression
+ * ===========================================================================
+ */
+
+/*
+ * This is the NufxLib compressor (Nu_CompressBlockRLE and
+ * Nu_CompressLZWBlock), cut down to LZW/1.  Every chunk starts with an
+ * empty table, so there's nothing to carry from one chunk to the next.
+ * LZW output long enough to fill the table can't beat the RLE data, so
+ * we just give up when that happens.
+ */
+static const int kLZWHashSize = 5119;       // must be prime
+static const int kLZWHashDelta = 0x120;     // used in secondary hashing
+static const uint32_t kLZWStopCode = 0x0ffd;
+
+struct GFDNuFX::LZWCompState {
+    uint16_t    entry[kLZWHashSize];
+    uint16_t    prefix[kLZWMaxCode + 1];
+    uint8_t     suffix[kLZWMaxCode + 1];
+
+    uint8_t     rleBuf[kLZWBlockSize * 2 + 64];
+    uint8_t     lzwBuf[(kLZWBlockSize * 3) / 2 + 64];
+};
+
+/*
+ * RLE-compress 4K of input.  Runs of more than three bytes, and any
+ * occurrence of the escape character, become "<escape> <char> <count-1>".
+ * The output can be up to twice as large as the input.
+ *
+ * Returns the length of the output.
+ */
+static long CompressRLE(const uint8_t* in, uint8_t escape, uint8_t* out)
+{
+    const uint8_t* inEnd = in + kLZWBlockSize;
+    uint8_t* outStart = out;
+    uint8_t matchChar;
+    int matchCount;
+
+    while (in < inEnd) {
+        matchChar = *in;
+        matchCount = 1;
+        while (++in < inEnd && *in == matchChar)
+            matchCount++;
+
+        while (matchCount > 256) {
+            *out++ = escape;
+            *out++ = matchChar;
+            *out++ = 255;
+            matchCount -= 256;
+        }
+        if (matchCount > 3 || matchChar == escape) {
+            *out++ = escape;
+            *out++ = matchChar;
+            *out++ = (uint8_t) (matchCount - 1);
+        } else {
+            while (matchCount--)
+                *out++ = matchChar;
+        }
+    }
+
+    return out - outStart;
+}
+
+/*
+ * Write a variable-width LZW code, low bits first.  "*pOutBuf" points
+ * past the last byte written (which may be partial), and "*pAtBit" holds
+ * the number of bits used in it.
+ */
+static inline void PutLZWCode(uint8_t** pOutBuf, uint32_t code, int codeBits,
+    int* pAtBit)
+{
+    int atBit = *pAtBit;
+    uint8_t* outBuf = *pOutBuf;
+
+    if (atBit) {
+        code <<= atBit;
+        outBuf[-1] = (uint8_t) ((outBuf[-1] & ((1 << atBit) - 1)) | code);
+    } else {
+        *outBuf++ = (uint8_t) code;
+    }
+
+    /* codes are at least 9 bits, so there's always one more byte */
+    *outBuf++ = (uint8_t) (code >> 8);
+    atBit += codeBits;
+    if (atBit > 16)
+        *outBuf++ = (uint8_t) (code >> 16);
+
+    *pAtBit = atBit & 0x07;
+    *pOutBuf = outBuf;
+}
+
+/*
+ * LZW-compress "inLen" bytes into pComp->lzwBuf, starting with an empty
+ * table.
+ *
+ * Returns the length of the output, or -1 if the table filled up.
+ */
+static long CompressLZW1(GFDNuFX::LZWCompState* pComp, const uint8_t* in,
+    long inLen)
+{
+    const uint8_t* inEnd = in + inLen;
+    uint16_t* pEntry = pComp->entry;
+    uint16_t* pPrefix = pComp->prefix;
+    uint8_t* pSuffix = pComp->suffix;
+    uint8_t* outBuf = pComp->lzwBuf;
+    uint32_t prefixCode, code, ic, nextFree, highCode;
+    int hash, hashDelta, codeBits, atBit;
+
+    memset(pEntry, 0, sizeof(pComp->entry));
+    nextFree = kLZWFirstCode;
+    codeBits = 9;
+    highCode = 0x01ff;
+    atBit = 0;
+
+    prefixCode = *in++;
+    while (in < inEnd) {
+        ic = *in++;
+        hash = prefixCode ^ ((((ic & 0x07) << 7) ^ ic) << 2);
+        code = pEntry[hash];
+
+        if (code != 0) {
+            if (pSuffix[code] != ic || pPrefix[code] != prefixCode) {
+                /* collision; do the secondary probe */
+                hashDelta = (kLZWHashDelta - ic) << 2;
+                do {
+                    if (hash >= hashDelta)
+                        hash -= hashDelta;
+                    else
+                        hash += kLZWHashSize - hashDelta;
+                    if ((code = pEntry[hash]) == 0)
+                        goto new_code;
+                } while (pSuffix[code] != ic || pPrefix[code] != prefixCode);
+            }
+
+            /* found the string, keep going */
+            prefixCode = code;
+            continue;
+        }
+
+new_code:
+        PutLZWCode(&outBuf, prefixCode, codeBits, &atBit);
+
+        code = nextFree++;
+        if (code >= kLZWStopCode)
+            return -1;
+        pEntry[hash] = (uint16_t) code;
+        pPrefix[code] = (uint16_t) prefixCode;
+        pSuffix[code] = (uint8_t) ic;
+
+        /* widen the codes one entry earlier than you might expect */
+        if (code >= highCode) {
+            highCode += code + 1;
+            codeBits++;
+        }
+        prefixCode = ic;
+    }
+
+    PutLZWCode(&outBuf, prefixCode, codeBits, &atBit);
+    return outBuf - pComp->lzwBuf;
+}
+
+/*
+ * Compress a 4K chunk into "outBuf", chunk header and all, picking
+ * whichever of LZW+RLE, RLE, or stored is smallest.  "outBuf" must have
+ * room for kLZWBlockSize+3 bytes.
+ *
+ * Returns the number of bytes written.
+ */
+static long CompressChunk(GFDNuFX::LZWCompState* pComp, const uint8_t* data,
+    uint8_t escape, uint8_t* outBuf)
+{
+    const uint8_t* src;
+    long rleLen, lzwLen;
+
+    rleLen = CompressRLE(data, escape, pComp->rleBuf);
+    if (rleLen < kLZWBlockSize) {
+        src = pComp->rleBuf;
+    } else {
+        src = data;
+        rleLen = kLZWBlockSize;
+    }
+
+    lzwLen = CompressLZW1(pComp, src, rleLen);
+    PutShortLE(outBuf, (uint16_t) rleLen);
+    if (lzwLen >= 0 && lzwLen < rleLen) {
+        outBuf[2] = 1;
+        memcpy(outBuf + 3, pComp->lzwBuf, lzwLen);
+        return 3 + lzwLen;
+    } else {
+        outBuf[2] = 0;
+        memcpy(outBuf + 3, src, rleLen);
+        return 3 + rleLen;
+    }
+}
+
+
+/*
+ * ===========================================================================
+ *      GFDNuFX
+ * ===========================================================================
+ */
+
+/*
+ * Prepare to read the disk image in "pThread".  Only LZW/1 images can
+ * be opened read-write.
+ */
+DIError GFDNuFX::Open(const char* archivePath, const NuThread* pThread,
+    bool checkThreadCRC, bool readOnly)
+{
+    DIError dierr = kDIErrNone;
+    uint8_t hdrBuf[4];
+    long minLen;
+    long i;
+
+    if (fpGFD != NULL)
+        return kDIErrAlreadyOpen;
+    if (!IsFormatSupported(pThread->thThreadFormat))
+        return kDIErrUnsupportedCompression;
+    if (!readOnly && !IsUpdateSupported(pThread->thThreadFormat))
+        return kDIErrNotSupported;
+
+    fFormat = pThread->thThreadFormat;
+    fThreadOffset = pThread->fileOffset;
+    fThreadCompLen = pThread->thCompThreadEOF;
+    fThreadCRC = pThread->thThreadCRC;
+    fCheckThreadCRC = checkThreadCRC;
+    fLength = pThread->actualThreadEOF;
+    fReadOnly = readOnly;
+
+    /* header, plus at least one chunk header */
+    minLen = (fFormat == kNuThreadFormatLZW1) ? 7 : 4;
+    if (fLength <= 0 || fThreadCompLen < minLen) {
+        LOGI(" GFDNuFX thread too short (comp=%ld uncomp=%ld)",
+            fThreadCompLen, (long) fLength);
+        return kDIErrBadCompressedData;
+    }
+
+    fpGFD = new GFDFile;
+    fArchivePath = StrcpyNew(archivePath);
+    if (fpGFD == NULL || fArchivePath == NULL) {
+        dierr = kDIErrMalloc;
+        goto bail;
+    }
+    dierr = fpGFD->Open(archivePath, true);
+    if (dierr != kDIErrNone)
+        goto bail;
+
+    dierr = fpGFD->Seek(fThreadOffset, kSeekSet);
+    if (dierr != kDIErrNone)
+        goto bail;
+    if (fFormat == kNuThreadFormatLZW1) {
+        dierr = fpGFD->Read(hdrBuf, 4);
+        if (dierr != kDIErrNone)
+            goto bail;
+        fStreamCRC = GetShortLE(hdrBuf);
+        fRLEEscape = hdrBuf[3];
+        fDataStart = 4;
+    } else {
+        dierr = fpGFD->Read(hdrBuf, 2);
+        if (dierr != kDIErrNone)
+            goto bail;
+        fStreamCRC = 0;
+        fRLEEscape = hdrBuf[1];
+        fDataStart = 2;
+    }
+
+    fNumChunks = (long) ((fLength + kChunkSize - 1) / kChunkSize);
+    fChunks = new ChunkInfo[fNumChunks];
+    fpScanState = new LZWState;
+    fpRandState = new LZWState;
+    fCompBuf = new uint8_t[kMaxChunkCompLen + kCompBufPad];
+    if (fChunks == NULL || fpScanState == NULL || fpRandState == NULL ||
+        fCompBuf == NULL)
+    {
+        dierr = kDIErrMalloc;
+        goto bail;
+    }
+    for (i = 0; i < fNumChunks; i++) {
+        fChunks[i].compOffset = -1;
+        fChunks[i].compLen = -1;
+        fChunks[i].cacheSlot = -1;
+        fChunks[i].dirty = NULL;
+    }
+    for (i = 0; i < kNumCacheChunks; i++)
+        fCache[i].chunkNum = -1;
+
+    fChunks[0].compOffset = fDataStart;
+    fNumScanned = 0;
+    fNumDirty = 0;
+    fpScanState->Reset();
+    fScanLastClear.chunkNum = 0;
+    fScanLastClear.compOffset = -1;
+    fScanStreamCRC = 0x0000;
+    fScanThreadCRC = 0xffff;
+    fBadCRC = false;
+    fCurrentOffset = 0;
+
+    LOGI(" GFDNuFX opened LZW/%d thread, %ld chunks (readOnly=%d)",
+        fFormat == kNuThreadFormatLZW1 ? 1 : 2, fNumChunks, readOnly);
+
+bail:
+    if (dierr != kDIErrNone)
+        Close();
+    return dierr;
+}
+
+/*
+ * Expand one chunk.
+ *
+ * If "pStart" is non-NULL, expansion begins at that reset point (which
+ * must be in this chunk), otherwise it continues from the state left in
+ * "pState" by the previous chunk.  If "outBuf" is NULL the output is
+ * discarded, which is useful for getting the LZW/2 table into shape.
+ *
+ * On success, "*pCompLen" holds the number of bytes of compressed data
+ * (including the chunk header) the chunk occupies, and "*pLastClear" is
+ * updated if we found a table clear.
+ */
+DIError GFDNuFX::DecodeChunk(LZWState* pState, long chunkNum,
+    const ResetPoint* pStart, uint8_t* outBuf, long* pCompLen,
+    ResetPoint* pLastClear)
+{
+    DIError dierr;
+    const bool isType2 = (fFormat == kNuThreadFormatLZW2);
+    const long compOffset = fChunks[chunkNum].compOffset;
+    long availLen, hdrLen, rleLen, writeLen, inCount;
+    bool lzwUsed, rleUsed;
+
+    assert(compOffset >= 0);
+    assert(pStart == NULL || pStart->chunkNum == chunkNum);
+
+    availLen = fThreadCompLen - compOffset;
+    if (availLen > kMaxChunkCompLen)
+        availLen = kMaxChunkCompLen;
+    if (availLen < (isType2 ? 2 : 3)) {
+        LOGI(" GFDNuFX ran out of data at chunk %ld", chunkNum);
+        return kDIErrBadCompressedData;
+    }
+    dierr = fpGFD->Seek(fThreadOffset + compOffset, kSeekSet);
+    if (dierr != kDIErrNone)
+        return dierr;
+    dierr = fpGFD->Read(fCompBuf, availLen);
+    if (dierr != kDIErrNone)
+        return dierr;
+    memset(fCompBuf + availLen, 0, kCompBufPad);
+
+    /* chunk header */
+    rleLen = GetShortLE(fCompBuf);
+    if (isType2) {
+        lzwUsed = (rleLen & 0x8000) != 0;
+        rleLen &= 0x1fff;
+        hdrLen = lzwUsed ? 4 : 2;
+    } else {
+        if (fCompBuf[2] > 1) {
+            LOGI(" GFDNuFX garbled LZW/1 header in chunk %ld", chunkNum);
+            return kDIErrBadCompressedData;
+        }
+        lzwUsed = (fCompBuf[2] != 0);
+        hdrLen = 3;
+    }
+    if (rleLen == 0 || rleLen > kChunkSize || hdrLen > availLen) {
+        LOGI(" GFDNuFX bad chunk header in chunk %ld", chunkNum);
+        return kDIErrBadCompressedData;
+    }
+    rleUsed = (rleLen != kChunkSize);
+    writeLen = WriteLen(chunkNum);
+
+    if (lzwUsed) {
+        LZWInput input;
+        LZWClear clear;
+        uint8_t* lzwOut;
+        bool atClear = false;
+        long outPos = 0;
+
+        input.base = fCompBuf;
+        input.ptr = fCompBuf + hdrLen;
+        input.end = fCompBuf + availLen;
+        input.atBit = 0;
+        input.lastByte = 0;
+        clear.found = false;
+
+        if (!isType2) {
+            pState->Reset();
+        } else if (pStart != NULL) {
+            if (pStart->compOffset < 0) {
+                pState->Reset();
+            } else {
+                input.ptr = fCompBuf + (pStart->compOffset - compOffset);
+                input.atBit = pStart->atBit;
+                if (input.atBit != 0)
+                    input.lastByte = input.ptr[-1];
+                outPos = pStart->outOffset;
+                atClear = true;
+            }
+        }
+
+        if (outBuf != NULL && !rleUsed)
+            lzwOut = outBuf;
+        else
+            lzwOut = pState->lzwOut;
+        if (!ExpandLZW(pState, isType2, atClear, &input, lzwOut, outPos,
+                rleLen, &clear))
+        {
+            LOGI(" GFDNuFX LZW expansion failed in chunk %ld", chunkNum);
+            return kDIErrBadCompressedData;
+        }
+        if (outBuf != NULL && rleUsed) {
+            if (!ExpandRLE(lzwOut, rleLen, fRLEEscape, outBuf)) {
+                LOGI(" GFDNuFX RLE expansion failed in chunk %ld", chunkNum);
+                return kDIErrBadCompressedData;
+            }
+        }
+
+        if (clear.found && pLastClear != NULL) {
+            pLastClear->chunkNum = chunkNum;
+            pLastClear->compOffset = compOffset + clear.inOffset;
+            pLastClear->atBit = clear.atBit;
+            pLastClear->outOffset = clear.outOffset;
+        }
+        *pCompLen = input.ptr - input.base;
+    } else {
+        /* no LZW; the data is RLE or stored */
+        inCount = rleUsed ? rleLen : writeLen;
+        if (hdrLen + inCount > availLen) {
+            LOGI(" GFDNuFX ran out of data at chunk %ld", chunkNum);
+            return kDIErrBadCompressedData;
+        }
+        if (outBuf != NULL) {
+            if (rleUsed) {
+                if (!ExpandRLE(fCompBuf + hdrLen, rleLen, fRLEEscape,
+                        outBuf))
+                {
+                    LOGI(" GFDNuFX RLE expansion failed in chunk %ld",
+                        chunkNum);
+                    return kDIErrBadCompressedData;
+                }
+            } else {
+                /*
+                 * Only "writeLen" bytes are consumed, but the padding
+                 * that follows is part of the LZW/1 CRC, so copy it too.
+                 */
+                long copyLen = availLen - hdrLen;
+                if (copyLen > kChunkSize)
+                    copyLen = kChunkSize;
+                memcpy(outBuf, fCompBuf + hdrLen, copyLen);
+                memset(outBuf + copyLen, 0, kChunkSize - copyLen);
+            }
+        }
+
+        /* no LZW used, so LZW/2 starts over with the next chunk */
+        pState->Reset();
+        *pCompLen = hdrLen + inCount;
+    }
+
+    return kDIErrNone;
+}
+
+/*
+ * Find out where the next chunk lives by expanding it.  The output goes
+ * into the cache, since somebody asked for it.
+ */
+DIError GFDNuFX::ScanNextChunk(void)
+{
+    DIError dierr;
+    const long chunkNum = fNumScanned;
+    ChunkInfo* pInfo = &fChunks[chunkNum];
+    long compLen, writeLen;
+    uint8_t* data;
+
+    assert(chunkNum < fNumChunks);
+    assert(pInfo->compOffset >= 0);
+
+    /* figure out where we'd have to start to re-create this chunk */
+    if (fFormat == kNuThreadFormatLZW1 || fpScanState->IsEmpty()) {
+        pInfo->reset.chunkNum = chunkNum;
+        pInfo->reset.compOffset = -1;
+        pInfo->reset.atBit = 0;
+        pInfo->reset.outOffset = 0;
+        fScanLastClear = pInfo->reset;
+    } else {
+        pInfo->reset = fScanLastClear;
+    }
+
+    data = AddToCache(chunkNum);
+    if (data == NULL)
+        return kDIErrMalloc;
+
+    dierr = DecodeChunk(fpScanState, chunkNum,
+                pInfo->reset.chunkNum == chunkNum ? &pInfo->reset : NULL,
+                data, &compLen, &fScanLastClear);
+    if (dierr != kDIErrNone) {
+        /* don't leave garbage in the cache */
+        fCache[pInfo->cacheSlot].chunkNum = -1;
+        pInfo->cacheSlot = -1;
+        return dierr;
+    }
+
+    pInfo->compLen = compLen;
+    if (chunkNum + 1 < fNumChunks)
+        fChunks[chunkNum + 1].compOffset = pInfo->compOffset + compLen;
+    fNumScanned++;
+
+    /*
+     * Keep the CRCs going, so we can check them when we hit the end.  The
+     * per-chunk CRC is kept around for BuildUpdate.
+     */
+    pInfo->crc = CalcCRC16(0x0000, data, kChunkSize);
+    writeLen = WriteLen(chunkNum);
+    if (writeLen == kChunkSize)
+        fScanThreadCRC = ShiftCRC16(fScanThreadCRC, kChunkSize) ^ pInfo->crc;
+    else
+        fScanThreadCRC = CalcCRC16(fScanThreadCRC, data, writeLen);
+    fScanStreamCRC = ShiftCRC16(fScanStreamCRC, kChunkSize) ^ pInfo->crc;
+
+    /*
+     * A mismatch means some of the data we've already handed out was
+     * wrong, so refuse to do anything else with the thread.
+     */
+    if (fNumScanned == fNumChunks) {
+        if (fFormat == kNuThreadFormatLZW1 && fScanStreamCRC != fStreamCRC) {
+            LOGW(" GFDNuFX LZW/1 CRC mismatch (expected 0x%04x, got 0x%04x)",
+                fStreamCRC, fScanStreamCRC);
+            fBadCRC = true;
+            return kDIErrBadChecksum;
+        }
+        if (fCheckThreadCRC && fScanThreadCRC != fThreadCRC) {
+            LOGW(" GFDNuFX thread CRC mismatch (expected 0x%04x, got 0x%04x)",
+                fThreadCRC, fScanThreadCRC);
+            fBadCRC = true;
+            return kDIErrBadChecksum;
+        }
+        LOGI(" GFDNuFX scanned all %ld chunks", fNumChunks);
+    }
+
+    return kDIErrNone;
+}
+
+/*
+ * Get chunk "chunkNum" into the cache.
+ */
+DIError GFDNuFX::ExpandChunk(long chunkNum)
+{
+    DIError dierr;
+    const ResetPoint* pReset;
+    long compLen, i;
+    uint8_t* data;
+
+    if (fBadCRC)
+        return kDIErrBadChecksum;
+
+    /* if we haven't been this far yet, scan forward; this caches them */
+    while (chunkNum >= fNumScanned) {
+        dierr = ScanNextChunk();
+        if (dierr != kDIErrNone)
+            return dierr;
+    }
+    if (GetCacheData(chunkNum) != NULL)
+        return kDIErrNone;
+
+    /*
+     * Start at the reset point, and work forward.  For LZW/2 the reset
+     * point may be in an earlier chunk; we expand those chunks too, and
+     * cache the ones that weren't already.
+     */
+    pReset = &fChunks[chunkNum].reset;
+    for (i = pReset->chunkNum; i <= chunkNum; i++) {
+        if (i == pReset->chunkNum && pReset->compOffset >= 0) {
+            /* starts mid-chunk; output is incomplete, so toss it */
+            data = NULL;
+        } else {
+            data = GetCacheData(i);
+            if (data == NULL) {
+                data = AddToCache(i);
+                if (data == NULL)
+                    return kDIErrMalloc;
+            }
+        }
+
+        dierr = DecodeChunk(fpRandState, i,
+                    i == pReset->chunkNum ? pReset : NULL, data, &compLen,
+                    NULL);
+        if (dierr != kDIErrNone || compLen != fChunks[i].compLen) {
+            LOGI(" GFDNuFX re-expansion of chunk %ld failed", i);
+            if (fChunks[i].cacheSlot >= 0) {
+                fCache[fChunks[i].cacheSlot].chunkNum = -1;
+                fChunks[i].cacheSlot = -1;
+            }
+            return dierr != kDIErrNone ? dierr : kDIErrBadCompressedData;
+        }
+    }
+
+    return kDIErrNone;
+}
+
+/*
+ * Return the cached data for "chunkNum", or NULL if it's not cached.
+ */
+uint8_t* GFDNuFX::GetCacheData(long chunkNum)
+{
+    int slot = fChunks[chunkNum].cacheSlot;
+
+    if (slot < 0)
+        return NULL;
+    assert(fCache[slot].chunkNum == chunkNum);
+    fCache[slot].lastUse = ++fUseCounter;
+    return fCache[slot].data;
+}
+
+/*
+ * Claim a cache entry for "chunkNum", discarding the least-recently-used
+ * entry if they're all busy.
+ */
+uint8_t* GFDNuFX::AddToCache(long chunkNum)
+{
+    CacheChunk* pChunk = &fCache[0];
+    int i;
+
+    assert(fChunks[chunkNum].cacheSlot < 0);
+
+    for (i = 0; i < kNumCacheChunks; i++) {
+        if (fCache[i].chunkNum < 0) {
+            pChunk = &fCache[i];
+            break;
+        }
+        if (fCache[i].lastUse < pChunk->lastUse)
+            pChunk = &fCache[i];
+    }
+
+    if (pChunk->data == NULL) {
+        pChunk->data = new uint8_t[kChunkSize];
+        if (pChunk->data == NULL)
+            return NULL;
+    }
+    if (pChunk->chunkNum >= 0)
+        fChunks[pChunk->chunkNum].cacheSlot = -1;
+    pChunk->chunkNum = chunkNum;
+    pChunk->lastUse = ++fUseCounter;
+    fChunks[chunkNum].cacheSlot = (int) (pChunk - fCache);
+    return pChunk->data;
+}
+
+/*
+ * Get the current contents of "chunkNum", expanding it if needed.  The
+ * pointer is only good until the next call.
+ */
+uint8_t* GFDNuFX::GetChunkData(long chunkNum, DIError* pErr)
+{
+    uint8_t* data;
+
+    *pErr = kDIErrNone;
+    if (fChunks[chunkNum].dirty != NULL)
+        return fChunks[chunkNum].dirty;
+
+    data = GetCacheData(chunkNum);
+    if (data == NULL) {
+        *pErr = ExpandChunk(chunkNum);
+        if (*pErr != kDIErrNone)
+            return NULL;
+        data = GetCacheData(chunkNum);
+        assert(data != NULL);
+    }
+    return data;
+}
+
+DIError GFDNuFX::Read(void* buf, size_t length, size_t* pActual)
+{
+    DIError dierr;
+
+    if (fpGFD == NULL)
+        return kDIErrNotReady;
+    if (length == 0)
+        return kDIErrInvalidArg;
+    if (fBadCRC)
+        return kDIErrBadChecksum;
+
+    if (fCurrentOffset + (long)length > fLength) {
+        if (pActual == NULL) {
+            LOGW("  GFDNuFX underrrun off=%ld len=%lu flen=%ld",
+                (long) fCurrentOffset, (unsigned long) length, (long) fLength);
+            return kDIErrDataUnderrun;
+        } else {
+            /* set *pActual and adjust "length" */
+            assert(fLength >= fCurrentOffset);
+            length = (size_t) (fLength - fCurrentOffset);
+            *pActual = length;
+
+            if (length == 0)
+                return kDIErrEOF;
+        }
+    }
+    if (pActual != NULL)
+        *pActual = length;
+
+    while (length != 0) {
+        long chunkNum = (long) (fCurrentOffset / kChunkSize);
+        long chunkOffset = (long) (fCurrentOffset % kChunkSize);
+        uint8_t* data;
+        size_t copyLen;
+
+        data = GetChunkData(chunkNum, &dierr);
+        if (data == NULL)
+            return dierr;
+
+        copyLen = kChunkSize - chunkOffset;
+        if (copyLen > length)
+            copyLen = length;
+        memcpy(buf, data + chunkOffset, copyLen);
+        buf = (uint8_t*) buf + copyLen;
+        length -= copyLen;
+        fCurrentOffset += copyLen;
+    }
+
+    return kDIErrNone;
+}
+
+/*
+ * Modified chunks are copied out of the cache and held until the archive
+ * is rewritten.
+ */
+DIError GFDNuFX::Write(const void* buf, size_t length, size_t* pActual)
+{
+    DIError dierr;
+
+    if (fpGFD == NULL)
+        return kDIErrNotReady;
+    if (fReadOnly)
+        return kDIErrAccessDenied;
+    if (fBadCRC)
+        return kDIErrBadChecksum;
+    assert(pActual == NULL);     // not handling this yet
+    if (fCurrentOffset + (long)length > fLength) {
+        LOGI("  GFDNuFX overrun off=%ld len=%lu flen=%ld",
+            (long) fCurrentOffset, (unsigned long) length, (long) fLength);
+        return kDIErrDataOverrun;
+    }
+
+    while (length != 0) {
+        long chunkNum = (long) (fCurrentOffset / kChunkSize);
+        long chunkOffset = (long) (fCurrentOffset % kChunkSize);
+        ChunkInfo* pInfo = &fChunks[chunkNum];
+        size_t copyLen;
+
+        if (pInfo->dirty == NULL) {
+            uint8_t* data = GetChunkData(chunkNum, &dierr);
+            if (data == NULL)
+                return dierr;
+            pInfo->dirty = new uint8_t[kChunkSize];
+            if (pInfo->dirty == NULL)
+                return kDIErrMalloc;
+            memcpy(pInfo->dirty, data, kChunkSize);
+
+            /* the cached copy is about to go stale */
+            assert(pInfo->cacheSlot >= 0);
+            fCache[pInfo->cacheSlot].chunkNum = -1;
+            pInfo->cacheSlot = -1;
+            fNumDirty++;
+        }
+
+        copyLen = kChunkSize - chunkOffset;
+        if (copyLen > length)
+            copyLen = length;
+        memcpy(pInfo->dirty + chunkOffset, buf, copyLen);
+        buf = (const uint8_t*) buf + copyLen;
+        length -= copyLen;
+        fCurrentOffset += copyLen;
+    }
+
+    return kDIErrNone;
+}
+
+DIError GFDNuFX::Seek(di_off_t offset, DIWhence whence)
+{
+    if (fpGFD == NULL)
+        return kDIErrNotReady;
+
+    switch (whence) {
+    case kSeekSet:
+        if (offset < 0 || offset >= fLength)
+            return kDIErrInvalidArg;
+        fCurrentOffset = offset;
+        break;
+    case kSeekEnd:
+        if (offset > 0 || offset < -fLength)
+            return kDIErrInvalidArg;
+        fCurrentOffset = fLength + offset;
+        break;
+    case kSeekCur:
+        if (offset < -fCurrentOffset ||
+            offset >= (fLength - fCurrentOffset))
+        {
+            return kDIErrInvalidArg;
+        }
+        fCurrentOffset += offset;
+        break;
+    default:
+        assert(false);
+        return kDIErrInvalidArg;
+    }
+
+    assert(fCurrentOffset >= 0 && fCurrentOffset <= fLength);
+    return kDIErrNone;
+}
+
+di_off_t GFDNuFX::Tell(void)
+{
+    if (fpGFD == NULL)
+        return (di_off_t) -1;
+    return fCurrentOffset;
+}
+
+/*
+ * Create a new LZW/1 thread with the current contents of the disk.
+ *
+ * Runs of unmodified chunks are copied out of the old thread as-is, and
+ * only the dirty ones are compressed.  The CRCs are put together from the
+ * per-chunk CRCs, so the clean chunks don't need to be expanded either
+ * (except for the last one, which the thread CRC only partly covers).
+ *
+ * On success, "*pBuf" holds the thread data (allocated with new[]), and
+ * the archive file has been closed so that NufxLib can replace it.
+ */
+DIError GFDNuFX::BuildUpdate(uint8_t** pBuf, long* pLen, uint16_t* pThreadCRC)
+{
+    DIError dierr = kDIErrNone;
+    LZWCompState* pComp = NULL;
+    uint8_t* outBuf = NULL;
+    uint8_t* data;
+    uint16_t streamCRC, threadCRC, lastCRC;
+    long outMax, outLen, lastNum, i, j;
+
+    if (fpGFD == NULL)
+        return kDIErrNotReady;
+    if (fReadOnly)
+        return kDIErrAccessDenied;
+    if (fBadCRC)
+        return kDIErrBadChecksum;
+    assert(fFormat == kNuThreadFormatLZW1);
+    assert(fPendingChunks == NULL);
+
+    /* we need to know where all of the clean chunks live */
+    while (fNumScanned < fNumChunks) {
+        dierr = ScanNextChunk();
+        if (dierr != kDIErrNone)
+            goto bail;
+    }
+
+    lastNum = fNumChunks - 1;
+    data = GetChunkData(lastNum, &dierr);
+    if (data == NULL)
+        goto bail;
+    lastCRC = CalcCRC16(0x0000, data, WriteLen(lastNum));
+
+    outMax = fThreadCompLen + fNumDirty * (kChunkSize + 3);
+    outBuf = new uint8_t[outMax];
+    fPendingChunks = new ChunkInfo[fNumChunks];
+    pComp = new LZWCompState;
+    if (outBuf == NULL || fPendingChunks == NULL || pComp == NULL) {
+        dierr = kDIErrMalloc;
+        goto bail;
+    }
+    memcpy(fPendingChunks, fChunks, fNumChunks * sizeof(ChunkInfo));
+
+    /* copy the CRC (replaced later), volume number, and RLE escape */
+    dierr = fpGFD->Seek(fThreadOffset, kSeekSet);
+    if (dierr == kDIErrNone)
+        dierr = fpGFD->Read(outBuf, fDataStart);
+    if (dierr != kDIErrNone)
+        goto bail;
+    outLen = fDataStart;
+
+    for (i = 0; i < fNumChunks; i = j) {
+        if (fChunks[i].dirty != NULL) {
+            ChunkInfo* pInfo = &fPendingChunks[i];
+            uint8_t* hdr = outBuf + outLen;
+
+            pInfo->compOffset = outLen;
+            pInfo->compLen = CompressChunk(pComp, fChunks[i].dirty,
+                                fRLEEscape, hdr);
+            pInfo->crc = CalcCRC16(0x0000, fChunks[i].dirty, kChunkSize);
+            outLen += pInfo->compLen;
+            if (GetShortLE(hdr) == kChunkSize && hdr[2] == 0) {
+                /* stored; the expander stops at the end of the data */
+                pInfo->compLen = 3 + WriteLen(i);
+            }
+            j = i + 1;
+        } else {
+            /*
+             * Copy a run of clean chunks in one go.  The last chunk takes
+             * along whatever follows it (GSHK adds an extra byte).
+             */
+            long runStart = fChunks[i].compOffset;
+            long runEnd;
+
+            for (j = i; j < fNumChunks && fChunks[j].dirty == NULL; j++) {
+                fPendingChunks[j].compOffset =
+                    outLen + (fChunks[j].compOffset - runStart);
+            }
+            runEnd = (j == fNumChunks) ? fThreadCompLen : fChunks[j].compOffset;
+
+            dierr = fpGFD->Seek(fThreadOffset + runStart, kSeekSet);
+            if (dierr == kDIErrNone)
+                dierr = fpGFD->Read(outBuf + outLen, runEnd - runStart);
+            if (dierr != kDIErrNone)
+                goto bail;
+            outLen += runEnd - runStart;
+        }
+        assert(outLen <= outMax);
+    }
+
+    streamCRC = 0x0000;
+    threadCRC = 0xffff;
+    for (i = 0; i < fNumChunks; i++) {
+        streamCRC = ShiftCRC16(streamCRC, kChunkSize) ^ fPendingChunks[i].crc;
+        if (i != lastNum) {
+            threadCRC = ShiftCRC16(threadCRC, kChunkSize) ^
+                        fPendingChunks[i].crc;
+        } else {
+            threadCRC = ShiftCRC16(threadCRC, WriteLen(i)) ^ lastCRC;
+        }
+    }
+    PutShortLE(outBuf, streamCRC);
+
+    LOGI(" GFDNuFX rebuilt thread: recompressed %ld of %ld chunks, %ld -> %ld",
+        fNumDirty, fNumChunks, fThreadCompLen, outLen);
+
+    /* NufxLib is about to replace the archive; let go of it */
+    fpGFD->Close();
+    fPendingCompLen = outLen;
+    fPendingStreamCRC = streamCRC;
+    *pBuf = outBuf;
+    *pLen = outLen;
+    *pThreadCRC = threadCRC;
+    outBuf = NULL;
+
+bail:
+    delete pComp;
+    delete[] outBuf;
+    if (dierr != kDIErrNone) {
+        delete[] fPendingChunks;
+        fPendingChunks = NULL;
+    }
+    return dierr;
+}
+
+/*
+ * The archive has been rewritten with the output of BuildUpdate, and
+ * "pThread" is the new disk image thread.  Switch over to it.
+ */
+DIError GFDNuFX::FinishUpdate(const NuThread* pThread)
+{
+    DIError dierr;
+    long i;
+
+    assert(fPendingChunks != NULL);
+    if (pThread->thThreadFormat != kNuThreadFormatLZW1 ||
+        (long) pThread->thCompThreadEOF != fPendingCompLen ||
+        (di_off_t) pThread->actualThreadEOF != fLength)
+    {
+        LOGW(" GFDNuFX new thread doesn't match (fmt=%d comp=%u len=%u)",
+            pThread->thThreadFormat, pThread->thCompThreadEOF,
+            pThread->actualThreadEOF);
+        return kDIErrInternal;
+    }
+
+    dierr = fpGFD->Open(fArchivePath, true);
+    if (dierr != kDIErrNone)
+        return dierr;
+    fThreadOffset = pThread->fileOffset;
+    fThreadCompLen = fPendingCompLen;
+    fStreamCRC = fPendingStreamCRC;
+    fThreadCRC = pThread->thThreadCRC;
+
+    /* the modified data goes into the cache, since it's probably hot */
+    for (i = 0; i < fNumChunks; i++) {
+        uint8_t* dirty = fChunks[i].dirty;
+        int cacheSlot = fChunks[i].cacheSlot;
+        uint8_t* data;
+
+        fChunks[i] = fPendingChunks[i];
+        fChunks[i].cacheSlot = cacheSlot;
+        fChunks[i].dirty = NULL;
+        if (dirty != NULL) {
+            assert(fChunks[i].cacheSlot < 0);
+            data = AddToCache(i);
+            if (data != NULL)
+                memcpy(data, dirty, kChunkSize);
+            delete[] dirty;
+        }
+    }
+    fNumDirty = 0;
+    delete[] fPendingChunks;
+    fPendingChunks = NULL;
+
+    return kDIErrNone;
+}
+
+/*
+ * The archive rewrite failed.  Go back to reading the original thread.
+ */
+DIError GFDNuFX::CancelUpdate(void)
+{
+    assert(fPendingChunks != NULL);
+    delete[] fPendingChunks;
+    fPendingChunks = NULL;
+    return fpGFD->Open(fArchivePath, true);
+}
+
+DIError GFDNuFX::Close(void)
+{
+    int i;
+
+    if (fpGFD == NULL)
+        return kDIErrNone;
+
+    LOGI("  GFDNuFX closing (scanned %ld of %ld chunks)", fNumScanned,
+        fNumChunks);
+    if (fNumDirty != 0)
+        LOGW("  GFDNuFX discarding %ld modified chunks", fNumDirty);
+    delete fpGFD;
+    fpGFD = NULL;
+    delete[] fArchivePath;
+    fArchivePath = NULL;
+    if (fChunks != NULL) {
+        for (i = 0; i < fNumChunks; i++)
+            delete[] fChunks[i].dirty;
+    }
+    delete[] fChunks;
+    fChunks = NULL;
+    fNumDirty = 0;
+    delete[] fPendingChunks;
+    fPendingChunks = NULL;
+    fNumChunks = fNumScanned = 0;
+    delete fpScanState;
+    fpScanState = NULL;
+    delete fpRandState;
+    fpRandState = NULL;
+    delete[] fCompBuf;
+    fCompBuf = NULL;
+    for (i = 0; i < kNumCacheChunks; i++) {
+        delete[] fCache[i].data;
+        fCache[i].data = NULL;
+        fCache[i].chunkNum = -1;
+    }
+
+    return kDIErrNone;
+}
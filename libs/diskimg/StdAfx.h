@@ -29,6 +29,13 @@
 #define HAVE_FSEEKO
 #define HAVE_FTRUNCATE
 
+#ifdef __linux__
+/* sparse file support */
+# include <sys/stat.h>
+# define HAVE_FALLOCATE
+# define HAVE_SEEK_DATA
+#endif
+
 // gcc wants special compile options; just ignore this for now
 #define override
 
@@ -46,7 +46,7 @@ NuResult NufxErrorMsgHandler(NuArchive* pArchive, void* vErrorMessage)
     return kNuOK;
 }
 
-void readfile(const char* filename, const char* resource, void** data, long* fileSize)
+FILE* openfork(const char* filename, const char* resource)
 {
     FILE* fin = NULL;
     char fullname[_MAX_PATH];
@@ -57,6 +57,12 @@ void readfile(const char* filename, const char* resource, void** data, long* fil
         sprintf_s(fullname, "%s", filename);
 
     fopen_s(&fin, fullname, "rb");
+    return fin;
+}
+
+void readfile(const char* filename, const char* resource, void** data, long* fileSize)
+{
+    FILE* fin = openfork(filename, resource);
     if (fin != NULL)
     {
         fseek(fin, 0, SEEK_END);
@@ -73,7 +79,38 @@ void readfile(const char* filename, const char* resource, void** data, long* fil
     }
 }
 
-void writefile(const char* imgFileName, const char* destFileName, const unsigned char* fileData, long fileDataSize, const unsigned char* rsrcData, long rsrcDataSize, AFP_Info* afpInfo)
+DiskImgLib::DIError copyfork(const char* filename, const char* resource, A2File* a2File, bool rsrcFork)
+{
+    static unsigned char buf[65536];
+    A2FileDescr* a2FileDescr;
+    DiskImgLib::DIError dierr;
+    size_t count;
+
+    dierr = a2File->Open(&a2FileDescr, false, rsrcFork);
+    if (dierr != kDIErrNone)
+        return dierr;
+
+    // a missing fork is left empty
+    FILE* fin = openfork(filename, resource);
+    if (fin != NULL)
+    {
+        while ((count = fread(buf, 1, sizeof(buf), fin)) > 0)
+        {
+            dierr = a2FileDescr->Write(buf, count);
+            if (dierr != kDIErrNone)
+                break;
+        }
+        // don't let a read error pass for the end of the fork
+        if (dierr == kDIErrNone && ferror(fin))
+            dierr = kDIErrReadFailed;
+        fclose(fin);
+    }
+
+    DiskImgLib::DIError closeErr = a2FileDescr->Close();
+    return dierr != kDIErrNone ? dierr : closeErr;
+}
+
+void writefile(const char* imgFileName, const char* destFileName, const char* srcFileName, AFP_Info* afpInfo)
 {
     DiskImgLib::DiskImg diskImg;
     DiskImgLib::DIError dierr;
@@ -83,7 +120,8 @@ void writefile(const char* imgFileName, const char* destFileName, const unsigned
     auto format = diskImg.GetFSFormat();
     auto diskFS = diskImg.OpenAppropriateDiskFS();
     diskFS->SetScanForSubVolumes(DiskFS::kScanSubEnabled);
-    dierr = diskFS->Initialize(&diskImg, DiskFS::kInitFull);
+    // only the directories along destFileName get read
+    dierr = diskFS->Initialize(&diskImg, DiskFS::kInitLazy);
 
     DiskFS::CreateParms parms;
     parms.fileType = afpInfo->prodos_file_type;
@@ -101,14 +139,9 @@ void writefile(const char* imgFileName, const char* destFileName, const unsigned
 
     dierr = diskFS->CreateFile(&parms, &a2File);
 
-    A2FileDescr* a2FileDescr;
-    dierr = a2File->Open(&a2FileDescr, false, false);
-    dierr = a2FileDescr->Write(fileData, fileDataSize);
-    dierr = a2FileDescr->Close();
-
-    dierr = a2File->Open(&a2FileDescr, false, true);
-    dierr = a2FileDescr->Write(rsrcData, rsrcDataSize);
-    dierr = a2FileDescr->Close();
+    // stream both forks through a fixed buffer rather than holding them in memory
+    dierr = copyfork(srcFileName, NULL, a2File, false);
+    dierr = copyfork(srcFileName, "AFP_Resource", a2File, true);
 
     delete diskFS;
 }
@@ -122,15 +155,8 @@ int main(int argc, char* argv[])
     char* imgFile   = argv[2];
 
     AFP_Info* afpInfo = NULL;
-    unsigned char* afpResource = NULL;
-    unsigned char* fileData = NULL;
-
-    long fileDataSize = 0;
-    long fileRsrcSize = 0;
 
     readfile(argv[1], "AFP_AfpInfo", (void**)&afpInfo, NULL);
-    readfile(argv[1], "AFP_Resource", (void**)&afpResource, &fileRsrcSize);
-    readfile(argv[1], NULL, (void**)&fileData, &fileDataSize);
 
     DiskImgLib::Global::SetDebugMsgHandler(DebugMsgHandler);
     DiskImgLib::Global::AppInit();
@@ -140,17 +166,11 @@ int main(int argc, char* argv[])
     char fileName[_MAX_FNAME];
     errno_t err = _splitpath_s(argv[1], NULL, 0, NULL, 0, fileName, _MAX_FNAME, NULL, 0);
 
-    writefile(argv[2], fileName, fileData, fileDataSize, afpResource, fileRsrcSize, afpInfo);
+    writefile(argv[2], fileName, argv[1], afpInfo);
 
     DiskImgLib::Global::AppCleanup();
 
     if(afpInfo != NULL)
         free(afpInfo);
-
-    if(afpResource != NULL)
-        free(afpResource);
-
-    if(fileData != NULL)
-        free(fileData);
 }
 